@@ -0,0 +1,151 @@
+﻿/*
+ * 微基准测试的计时框架，见 bench_harness.h。
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#ifdef WIN32
+# include <windows.h>
+#else
+# include <time.h>
+#endif
+
+#include "bench_harness.h"
+
+volatile size_t bench_sink;
+
+static double now_ms()
+{
+#ifdef WIN32
+	LARGE_INTEGER freq, counter;
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&counter);
+	return (double)counter.QuadPart * 1000.0 / (double)freq.QuadPart;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+#endif
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+	return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+/*最近秩法求百分位，values 已升序排列*/
+static double percentile(const double *values, int count, double p)
+{
+	int rank = (int)ceil(p / 100.0 * count);
+	if (rank < 1) rank = 1;
+	if (rank > count) rank = count;
+	return values[rank - 1];
+}
+
+int bench_parse_args(BenchConfig *cfg, int argc, char *argv[])
+{
+	int i;
+	const char *a;
+	memset(cfg, 0, sizeof(BenchConfig));
+	cfg->trials = BENCH_DEFAULT_TRIALS;
+	cfg->warmup_ms = BENCH_DEFAULT_WARMUP_MS;
+	cfg->trial_ms = BENCH_DEFAULT_TRIAL_MS;
+	for (i = 1; i < argc; i++) {
+		a = argv[i];
+		if (strncmp(a, "--trials=", 9) == 0) cfg->trials = atoi(a + 9);
+		else if (strncmp(a, "--warmup=", 9) == 0) cfg->warmup_ms = atof(a + 9);
+		else if (strncmp(a, "--trial-ms=", 11) == 0) cfg->trial_ms = atof(a + 11);
+		else if (strncmp(a, "--filter=", 9) == 0) cfg->filter = a + 9;
+		else if (strcmp(a, "--json") == 0) cfg->json = 1;
+		else return -1;
+	}
+	if (cfg->trials < 1 || cfg->warmup_ms < 0 || cfg->trial_ms <= 0)
+		return -1;
+	return 0;
+}
+
+void bench_begin(BenchConfig *cfg)
+{
+	cfg->count = 0;
+	if (cfg->json) {
+		printf("{\n  \"trials\": %d,\n  \"warmup_ms\": %.1f,\n  \"trial_ms\": %.1f,\n  \"benchmarks\": [",
+			cfg->trials, cfg->warmup_ms, cfg->trial_ms);
+	}
+	else {
+		printf("%-32s %10s %10s %10s %10s %10s %10s %10s\n",
+			"benchmark", "ns/op p50", "p90", "p99", "min", "max", "stddev", "MB/s");
+	}
+	fflush(stdout);
+}
+
+void bench_run(BenchConfig *cfg, const char *name, BenchFunction fn, void *state,
+	int ops_per_call, size_t bytes_per_call)
+{
+	double *samples, t, start, per_call, sum = 0, sq = 0, mean, stddev, mbps;
+	long calls, iterations, k;
+	int i;
+
+	if (cfg->filter && !strstr(name, cfg->filter)) return;
+	if (ops_per_call < 1) ops_per_call = 1;
+	samples = (double *)malloc(sizeof(double) * cfg->trials);
+	if (!samples) return;
+
+	/*预热，同时估算每次调用的耗时*/
+	calls = 0;
+	start = now_ms();
+	do {
+		fn(state);
+		calls++;
+		t = now_ms() - start;
+	} while (t < cfg->warmup_ms);
+	per_call = t / calls;
+	iterations = per_call > 0 ? (long)(cfg->trial_ms / per_call) : 1;
+	if (iterations < 1) iterations = 1;
+
+	for (i = 0; i < cfg->trials; i++) {
+		start = now_ms();
+		for (k = 0; k < iterations; k++)
+			fn(state);
+		t = now_ms() - start;
+		samples[i] = t * 1000000.0 / ((double)iterations * ops_per_call);
+		sum += samples[i];
+	}
+	mean = sum / cfg->trials;
+	for (i = 0; i < cfg->trials; i++)
+		sq += (samples[i] - mean) * (samples[i] - mean);
+	stddev = sqrt(sq / cfg->trials);
+	qsort(samples, cfg->trials, sizeof(double), &cmp_double);
+	/*按中位数折算吞吐*/
+	mbps = bytes_per_call ? (double)bytes_per_call / ops_per_call / percentile(samples, cfg->trials, 50) * 1000000000.0 / 1048576.0 : 0;
+
+	if (cfg->json) {
+		printf("%s\n    {\"name\": \"%s\", \"ops_per_call\": %d, \"iterations\": %ld, "
+			"\"ns_per_op\": {\"min\": %.2f, \"p50\": %.2f, \"p90\": %.2f, \"p99\": %.2f, \"max\": %.2f, \"mean\": %.2f, \"stddev\": %.2f}",
+			cfg->count ? "," : "", name, ops_per_call, iterations,
+			samples[0], percentile(samples, cfg->trials, 50), percentile(samples, cfg->trials, 90),
+			percentile(samples, cfg->trials, 99), samples[cfg->trials - 1], mean, stddev);
+		if (bytes_per_call)
+			printf(", \"mb_per_s\": %.2f", mbps);
+		printf("}");
+	}
+	else {
+		printf("%-32s %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f",
+			name, percentile(samples, cfg->trials, 50), percentile(samples, cfg->trials, 90),
+			percentile(samples, cfg->trials, 99), samples[0], samples[cfg->trials - 1], stddev);
+		if (bytes_per_call)
+			printf(" %10.1f", mbps);
+		printf("\n");
+	}
+	fflush(stdout);
+	cfg->count++;
+	free(samples);
+}
+
+void bench_end(BenchConfig *cfg)
+{
+	if (cfg->json)
+		printf("\n  ]\n}\n");
+	fflush(stdout);
+}
@@ -0,0 +1,52 @@
+﻿/*
+ * 微基准测试的计时框架。
+ * 每个用例先预热，根据预热结果确定每轮调用次数，再重复多轮计时，
+ * 报告每次操作耗时的 min/p50/p90/p99/max/mean/stddev。
+ * 默认输出表格，--json 时输出 JSON，便于脚本对比两次结果。
+*/
+#ifndef _PCS_BENCH_HARNESS_H_
+#define _PCS_BENCH_HARNESS_H_
+
+#include <stddef.h>
+
+#define BENCH_DEFAULT_TRIALS		30
+#define BENCH_DEFAULT_WARMUP_MS		200.0
+#define BENCH_DEFAULT_TRIAL_MS		50.0
+
+typedef struct BenchConfig {
+	int			trials;		/*计时轮数*/
+	double		warmup_ms;	/*每个用例的预热时间*/
+	double		trial_ms;	/*每轮的目标耗时*/
+	const char	*filter;	/*只运行名称中包含该串的用例，NULL 表示全部*/
+	int			json;		/*非 0 时输出 JSON*/
+	int			count;		/*已输出的用例数*/
+} BenchConfig;
+
+/*被测函数。每次调用执行 ops_per_call 次操作*/
+typedef void (*BenchFunction)(void *state);
+
+/*用于防止编译器把被测代码优化掉*/
+extern volatile size_t bench_sink;
+
+/*
+ * 解析 --trials=N --warmup=ms --trial-ms=ms --filter=str --json 选项。
+ * 无法识别的选项返回非 0。
+*/
+int bench_parse_args(BenchConfig *cfg, int argc, char *argv[]);
+
+/*输出报告头，在所有 bench_run() 之前调用*/
+void bench_begin(BenchConfig *cfg);
+
+/*
+ * 运行一个用例。
+ *   ops_per_call   每次调用 fn 包含的操作数，结果按操作数折算
+ *   bytes_per_call 每次调用处理的字节数，非 0 时额外报告 MB/s
+ * 名称不匹配 filter 时直接返回
+*/
+void bench_run(BenchConfig *cfg, const char *name, BenchFunction fn, void *state,
+	int ops_per_call, size_t bytes_per_call);
+
+/*输出报告尾，在所有 bench_run() 之后调用*/
+void bench_end(BenchConfig *cfg);
+
+#endif
@@ -0,0 +1,268 @@
+﻿/*
+ * 守护进程缓存表基准测试：对比 pcs_cache 表的两种写入方式和两种前缀查询方式。
+ *   写入：默认日志模式下逐行自动提交（旧方式） 与 WAL + 批量事务（test/sql.h 中的 SQL_PRAGMA_TUNE）
+ *   子树：server_path LIKE 'X/%'（旧方式）、server_path >= 'X/' AND server_path < 'X0'（当前方式）
+ *         与按 parent_id 递归的 CTE
+ *   子项：范围条件加 instr() 过滤（旧方式） 与 parent_id 等值查找（SQL_CACHE_SELECT_CHILDREN）
+ * 逐行自动提交太慢，只写入 legacy_rows 行，再按比例估算 1M 行的耗时。
+ * 编译运行：make bench_cache && ./bin/cache_bench [db_dir] [row_count] [legacy_rows]
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifdef WIN32
+# include <windows.h>
+#endif
+
+#include <sqlite3.h>
+
+#include "../test/sql.h"
+
+#define DEFAULT_ROW_COUNT		1000000
+#define DEFAULT_LEGACY_ROWS		20000
+#define BATCH_SIZE				5000
+#define QUERY_REPEAT			20
+
+#define LEGACY_SELECT_SUB		"SELECT COUNT(*) FROM pcs_cache WHERE server_path LIKE ?1"
+#define LEGACY_CLEAR			"DELETE FROM pcs_cache WHERE server_path LIKE ?1"
+#define RANGE_SELECT_SUB		"SELECT COUNT(*) FROM pcs_cache WHERE server_path >= ?1 AND server_path < ?2"
+#define TREE_WITH_SUB			"WITH RECURSIVE sub(id) AS (" \
+								"SELECT rowid FROM pcs_cache WHERE parent_id = (SELECT rowid FROM pcs_cache WHERE server_path = ?1) " \
+								"UNION ALL SELECT c.rowid FROM pcs_cache c JOIN sub ON c.parent_id = sub.id) "
+#define TREE_SELECT_SUB			TREE_WITH_SUB "SELECT COUNT(*) FROM pcs_cache WHERE rowid IN sub"
+#define TREE_CLEAR				TREE_WITH_SUB "DELETE FROM pcs_cache WHERE rowid IN sub"
+#define RANGE_SELECT_CHILDREN	"SELECT COUNT(*) FROM pcs_cache WHERE server_path >= ?1 AND server_path < ?2 " \
+								"AND instr(substr(server_path, length(?1) + 1), '/') = 0"
+#define TREE_SELECT_CHILDREN	"SELECT COUNT(*) FROM (" SQL_CACHE_SELECT_CHILDREN ")"
+
+static double now_ms()
+{
+#ifdef WIN32
+	LARGE_INTEGER freq, counter;
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&counter);
+	return (double)counter.QuadPart * 1000.0 / (double)freq.QuadPart;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+#endif
+}
+
+/*第i行的路径：/bench/dXXX/sXXX/fXXXXXXX.dat，每个目录下100个子目录，每个子目录下100个文件*/
+static void make_path(char *buf, int i)
+{
+	sprintf(buf, "/bench/d%03d/s%03d/f%07d.dat", i / 10000, (i / 100) % 100, i);
+}
+
+static sqlite3 *open_db(const char *file, int tuned)
+{
+	sqlite3 *db = NULL;
+	remove(file);
+	if (sqlite3_open(file, &db)) {
+		fprintf(stderr, "Can't open %s: %s\n", file, sqlite3_errmsg(db));
+		return NULL;
+	}
+	if (tuned && sqlite3_exec(db, SQL_PRAGMA_TUNE, NULL, NULL, NULL)) {
+		fprintf(stderr, "Can't tune %s: %s\n", file, sqlite3_errmsg(db));
+	}
+	if (sqlite3_exec(db, TABLE_CACHE_CREATOR, NULL, NULL, NULL)
+		|| sqlite3_exec(db, TABLE_CACHE_INDEX_CREATOR, NULL, NULL, NULL)
+		|| (tuned && sqlite3_exec(db, SQL_CACHE_HIERARCHY_CREATOR, NULL, NULL, NULL))) {
+		fprintf(stderr, "Can't create the table: %s\n", sqlite3_errmsg(db));
+		sqlite3_close(db);
+		return NULL;
+	}
+	return db;
+}
+
+static int insert_one(sqlite3 *db, sqlite3_stmt *stmt, const char *path, int isdir, int i)
+{
+	int rc;
+	sqlite3_bind_int64(stmt, 1, (sqlite3_int64)i + 1);
+	sqlite3_bind_text(stmt, 2, path, -1, SQLITE_STATIC);
+	sqlite3_bind_text(stmt, 3, strrchr(path, '/') + 1, -1, SQLITE_STATIC);
+	sqlite3_bind_int64(stmt, 4, 1400000000 + i);
+	sqlite3_bind_int64(stmt, 5, 1400000000 + i);
+	sqlite3_bind_int64(stmt, 6, isdir ? 0 : i * 37);
+	sqlite3_bind_int(stmt, 7, isdir ? 0 : 6);
+	sqlite3_bind_int(stmt, 8, isdir);
+	sqlite3_bind_int(stmt, 9, 0);
+	sqlite3_bind_int(stmt, 10, 0);
+	sqlite3_bind_text(stmt, 11, "d41d8cd98f00b204e9800998ecf8427e", -1, SQLITE_STATIC);
+	sqlite3_bind_null(stmt, 12);
+	sqlite3_bind_int(stmt, 13, 0);
+	sqlite3_bind_int64(stmt, 14, 1400000000);
+	sqlite3_bind_text(stmt, 15, "bench", -1, SQLITE_STATIC);
+	sqlite3_bind_int(stmt, 16, 0);
+	sqlite3_bind_text(stmt, 17, path, (int)(strrchr(path, '/') - path), SQLITE_STATIC);
+	rc = sqlite3_step(stmt);
+	sqlite3_reset(stmt);
+	if (rc != SQLITE_DONE) {
+		fprintf(stderr, "Can't insert %s: %s\n", path, sqlite3_errmsg(db));
+		return -1;
+	}
+	return 0;
+}
+
+/*插入 [from, to) 行文件，以及它们所在的目录。batch 为0时每行自动提交，否则每 batch 行提交一次*/
+static int insert_rows(sqlite3 *db, int from, int to, int batch)
+{
+	sqlite3_stmt *stmt = NULL;
+	char path[128];
+	int i, rc = 0;
+	if (sqlite3_prepare_v2(db, SQL_CACHE_INSERT, -1, &stmt, NULL)) {
+		fprintf(stderr, "Can't build the sql: %s\n", sqlite3_errmsg(db));
+		return -1;
+	}
+	if (batch) sqlite3_exec(db, SQL_BEGIN, NULL, NULL, NULL);
+	if (from == 0)
+		rc = insert_one(db, stmt, "/bench", 1, 0);
+	for (i = from; i < to && !rc; i++) {
+		if (i % 10000 == 0) {
+			sprintf(path, "/bench/d%03d", i / 10000);
+			rc = insert_one(db, stmt, path, 1, i);
+		}
+		if (!rc && i % 100 == 0) {
+			sprintf(path, "/bench/d%03d/s%03d", i / 10000, (i / 100) % 100);
+			rc = insert_one(db, stmt, path, 1, i);
+		}
+		if (!rc) {
+			make_path(path, i);
+			rc = insert_one(db, stmt, path, 0, i);
+		}
+		if (!rc && batch && (i - from + 1) % batch == 0) {
+			sqlite3_exec(db, SQL_COMMIT, NULL, NULL, NULL);
+			sqlite3_exec(db, SQL_BEGIN, NULL, NULL, NULL);
+		}
+	}
+	if (batch) sqlite3_exec(db, SQL_COMMIT, NULL, NULL, NULL);
+	sqlite3_finalize(stmt);
+	return rc;
+}
+
+/*执行一次前缀查询或删除。range 为0时使用 LIKE，为1时使用范围条件，为2时只绑定目录本身。返回结果行数或影响行数*/
+static int run_prefix(sqlite3 *db, const char *sql, const char *dir, int range)
+{
+	sqlite3_stmt *stmt = NULL;
+	char low[128], high[128];
+	int n = 0;
+	if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL)) {
+		fprintf(stderr, "Can't build the sql %s: %s\n", sql, sqlite3_errmsg(db));
+		return -1;
+	}
+	if (range == 2) {
+		sqlite3_bind_text(stmt, 1, dir, -1, SQLITE_STATIC);
+	}
+	else if (range) {
+		sprintf(low, "%s/", dir);
+		sprintf(high, "%s0", dir);
+		sqlite3_bind_text(stmt, 1, low, -1, SQLITE_STATIC);
+		sqlite3_bind_text(stmt, 2, high, -1, SQLITE_STATIC);
+	}
+	else {
+		sprintf(low, "%s/%%", dir);
+		sqlite3_bind_text(stmt, 1, low, -1, SQLITE_STATIC);
+	}
+	if (sqlite3_step(stmt) == SQLITE_ROW)
+		n = sqlite3_column_int(stmt, 0);
+	else
+		n = sqlite3_changes(db);
+	sqlite3_finalize(stmt);
+	return n;
+}
+
+static void print_result(const char *name, int count, double ms)
+{
+	printf("%-34s %10.2f ms %12.1f rows/s\n", name, ms, ms > 0 ? count * 1000.0 / ms : 0.0);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *dir = argc > 1 ? argv[1] : ".";
+	int count = argc > 2 ? atoi(argv[2]) : DEFAULT_ROW_COUNT;
+	int legacy_rows = argc > 3 ? atoi(argv[3]) : DEFAULT_LEGACY_ROWS;
+	char legacy_file[512], tuned_file[512], wal[600], dirpath[64];
+	sqlite3 *db;
+	double t, ms;
+	int i, n = 0;
+
+	if (count < 10000) count = 10000;
+	if (legacy_rows > count) legacy_rows = count;
+	sprintf(legacy_file, "%s/cache_bench_legacy.db", dir);
+	sprintf(tuned_file, "%s/cache_bench_tuned.db", dir);
+	printf("SQLite %s, rows: %d, legacy rows: %d\n\n", sqlite3_libversion(), count, legacy_rows);
+
+	/*旧方式：默认日志模式，每行一个事务*/
+	db = open_db(legacy_file, 0);
+	if (!db) return 1;
+	t = now_ms();
+	if (insert_rows(db, 0, legacy_rows, 0)) return 1;
+	ms = now_ms() - t;
+	print_result("insert autocommit", legacy_rows, ms);
+	printf("%-34s %10.2f ms (estimated)\n", "  -> for all rows", ms * count / legacy_rows);
+	sqlite3_close(db);
+	remove(legacy_file);
+
+	/*新方式：WAL + 批量事务*/
+	db = open_db(tuned_file, 1);
+	if (!db) return 1;
+	t = now_ms();
+	if (insert_rows(db, 0, count, BATCH_SIZE)) return 1;
+	print_result("insert WAL + batch", count, now_ms() - t);
+	putchar('\n');
+
+	/*前缀查询：统计一个一级目录下的所有行*/
+	t = now_ms();
+	for (i = 0; i < QUERY_REPEAT; i++) {
+		sprintf(dirpath, "/bench/d%03d", i % (count / 10000));
+		n = run_prefix(db, LEGACY_SELECT_SUB, dirpath, 0);
+	}
+	ms = (now_ms() - t) / QUERY_REPEAT;
+	printf("%-34s %10.3f ms/query (%d rows)\n", "select subtree LIKE", ms, n);
+	t = now_ms();
+	for (i = 0; i < QUERY_REPEAT; i++) {
+		sprintf(dirpath, "/bench/d%03d", i % (count / 10000));
+		n = run_prefix(db, RANGE_SELECT_SUB, dirpath, 1);
+	}
+	ms = (now_ms() - t) / QUERY_REPEAT;
+	printf("%-34s %10.3f ms/query (%d rows)\n", "select subtree range", ms, n);
+	t = now_ms();
+	for (i = 0; i < QUERY_REPEAT; i++) {
+		sprintf(dirpath, "/bench/d%03d", i % (count / 10000));
+		n = run_prefix(db, TREE_SELECT_SUB, dirpath, 2);
+	}
+	ms = (now_ms() - t) / QUERY_REPEAT;
+	printf("%-34s %10.3f ms/query (%d rows)\n", "select subtree parent_id", ms, n);
+
+	/*前缀删除：分别删除两个不同的二级目录*/
+	t = now_ms();
+	n = run_prefix(db, LEGACY_CLEAR, "/bench/d000/s001", 0);
+	printf("%-34s %10.3f ms (%d rows)\n", "delete subtree LIKE", now_ms() - t, n);
+	t = now_ms();
+	n = run_prefix(db, SQL_CACHE_CLEAR, "/bench/d000/s002", 1);
+	printf("%-34s %10.3f ms (%d rows)\n", "delete subtree range", now_ms() - t, n);
+	t = now_ms();
+	n = run_prefix(db, TREE_CLEAR, "/bench/d000/s003", 2);
+	printf("%-34s %10.3f ms (%d rows)\n", "delete subtree parent_id", now_ms() - t, n);
+
+
+	/*列出直接子项：/bench 下只有 count/10000 个子目录，但范围条件要扫描整张表*/
+	t = now_ms();
+	for (i = 0; i < QUERY_REPEAT; i++)
+		n = run_prefix(db, RANGE_SELECT_CHILDREN, "/bench", 1);
+	ms = (now_ms() - t) / QUERY_REPEAT;
+	printf("%-34s %10.3f ms/query (%d rows)\n", "select children range + instr", ms, n);
+	t = now_ms();
+	for (i = 0; i < QUERY_REPEAT; i++)
+		n = run_prefix(db, TREE_SELECT_CHILDREN, "/bench", 2);
+	ms = (now_ms() - t) / QUERY_REPEAT;
+	printf("%-34s %10.3f ms/query (%d rows)\n", "select children parent_id", ms, n);
+
+	sqlite3_close(db);
+	remove(tuned_file);
+	sprintf(wal, "%s-wal", tuned_file); remove(wal);
+	sprintf(wal, "%s-shm", tuned_file); remove(wal);
+	return 0;
+}
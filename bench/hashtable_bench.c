@@ -0,0 +1,169 @@
+﻿/*
+ * 哈希表基准测试：对比 hashtable.c（开放寻址）与 test/hashtable.c（旧的链表实现）
+ * 在 1M 个Key时的插入、查找、遍历耗时。
+ * 编译运行：make bench_hashtable && ./bin/hashtable_bench [key_count]
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef WIN32
+# include <windows.h>
+#else
+# include <time.h>
+#endif
+
+#include "../pcs/pcs_mem.h"
+#include "../hashtable.h"
+#include "../test/hashtable.h"
+
+#define DEFAULT_KEY_COUNT 1000000
+
+static double now_ms()
+{
+#ifdef WIN32
+	LARGE_INTEGER freq, counter;
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&counter);
+	return (double)counter.QuadPart * 1000.0 / (double)freq.QuadPart;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+#endif
+}
+
+/*生成类似网盘路径的Key*/
+static char **make_keys(int count)
+{
+	char **keys, buf[256];
+	int i;
+	keys = (char **)pcs_malloc(count * sizeof(char *));
+	for (i = 0; i < count; i++) {
+		sprintf(buf, "/apps/baidupcs/backup/dir%04d/sub%03d/file%08d.dat", i % 7919, i % 131, i);
+		keys[i] = (char *)pcs_malloc(strlen(buf) + 1);
+		strcpy(keys[i], buf);
+	}
+	return keys;
+}
+
+static void print_result(const char *name, const char *op, int count, double ms)
+{
+	printf("%-22s %-8s %10.2f ms %10.1f ns/op\n", name, op, ms, ms * 1000000.0 / count);
+}
+
+static int bench_ht(const char *name, char **keys, int count, int incremental)
+{
+	Hashtable *ht;
+	HashtableIterater *it;
+	double t, dt, max_op = 0;
+	int i, found = 0, iterated = 0;
+	long long sum = 0;
+
+	ht = ht_create(17, 0, NULL);
+	if (!ht) return -1;
+	ht_set_incremental(ht, incremental);
+	t = now_ms();
+	for (i = 0; i < count; i++) {
+		dt = now_ms();
+		if (ht_add(ht, keys[i], -1, (void *)(size_t)(i + 1))) {
+			printf("%s: add failed at %d\n", name, i);
+			ht_destroy(ht);
+			return -1;
+		}
+		dt = now_ms() - dt;
+		if (dt > max_op) max_op = dt;
+	}
+	print_result(name, "insert", count, now_ms() - t);
+	printf("%-22s %-8s %10.3f ms (max single insert)\n", name, "", max_op);
+
+	t = now_ms();
+	for (i = 0; i < count; i++) {
+		if ((size_t)ht_get(ht, keys[i], -1) == (size_t)(i + 1)) found++;
+	}
+	print_result(name, "lookup", count, now_ms() - t);
+
+	t = now_ms();
+	for (i = 0; i < count; i++) {
+		if (ht_has(ht, keys[i], (int)strlen(keys[i]) - 1)) found = -1;
+	}
+	print_result(name, "miss", count, now_ms() - t);
+
+	it = ht_it_create(ht);
+	t = now_ms();
+	while (ht_it_next(it)) {
+		sum += (long long)(size_t)ht_it_current(it);
+		iterated++;
+	}
+	print_result(name, "iterate", count, now_ms() - t);
+	ht_it_destroy(it);
+
+	t = now_ms();
+	for (i = 0; i < count; i += 2) {
+		ht_remove(ht, keys[i], -1, NULL);
+	}
+	print_result(name, "remove", count / 2, now_ms() - t);
+
+	if (found != count || iterated != count || sum != (long long)count * (count + 1) / 2 || ht->count != count / 2) {
+		printf("%s: verify failed (found=%d, iterated=%d)\n", name, found, iterated);
+		ht_destroy(ht);
+		return -1;
+	}
+	ht_destroy(ht);
+	return 0;
+}
+
+static int bench_legacy(const char *name, char **keys, int count)
+{
+	hashtable *ht;
+	hashtable_iterater *it;
+	double t;
+	int i, found = 0, iterated = 0;
+
+	ht = hashtable_create(17, 0, NULL);
+	if (!ht) return -1;
+	t = now_ms();
+	for (i = 0; i < count; i++) {
+		if (hashtable_add(ht, keys[i], (void *)(size_t)(i + 1))) {
+			printf("%s: add failed at %d\n", name, i);
+			hashtable_destroy(ht);
+			return -1;
+		}
+	}
+	print_result(name, "insert", count, now_ms() - t);
+
+	t = now_ms();
+	for (i = 0; i < count; i++) {
+		if ((size_t)hashtable_get(ht, keys[i]) == (size_t)(i + 1)) found++;
+	}
+	print_result(name, "lookup", count, now_ms() - t);
+
+	it = hashtable_iterater_create(ht);
+	t = now_ms();
+	while (hashtable_iterater_next(it))
+		iterated++;
+	print_result(name, "iterate", count, now_ms() - t);
+	hashtable_iterater_destroy(it);
+	hashtable_destroy(ht);
+	if (found != count || iterated != count) {
+		printf("%s: verify failed (found=%d, iterated=%d)\n", name, found, iterated);
+		return -1;
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	char **keys;
+	int count = DEFAULT_KEY_COUNT, i, rc = 0;
+	if (argc > 1) count = atoi(argv[1]);
+	if (count <= 0) count = DEFAULT_KEY_COUNT;
+	keys = make_keys(count);
+	printf("keys: %d\n", count);
+	rc |= bench_legacy("chained (legacy)", keys, count);
+	rc |= bench_ht("open addressing", keys, count, 0);
+	rc |= bench_ht("open addressing (inc)", keys, count, 1);
+	for (i = 0; i < count; i++)
+		pcs_free(keys[i]);
+	pcs_free(keys);
+	return rc ? 1 : 0;
+}
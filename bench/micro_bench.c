@@ -0,0 +1,390 @@
+﻿/*
+ * 热点函数的微基准测试：
+ *   hashtable.c 的插入、查找、遍历
+ *   rb_tree 的插入、查找、遍历、批量建树
+ *   pcs_http_build_url_v()、pcs_http_build_post_data_v()
+ *   pcs_parse_fileinfo()
+ *   combin_net_disk_path()
+ *   utf8.c 的 u8_toucs()、u8_toutf8()、u8_strlen()
+ *   md5_file()
+ * 计时框架见 bench_harness.c。
+ * 编译运行：make bench_micro && ./bin/micro_bench [--json] [--filter=str] [--trials=N] [--warmup=ms] [--trial-ms=ms]
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+
+#include "../pcs/pcs.h"
+#include "../pcs/cJSON.h"
+#include "../hashtable.h"
+#include "../rb_tree/red_black_tree.h"
+#include "../utils.h"
+#include "../utf8.h"
+#include "bench_harness.h"
+
+#define KEY_COUNT			10000
+#define FILEINFO_COUNT		100
+#define UTF8_REPEAT			64
+#define MD5_FILE_SIZE		(4 * 1024 * 1024)
+
+typedef struct KeySet {
+	char	**keys;
+	char	**sorted;	/*按 strcmp 排序，供 RBTreeBulkLoad 使用*/
+	int		count;
+} KeySet;
+
+typedef struct MapState {
+	KeySet			*ks;
+	Hashtable		*ht;
+	rb_red_blk_tree	*tree;
+} MapState;
+
+typedef struct HttpState {
+	PcsHttp		http;
+	char		tt[16];
+} HttpState;
+
+typedef struct Utf8State {
+	char		*text;
+	int			text_size;
+	wchar_t		*wide;
+	int			wide_size;
+	char		*out;
+	int			out_size;
+} Utf8State;
+
+#pragma region 测试数据
+
+static int cmp_str(const void *a, const void *b)
+{
+	return strcmp(*(const char **)a, *(const char **)b);
+}
+
+/*生成类似网盘路径的Key，与 hashtable_bench.c 一致*/
+static void keyset_init(KeySet *ks, int count)
+{
+	char buf[256];
+	int i;
+	ks->count = count;
+	ks->keys = (char **)pcs_malloc(count * sizeof(char *));
+	ks->sorted = (char **)pcs_malloc(count * sizeof(char *));
+	for (i = 0; i < count; i++) {
+		sprintf(buf, "/apps/baidupcs/backup/dir%04d/sub%03d/file%08d.dat", i % 7919, i % 131, i);
+		ks->keys[i] = pcs_utils_strdup(buf);
+		ks->sorted[i] = ks->keys[i];
+	}
+	qsort(ks->sorted, count, sizeof(char *), &cmp_str);
+}
+
+static void keyset_free(KeySet *ks)
+{
+	int i;
+	for (i = 0; i < ks->count; i++)
+		pcs_free(ks->keys[i]);
+	pcs_free(ks->keys);
+	pcs_free(ks->sorted);
+}
+
+static int rb_compare(const void *a, const void *b, void *state)
+{
+	int rc = strcmp((const char *)a, (const char *)b);
+	return rc > 0 ? 1 : (rc < 0 ? -1 : 0);
+}
+
+static void rb_destroy_nothing(void *a, void *state)
+{
+}
+
+static rb_red_blk_tree *rb_create()
+{
+	return RBTreeCreate(&rb_compare, &rb_destroy_nothing, &rb_destroy_nothing, NULL, NULL);
+}
+
+/*生成 pcs/api/list 返回的 list 数组*/
+static cJSON *make_fileinfo_list(int count)
+{
+	char *json, *p;
+	cJSON *list;
+	int i;
+	json = (char *)pcs_malloc(count * 512 + 16);
+	p = json;
+	p += sprintf(p, "[");
+	for (i = 0; i < count; i++) {
+		p += sprintf(p, "%s{\"fs_id\":%d,\"path\":\"/apps/baidupcs/backup/\xe7\x85\xa7\xe7\x89\x87/2014/IMG_%04d.JPG\","
+			"\"server_filename\":\"IMG_%04d.JPG\",\"server_mtime\":1400000000,\"server_ctime\":1400000000,"
+			"\"local_mtime\":1400000000,\"local_ctime\":1400000000,\"isdir\":0,\"category\":3,\"size\":%d,"
+			"\"md5\":\"0123456789abcdef0123456789abcdef\",\"block_list\":[\"0123456789abcdef0123456789abcdef\"]}",
+			i ? "," : "", 3000000 + i, i, i, 1024 * 1024 + i);
+	}
+	sprintf(p, "]");
+	list = cJSON_Parse(json);
+	pcs_free(json);
+	return list;
+}
+
+#pragma endregion
+
+#pragma region hashtable
+
+static void ht_add_batch(void *state)
+{
+	MapState *st = (MapState *)state;
+	Hashtable *ht = ht_create(17, 0, NULL);
+	int i;
+	for (i = 0; i < st->ks->count; i++)
+		ht_add(ht, st->ks->keys[i], -1, (void *)(size_t)(i + 1));
+	bench_sink += ht->count;
+	ht_destroy(ht);
+}
+
+static void ht_get_batch(void *state)
+{
+	MapState *st = (MapState *)state;
+	size_t sum = 0;
+	int i;
+	for (i = 0; i < st->ks->count; i++)
+		sum += (size_t)ht_get(st->ht, st->ks->keys[i], -1);
+	bench_sink += sum;
+}
+
+static void ht_iterate_batch(void *state)
+{
+	MapState *st = (MapState *)state;
+	HashtableIterater *it = ht_it_create(st->ht);
+	size_t sum = 0;
+	while (ht_it_next(it))
+		sum += (size_t)ht_it_current(it);
+	ht_it_destroy(it);
+	bench_sink += sum;
+}
+
+#pragma endregion
+
+#pragma region rb_tree
+
+static void rb_insert_batch(void *state)
+{
+	MapState *st = (MapState *)state;
+	rb_red_blk_tree *tree = rb_create();
+	int i;
+	for (i = 0; i < st->ks->count; i++)
+		RBTreeInsert(tree, st->ks->keys[i], NULL);
+	bench_sink += (size_t)tree->root->left;
+	RBTreeDestroy(tree);
+}
+
+static void rb_query_batch(void *state)
+{
+	MapState *st = (MapState *)state;
+	size_t sum = 0;
+	int i;
+	for (i = 0; i < st->ks->count; i++)
+		sum += (size_t)RBExactQuery(st->tree, st->ks->keys[i]);
+	bench_sink += sum;
+}
+
+/*用 RBTreeFirst/RBTreeNext 按顺序遍历，与 hashtable/iterate 对比*/
+static void rb_iterate_batch(void *state)
+{
+	MapState *st = (MapState *)state;
+	rb_red_blk_node *x;
+	size_t sum = 0;
+	for (x = RBTreeFirst(st->tree); x; x = RBTreeNext(st->tree, x))
+		sum += (size_t)x->key;
+	bench_sink += sum;
+}
+
+static void rb_bulk_load_batch(void *state)
+{
+	MapState *st = (MapState *)state;
+	rb_red_blk_tree *tree = rb_create();
+	RBTreeBulkLoad(tree, (void **)st->ks->sorted, NULL, st->ks->count);
+	bench_sink += (size_t)tree->root->left;
+	RBTreeDestroy(tree);
+}
+
+#pragma endregion
+
+#pragma region pcs_http 和 pcs_parse_fileinfo
+
+/*与 pcs_build_pan_api_url() 拼接 list 请求时的参数相同*/
+static void build_url_once(void *state)
+{
+	HttpState *st = (HttpState *)state;
+	char *url = pcs_http_build_url(st->http, "http://pan.baidu.com/api/list",
+		"channel", "chunlei",
+		"clienttype", "0",
+		"web", "1",
+		"t", st->tt,
+		"bdstoken", "0123456789abcdef0123456789abcdef",
+		"_", st->tt,
+		"dir", "/apps/baidupcs/backup/\xe7\x85\xa7\xe7\x89\x87 2014/\xe6\x97\x85\xe8\xa1\x8c",
+		"page", "1",
+		"num", "100",
+		"order", "name",
+		NULL);
+	bench_sink += strlen(url);
+	pcs_free(url);
+}
+
+/*与 pcs_mkdir() 的 post 数据相同*/
+static void build_post_data_once(void *state)
+{
+	HttpState *st = (HttpState *)state;
+	char *data = pcs_http_build_post_data(st->http,
+		"path", "/apps/baidupcs/backup/\xe7\x85\xa7\xe7\x89\x87 2014/\xe6\x97\x85\xe8\xa1\x8c & more",
+		"isdir", "1",
+		"size", "",
+		"block_list", "[]",
+		"method", "post",
+		NULL);
+	bench_sink += strlen(data);
+	pcs_free(data);
+}
+
+static void parse_fileinfo_batch(void *state)
+{
+	cJSON *list = (cJSON *)state, *item;
+	PcsFileInfo *fi;
+	for (item = list->child; item; item = item->next) {
+		fi = pcs_parse_fileinfo(item);
+		bench_sink += (size_t)fi->size;
+		pcs_fileinfo_destroy(fi);
+	}
+}
+
+#pragma endregion
+
+#pragma region 路径、UTF-8 和 MD5
+
+static void combin_path_batch(void *state)
+{
+	static const char *cases[][2] = {
+		{ "/apps/baidupcs", "backup/2014/file.dat" },
+		{ "/apps/baidupcs/backup/", "./sub/../sub2/file.dat" },
+		{ "/apps/baidupcs/backup/dir", "/absolute/path/file.dat" },
+		{ "/", "\xe7\x85\xa7\xe7\x89\x87/2014/IMG_0001.JPG" },
+	};
+	char *path;
+	int i;
+	for (i = 0; i < 4; i++) {
+		path = combin_net_disk_path(cases[i][0], cases[i][1]);
+		bench_sink += strlen(path);
+		pcs_free(path);
+	}
+}
+
+static void u8_toucs_once(void *state)
+{
+	Utf8State *st = (Utf8State *)state;
+	bench_sink += u8_toucs(st->wide, st->wide_size, st->text, st->text_size);
+}
+
+static void u8_toutf8_once(void *state)
+{
+	Utf8State *st = (Utf8State *)state;
+	bench_sink += u8_toutf8(st->out, st->out_size, st->wide, st->wide_size - 1);
+}
+
+static void u8_strlen_once(void *state)
+{
+	Utf8State *st = (Utf8State *)state;
+	bench_sink += u8_strlen(st->text);
+}
+
+static void md5_file_once(void *state)
+{
+	char buf[33];
+	md5_file_r((const char *)state, buf);
+	bench_sink += buf[0];
+}
+
+static void utf8_init(Utf8State *st)
+{
+	static const char *piece = "/apps/baidupcs/\xe5\xa4\x87\xe4\xbb\xbd/\xe7\x85\xa7\xe7\x89\x87 2014/IMG_0001.JPG ";
+	int i, plen = (int)strlen(piece);
+	st->text_size = plen * UTF8_REPEAT;
+	st->text = (char *)pcs_malloc(st->text_size + 1);
+	for (i = 0; i < UTF8_REPEAT; i++)
+		memcpy(st->text + i * plen, piece, plen);
+	st->text[st->text_size] = '\0';
+	st->wide_size = st->text_size + 1;
+	st->wide = (wchar_t *)pcs_malloc(st->wide_size * sizeof(wchar_t));
+	st->wide_size = u8_toucs(st->wide, st->wide_size, st->text, st->text_size) + 1;
+	st->out_size = st->text_size + 1;
+	st->out = (char *)pcs_malloc(st->out_size);
+}
+
+#pragma endregion
+
+int main(int argc, char *argv[])
+{
+	BenchConfig cfg;
+	KeySet ks;
+	MapState map = { 0 };
+	HttpState http = { 0 };
+	Utf8State u8 = { 0 };
+	cJSON *filist;
+	char md5_path[] = "/tmp/pcs_micro_bench_XXXXXX", *buf;
+	FILE *fp;
+	int i;
+
+	if (bench_parse_args(&cfg, argc, argv)) {
+		printf("Usage: %s [--json] [--filter=str] [--trials=N] [--warmup=ms] [--trial-ms=ms]\n", argv[0]);
+		return 1;
+	}
+
+	keyset_init(&ks, KEY_COUNT);
+	map.ks = &ks;
+	map.ht = ht_create(17, 0, NULL);
+	map.tree = rb_create();
+	for (i = 0; i < ks.count; i++) {
+		ht_add(map.ht, ks.keys[i], -1, (void *)(size_t)(i + 1));
+		RBTreeInsert(map.tree, ks.keys[i], NULL);
+	}
+	http.http = pcs_http_create(NULL);
+	sprintf(http.tt, "%d", 1400000000);
+	filist = make_fileinfo_list(FILEINFO_COUNT);
+	utf8_init(&u8);
+	i = mkstemp(md5_path);
+	fp = i >= 0 ? fdopen(i, "wb") : NULL;
+	buf = (char *)pcs_malloc(MD5_FILE_SIZE);
+	if (!http.http || !filist || !fp || !buf) {
+		printf("Can't prepare the test data\n");
+		return 1;
+	}
+	for (i = 0; i < MD5_FILE_SIZE; i++) buf[i] = (char)(i * 31 + 7);
+	fwrite(buf, 1, MD5_FILE_SIZE, fp);
+	fclose(fp);
+	pcs_free(buf);
+
+	bench_begin(&cfg);
+	bench_run(&cfg, "hashtable/add", &ht_add_batch, &map, KEY_COUNT, 0);
+	bench_run(&cfg, "hashtable/get", &ht_get_batch, &map, KEY_COUNT, 0);
+	bench_run(&cfg, "hashtable/iterate", &ht_iterate_batch, &map, KEY_COUNT, 0);
+	bench_run(&cfg, "rb_tree/insert", &rb_insert_batch, &map, KEY_COUNT, 0);
+	bench_run(&cfg, "rb_tree/query", &rb_query_batch, &map, KEY_COUNT, 0);
+	bench_run(&cfg, "rb_tree/iterate", &rb_iterate_batch, &map, KEY_COUNT, 0);
+	bench_run(&cfg, "rb_tree/bulk_load", &rb_bulk_load_batch, &map, KEY_COUNT, 0);
+	bench_run(&cfg, "pcs_http_build_url_v", &build_url_once, &http, 1, 0);
+	bench_run(&cfg, "pcs_http_build_post_data_v", &build_post_data_once, &http, 1, 0);
+	bench_run(&cfg, "pcs_parse_fileinfo", &parse_fileinfo_batch, filist, FILEINFO_COUNT, 0);
+	bench_run(&cfg, "combin_net_disk_path", &combin_path_batch, NULL, 4, 0);
+	bench_run(&cfg, "u8_toucs", &u8_toucs_once, &u8, 1, u8.text_size);
+	bench_run(&cfg, "u8_toutf8", &u8_toutf8_once, &u8, 1, u8.text_size);
+	bench_run(&cfg, "u8_strlen", &u8_strlen_once, &u8, 1, u8.text_size);
+	bench_run(&cfg, "md5_file", &md5_file_once, md5_path, 1, MD5_FILE_SIZE);
+	bench_end(&cfg);
+
+	remove(md5_path);
+	pcs_free(u8.text);
+	pcs_free(u8.wide);
+	pcs_free(u8.out);
+	cJSON_Delete(filist);
+	pcs_http_destroy(http.http);
+	RBTreeDestroy(map.tree);
+	ht_destroy(map.ht);
+	keyset_free(&ks);
+	return 0;
+}
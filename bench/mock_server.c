@@ -0,0 +1,1355 @@
+﻿/*
+ * 模拟的百度网盘服务器，见 mock_server.h。
+ * 每个连接一个线程，支持 HTTP/1.1 长连接、Expect: 100-continue 和 chunked 请求体。
+ * 目录树由一把互斥锁保护，只追求正确，不追求服务器本身的吞吐。
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include <openssl/evp.h>
+
+#include "../pcs/cJSON.h"
+#include "mock_server.h"
+
+#define MOCK_BDSTOKEN			"0123456789abcdef0123456789abcdef"
+#define MOCK_USERNAME			"pcs_bench"
+#define MOCK_QUOTA				(2048.0 * 1024 * 1024 * 1024)
+#define MOCK_MAX_CONNS			256
+#define MOCK_MAX_HEADER			(64 * 1024)
+#define MOCK_IO_CHUNK			(64 * 1024)
+
+typedef struct MockNode {
+	char				*name;
+	int					isdir;
+	char				*data;
+	size_t				size;
+	time_t				ctime;
+	time_t				mtime;
+	unsigned long long	fs_id;
+	char				md5[33];
+	struct MockNode		*parent;
+	struct MockNode		*child;		/*子项按名称升序排列*/
+	struct MockNode		*next;
+} MockNode;
+
+struct MockServer {
+	MockServerOptions	opts;
+	int					listen_fd;
+	int					port;
+	pthread_t			accept_thread;
+
+	pthread_mutex_t		lock;		/*保护 root、next_fs_id、used、seed、fail_next、ignore_range 和 stats*/
+	MockNode			*root;
+	unsigned long long	next_fs_id;
+	double				used;
+	unsigned int		seed;
+	int					fail_next;	/*之后需要返回错误的请求数*/
+	int					ignore_range;	/*非 0 时忽略 Range 请求头*/
+	MockServerStats		stats;
+
+	pthread_mutex_t		conn_lock;	/*保护以下连接状态*/
+	pthread_cond_t		conn_cond;
+	int					conns[MOCK_MAX_CONNS];
+	int					conn_count;
+	int					stopping;
+};
+
+typedef struct StrBuf {
+	char	*data;
+	size_t	size;
+	size_t	capacity;
+} StrBuf;
+
+typedef struct MockConn {
+	MockServer	*server;
+	int			fd;
+	char		*buf;		/*已读取但未处理的数据*/
+	size_t		len;
+	size_t		capacity;
+} MockConn;
+
+typedef struct MockRequest {
+	char		method[16];
+	char		*target;	/*路径和查询串，不含协议和主机*/
+	char		*query;		/*指向 target 中 '?' 之后的部分，可能为空串*/
+	char		*content_type;
+	char		*range;		/*Range 请求头，没有时为NULL*/
+	char		*body;
+	size_t		body_size;
+	int			keep_alive;
+} MockRequest;
+
+#pragma region 字符串缓冲区
+
+static int sb_reserve(StrBuf *sb, size_t extra)
+{
+	char *p;
+	size_t cap;
+	if (sb->size + extra + 1 <= sb->capacity) return 0;
+	cap = sb->capacity ? sb->capacity : 256;
+	while (cap < sb->size + extra + 1) cap *= 2;
+	p = (char *)realloc(sb->data, cap);
+	if (!p) return -1;
+	sb->data = p;
+	sb->capacity = cap;
+	return 0;
+}
+
+static void sb_append(StrBuf *sb, const char *s, size_t n)
+{
+	if (sb_reserve(sb, n)) return;
+	memcpy(sb->data + sb->size, s, n);
+	sb->size += n;
+	sb->data[sb->size] = '\0';
+}
+
+static void sb_puts(StrBuf *sb, const char *s)
+{
+	sb_append(sb, s, strlen(s));
+}
+
+static void sb_printf(StrBuf *sb, const char *fmt, ...)
+{
+	va_list ap;
+	int n;
+	va_start(ap, fmt);
+	n = vsnprintf(NULL, 0, fmt, ap);
+	va_end(ap);
+	if (n < 0 || sb_reserve(sb, (size_t)n)) return;
+	va_start(ap, fmt);
+	vsnprintf(sb->data + sb->size, (size_t)n + 1, fmt, ap);
+	va_end(ap);
+	sb->size += (size_t)n;
+}
+
+/*写入 JSON 字符串，包含两侧引号*/
+static void sb_json_str(StrBuf *sb, const char *s)
+{
+	char esc[8];
+	sb_append(sb, "\"", 1);
+	for (; *s; s++) {
+		unsigned char c = (unsigned char)*s;
+		if (c == '"' || c == '\\') {
+			esc[0] = '\\'; esc[1] = (char)c;
+			sb_append(sb, esc, 2);
+		}
+		else if (c < 0x20) {
+			snprintf(esc, sizeof(esc), "\\u%04x", c);
+			sb_append(sb, esc, 6);
+		}
+		else {
+			sb_append(sb, s, 1);
+		}
+	}
+	sb_append(sb, "\"", 1);
+}
+
+#pragma endregion
+
+#pragma region 内存目录树
+
+static void node_md5(MockNode *node)
+{
+	unsigned char md[EVP_MAX_MD_SIZE];
+	unsigned int mdlen = 0, i;
+	EVP_Digest(node->data ? node->data : "", node->size, md, &mdlen, EVP_md5(), NULL);
+	for (i = 0; i < mdlen && i < 16; i++)
+		sprintf(&node->md5[i * 2], "%02x", md[i]);
+	node->md5[32] = '\0';
+}
+
+static MockNode *node_create(MockServer *server, const char *name, size_t namelen, int isdir, time_t mtime)
+{
+	MockNode *node = (MockNode *)calloc(1, sizeof(MockNode));
+	if (!node) return NULL;
+	node->name = (char *)malloc(namelen + 1);
+	if (!node->name) {
+		free(node);
+		return NULL;
+	}
+	memcpy(node->name, name, namelen);
+	node->name[namelen] = '\0';
+	node->isdir = isdir;
+	node->ctime = node->mtime = mtime;
+	node->fs_id = ++server->next_fs_id;
+	return node;
+}
+
+static void node_free(MockServer *server, MockNode *node)
+{
+	MockNode *child, *next;
+	for (child = node->child; child; child = next) {
+		next = child->next;
+		node_free(server, child);
+	}
+	if (!node->isdir) server->used -= (double)node->size;
+	free(node->data);
+	free(node->name);
+	free(node);
+}
+
+static MockNode *node_child(MockNode *dir, const char *name, size_t namelen)
+{
+	MockNode *child;
+	for (child = dir->child; child; child = child->next) {
+		if (strncmp(child->name, name, namelen) == 0 && child->name[namelen] == '\0')
+			return child;
+	}
+	return NULL;
+}
+
+/*按名称顺序插入到 dir 的子项中*/
+static void node_link(MockNode *dir, MockNode *node)
+{
+	MockNode **pp = &dir->child;
+	while (*pp && strcmp((*pp)->name, node->name) < 0)
+		pp = &(*pp)->next;
+	node->next = *pp;
+	*pp = node;
+	node->parent = dir;
+}
+
+static void node_unlink(MockNode *node)
+{
+	MockNode **pp = &node->parent->child;
+	while (*pp && *pp != node)
+		pp = &(*pp)->next;
+	if (*pp) *pp = node->next;
+	node->parent = NULL;
+	node->next = NULL;
+}
+
+/*查找 path 对应的节点。create_dirs 非 0 时，沿途不存在的目录会被创建*/
+static MockNode *node_find(MockServer *server, const char *path, int create_dirs)
+{
+	MockNode *node = server->root, *child;
+	const char *p = path, *end;
+	while (node && *p) {
+		while (*p == '/') p++;
+		if (!*p) break;
+		end = p;
+		while (*end && *end != '/') end++;
+		if (!node->isdir) return NULL;
+		child = node_child(node, p, end - p);
+		if (!child && create_dirs) {
+			child = node_create(server, p, end - p, 1, time(NULL));
+			if (!child) return NULL;
+			node_link(node, child);
+		}
+		node = child;
+		p = end;
+	}
+	return node;
+}
+
+/*拆分出上级目录和文件名。失败返回 NULL，成功返回上级目录节点，*pName 指向 path 中的文件名*/
+static MockNode *node_parent(MockServer *server, const char *path, const char **pName, int create_dirs)
+{
+	const char *slash = strrchr(path, '/');
+	char *dir;
+	MockNode *parent;
+	if (!slash || !slash[1]) return NULL;
+	dir = (char *)malloc(slash - path + 1);
+	if (!dir) return NULL;
+	memcpy(dir, path, slash - path);
+	dir[slash - path] = '\0';
+	parent = node_find(server, dir, create_dirs);
+	free(dir);
+	if (!parent || !parent->isdir) return NULL;
+	*pName = slash + 1;
+	return parent;
+}
+
+static void node_path(MockNode *node, StrBuf *sb)
+{
+	if (!node->parent) {
+		if (!sb->size) sb_puts(sb, "/");
+		return;
+	}
+	node_path(node->parent, sb);
+	if (sb->size > 1) sb_puts(sb, "/");
+	sb_puts(sb, node->name);
+}
+
+static MockNode *node_clone(MockServer *server, MockNode *src)
+{
+	MockNode *node, *child, *copy;
+	node = node_create(server, src->name, strlen(src->name), src->isdir, src->mtime);
+	if (!node) return NULL;
+	if (src->size) {
+		node->data = (char *)malloc(src->size);
+		if (!node->data) {
+			node_free(server, node);
+			return NULL;
+		}
+		memcpy(node->data, src->data, src->size);
+	}
+	node->size = src->size;
+	memcpy(node->md5, src->md5, sizeof(node->md5));
+	if (!node->isdir) server->used += (double)node->size;
+	for (child = src->child; child; child = child->next) {
+		copy = node_clone(server, child);
+		if (copy) node_link(node, copy);
+	}
+	return node;
+}
+
+/*以 pcs_parse_fileinfo() 能识别的格式输出一项的各个字段，不含两侧的大括号*/
+static void node_json_fields(MockNode *node, StrBuf *sb)
+{
+	StrBuf path = { 0 };
+	node_path(node, &path);
+	sb_printf(sb, "\"fs_id\":%llu,\"path\":", node->fs_id);
+	sb_json_str(sb, path.data);
+	sb_puts(sb, ",\"server_filename\":");
+	sb_json_str(sb, node->name);
+	sb_printf(sb, ",\"server_mtime\":%ld,\"server_ctime\":%ld,\"local_mtime\":%ld,\"local_ctime\":%ld",
+		(long)node->mtime, (long)node->ctime, (long)node->mtime, (long)node->ctime);
+	if (node->isdir)
+		sb_printf(sb, ",\"isdir\":1,\"category\":6,\"size\":0,\"dir_empty\":%d,\"empty\":0", node->child ? 0 : 1);
+	else
+		sb_printf(sb, ",\"isdir\":0,\"category\":6,\"size\":%lu,\"md5\":\"%s\"", (unsigned long)node->size, node->md5);
+	free(path.data);
+}
+
+static void node_to_json(MockNode *node, StrBuf *sb)
+{
+	sb_puts(sb, "{");
+	node_json_fields(node, sb);
+	sb_puts(sb, "}");
+}
+
+/*写入文件，data 的所有权转移给节点。调用者需持有 server->lock*/
+static MockNode *tree_put(MockServer *server, const char *path, char *data, size_t size, time_t mtime, int overwrite)
+{
+	const char *name;
+	char *newname = NULL;
+	MockNode *parent, *node;
+	int i;
+
+	parent = node_parent(server, path, &name, 1);
+	if (!parent) return NULL;
+	node = node_child(parent, name, strlen(name));
+	if (node && (node->isdir || !overwrite)) {
+		/*与网盘的 ondup=newcopy 一样，换一个不冲突的名字*/
+		for (i = 1; i < 10000; i++) {
+			free(newname);
+			newname = (char *)malloc(strlen(name) + 16);
+			if (!newname) return NULL;
+			sprintf(newname, "%s(%d)", name, i);
+			if (!node_child(parent, newname, strlen(newname))) break;
+		}
+		name = newname;
+		node = NULL;
+	}
+	if (!node) {
+		node = node_create(server, name, strlen(name), 0, mtime);
+		if (!node) {
+			free(newname);
+			return NULL;
+		}
+		node_link(parent, node);
+	}
+	else {
+		server->used -= (double)node->size;
+		free(node->data);
+		node->mtime = mtime;
+	}
+	free(newname);
+	node->data = data;
+	node->size = size;
+	server->used += (double)size;
+	node_md5(node);
+	return node;
+}
+
+#pragma endregion
+
+#pragma region 请求解析
+
+static void url_decode(char *s)
+{
+	char *d = s, hex[3] = { 0 };
+	while (*s) {
+		if (*s == '%' && s[1] && s[2]) {
+			hex[0] = s[1]; hex[1] = s[2];
+			*d++ = (char)strtol(hex, NULL, 16);
+			s += 3;
+		}
+		else if (*s == '+') {
+			*d++ = ' ';
+			s++;
+		}
+		else {
+			*d++ = *s++;
+		}
+	}
+	*d = '\0';
+}
+
+/*从 a=1&b=2 形式的串中取出 key 的值，返回的串需要 free()。不存在时返回 NULL*/
+static char *form_get(const char *qs, const char *key)
+{
+	size_t keylen = strlen(key);
+	const char *p = qs, *end;
+	char *val;
+	while (p && *p) {
+		end = strchr(p, '&');
+		if (!end) end = p + strlen(p);
+		if ((size_t)(end - p) > keylen && strncmp(p, key, keylen) == 0 && p[keylen] == '=') {
+			p += keylen + 1;
+			val = (char *)malloc(end - p + 1);
+			if (!val) return NULL;
+			memcpy(val, p, end - p);
+			val[end - p] = '\0';
+			url_decode(val);
+			return val;
+		}
+		p = *end ? end + 1 : end;
+	}
+	return NULL;
+}
+
+static void *mem_find(const void *hay, size_t haylen, const void *needle, size_t nlen)
+{
+	const char *h = (const char *)hay, *end;
+	if (nlen == 0 || haylen < nlen) return NULL;
+	end = h + haylen - nlen;
+	for (; h <= end; h++) {
+		h = (const char *)memchr(h, *(const char *)needle, end - h + 1);
+		if (!h) return NULL;
+		if (memcmp(h, needle, nlen) == 0) return (void *)h;
+	}
+	return NULL;
+}
+
+/*从 multipart/form-data 请求体中取出 name="file" 的内容*/
+static int multipart_file(MockRequest *req, const char **pData, size_t *pSize)
+{
+	const char *b, *p, *end, *hdr_end, *data_end;
+	char delim[256];
+	size_t dlen;
+
+	if (!req->content_type) return -1;
+	b = strstr(req->content_type, "boundary=");
+	if (!b) return -1;
+	b += 9;
+	if (*b == '"') b++;
+	dlen = strcspn(b, "\";\r\n ");
+	if (dlen == 0 || dlen + 4 >= sizeof(delim)) return -1;
+	memcpy(delim, "\r\n--", 4);
+	memcpy(delim + 4, b, dlen);
+	dlen += 4;
+
+	p = req->body;
+	end = req->body + req->body_size;
+	/*第一个分隔符前面没有 \r\n*/
+	p = (const char *)mem_find(p, end - p, delim + 2, dlen - 2);
+	while (p) {
+		p += dlen - 2;
+		if (end - p >= 2 && p[0] == '-' && p[1] == '-') break;
+		hdr_end = (const char *)mem_find(p, end - p, "\r\n\r\n", 4);
+		if (!hdr_end) break;
+		data_end = (const char *)mem_find(hdr_end + 4, end - hdr_end - 4, delim, dlen);
+		if (!data_end) break;
+		if (mem_find(p, hdr_end - p, "name=\"file\"", 11)) {
+			*pData = hdr_end + 4;
+			*pSize = data_end - (hdr_end + 4);
+			return 0;
+		}
+		p = data_end + 2;
+	}
+	return -1;
+}
+
+#pragma endregion
+
+#pragma region 网络读写
+
+static void sleep_ms(double ms)
+{
+	struct timespec ts;
+	if (ms <= 0) return;
+	ts.tv_sec = (time_t)(ms / 1000);
+	ts.tv_nsec = (long)((ms - ts.tv_sec * 1000.0) * 1000000.0);
+	nanosleep(&ts, NULL);
+}
+
+static double clock_ms()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+/*带宽限制：已传输 done 字节时，应至少经过 done / bandwidth 秒*/
+static void throttle(MockServer *server, double start, size_t done)
+{
+	double expect;
+	if (server->opts.bandwidth <= 0) return;
+	expect = (double)done * 1000.0 / (double)server->opts.bandwidth;
+	sleep_ms(expect - (clock_ms() - start));
+}
+
+static int send_all(int fd, const char *data, size_t size)
+{
+	ssize_t n;
+	while (size > 0) {
+		n = send(fd, data, size, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		data += n;
+		size -= (size_t)n;
+	}
+	return 0;
+}
+
+/*再读一些数据到连接缓冲区，连接关闭或出错时返回 -1*/
+static int conn_fill(MockConn *conn)
+{
+	ssize_t n;
+	char *p;
+	size_t cap;
+	if (conn->capacity - conn->len < MOCK_IO_CHUNK) {
+		cap = conn->capacity ? conn->capacity * 2 : MOCK_IO_CHUNK * 2;
+		while (cap - conn->len < MOCK_IO_CHUNK) cap *= 2;
+		p = (char *)realloc(conn->buf, cap + 1);
+		if (!p) return -1;
+		conn->buf = p;
+		conn->capacity = cap;
+	}
+	do {
+		n = recv(conn->fd, conn->buf + conn->len, conn->capacity - conn->len, 0);
+	} while (n < 0 && errno == EINTR);
+	if (n <= 0) return -1;
+	conn->len += (size_t)n;
+	conn->buf[conn->len] = '\0';
+	return 0;
+}
+
+/*确保缓冲区中至少有 need 字节，读取时按带宽限制放慢*/
+static int conn_need(MockConn *conn, size_t need, double start, size_t base)
+{
+	while (conn->len < need) {
+		if (conn_fill(conn)) return -1;
+		throttle(conn->server, start, conn->len > base ? conn->len - base : 0);
+	}
+	return 0;
+}
+
+static void conn_consume(MockConn *conn, size_t n)
+{
+	memmove(conn->buf, conn->buf + n, conn->len - n);
+	conn->len -= n;
+	if (conn->buf) conn->buf[conn->len] = '\0';
+}
+
+/*读取 chunked 编码的请求体，解码后的内容写入 req->body*/
+static int read_chunked(MockConn *conn, MockRequest *req, double start)
+{
+	StrBuf body = { 0 };
+	char *eol;
+	size_t chunk;
+	for (;;) {
+		while (!(eol = (char *)mem_find(conn->buf, conn->len, "\r\n", 2))) {
+			if (conn_fill(conn)) goto fail;
+		}
+		chunk = (size_t)strtoul(conn->buf, NULL, 16);
+		conn_consume(conn, eol - conn->buf + 2);
+		if (chunk == 0) {
+			/*跳过尾部的头，直到空行*/
+			for (;;) {
+				while (!(eol = (char *)mem_find(conn->buf, conn->len, "\r\n", 2))) {
+					if (conn_fill(conn)) goto fail;
+				}
+				if (eol == conn->buf) {
+					conn_consume(conn, 2);
+					break;
+				}
+				conn_consume(conn, eol - conn->buf + 2);
+			}
+			break;
+		}
+		if (conn_need(conn, chunk + 2, start, 0)) goto fail;
+		sb_append(&body, conn->buf, chunk);
+		conn_consume(conn, chunk + 2);
+		throttle(conn->server, start, body.size);
+	}
+	req->body = body.data ? body.data : (char *)calloc(1, 1);
+	req->body_size = body.size;
+	return 0;
+fail:
+	free(body.data);
+	return -1;
+}
+
+static const char *header_value(char *headers, const char *name)
+{
+	size_t n = strlen(name);
+	char *line = headers, *p;
+	while (line && *line) {
+		if (strncasecmp(line, name, n) == 0 && line[n] == ':') {
+			p = line + n + 1;
+			while (*p == ' ' || *p == '\t') p++;
+			return p;
+		}
+		line = strstr(line, "\r\n");
+		if (line) line += 2;
+	}
+	return NULL;
+}
+
+static char *header_dup(char *headers, const char *name)
+{
+	const char *v = header_value(headers, name);
+	size_t n;
+	char *s;
+	if (!v) return NULL;
+	n = strcspn(v, "\r\n");
+	s = (char *)malloc(n + 1);
+	if (!s) return NULL;
+	memcpy(s, v, n);
+	s[n] = '\0';
+	return s;
+}
+
+static void request_free(MockRequest *req)
+{
+	free(req->target);
+	free(req->content_type);
+	free(req->range);
+	free(req->body);
+	memset(req, 0, sizeof(MockRequest));
+}
+
+/*读取一个完整的请求。连接关闭或请求无效时返回 -1*/
+static int read_request(MockConn *conn, MockRequest *req)
+{
+	char *hdr_end, *line_end, *sp1, *sp2, *target, *expect, *te, *conn_hdr;
+	const char *cl;
+	size_t hdr_len, body_len;
+	int http10;
+	double start;
+
+	while (!(hdr_end = strstr(conn->buf ? conn->buf : "", "\r\n\r\n"))) {
+		if (conn->len > MOCK_MAX_HEADER || conn_fill(conn)) return -1;
+	}
+	hdr_len = hdr_end - conn->buf + 4;
+	hdr_end[2] = '\0';	/*头部以 \r\n 结束，便于按行查找*/
+
+	line_end = strstr(conn->buf, "\r\n");
+	sp1 = strchr(conn->buf, ' ');
+	if (!sp1 || sp1 > line_end || sp1 - conn->buf >= (int)sizeof(req->method)) return -1;
+	sp2 = strchr(sp1 + 1, ' ');
+	if (!sp2 || sp2 > line_end) return -1;
+	memcpy(req->method, conn->buf, sp1 - conn->buf);
+	req->method[sp1 - conn->buf] = '\0';
+	http10 = strncmp(sp2 + 1, "HTTP/1.0", 8) == 0;
+
+	/*作为代理时，请求行中是完整的 URL*/
+	target = sp1 + 1;
+	if (strncasecmp(target, "http://", 7) == 0) {
+		target = strchr(target + 7, '/');
+		if (!target || target > sp2) target = sp2;
+	}
+	req->target = (char *)malloc(sp2 - target + 2);
+	if (!req->target) return -1;
+	if (target == sp2) {
+		strcpy(req->target, "/");
+	}
+	else {
+		memcpy(req->target, target, sp2 - target);
+		req->target[sp2 - target] = '\0';
+	}
+	req->query = strchr(req->target, '?');
+	if (req->query) *req->query++ = '\0';
+	else req->query = req->target + strlen(req->target);
+
+	req->content_type = header_dup(line_end + 2, "Content-Type");
+	req->range = header_dup(line_end + 2, "Range");
+	expect = header_dup(line_end + 2, "Expect");
+	te = header_dup(line_end + 2, "Transfer-Encoding");
+	conn_hdr = header_dup(line_end + 2, "Connection");
+	if (!conn_hdr) conn_hdr = header_dup(line_end + 2, "Proxy-Connection");
+	cl = header_value(line_end + 2, "Content-Length");
+	body_len = cl ? (size_t)strtoull(cl, NULL, 10) : 0;
+	req->keep_alive = http10 ? (conn_hdr && strcasecmp(conn_hdr, "keep-alive") == 0)
+		: !(conn_hdr && strcasecmp(conn_hdr, "close") == 0);
+	conn_consume(conn, hdr_len);
+
+	if (expect && strcasecmp(expect, "100-continue") == 0 && conn->len == 0
+		&& (body_len > 0 || te)) {
+		send_all(conn->fd, "HTTP/1.1 100 Continue\r\n\r\n", 25);
+	}
+	free(expect);
+	free(conn_hdr);
+
+	start = clock_ms();
+	if (te && strcasecmp(te, "chunked") == 0) {
+		free(te);
+		return read_chunked(conn, req, start);
+	}
+	free(te);
+	if (conn_need(conn, body_len, start, 0)) return -1;
+	req->body = (char *)malloc(body_len + 1);
+	if (!req->body) return -1;
+	memcpy(req->body, conn->buf, body_len);
+	req->body[body_len] = '\0';
+	req->body_size = body_len;
+	conn_consume(conn, body_len);
+	return 0;
+}
+
+static int send_response(MockConn *conn, MockRequest *req, int code, const char *content_type,
+	const char *extra_headers, const char *body, size_t size)
+{
+	StrBuf head = { 0 };
+	const char *status;
+	double start;
+	size_t sent, n;
+	int rc;
+
+	switch (code) {
+	case 200: status = "OK"; break;
+	case 206: status = "Partial Content"; break;
+	case 400: status = "Bad Request"; break;
+	case 404: status = "Not Found"; break;
+	case 416: status = "Range Not Satisfiable"; break;
+	default: status = "Internal Server Error"; break;
+	}
+	sb_printf(&head, "HTTP/1.1 %d %s\r\nServer: pcs-mock\r\nContent-Type: %s\r\nContent-Length: %lu\r\n"
+		"Connection: %s\r\n%s\r\n",
+		code, status, content_type, (unsigned long)size,
+		req->keep_alive ? "keep-alive" : "close", extra_headers ? extra_headers : "");
+	rc = send_all(conn->fd, head.data, head.size);
+	free(head.data);
+	if (rc) return rc;
+	if (conn->server->opts.bandwidth <= 0)
+		return send_all(conn->fd, body, size);
+	start = clock_ms();
+	for (sent = 0; sent < size; sent += n) {
+		n = size - sent < MOCK_IO_CHUNK ? size - sent : MOCK_IO_CHUNK;
+		if (send_all(conn->fd, body + sent, n)) return -1;
+		throttle(conn->server, start, sent + n);
+	}
+	return 0;
+}
+
+static int send_json(MockConn *conn, MockRequest *req, int code, StrBuf *sb)
+{
+	int rc = send_response(conn, req, code, "application/json; charset=UTF-8", NULL, sb->data ? sb->data : "", sb->size);
+	free(sb->data);
+	sb->data = NULL;
+	sb->size = sb->capacity = 0;
+	return rc;
+}
+
+#pragma endregion
+
+#pragma region 接口实现
+
+static int api_home(MockConn *conn, MockRequest *req)
+{
+	StrBuf sb = { 0 };
+	int rc;
+	sb_puts(&sb, "<!DOCTYPE html><html><head><title>pcs mock</title></head><body><script>\n"
+		"var yunData = {};\n"
+		"yunData.MYBDSTOKEN = \"" MOCK_BDSTOKEN "\";\n"
+		"yunData.MYNAME = \"" MOCK_USERNAME "\";\n"
+		"</script></body></html>\n");
+	rc = send_response(conn, req, 200, "text/html; charset=utf-8",
+		"Set-Cookie: BDUSS=pcsbenchbduss; expires=Fri, 01-Jan-2100 00:00:00 GMT; path=/; domain=.baidu.com\r\n",
+		sb.data, sb.size);
+	free(sb.data);
+	return rc;
+}
+
+static int api_list(MockConn *conn, MockRequest *req)
+{
+	MockServer *server = conn->server;
+	StrBuf sb = { 0 };
+	MockNode *dir, *child, **items = NULL;
+	char *path = form_get(req->query, "dir"),
+		*page = form_get(req->query, "page"),
+		*num = form_get(req->query, "num"),
+		*desc = form_get(req->query, "desc");
+	int pageindex = page ? atoi(page) : 1, pagesize = num ? atoi(num) : 100,
+		cnt = 0, i, first, last;
+
+	if (pageindex < 1) pageindex = 1;
+	if (pagesize < 1) pagesize = 100;
+	pthread_mutex_lock(&server->lock);
+	dir = path ? node_find(server, path, 0) : NULL;
+	if (!dir || !dir->isdir) {
+		sb_puts(&sb, "{\"errno\":-9,\"list\":[],\"request_id\":1}");
+	}
+	else {
+		for (child = dir->child; child; child = child->next) cnt++;
+		items = (MockNode **)malloc(sizeof(MockNode *) * (cnt + 1));
+		i = 0;
+		if (items) for (child = dir->child; child; child = child->next) items[i++] = child;
+		first = (pageindex - 1) * pagesize;
+		last = first + pagesize < cnt ? first + pagesize : cnt;
+		sb_puts(&sb, "{\"errno\":0,\"list\":[");
+		for (i = first; items && i < last; i++) {
+			if (i > first) sb_puts(&sb, ",");
+			/*desc=1 时倒序*/
+			node_to_json(desc && strcmp(desc, "1") == 0 ? items[cnt - 1 - i] : items[i], &sb);
+		}
+		sb_puts(&sb, "],\"request_id\":1}");
+		free(items);
+	}
+	pthread_mutex_unlock(&server->lock);
+	free(path); free(page); free(num); free(desc);
+	return send_json(conn, req, 200, &sb);
+}
+
+static void search_node(MockNode *dir, const char *key, int recursion, StrBuf *sb, int *cnt)
+{
+	MockNode *child;
+	for (child = dir->child; child; child = child->next) {
+		if (strstr(child->name, key)) {
+			if ((*cnt)++) sb_puts(sb, ",");
+			node_to_json(child, sb);
+		}
+		if (recursion && child->isdir)
+			search_node(child, key, recursion, sb, cnt);
+	}
+}
+
+static int api_search(MockConn *conn, MockRequest *req)
+{
+	MockServer *server = conn->server;
+	StrBuf sb = { 0 };
+	MockNode *dir;
+	char *path = form_get(req->query, "dir"),
+		*key = form_get(req->query, "key"),
+		*recursion = form_get(req->query, "recursion");
+	int cnt = 0;
+
+	pthread_mutex_lock(&server->lock);
+	dir = path ? node_find(server, path, 0) : NULL;
+	if (!dir || !dir->isdir || !key) {
+		sb_puts(&sb, "{\"errno\":-9,\"list\":[],\"request_id\":1}");
+	}
+	else {
+		sb_puts(&sb, "{\"errno\":0,\"list\":[");
+		search_node(dir, key, recursion != NULL, &sb, &cnt);
+		sb_puts(&sb, "],\"request_id\":1}");
+	}
+	pthread_mutex_unlock(&server->lock);
+	free(path); free(key); free(recursion);
+	return send_json(conn, req, 200, &sb);
+}
+
+static int api_quota(MockConn *conn, MockRequest *req)
+{
+	StrBuf sb = { 0 };
+	double used;
+	pthread_mutex_lock(&conn->server->lock);
+	used = conn->server->used;
+	pthread_mutex_unlock(&conn->server->lock);
+	sb_printf(&sb, "{\"errno\":0,\"total\":%.0f,\"used\":%.0f,\"request_id\":1}", MOCK_QUOTA, used);
+	return send_json(conn, req, 200, &sb);
+}
+
+static int api_create(MockConn *conn, MockRequest *req)
+{
+	MockServer *server = conn->server;
+	StrBuf sb = { 0 };
+	MockNode *parent, *node;
+	const char *name;
+	char *path = form_get(req->body, "path");
+
+	pthread_mutex_lock(&server->lock);
+	parent = path ? node_parent(server, path, &name, 1) : NULL;
+	if (!parent) {
+		sb_puts(&sb, "{\"errno\":-7,\"request_id\":1}");
+	}
+	else if (node_child(parent, name, strlen(name))) {
+		sb_puts(&sb, "{\"errno\":-8,\"request_id\":1}");
+	}
+	else {
+		node = node_create(server, name, strlen(name), 1, time(NULL));
+		if (node) {
+			node_link(parent, node);
+			sb_puts(&sb, "{\"errno\":0,");
+			node_json_fields(node, &sb);
+			sb_puts(&sb, ",\"request_id\":1}");
+		}
+		else {
+			sb_puts(&sb, "{\"errno\":-1,\"request_id\":1}");
+		}
+	}
+	pthread_mutex_unlock(&server->lock);
+	free(path);
+	return send_json(conn, req, 200, &sb);
+}
+
+/*执行 filemanager 的一项操作，返回网盘的 errno*/
+static int filemanager_item(MockServer *server, const char *opera, cJSON *item)
+{
+	cJSON *val;
+	const char *path, *newname = NULL, *dest = NULL, *name;
+	MockNode *node, *target, *parent;
+
+	if (item->type == cJSON_String) {
+		path = item->valuestring;
+	}
+	else {
+		val = cJSON_GetObjectItem(item, "path");
+		if (!val || val->type != cJSON_String) return -7;
+		path = val->valuestring;
+		if ((val = cJSON_GetObjectItem(item, "newname"))) newname = val->valuestring;
+		if ((val = cJSON_GetObjectItem(item, "dest"))) dest = val->valuestring;
+	}
+	node = node_find(server, path, 0);
+	if (!node || !node->parent) return -9;
+
+	if (strcmp(opera, "delete") == 0) {
+		node_unlink(node);
+		node_free(server, node);
+		return 0;
+	}
+	if (!newname || !*newname || strchr(newname, '/')) return -7;
+	if (strcmp(opera, "rename") == 0) {
+		parent = node->parent;
+	}
+	else if (strcmp(opera, "move") == 0 || strcmp(opera, "copy") == 0) {
+		parent = dest ? node_find(server, dest, 1) : NULL;
+		if (!parent || !parent->isdir) return -9;
+		/*不能移动到自身的子目录中*/
+		for (target = parent; target; target = target->parent) {
+			if (target == node) return -7;
+		}
+	}
+	else {
+		return -1;
+	}
+	target = node_child(parent, newname, strlen(newname));
+	if (target == node) return 0;
+	if (target) return -8;
+	if (strcmp(opera, "copy") == 0) {
+		node = node_clone(server, node);
+		if (!node) return -1;
+	}
+	else {
+		node_unlink(node);
+	}
+	name = node->name;
+	node->name = strdup(newname);
+	if (!node->name) {
+		node->name = (char *)name;
+		name = NULL;
+	}
+	free((char *)name);
+	node_link(parent, node);
+	return 0;
+}
+
+static int api_filemanager(MockConn *conn, MockRequest *req)
+{
+	MockServer *server = conn->server;
+	StrBuf sb = { 0 }, info = { 0 };
+	cJSON *list, *item, *val;
+	char *opera = form_get(req->query, "opera"),
+		*filelist = form_get(req->body, "filelist");
+	int i, cnt, error, failed = 0;
+
+	list = filelist ? cJSON_Parse(filelist) : NULL;
+	if (!opera || !list || list->type != cJSON_Array) {
+		sb_puts(&sb, "{\"errno\":2,\"info\":[],\"request_id\":1}");
+	}
+	else {
+		cnt = cJSON_GetArraySize(list);
+		pthread_mutex_lock(&server->lock);
+		for (i = 0; i < cnt; i++) {
+			item = cJSON_GetArrayItem(list, i);
+			error = filemanager_item(server, opera, item);
+			if (error) failed = 1;
+			if (i) sb_puts(&info, ",");
+			sb_puts(&info, "{\"path\":");
+			val = item->type == cJSON_String ? item : cJSON_GetObjectItem(item, "path");
+			sb_json_str(&info, val && val->type == cJSON_String ? val->valuestring : "");
+			sb_printf(&info, ",\"errno\":%d}", error);
+		}
+		pthread_mutex_unlock(&server->lock);
+		sb_printf(&sb, "{\"errno\":%d,\"info\":[%s],\"request_id\":1}", failed ? 12 : 0, info.data ? info.data : "");
+	}
+	if (list) cJSON_Delete(list);
+	free(info.data);
+	free(opera);
+	free(filelist);
+	return send_json(conn, req, 200, &sb);
+}
+
+static int pcs_upload(MockConn *conn, MockRequest *req)
+{
+	MockServer *server = conn->server;
+	StrBuf sb = { 0 }, path = { 0 };
+	MockNode *node = NULL;
+	const char *data;
+	char *copy, *dir = form_get(req->query, "dir"),
+		*filename = form_get(req->query, "filename"),
+		*ondup = form_get(req->query, "ondup");
+	size_t size;
+
+	if (dir && filename && *filename && !strchr(filename, '/')
+		&& multipart_file(req, &data, &size) == 0) {
+		sb_puts(&path, dir);
+		if (!path.size || path.data[path.size - 1] != '/') sb_puts(&path, "/");
+		sb_puts(&path, filename);
+		copy = (char *)malloc(size ? size : 1);
+		if (copy) {
+			memcpy(copy, data, size);
+			pthread_mutex_lock(&server->lock);
+			node = tree_put(server, path.data, copy, size, time(NULL), ondup && strcmp(ondup, "overwrite") == 0);
+			if (node) {
+				server->stats.uploads++;
+				server->stats.bytes_in += (double)size;
+				node_to_json(node, &sb);
+			}
+			pthread_mutex_unlock(&server->lock);
+			if (!node) free(copy);
+		}
+	}
+	free(path.data); free(dir); free(filename); free(ondup);
+	if (!node) {
+		sb_puts(&sb, "{\"error_code\":31062,\"error_msg\":\"file name is invalid\",\"request_id\":1}");
+		return send_json(conn, req, 400, &sb);
+	}
+	return send_json(conn, req, 200, &sb);
+}
+
+/*
+ * 解析 "bytes=FIRST-LAST" 或 "bytes=FIRST-" 形式的 Range 头，只支持单个区间。
+ * 成功返回0，区间超出文件范围返回-1
+*/
+static int parse_range(const char *range, size_t size, size_t *first, size_t *last)
+{
+	char *end;
+	unsigned long long a, b;
+	if (strncmp(range, "bytes=", 6) != 0) return -1;
+	a = strtoull(range + 6, &end, 10);
+	if (end == range + 6 || *end != '-') return -1;
+	range = end + 1;
+	b = strtoull(range, &end, 10);
+	if (end == range) b = size ? size - 1 : 0;
+	if (a >= size || b < a) return -1;
+	if (b >= size) b = size - 1;
+	*first = (size_t)a;
+	*last = (size_t)b;
+	return 0;
+}
+
+static int pcs_download(MockConn *conn, MockRequest *req)
+{
+	MockServer *server = conn->server;
+	StrBuf sb = { 0 };
+	MockNode *node;
+	char *data = NULL, *path = form_get(req->query, "path"), head[96];
+	size_t size = 0, first, last;
+	int found = 0, ranged, rc;
+
+	pthread_mutex_lock(&server->lock);
+	ranged = req->range && !server->ignore_range;
+	node = path ? node_find(server, path, 0) : NULL;
+	if (node && !node->isdir) {
+		/*复制一份再发送，避免发送期间持有锁*/
+		data = (char *)malloc(node->size ? node->size : 1);
+		if (data) {
+			memcpy(data, node->data, node->size);
+			size = node->size;
+			found = 1;
+			server->stats.downloads++;
+			server->stats.bytes_out += (double)size;
+		}
+	}
+	pthread_mutex_unlock(&server->lock);
+	free(path);
+	if (!found) {
+		sb_puts(&sb, "{\"error_code\":31066,\"error_msg\":\"file does not exist\",\"request_id\":1}");
+		return send_json(conn, req, 404, &sb);
+	}
+	if (ranged) {
+		if (parse_range(req->range, size, &first, &last)) {
+			free(data);
+			sprintf(head, "Content-Range: bytes */%lu\r\n", (unsigned long)size);
+			return send_response(conn, req, 416, "text/plain", head, "", 0);
+		}
+		sprintf(head, "Content-Range: bytes %lu-%lu/%lu\r\n", (unsigned long)first, (unsigned long)last, (unsigned long)size);
+		rc = send_response(conn, req, 206, "application/octet-stream", head, data + first, last - first + 1);
+	}
+	else {
+		rc = send_response(conn, req, 200, "application/octet-stream", NULL, data, size);
+	}
+	free(data);
+	return rc;
+}
+
+static int dispatch(MockConn *conn, MockRequest *req)
+{
+	MockServer *server = conn->server;
+	StrBuf sb = { 0 };
+	char *method;
+	int inject = 0, rc;
+
+	pthread_mutex_lock(&server->lock);
+	server->stats.requests++;
+	if (server->fail_next > 0) {
+		server->fail_next--;
+		server->stats.errors++;
+		inject = 1;
+	}
+	else if (server->opts.error_rate > 0 && (int)(rand_r(&server->seed) % 1000) < server->opts.error_rate) {
+		server->stats.errors++;
+		inject = 1;
+	}
+	pthread_mutex_unlock(&server->lock);
+	if (server->opts.latency_ms > 0)
+		sleep_ms(server->opts.latency_ms);
+	if (inject) {
+		sb_puts(&sb, "{\"error_code\":31000,\"error_msg\":\"injected error\",\"request_id\":1}");
+		return send_json(conn, req, 500, &sb);
+	}
+
+	if (strcmp(req->target, "/disk/home") == 0)
+		return api_home(conn, req);
+	if (strcmp(req->target, "/api/list") == 0)
+		return api_list(conn, req);
+	if (strcmp(req->target, "/api/search") == 0)
+		return api_search(conn, req);
+	if (strcmp(req->target, "/api/quota") == 0)
+		return api_quota(conn, req);
+	if (strcmp(req->target, "/api/create") == 0)
+		return api_create(conn, req);
+	if (strcmp(req->target, "/api/filemanager") == 0)
+		return api_filemanager(conn, req);
+	if (strcmp(req->target, "/rest/2.0/pcs/file") == 0) {
+		method = form_get(req->query, "method");
+		rc = 1;
+		if (method && strcmp(method, "upload") == 0)
+			rc = pcs_upload(conn, req);
+		else if (method && strcmp(method, "download") == 0)
+			rc = pcs_download(conn, req);
+		free(method);
+		if (rc != 1) return rc;
+	}
+	sb_puts(&sb, "{\"error_code\":3,\"error_msg\":\"Unsupported openapi method\",\"request_id\":1}");
+	return send_json(conn, req, 404, &sb);
+}
+
+#pragma endregion
+
+#pragma region 线程
+
+static void conn_register(MockServer *server, int fd, int add)
+{
+	int i;
+	pthread_mutex_lock(&server->conn_lock);
+	if (add) {
+		server->conns[server->conn_count++] = fd;
+	}
+	else {
+		for (i = 0; i < server->conn_count; i++) {
+			if (server->conns[i] == fd) {
+				server->conns[i] = server->conns[--server->conn_count];
+				break;
+			}
+		}
+		pthread_cond_broadcast(&server->conn_cond);
+	}
+	pthread_mutex_unlock(&server->conn_lock);
+}
+
+static void *conn_main(void *arg)
+{
+	MockConn *conn = (MockConn *)arg;
+	MockRequest req = { { 0 } };
+
+	for (;;) {
+		if (read_request(conn, &req)) break;
+		if (dispatch(conn, &req) || !req.keep_alive) break;
+		request_free(&req);
+	}
+	request_free(&req);
+	conn_register(conn->server, conn->fd, 0);
+	close(conn->fd);
+	free(conn->buf);
+	free(conn);
+	return NULL;
+}
+
+static void *accept_main(void *arg)
+{
+	MockServer *server = (MockServer *)arg;
+	MockConn *conn;
+	pthread_t tid;
+	int fd, one = 1, full;
+
+	for (;;) {
+		fd = accept(server->listen_fd, NULL, NULL);
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED) continue;
+			break;
+		}
+		pthread_mutex_lock(&server->conn_lock);
+		full = server->stopping || server->conn_count >= MOCK_MAX_CONNS;
+		pthread_mutex_unlock(&server->conn_lock);
+		if (full) {
+			close(fd);
+			continue;
+		}
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		conn = (MockConn *)calloc(1, sizeof(MockConn));
+		if (!conn) {
+			close(fd);
+			continue;
+		}
+		conn->server = server;
+		conn->fd = fd;
+		conn_register(server, fd, 1);
+		if (pthread_create(&tid, NULL, &conn_main, conn)) {
+			conn_register(server, fd, 0);
+			close(fd);
+			free(conn);
+			continue;
+		}
+		pthread_detach(tid);
+	}
+	return NULL;
+}
+
+MockServer *mock_server_start(const MockServerOptions *opts)
+{
+	MockServer *server;
+	struct sockaddr_in addr;
+	socklen_t addrlen = sizeof(addr);
+	int one = 1;
+
+	server = (MockServer *)calloc(1, sizeof(MockServer));
+	if (!server) return NULL;
+	if (opts) server->opts = *opts;
+	server->seed = (unsigned int)time(NULL);
+	pthread_mutex_init(&server->lock, NULL);
+	pthread_mutex_init(&server->conn_lock, NULL);
+	pthread_cond_init(&server->conn_cond, NULL);
+	server->root = node_create(server, "", 0, 1, time(NULL));
+	server->listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (!server->root || server->listen_fd < 0)
+		goto fail;
+	setsockopt(server->listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons((unsigned short)server->opts.port);
+	if (bind(server->listen_fd, (struct sockaddr *)&addr, sizeof(addr))
+		|| listen(server->listen_fd, 64)
+		|| getsockname(server->listen_fd, (struct sockaddr *)&addr, &addrlen))
+		goto fail;
+	server->port = ntohs(addr.sin_port);
+	if (pthread_create(&server->accept_thread, NULL, &accept_main, server))
+		goto fail;
+	return server;
+fail:
+	if (server->listen_fd >= 0) close(server->listen_fd);
+	if (server->root) node_free(server, server->root);
+	pthread_mutex_destroy(&server->lock);
+	pthread_mutex_destroy(&server->conn_lock);
+	pthread_cond_destroy(&server->conn_cond);
+	free(server);
+	return NULL;
+}
+
+void mock_server_stop(MockServer *server)
+{
+	int i;
+	if (!server) return;
+	pthread_mutex_lock(&server->conn_lock);
+	server->stopping = 1;
+	pthread_mutex_unlock(&server->conn_lock);
+	shutdown(server->listen_fd, SHUT_RDWR);
+	pthread_join(server->accept_thread, NULL);
+	close(server->listen_fd);
+
+	/*断开客户端仍保持着的长连接，并等待连接线程退出*/
+	pthread_mutex_lock(&server->conn_lock);
+	for (i = 0; i < server->conn_count; i++)
+		shutdown(server->conns[i], SHUT_RDWR);
+	while (server->conn_count > 0)
+		pthread_cond_wait(&server->conn_cond, &server->conn_lock);
+	pthread_mutex_unlock(&server->conn_lock);
+
+	node_free(server, server->root);
+	pthread_mutex_destroy(&server->lock);
+	pthread_mutex_destroy(&server->conn_lock);
+	pthread_cond_destroy(&server->conn_cond);
+	free(server);
+}
+
+int mock_server_port(MockServer *server)
+{
+	return server->port;
+}
+
+int mock_server_mkdir(MockServer *server, const char *path)
+{
+	MockNode *node;
+	pthread_mutex_lock(&server->lock);
+	node = node_find(server, path, 1);
+	pthread_mutex_unlock(&server->lock);
+	return node && node->isdir ? 0 : -1;
+}
+
+int mock_server_put(MockServer *server, const char *path, const char *data, size_t size, time_t mtime)
+{
+	MockNode *node;
+	char *copy = (char *)malloc(size ? size : 1);
+	if (!copy) return -1;
+	memcpy(copy, data, size);
+	pthread_mutex_lock(&server->lock);
+	node = tree_put(server, path, copy, size, mtime, 1);
+	pthread_mutex_unlock(&server->lock);
+	if (!node) {
+		free(copy);
+		return -1;
+	}
+	return 0;
+}
+
+void mock_server_fail_next(MockServer *server, int count)
+{
+	pthread_mutex_lock(&server->lock);
+	server->fail_next = count;
+	pthread_mutex_unlock(&server->lock);
+}
+
+void mock_server_ignore_range(MockServer *server, int ignore)
+{
+	pthread_mutex_lock(&server->lock);
+	server->ignore_range = ignore;
+	pthread_mutex_unlock(&server->lock);
+}
+
+void mock_server_get_stats(MockServer *server, MockServerStats *stats)
+{
+	pthread_mutex_lock(&server->lock);
+	*stats = server->stats;
+	pthread_mutex_unlock(&server->lock);
+}
+
+#pragma endregion
@@ -0,0 +1,61 @@
+﻿/*
+ * 模拟的百度网盘服务器，供基准测试使用。
+ * 在内存中维护一棵目录树，实现 pcs.c 用到的接口：
+ *   /disk/home                    返回 yunData.MYBDSTOKEN 等登录信息，并写入 BDUSS Cookie
+ *   /api/list, /api/search        列目录、搜索
+ *   /api/quota, /api/create       配额、创建目录
+ *   /api/filemanager              delete/rename/move/copy
+ *   /rest/2.0/pcs/file            method=upload（multipart）和 method=download（支持单个区间的 Range）
+ * pcs.c 中的地址是写死的，所以服务器同时作为 HTTP 代理使用：
+ * 设置环境变量 http_proxy=http://127.0.0.1:<port> 后，libcurl 会把请求发到这里。
+ * 仅支持类 Unix 系统。
+*/
+#ifndef _PCS_BENCH_MOCK_SERVER_H_
+#define _PCS_BENCH_MOCK_SERVER_H_
+
+#include <stddef.h>
+#include <time.h>
+
+typedef struct MockServerOptions {
+	int		port;			/*监听端口，0 表示由系统分配*/
+	int		latency_ms;		/*每个请求在响应前增加的延迟，单位：毫秒*/
+	long	bandwidth;		/*上传和下载内容的带宽限制，单位：字节/秒，0 表示不限制*/
+	int		error_rate;		/*以千分比随机返回 500 错误，0 表示不注入错误*/
+} MockServerOptions;
+
+typedef struct MockServerStats {
+	unsigned long	requests;	/*处理的请求数*/
+	unsigned long	errors;		/*注入的错误数*/
+	unsigned long	uploads;	/*上传的文件数*/
+	unsigned long	downloads;	/*下载的文件数*/
+	double			bytes_in;	/*上传的字节数*/
+	double			bytes_out;	/*下载的字节数*/
+} MockServerStats;
+
+typedef struct MockServer MockServer;
+
+/*启动服务器，opts 为 NULL 时使用默认值。失败返回 NULL*/
+MockServer *mock_server_start(const MockServerOptions *opts);
+
+/*停止服务器，断开所有连接并释放内存中的目录树*/
+void mock_server_stop(MockServer *server);
+
+/*返回实际监听的端口*/
+int mock_server_port(MockServer *server);
+
+/*在内存树中创建目录，上级目录不存在时自动创建。成功返回 0*/
+int mock_server_mkdir(MockServer *server, const char *path);
+
+/*在内存树中写入文件，已存在时覆盖，上级目录不存在时自动创建。成功返回 0*/
+int mock_server_put(MockServer *server, const char *path, const char *data, size_t size, time_t mtime);
+
+/*之后的 count 个请求返回 500 错误，用于测试重试和熔断*/
+void mock_server_fail_next(MockServer *server, int count);
+
+/*ignore 非 0 时下载忽略 Range 请求头，总是返回 200 和整个文件，用于模拟不支持断点续传的服务器*/
+void mock_server_ignore_range(MockServer *server, int ignore);
+
+/*读取统计数据*/
+void mock_server_get_stats(MockServer *server, MockServerStats *stats);
+
+#endif
@@ -0,0 +1,365 @@
+﻿/*
+ * 端到端基准测试：在进程内启动模拟服务器（mock_server.c），通过 http_proxy 把 libpcs 的请求
+ * 转到模拟服务器上，测量：
+ *   list 每秒请求数
+ *   上传、下载的 MB/s（明文和 AES-128 加密两种）
+ *   在合成目录树上执行 pcs compare -r 和 pcs synch -r 的耗时（以子进程方式运行 bin/pcs）
+ * 可通过选项给模拟服务器增加延迟、带宽限制和随机错误。
+ * 编译运行：make bench
+ *   ./bin/pcs_bench [--latency=ms] [--bandwidth=KB/s] [--error-rate=千分比]
+ *                   [--size=MB] [--rounds=N] [--list=N] [--tree=DIRSxFILES] [--pcs=path]
+ *   ./bin/pcs_bench --serve[=port]    只运行模拟服务器，供手工调试 bin/pcs 使用
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <utime.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "../pcs/pcs.h"
+#include "mock_server.h"
+
+#define DEFAULT_SIZE_MB			16
+#define DEFAULT_ROUNDS			4
+#define DEFAULT_LIST_REQUESTS	500
+#define DEFAULT_TREE_DIRS		20
+#define DEFAULT_TREE_FILES		50
+#define LIST_DIR_ENTRIES		1000
+#define LIST_PAGE_SIZE			100
+#define TREE_FILE_SIZE			1024
+#define SECURE_KEY				"pcs_bench_secure_key"
+#define BENCH_CONTEXT			"{\"list_page_size\": 1000000, \"timeout_retry\": false}"
+
+typedef struct BenchOptions {
+	MockServerOptions	server;
+	int					serve;
+	int					size_mb;
+	int					rounds;
+	int					list_requests;
+	int					tree_dirs;
+	int					tree_files;
+	const char			*pcs_path;
+} BenchOptions;
+
+typedef struct DownloadState {
+	size_t	size;
+} DownloadState;
+
+static double now_ms()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static void usage(const char *name)
+{
+	printf("Usage: %s [--latency=ms] [--bandwidth=KB/s] [--error-rate=permille]\n"
+		   "          [--size=MB] [--rounds=N] [--list=N] [--tree=DIRSxFILES] [--pcs=path]\n"
+		   "       %s --serve[=port]\n", name, name);
+}
+
+static int parse_options(BenchOptions *opts, int argc, char *argv[])
+{
+	int i;
+	const char *a;
+	memset(opts, 0, sizeof(BenchOptions));
+	opts->size_mb = DEFAULT_SIZE_MB;
+	opts->rounds = DEFAULT_ROUNDS;
+	opts->list_requests = DEFAULT_LIST_REQUESTS;
+	opts->tree_dirs = DEFAULT_TREE_DIRS;
+	opts->tree_files = DEFAULT_TREE_FILES;
+	opts->pcs_path = "./bin/pcs";
+	for (i = 1; i < argc; i++) {
+		a = argv[i];
+		if (strncmp(a, "--latency=", 10) == 0) opts->server.latency_ms = atoi(a + 10);
+		else if (strncmp(a, "--bandwidth=", 12) == 0) opts->server.bandwidth = atol(a + 12) * 1024;
+		else if (strncmp(a, "--error-rate=", 13) == 0) opts->server.error_rate = atoi(a + 13);
+		else if (strncmp(a, "--size=", 7) == 0) opts->size_mb = atoi(a + 7);
+		else if (strncmp(a, "--rounds=", 9) == 0) opts->rounds = atoi(a + 9);
+		else if (strncmp(a, "--list=", 7) == 0) opts->list_requests = atoi(a + 7);
+		else if (strncmp(a, "--tree=", 7) == 0) {
+			if (sscanf(a + 7, "%dx%d", &opts->tree_dirs, &opts->tree_files) != 2) return -1;
+		}
+		else if (strncmp(a, "--pcs=", 6) == 0) opts->pcs_path = a + 6;
+		else if (strcmp(a, "--serve") == 0) opts->serve = 1;
+		else if (strncmp(a, "--serve=", 8) == 0) {
+			opts->serve = 1;
+			opts->server.port = atoi(a + 8);
+		}
+		else return -1;
+	}
+	if (opts->size_mb <= 0 || opts->rounds <= 0 || opts->list_requests <= 0
+		|| opts->tree_dirs <= 0 || opts->tree_files <= 0)
+		return -1;
+	return 0;
+}
+
+static int write_file(const char *path, const char *data, size_t size, time_t mtime)
+{
+	FILE *fp;
+	struct utimbuf tm;
+	fp = fopen(path, "wb");
+	if (!fp) return -1;
+	if (size && fwrite(data, 1, size, fp) != size) {
+		fclose(fp);
+		return -1;
+	}
+	fclose(fp);
+	if (mtime) {
+		tm.actime = tm.modtime = mtime;
+		utime(path, &tm);
+	}
+	return 0;
+}
+
+static void fill_random(char *buf, size_t size, unsigned int seed)
+{
+	size_t i;
+	for (i = 0; i < size; i++) {
+		seed = seed * 1103515245 + 12345;
+		buf[i] = (char)(seed >> 16);
+	}
+}
+
+/*list：目录中有 LIST_DIR_ENTRIES 项，按页轮流读取*/
+static void bench_list(Pcs pcs, MockServer *server, const BenchOptions *opts)
+{
+	char path[256], data[64];
+	PcsFileInfoList *list;
+	int i, failed = 0, pages = LIST_DIR_ENTRIES / LIST_PAGE_SIZE;
+	double t;
+
+	for (i = 0; i < LIST_DIR_ENTRIES; i++) {
+		sprintf(path, "/bench/list/file%05d.dat", i);
+		sprintf(data, "file %d", i);
+		mock_server_put(server, path, data, strlen(data), time(NULL));
+	}
+	t = now_ms();
+	for (i = 0; i < opts->list_requests; i++) {
+		list = pcs_list(pcs, "/bench/list", i % pages + 1, LIST_PAGE_SIZE, "name", PcsFalse);
+		if (!list || list->count != LIST_PAGE_SIZE) failed++;
+		if (list) pcs_filist_destroy(list);
+	}
+	t = now_ms() - t;
+	printf("%-16s %10.1f req/s  (%d requests, %d entries/page, %d failed)\n",
+		"list", opts->list_requests * 1000.0 / t, opts->list_requests, LIST_PAGE_SIZE, failed);
+}
+
+static size_t bench_download_write(char *ptr, size_t size, size_t contentlength, void *userdata)
+{
+	DownloadState *state = (DownloadState *)userdata;
+	state->size += size;
+	return size;
+}
+
+static void print_rate(const char *name, double bytes, double ms, int rounds, int size_mb, int failed)
+{
+	printf("%-16s %10.1f MB/s   (%d x %d MB, %d failed)\n",
+		name, ms > 0 ? bytes / 1048576.0 * 1000.0 / ms : 0.0, rounds, size_mb, failed);
+}
+
+/*上传、下载：rounds 次上传同一个本地文件，再逐个下载*/
+static void bench_transfer(Pcs pcs, const char *tmpdir, const BenchOptions *opts, const char *suffix)
+{
+	char local[1024], remote[256], name[32];
+	size_t size = (size_t)opts->size_mb * 1024 * 1024;
+	char *buf;
+	PcsFileInfo *meta;
+	DownloadState state;
+	double t, bytes = 0;
+	int i, failed = 0;
+
+	buf = (char *)malloc(size);
+	if (!buf) return;
+	fill_random(buf, size, 20140117);
+	sprintf(local, "%s/transfer.bin", tmpdir);
+	if (write_file(local, buf, size, 0)) {
+		printf("Can't write %s\n", local);
+		free(buf);
+		return;
+	}
+	free(buf);
+
+	t = now_ms();
+	for (i = 0; i < opts->rounds; i++) {
+		sprintf(remote, "/bench/transfer/file%d.bin", i);
+		meta = pcs_upload(pcs, remote, PcsTrue, local);
+		if (meta) {
+			bytes += (double)size;
+			pcs_fileinfo_destroy(meta);
+		}
+		else {
+			failed++;
+		}
+	}
+	sprintf(name, "upload%s", suffix);
+	print_rate(name, bytes, now_ms() - t, opts->rounds, opts->size_mb, failed);
+
+	pcs_setopts(pcs,
+		PCS_OPTION_DOWNLOAD_WRITE_FUNCTION, &bench_download_write,
+		PCS_OPTION_DOWNLOAD_WRITE_FUNCTION_DATA, &state,
+		PCS_OPTION_END);
+	bytes = 0;
+	failed = 0;
+	t = now_ms();
+	for (i = 0; i < opts->rounds; i++) {
+		sprintf(remote, "/bench/transfer/file%d.bin", i);
+		state.size = 0;
+		if (pcs_download(pcs, remote) == PCS_OK && state.size == size)
+			bytes += (double)size;
+		else
+			failed++;
+	}
+	sprintf(name, "download%s", suffix);
+	print_rate(name, bytes, now_ms() - t, opts->rounds, opts->size_mb, failed);
+	remove(local);
+}
+
+/*以子进程执行 bin/pcs，返回耗时（毫秒），失败返回 -1*/
+static double run_shell(const BenchOptions *opts, const char *cmd, const char *local, const char *remote)
+{
+	char *line;
+	double t;
+	int rc;
+
+	line = pcs_utils_sprintf("\"%s\" %s \"%s\" \"%s\" < /dev/null > /dev/null", opts->pcs_path, cmd, local, remote);
+	t = now_ms();
+	rc = system(line);
+	t = now_ms() - t;
+	pcs_free(line);
+	if (rc == -1 || !WIFEXITED(rc) || WEXITSTATUS(rc) != 0) {
+		printf("%-16s failed (exit status %d)\n", cmd, rc == -1 ? -1 : WEXITSTATUS(rc));
+		return -1;
+	}
+	return t;
+}
+
+/*
+ * compare/synch：本地 dirs x files 个文件。
+ * 每 10 个文件中，第 0 个只在本地（synch 时上传），第 5 个只在网盘（synch 时下载），其余两边相同。
+*/
+static void bench_tree(MockServer *server, const char *tmpdir, const BenchOptions *opts)
+{
+	char local[1024], path[1024], remote[256], data[TREE_FILE_SIZE];
+	time_t mtime = time(NULL) - 3600;
+	MockServerStats before, after;
+	int d, f, local_cnt = 0;
+	double t;
+
+	if (access(opts->pcs_path, X_OK)) {
+		printf("%-16s skipped: %s is not executable\n", "compare/synch", opts->pcs_path);
+		return;
+	}
+	sprintf(local, "%s/tree", tmpdir);
+	mkdir(local, 0755);
+	for (d = 0; d < opts->tree_dirs; d++) {
+		sprintf(path, "%s/dir%03d", local, d);
+		mkdir(path, 0755);
+		sprintf(remote, "/bench/tree/dir%03d", d);
+		mock_server_mkdir(server, remote);
+		for (f = 0; f < opts->tree_files; f++) {
+			fill_random(data, sizeof(data), d * 100000 + f);
+			sprintf(path, "%s/dir%03d/file%04d.txt", local, d, f);
+			sprintf(remote, "/bench/tree/dir%03d/file%04d.txt", d, f);
+			if (f % 10 != 5) {
+				write_file(path, data, sizeof(data), mtime);
+				local_cnt++;
+			}
+			if (f % 10 != 0)
+				mock_server_put(server, remote, data, sizeof(data), mtime);
+		}
+	}
+	/*目录的修改时间在写入文件后才固定下来*/
+	for (d = 0; d < opts->tree_dirs; d++) {
+		struct utimbuf tm;
+		tm.actime = tm.modtime = mtime;
+		sprintf(path, "%s/dir%03d", local, d);
+		utime(path, &tm);
+	}
+
+	t = run_shell(opts, "compare -r", local, "/bench/tree");
+	if (t >= 0)
+		printf("%-16s %10.1f ms     (%d local files in %d dirs)\n", "compare -r", t, local_cnt, opts->tree_dirs);
+
+	mock_server_get_stats(server, &before);
+	t = run_shell(opts, "synch -r", local, "/bench/tree");
+	mock_server_get_stats(server, &after);
+	if (t >= 0)
+		printf("%-16s %10.1f ms     (%lu uploaded, %lu downloaded, %lu requests)\n", "synch -r", t,
+			after.uploads - before.uploads, after.downloads - before.downloads, after.requests - before.requests);
+}
+
+int main(int argc, char *argv[])
+{
+	BenchOptions opts;
+	MockServer *server;
+	MockServerStats stats;
+	Pcs pcs;
+	char tmpdir[] = "/tmp/pcs_bench_XXXXXX", proxy[64], file[1024], *cmd;
+
+	if (parse_options(&opts, argc, argv)) {
+		usage(argv[0]);
+		return 1;
+	}
+	server = mock_server_start(&opts.server);
+	if (!server) {
+		printf("Can't start the mock server\n");
+		return 1;
+	}
+	sprintf(proxy, "http://127.0.0.1:%d", mock_server_port(server));
+	if (opts.serve) {
+		printf("Mock server listening on 127.0.0.1:%d\n", mock_server_port(server));
+		printf("Run: http_proxy=%s PCS_CONTEXT=/tmp/pcs_mock.context PCS_COOKIE=/tmp/pcs_mock.cookie ./bin/pcs ...\n", proxy);
+		fflush(stdout);
+		for (;;) pause();
+	}
+
+	/*pcs.c 中的地址是写死的，通过代理把请求转到模拟服务器，子进程也会继承这些环境变量*/
+	setenv("http_proxy", proxy, 1);
+	unsetenv("no_proxy");
+	unsetenv("NO_PROXY");
+	if (!mkdtemp(tmpdir)) {
+		printf("Can't create the temp directory\n");
+		mock_server_stop(server);
+		return 1;
+	}
+	sprintf(file, "%s/pcs.context", tmpdir);
+	setenv("PCS_CONTEXT", file, 1);
+	/*关闭 compare 的分页提示和超时后等待 10 秒重试*/
+	write_file(file, BENCH_CONTEXT, strlen(BENCH_CONTEXT), 0);
+	sprintf(file, "%s/pcs.cookie", tmpdir);
+	setenv("PCS_COOKIE", file, 1);
+
+	printf("mock server: 127.0.0.1:%d, latency %d ms, bandwidth %ld KB/s, error rate %d/1000\n",
+		mock_server_port(server), opts.server.latency_ms, opts.server.bandwidth / 1024, opts.server.error_rate);
+	pcs = pcs_create(file);
+	if (!pcs || pcs_islogin(pcs) != PCS_LOGIN) {
+		printf("Can't login to the mock server: %s\n", pcs ? pcs_strerror(pcs) : "pcs_create() failed");
+	}
+	else {
+		bench_list(pcs, server, &opts);
+		bench_transfer(pcs, tmpdir, &opts, "");
+		/*createPcsAesState() 只生成 16 字节的密钥，192/256 位会读到密钥之外的内存，所以用 128 位*/
+		pcs_setopts(pcs,
+			PCS_OPTION_SECURE_METHOD, (void *)((long)PCS_SECURE_AES_CBC_128),
+			PCS_OPTION_SECURE_KEY, SECURE_KEY,
+			PCS_OPTION_SECURE_ENABLE, (void *)((long)PcsTrue),
+			PCS_OPTION_END);
+		bench_transfer(pcs, tmpdir, &opts, " (AES)");
+		bench_tree(server, tmpdir, &opts);
+	}
+	if (pcs) pcs_destroy(pcs);
+
+	mock_server_get_stats(server, &stats);
+	printf("mock server: %lu requests, %lu injected errors\n", stats.requests, stats.errors);
+	mock_server_stop(server);
+	cmd = pcs_utils_sprintf("rm -rf \"%s\"", tmpdir);
+	if (system(cmd) != 0)
+		printf("Can't remove %s\n", tmpdir);
+	pcs_free(cmd);
+	return 0;
+}
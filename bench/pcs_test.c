@@ -0,0 +1,936 @@
+﻿/*
+ * 自测程序：在进程内启动模拟服务器（mock_server.c），通过 http_proxy 把 libpcs 的请求
+ * 转到模拟服务器上，检查多线程、重试、限速、断点下载和包索引等行为是否符合预期。
+ * 每个用例使用独立的模拟服务器和临时目录，输出一行 PASS 或 FAIL，有用例失败时退出码为 1。
+ * 编译运行：make test
+ *   ./bin/pcs_test [--filter=str]    只运行名称中包含 str 的用例
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <curl/curl.h>
+
+#include "../pcs/pcs.h"
+#include "../pcs/pcs_transfer.h"
+#include "../test/pack_index.h"
+#include "mock_server.h"
+
+#define TEST_CONTEXT			"{\"timeout_retry\": false}"
+
+#define STRESS_HANDLES			8
+#define STRESS_ROUNDS			20
+#define STRESS_FILE_SIZE		8192
+
+#define FM_FILES				350
+
+#define RETRY_MAX				3
+#define BREAKER_THRESHOLD		2
+#define BREAKER_COOLDOWN		1
+
+#define RATE_LIMIT				(16 * 1024)
+#define RATE_FILE_SIZE			(64 * 1024)	/*限速下约 4 秒，每次进度回调的欠账超过 0.5 秒*/
+
+#define AIMD_JOBS				3
+#define AIMD_FILE_SIZE			(768 * 1024)
+#define AIMD_BANDWIDTH			(128 * 1024)	/*每个文件下载约 6 秒*/
+
+#define RANGE_FILE_SIZE			4096
+
+/*条件不成立时打印位置和原因，并使用例失败*/
+#define CHECK(cond, ...) do { \
+	if (!(cond)) { \
+		printf("    %s:%d: ", __FILE__, __LINE__); \
+		printf(__VA_ARGS__); \
+		printf("\n"); \
+		return -1; \
+	} \
+} while (0)
+
+/*一个用例的运行环境*/
+typedef struct TestEnv {
+	MockServer	*server;
+	char		dir[64];	/*临时目录，存放 Context 和 Cookie 文件*/
+} TestEnv;
+
+typedef int (*TestFunction)(TestEnv *env);
+
+typedef struct TestCase {
+	const char		*name;
+	TestFunction	fn;
+	int				latency_ms;	/*模拟服务器的选项*/
+	long			bandwidth;
+	int				error_rate;
+} TestCase;
+
+/*下载时写入内存*/
+typedef struct TestBuffer {
+	char	*data;
+	size_t	size;
+	size_t	capacity;
+} TestBuffer;
+
+static double now_ms()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static int write_text(const char *path, const char *text)
+{
+	FILE *fp = fopen(path, "wb");
+	if (!fp) return -1;
+	fputs(text, fp);
+	fclose(fp);
+	return 0;
+}
+
+/*生成 size 字节的可打印内容，以 '\0' 结尾，buf 至少 size + 1 字节*/
+static void fill_text(char *buf, size_t size, unsigned int seed)
+{
+	size_t i;
+	for (i = 0; i < size; i++) {
+		seed = seed * 1103515245 + 12345;
+		buf[i] = 'a' + (char)((seed >> 16) % 26);
+	}
+	buf[size] = '\0';
+}
+
+static size_t buffer_write(char *ptr, size_t size, size_t contentlength, void *userdata)
+{
+	TestBuffer *buf = (TestBuffer *)userdata;
+	char *p;
+	if (buf->size + size > buf->capacity) {
+		p = (char *)realloc(buf->data, buf->size + size + 1);
+		if (!p) return 0;
+		buf->data = p;
+		buf->capacity = buf->size + size;
+	}
+	memcpy(buf->data + buf->size, ptr, size);
+	buf->size += size;
+	return size;
+}
+
+static int env_start(TestEnv *env, const TestCase *tc)
+{
+	MockServerOptions opts;
+	char proxy[64], file[128];
+	memset(env, 0, sizeof(TestEnv));
+	memset(&opts, 0, sizeof(opts));
+	opts.latency_ms = tc->latency_ms;
+	opts.bandwidth = tc->bandwidth;
+	opts.error_rate = tc->error_rate;
+	strcpy(env->dir, "/tmp/pcs_test_XXXXXX");
+	if (!mkdtemp(env->dir))
+		return -1;
+	env->server = mock_server_start(&opts);
+	if (!env->server)
+		return -1;
+	/*pcs.c 中的地址是写死的，通过代理把请求转到模拟服务器*/
+	sprintf(proxy, "http://127.0.0.1:%d", mock_server_port(env->server));
+	setenv("http_proxy", proxy, 1);
+	unsetenv("no_proxy");
+	unsetenv("NO_PROXY");
+	sprintf(file, "%s/pcs.context", env->dir);
+	setenv("PCS_CONTEXT", file, 1);
+	return write_text(file, TEST_CONTEXT);
+}
+
+static void env_stop(TestEnv *env)
+{
+	char *cmd;
+	if (env->server)
+		mock_server_stop(env->server);
+	cmd = pcs_utils_sprintf("rm -rf \"%s\"", env->dir);
+	if (system(cmd) != 0)
+		printf("    Can't remove %s\n", env->dir);
+	pcs_free(cmd);
+}
+
+/*创建并登录一个 Pcs 对象，每个对象使用独立的 Cookie 文件*/
+static Pcs env_login(TestEnv *env, const char *name)
+{
+	char file[128];
+	Pcs pcs;
+	sprintf(file, "%s/%s.cookie", env->dir, name);
+	pcs = pcs_create(file);
+	if (!pcs)
+		return NULL;
+	if (pcs_islogin(pcs) != PCS_LOGIN) {
+		printf("    Can't login: %s\n", pcs_strerror(pcs));
+		pcs_destroy(pcs);
+		return NULL;
+	}
+	return pcs;
+}
+
+/*列出目录，返回项数；空目录时 pcs_list() 返回NULL且没有错误消息，返回0；出错返回-1*/
+static int list_count(Pcs pcs, const char *dir)
+{
+	PcsFileInfoList *list;
+	int count;
+	list = pcs_list(pcs, dir, 1, 1000, "name", PcsFalse);
+	if (!list)
+		return pcs_strerror(pcs) ? -1 : 0;
+	count = list->count;
+	pcs_filist_destroy(list);
+	return count;
+}
+
+/*模拟服务器已处理的请求数*/
+static unsigned long server_requests(TestEnv *env)
+{
+	MockServerStats stats;
+	mock_server_get_stats(env->server, &stats);
+	return stats.requests;
+}
+
+#pragma region 多线程压力测试
+
+/*压力测试中一个线程的状态*/
+typedef struct StressWorker {
+	Pcs			pcs;
+	int			id;
+	int			failed;
+	char		errmsg[512];
+} StressWorker;
+
+#define STRESS_FAIL(w, ...) do { \
+	snprintf((w)->errmsg, sizeof((w)->errmsg), __VA_ARGS__); \
+	(w)->failed = 1; \
+	goto out; \
+} while (0)
+
+/*每轮上传一个文件，再下载、列目录并校验内容和md5*/
+static void *stress_main(void *arg)
+{
+	StressWorker *w = (StressWorker *)arg;
+	char path[128], dir[64], md5[33], md5_2[33];
+	char *text = (char *)malloc(STRESS_FILE_SIZE + 1);
+	size_t size;
+	TestBuffer buf = {0};
+	PcsFileInfo *meta;
+	PcsFileInfoList *list;
+	int r;
+
+	if (!text) {
+		w->failed = 1;
+		return NULL;
+	}
+	sprintf(dir, "/stress/w%d", w->id);
+	pcs_setopts(w->pcs,
+		PCS_OPTION_DOWNLOAD_WRITE_FUNCTION, &buffer_write,
+		PCS_OPTION_DOWNLOAD_WRITE_FUNCTION_DATA, &buf,
+		PCS_OPTION_END);
+	for (r = 0; r < STRESS_ROUNDS; r++) {
+		size = STRESS_FILE_SIZE - (size_t)(r * 97 + w->id * 13);
+		fill_text(text, size, (unsigned int)(w->id * 1000 + r));
+		md5_string_r(text, md5);
+		sprintf(path, "%s/f%02d.txt", dir, r);
+		meta = pcs_upload_buffer(w->pcs, path, PcsTrue, text, size);
+		if (!meta)
+			STRESS_FAIL(w, "upload %s: %s", path, pcs_strerror(w->pcs));
+		if (meta->size != size || !meta->md5 || strcmp(meta->md5, md5)) {
+			pcs_fileinfo_destroy(meta);
+			STRESS_FAIL(w, "upload %s: wrong size or md5", path);
+		}
+		pcs_fileinfo_destroy(meta);
+
+		buf.size = 0;
+		if (pcs_download(w->pcs, path) != PCS_OK)
+			STRESS_FAIL(w, "download %s: %s", path, pcs_strerror(w->pcs));
+		if (buf.size != size)
+			STRESS_FAIL(w, "download %s: got %lu bytes, expect %lu", path, (unsigned long)buf.size, (unsigned long)size);
+		buf.data[buf.size] = '\0';
+		md5_string_r(buf.data, md5_2);
+		if (strcmp(md5, md5_2))
+			STRESS_FAIL(w, "download %s: content mismatch", path);
+
+		list = pcs_list(w->pcs, dir, 1, 1000, "name", PcsFalse);
+		if (!list)
+			STRESS_FAIL(w, "list %s: %s", dir, pcs_strerror(w->pcs));
+		size = (size_t)list->count;
+		pcs_filist_destroy(list);
+		if (size != (size_t)(r + 1))
+			STRESS_FAIL(w, "list %s: got %lu entries, expect %d", dir, (unsigned long)size, r + 1);
+	}
+out:
+	free(buf.data);
+	free(text);
+	return NULL;
+}
+
+/*
+ * 多个 Pcs 对象在不同线程中同时上传、下载和列目录。
+ * 一半对象由 pcs_create() 独立登录，另一半在主线程中由 pcs_clone() 复制。
+ * 复制的对象与主对象共用请求统计，主对象的统计中应包含它们的所有上传。
+*/
+static int test_stress(TestEnv *env)
+{
+	StressWorker workers[STRESS_HANDLES];
+	pthread_t threads[STRESS_HANDLES];
+	PcsHttpStats *stats;
+	char name[32];
+	Pcs main_pcs;
+	unsigned long uploads = 0;
+	int i, started = 0, failed = 0;
+
+	main_pcs = env_login(env, "main");
+	CHECK(main_pcs, "Can't create the main handle");
+	memset(workers, 0, sizeof(workers));
+	for (i = 0; i < STRESS_HANDLES; i++) {
+		workers[i].id = i;
+		if (i % 2) {
+			workers[i].pcs = pcs_clone(main_pcs);
+		}
+		else {
+			sprintf(name, "worker%d", i);
+			workers[i].pcs = env_login(env, name);
+		}
+		if (!workers[i].pcs) {
+			failed = 1;
+			break;
+		}
+	}
+	if (!failed) {
+		for (; started < STRESS_HANDLES; started++) {
+			if (pthread_create(&threads[started], NULL, &stress_main, &workers[started]))
+				break;
+		}
+		for (i = 0; i < started; i++)
+			pthread_join(threads[i], NULL);
+	}
+	for (i = 0; i < STRESS_HANDLES; i++) {
+		if (workers[i].failed) {
+			printf("    worker %d: %s\n", i, workers[i].errmsg);
+			failed = 1;
+		}
+		if (workers[i].pcs)
+			pcs_destroy(workers[i].pcs);
+	}
+	stats = (PcsHttpStats *)malloc(sizeof(PcsHttpStats));
+	if (stats && pcs_getstats(main_pcs, stats) == PCS_OK)
+		uploads = stats->endpoints[PCS_HTTP_ENDPOINT_UPLOAD].count;
+	free(stats);
+	pcs_destroy(main_pcs);
+	CHECK(!failed, "%d of %d workers started, see the messages above", started, STRESS_HANDLES);
+	CHECK(started == STRESS_HANDLES, "Only %d threads started", started);
+	CHECK(uploads >= STRESS_HANDLES / 2 * STRESS_ROUNDS, "The main handle counted %lu uploads, expect at least %d",
+		uploads, STRESS_HANDLES / 2 * STRESS_ROUNDS);
+	return 0;
+}
+
+#pragma endregion
+
+#pragma region 批量文件操作
+
+/*删除的文件超过一个批次，各批次由多个线程并发提交，结果按输入顺序合并*/
+static int test_fm_batches(TestEnv *env)
+{
+	PcsSList *items, *slist = NULL;
+	PcsPanApiRes *res;
+	PcsPanApiResInfoList *info;
+	PcsFileInfoList *list;
+	char path[64];
+	Pcs pcs;
+	int i, count = 0, failed = 0, remain;
+
+	items = (PcsSList *)calloc(FM_FILES, sizeof(PcsSList));
+	CHECK(items, "Can't alloc memory");
+	for (i = FM_FILES - 1; i >= 0; i--) {
+		sprintf(path, "/fm/file%04d", i);
+		mock_server_put(env->server, path, path, strlen(path), 0);
+		items[i].string = pcs_utils_strdup(path);
+		items[i].next = slist;
+		slist = &items[i];
+	}
+	pcs = env_login(env, "fm");
+	if (pcs) {
+		res = pcs_delete(pcs, slist);
+		if (res) {
+			for (info = res->info_list; info; info = info->next, count++) {
+				if (count >= FM_FILES || info->info.error || !info->info.path || strcmp(info->info.path, items[count].string))
+					failed++;
+			}
+			pcs_pan_api_res_destroy(res);
+		}
+		else {
+			printf("    delete: %s\n", pcs_strerror(pcs));
+		}
+		list = pcs_list(pcs, "/fm", 1, 1000, "name", PcsFalse);
+		/*空目录时 pcs_list() 返回NULL，且没有错误消息*/
+		remain = list ? list->count : (pcs_strerror(pcs) ? -1 : 0);
+		if (list) pcs_filist_destroy(list);
+		pcs_destroy(pcs);
+	}
+	for (i = 0; i < FM_FILES; i++)
+		pcs_free(items[i].string);
+	free(items);
+	CHECK(pcs, "Can't login");
+	CHECK(count == FM_FILES && !failed, "%d results, %d wrong, expect %d in input order", count, failed, FM_FILES);
+	CHECK(remain == 0, "%d files left", remain);
+	return 0;
+}
+
+#pragma endregion
+
+#pragma region 重试和熔断
+
+/*检查 pcs_getstats() 中 list 接口的统计比 before 多了 count 个请求、errors 个错误和 retries 次重试*/
+static int check_list_stats(Pcs pcs, const PcsHttpEndpointStats *before, unsigned long count, unsigned long errors, unsigned long retries)
+{
+	PcsHttpStats stats;
+	const PcsHttpEndpointStats *es = &stats.endpoints[PCS_HTTP_ENDPOINT_LIST];
+	pcs_getstats(pcs, &stats);
+	CHECK(es->count - before->count == count && es->errors - before->errors == errors && es->retries - before->retries == retries,
+		"list stats: +%lu requests, +%lu errors, +%lu retries, expect +%lu, +%lu, +%lu",
+		es->count - before->count, es->errors - before->errors, es->retries - before->retries, count, errors, retries);
+	return 0;
+}
+
+/*
+ * GET 请求遇到 500 时重试，最多 RETRY_MAX 次；上传（POST）在服务器可能已经处理的情况下不重试。
+ * 统计中一个请求只计一次，retries 为重试的次数。
+*/
+static int test_retry(TestEnv *env)
+{
+	PcsHttpStats stats;
+	PcsFileInfo *meta;
+	Pcs pcs;
+	unsigned long start;
+	int count;
+
+	mock_server_put(env->server, "/retry/a.txt", "a", 1, 0);
+	pcs = env_login(env, "retry");
+	CHECK(pcs, "Can't login");
+	pcs_setopts(pcs,
+		PCS_OPTION_RETRY_MAX, (void *)(long)RETRY_MAX,
+		PCS_OPTION_RETRY_DELAY, (void *)10L,
+		PCS_OPTION_RETRY_MAX_DELAY, (void *)50L,
+		PCS_OPTION_BREAKER_THRESHOLD, (void *)0L,
+		PCS_OPTION_END);
+
+	/*失败两次后成功*/
+	pcs_getstats(pcs, &stats);
+	start = server_requests(env);
+	mock_server_fail_next(env->server, 2);
+	count = list_count(pcs, "/retry");
+	CHECK(count == 1, "list after 2 errors: got %d, expect 1 (%s)", count, pcs_strerror(pcs));
+	CHECK(server_requests(env) - start == 3, "list after 2 errors: %lu requests, expect 3", server_requests(env) - start);
+	if (check_list_stats(pcs, &stats.endpoints[PCS_HTTP_ENDPOINT_LIST], 1, 0, 2)) return -1;
+
+	/*重试用完后失败*/
+	pcs_getstats(pcs, &stats);
+	start = server_requests(env);
+	mock_server_fail_next(env->server, RETRY_MAX + 10);
+	count = list_count(pcs, "/retry");
+	mock_server_fail_next(env->server, 0);
+	CHECK(count < 0, "list should fail when every attempt fails");
+	CHECK(server_requests(env) - start == RETRY_MAX + 1, "failed list: %lu requests, expect %d",
+		server_requests(env) - start, RETRY_MAX + 1);
+	if (check_list_stats(pcs, &stats.endpoints[PCS_HTTP_ENDPOINT_LIST], 1, 1, RETRY_MAX)) return -1;
+
+	/*上传不重试*/
+	start = server_requests(env);
+	mock_server_fail_next(env->server, 1);
+	meta = pcs_upload_buffer(pcs, "/retry/b.txt", PcsTrue, "b", 1);
+	mock_server_fail_next(env->server, 0);
+	if (meta) pcs_fileinfo_destroy(meta);
+	CHECK(!meta, "upload should fail on 500");
+	CHECK(server_requests(env) - start == 1, "failed upload: %lu requests, expect 1", server_requests(env) - start);
+
+	pcs_destroy(pcs);
+	return 0;
+}
+
+/*
+ * 熔断按请求计数：一个请求的多次重试只算一次失败。
+ * 连续 BREAKER_THRESHOLD 个请求失败后熔断，熔断期间的请求不发出；冷却后试探请求成功则恢复。
+*/
+static int test_breaker(TestEnv *env)
+{
+	Pcs pcs;
+	unsigned long start;
+	int count;
+
+	mock_server_put(env->server, "/breaker/a.txt", "a", 1, 0);
+	pcs = env_login(env, "breaker");
+	CHECK(pcs, "Can't login");
+	pcs_setopts(pcs,
+		PCS_OPTION_RETRY_MAX, (void *)(long)RETRY_MAX,
+		PCS_OPTION_RETRY_DELAY, (void *)10L,
+		PCS_OPTION_RETRY_MAX_DELAY, (void *)50L,
+		PCS_OPTION_BREAKER_THRESHOLD, (void *)(long)BREAKER_THRESHOLD,
+		PCS_OPTION_BREAKER_COOLDOWN, (void *)(long)BREAKER_COOLDOWN,
+		PCS_OPTION_END);
+
+	/*一个请求的所有尝试都失败，只算一次，不熔断*/
+	mock_server_fail_next(env->server, RETRY_MAX + 1);
+	CHECK(list_count(pcs, "/breaker") < 0, "list should fail when every attempt fails");
+	count = list_count(pcs, "/breaker");
+	CHECK(count == 1, "list after one failed request: got %d, expect 1 (%s)", count, pcs_strerror(pcs));
+
+	/*连续 BREAKER_THRESHOLD 个请求失败后熔断*/
+	mock_server_fail_next(env->server, (RETRY_MAX + 1) * BREAKER_THRESHOLD);
+	for (count = 0; count < BREAKER_THRESHOLD; count++)
+		CHECK(list_count(pcs, "/breaker") < 0, "list %d should fail", count);
+	start = server_requests(env);
+	CHECK(list_count(pcs, "/breaker") < 0, "list should fail while the breaker is open");
+	CHECK(server_requests(env) == start, "%lu requests sent while the breaker is open", server_requests(env) - start);
+
+	/*冷却后放行试探请求，成功后恢复*/
+	usleep((BREAKER_COOLDOWN + 1) * 1000000 + 100000);
+	count = list_count(pcs, "/breaker");
+	CHECK(count == 1, "probe after cooldown: got %d, expect 1 (%s)", count, pcs_strerror(pcs));
+	count = list_count(pcs, "/breaker");
+	CHECK(count == 1, "list after recovery: got %d, expect 1 (%s)", count, pcs_strerror(pcs));
+
+	pcs_destroy(pcs);
+	return 0;
+}
+
+#pragma endregion
+
+#pragma region 限速
+
+/*按 size 字节用了 ms 毫秒检查限速：不能明显快于限速，也不能慢太多*/
+static int check_rate(const char *what, size_t size, double ms)
+{
+	double expect = (double)size * 1000.0 / RATE_LIMIT;
+	CHECK(ms >= expect * 0.85, "%s took %.0f ms, expect about %.0f ms: %.1f KB/s exceeds the limit of %d KB/s",
+		what, ms, expect, size / ms * 1000.0 / 1024, RATE_LIMIT / 1024);
+	CHECK(ms <= expect * 2, "%s took %.0f ms, expect about %.0f ms", what, ms, expect);
+	return 0;
+}
+
+/*
+ * 单个请求按限速上传和下载。
+ * 每次进度回调欠下的令牌可能超过 PCS_HTTP_RATE_MAX_SLEEP 毫秒，应分多次睡眠直到还清。
+*/
+static int test_rate_limit(TestEnv *env)
+{
+	TestBuffer buf = {0};
+	PcsFileInfo *meta;
+	char *text;
+	Pcs pcs;
+	double t, upload_ms, download_ms;
+	PcsRes res;
+
+	text = (char *)malloc(RATE_FILE_SIZE + 1);
+	CHECK(text, "Out of memory");
+	fill_text(text, RATE_FILE_SIZE, 7);
+	pcs = env_login(env, "rate");
+	CHECK(pcs, "Can't login");
+	pcs_setopts(pcs,
+		PCS_OPTION_DOWNLOAD_WRITE_FUNCTION, &buffer_write,
+		PCS_OPTION_DOWNLOAD_WRITE_FUNCTION_DATA, &buf,
+		PCS_OPTION_END);
+
+	pcs_set_rate_limit(RATE_LIMIT, RATE_LIMIT);
+	t = now_ms();
+	meta = pcs_upload_buffer(pcs, "/rate/a.txt", PcsTrue, text, RATE_FILE_SIZE);
+	upload_ms = now_ms() - t;
+	t = now_ms();
+	res = meta ? pcs_download(pcs, "/rate/a.txt") : PCS_FAIL;
+	download_ms = now_ms() - t;
+	pcs_set_rate_limit(0, 0);
+
+	if (meta) pcs_fileinfo_destroy(meta);
+	CHECK(meta, "upload: %s", pcs_strerror(pcs));
+	CHECK(res == PCS_OK, "download: %s", pcs_strerror(pcs));
+	CHECK(buf.size == RATE_FILE_SIZE && memcmp(buf.data, text, RATE_FILE_SIZE) == 0, "download: content mismatch");
+	free(buf.data);
+	free(text);
+	pcs_destroy(pcs);
+	if (check_rate("upload", RATE_FILE_SIZE, upload_ms)) return -1;
+	if (check_rate("download", RATE_FILE_SIZE, download_ms)) return -1;
+	return 0;
+}
+
+#pragma endregion
+
+#pragma region 并发传输池
+
+typedef struct AimdJob {
+	char	path[32];
+	size_t	received;
+} AimdJob;
+
+static size_t aimd_write(char *ptr, size_t size, size_t contentlength, void *userdata)
+{
+	((AimdJob *)userdata)->received += size;
+	return size;
+}
+
+static int aimd_download(Pcs pcs, void *job, size_t *bytes, void *state)
+{
+	AimdJob *j = (AimdJob *)job;
+	pcs_setopts(pcs,
+		PCS_OPTION_DOWNLOAD_WRITE_FUNCTION, &aimd_write,
+		PCS_OPTION_DOWNLOAD_WRITE_FUNCTION_DATA, j,
+		PCS_OPTION_END);
+	if (pcs_download(pcs, j->path) != PCS_OK)
+		return -1;
+	*bytes = j->received;
+	return 0;
+}
+
+/*
+ * AIMD 控制器按执行中的传输已经传输的字节数统计吞吐：
+ * 每个下载都比两个统计周期长，在第一个下载完成之前，有任务排队时并发数就应该增加。
+*/
+static int test_transfer_aimd(TestEnv *env)
+{
+	AimdJob jobs[AIMD_JOBS];
+	PcsTransferPool pool;
+	PcsTransferProgress pg;
+	AimdJob *job;
+	char *text;
+	Pcs pcs;
+	int i, rc, failed = 0;
+
+	text = (char *)malloc(AIMD_FILE_SIZE + 1);
+	CHECK(text, "Out of memory");
+	fill_text(text, AIMD_FILE_SIZE, 1);
+	memset(jobs, 0, sizeof(jobs));
+	for (i = 0; i < AIMD_JOBS; i++) {
+		sprintf(jobs[i].path, "/aimd/f%d.txt", i);
+		mock_server_put(env->server, jobs[i].path, text, AIMD_FILE_SIZE, 0);
+	}
+	free(text);
+	pcs = env_login(env, "aimd");
+	CHECK(pcs, "Can't login");
+	pool = pcs_transfer_pool_create(pcs, 1, AIMD_JOBS, &aimd_download, NULL);
+	CHECK(pool, "Can't create the transfer pool");
+	for (i = 0; i < AIMD_JOBS; i++)
+		pcs_transfer_submit(pool, &jobs[i], AIMD_FILE_SIZE);
+
+	usleep((useconds_t)(PCS_TRANSFER_SAMPLE_INTERVAL * 2 * 1000000) + 300000);
+	pcs_transfer_progress(pool, &pg);
+
+	while ((job = (AimdJob *)pcs_transfer_wait(pool, NULL, &rc)) != NULL) {
+		if (rc || job->received != AIMD_FILE_SIZE) {
+			printf("    download %s: rc %d, got %lu bytes\n", job->path, rc, (unsigned long)job->received);
+			failed++;
+		}
+	}
+	pcs_transfer_pool_destroy(pool);
+	pcs_destroy(pcs);
+	CHECK(!failed, "%d downloads failed", failed);
+	CHECK(pg.done == 0, "%d downloads finished within two sample intervals, the files are too small", pg.done);
+	CHECK(pg.limit >= 2, "concurrency is %d after two sample intervals with queued jobs, expect at least 2", pg.limit);
+	return 0;
+}
+
+#pragma endregion
+
+#pragma region 断点下载
+
+/*记录 Content-Range 响应头*/
+static size_t range_header(char *ptr, size_t size, size_t nmemb, void *userdata)
+{
+	char *content_range = (char *)userdata;
+	size_t len = size * nmemb;
+	if (len > 15 && strncasecmp(ptr, "Content-Range: ", 15) == 0 && len - 15 < 64) {
+		memcpy(content_range, ptr + 15, len - 15);
+		content_range[len - 15] = '\0';
+		content_range[strcspn(content_range, "\r\n")] = '\0';
+	}
+	return len;
+}
+
+static size_t range_write(char *ptr, size_t size, size_t nmemb, void *userdata)
+{
+	return buffer_write(ptr, size * nmemb, 0, userdata);
+}
+
+/*不经过 libpcs，直接向模拟服务器发送下载请求，range 为NULL时不带 Range 头。返回 HTTP 状态码，出错返回-1*/
+static long raw_download(TestEnv *env, const char *path, const char *range, TestBuffer *buf, char content_range[64])
+{
+	struct curl_slist *headers = NULL;
+	char url[256], header[80];
+	long status = -1;
+	CURL *curl;
+
+	curl = curl_easy_init();
+	if (!curl) return -1;
+	sprintf(url, "http://127.0.0.1:%d/rest/2.0/pcs/file?method=download&path=%s", mock_server_port(env->server), path);
+	if (range) {
+		sprintf(header, "Range: %s", range);
+		headers = curl_slist_append(headers, header);
+	}
+	content_range[0] = '\0';
+	curl_easy_setopt(curl, CURLOPT_URL, url);
+	curl_easy_setopt(curl, CURLOPT_PROXY, "");
+	curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+	curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, &range_header);
+	curl_easy_setopt(curl, CURLOPT_HEADERDATA, content_range);
+	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, &range_write);
+	curl_easy_setopt(curl, CURLOPT_WRITEDATA, buf);
+	if (curl_easy_perform(curl) == CURLE_OK)
+		curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status);
+	curl_slist_free_all(headers);
+	curl_easy_cleanup(curl);
+	return status;
+}
+
+/*
+ * 模拟服务器的 Range 支持：单个区间返回 206 和 Content-Range，结束位置超出文件时截断，
+ * 开始位置超出文件时返回 416，没有 Range 头时返回 200 和整个文件。
+*/
+static int test_mock_range(TestEnv *env)
+{
+	static const struct {
+		const char	*range;
+		long		status;
+		size_t		first;
+		size_t		length;
+		const char	*content_range;
+	} cases[] = {
+		{ "bytes=10-19", 206, 10, 10, "bytes 10-19/4096" },
+		{ "bytes=4000-", 206, 4000, 96, "bytes 4000-4095/4096" },
+		{ "bytes=4090-9999", 206, 4090, 6, "bytes 4090-4095/4096" },
+		{ "bytes=4096-", 416, 0, 0, "bytes */4096" },
+		{ NULL, 200, 0, RANGE_FILE_SIZE, "" },
+	};
+	char text[RANGE_FILE_SIZE + 1], content_range[64];
+	TestBuffer buf;
+	long status;
+	int i;
+
+	fill_text(text, RANGE_FILE_SIZE, 3);
+	mock_server_put(env->server, "/range/a.txt", text, RANGE_FILE_SIZE, 0);
+	for (i = 0; i < (int)(sizeof(cases) / sizeof(cases[0])); i++) {
+		memset(&buf, 0, sizeof(buf));
+		status = raw_download(env, "/range/a.txt", cases[i].range, &buf, content_range);
+		if (status != cases[i].status || buf.size != cases[i].length
+			|| (buf.size && memcmp(buf.data, text + cases[i].first, buf.size) != 0)
+			|| strcmp(content_range, cases[i].content_range) != 0) {
+			printf("    %s: status %ld, %lu bytes, Content-Range \"%s\"\n", cases[i].range ? cases[i].range : "no range",
+				status, (unsigned long)buf.size, content_range);
+			free(buf.data);
+			CHECK(0, "expect status %ld, %lu bytes from %lu, Content-Range \"%s\"", cases[i].status,
+				(unsigned long)cases[i].length, (unsigned long)cases[i].first, cases[i].content_range);
+		}
+		free(buf.data);
+	}
+
+	/*忽略 Range 时返回整个文件*/
+	memset(&buf, 0, sizeof(buf));
+	mock_server_ignore_range(env->server, 1);
+	status = raw_download(env, "/range/a.txt", "bytes=10-19", &buf, content_range);
+	mock_server_ignore_range(env->server, 0);
+	free(buf.data);
+	CHECK(status == 200 && buf.size == RANGE_FILE_SIZE && !content_range[0],
+		"ignored range: status %ld, %lu bytes, Content-Range \"%s\"", status, (unsigned long)buf.size, content_range);
+	return 0;
+}
+
+/*下载 [offset, offset + length) 并与 text 比较*/
+static int check_download_range(Pcs pcs, const char *text, Int64 offset, Int64 length)
+{
+	TestBuffer buf = {0};
+	PcsRes res;
+	int same;
+
+	pcs_setopts(pcs,
+		PCS_OPTION_DOWNLOAD_WRITE_FUNCTION, &buffer_write,
+		PCS_OPTION_DOWNLOAD_WRITE_FUNCTION_DATA, &buf,
+		PCS_OPTION_END);
+	res = pcs_download_range(pcs, "/range/a.txt", offset, length);
+	same = buf.size == (size_t)length && memcmp(buf.data, text + offset, buf.size) == 0;
+	free(buf.data);
+	CHECK(res == PCS_OK, "range %lld+%lld: %s", (long long)offset, (long long)length, pcs_strerror(pcs));
+	CHECK(same, "range %lld+%lld: got %lu bytes, content mismatch", (long long)offset, (long long)length, (unsigned long)buf.size);
+	return 0;
+}
+
+/*
+ * pcs_download_range() 只写入请求的区间，服务器忽略 Range 返回整个文件时也一样。
+ * 返回 206 的请求在统计中不算错误。区间超出文件时失败；参数错误时不发送请求。
+*/
+static int test_download_range(TestEnv *env)
+{
+	char text[RANGE_FILE_SIZE + 1];
+	PcsHttpEndpointStats *es;
+	TestBuffer buf = {0};
+	PcsHttpStats stats;
+	unsigned long start;
+	PcsRes res;
+	Pcs pcs;
+
+	fill_text(text, RANGE_FILE_SIZE, 5);
+	mock_server_put(env->server, "/range/a.txt", text, RANGE_FILE_SIZE, 0);
+	pcs = env_login(env, "range");
+	CHECK(pcs, "Can't login");
+
+	if (check_download_range(pcs, text, 0, 1)
+		|| check_download_range(pcs, text, 1234, 500)
+		|| check_download_range(pcs, text, RANGE_FILE_SIZE - 100, 100)) {
+		pcs_destroy(pcs);
+		return -1;
+	}
+	pcs_getstats(pcs, &stats);
+	es = &stats.endpoints[PCS_HTTP_ENDPOINT_DOWNLOAD];
+	CHECK(es->count == 3 && es->errors == 0, "download stats: %lu requests, %lu errors, expect 3 requests without errors",
+		es->count, es->errors);
+
+	mock_server_ignore_range(env->server, 1);
+	res = check_download_range(pcs, text, 1234, 500) ? PCS_FAIL : PCS_OK;
+	mock_server_ignore_range(env->server, 0);
+	if (res != PCS_OK) {
+		pcs_destroy(pcs);
+		return -1;
+	}
+
+	pcs_setopts(pcs,
+		PCS_OPTION_DOWNLOAD_WRITE_FUNCTION, &buffer_write,
+		PCS_OPTION_DOWNLOAD_WRITE_FUNCTION_DATA, &buf,
+		PCS_OPTION_END);
+	res = pcs_download_range(pcs, "/range/a.txt", RANGE_FILE_SIZE, 10);
+	CHECK(res != PCS_OK, "range past the end should fail");
+
+	start = server_requests(env);
+	res = pcs_download_range(pcs, "/range/a.txt", 0, 0);
+	CHECK(res != PCS_OK, "empty range should fail");
+	res = pcs_download_range(pcs, "/range/a.txt", -1, 10);
+	CHECK(res != PCS_OK, "negative offset should fail");
+	CHECK(server_requests(env) == start, "%lu requests sent for wrong ranges", server_requests(env) - start);
+
+	free(buf.data);
+	pcs_destroy(pcs);
+	return 0;
+}
+
+#pragma endregion
+
+#pragma region 包索引
+
+/*
+ * pack_build_index() 生成的索引经 pack_parse_index() 解析后与原来一致，
+ * 魔数错误或某行格式错误时返回-1。
+*/
+static int test_pack_index(TestEnv *env)
+{
+	PackEntry entries[3], *parsed = NULL;
+	char *index, *bad;
+	size_t size;
+	int i, count, same = 1;
+
+	memset(entries, 0, sizeof(entries));
+	entries[0].path = "/pack/a.txt";
+	entries[0].offset = 0;
+	entries[0].length = 0;
+	entries[0].mtime = 0;
+	strcpy(entries[0].md5, "d41d8cd98f00b204e9800998ecf8427e");
+	entries[1].path = "/pack/dir with spaces/\xe4\xb8\xad\xe6\x96\x87.txt";
+	entries[1].offset = 0;
+	entries[1].length = 5000000000LL;
+	entries[1].mtime = 1700000000;
+	strcpy(entries[1].md5, "0123456789abcdef0123456789abcdef");
+	entries[2].path = "/pack/b";
+	entries[2].offset = 5000000000LL;
+	entries[2].length = 1;
+	entries[2].mtime = 1;
+	strcpy(entries[2].md5, "ffffffffffffffffffffffffffffffff");
+
+	index = pack_build_index(entries, 3, &size);
+	CHECK(size == strlen(index), "index size %lu, strlen %lu", (unsigned long)size, (unsigned long)strlen(index));
+	count = pack_parse_index(index, &parsed);
+	if (count != 3) {
+		pcs_free(index);
+		CHECK(0, "parsed %d entries, expect 3", count);
+	}
+	for (i = 0; i < count; i++) {
+		if (strcmp(parsed[i].path, entries[i].path) || parsed[i].offset != entries[i].offset
+			|| parsed[i].length != entries[i].length || parsed[i].mtime != entries[i].mtime
+			|| strcmp(parsed[i].md5, entries[i].md5)) {
+			printf("    entry %d: %s %lld %lld %lld %s\n", i, parsed[i].path, (long long)parsed[i].offset,
+				(long long)parsed[i].length, (long long)parsed[i].mtime, parsed[i].md5);
+			same = 0;
+		}
+		freePackEntry(&parsed[i]);
+	}
+	pcs_free(parsed);
+	CHECK(same, "parsed entries differ from the built ones");
+
+	/*魔数错误*/
+	index[0] = 'X';
+	count = pack_parse_index(index, &parsed);
+	CHECK(count == -1, "wrong magic: got %d, expect -1", count);
+	index[0] = PACK_INDEX_MAGIC[0];
+
+	/*第二行缺少路径*/
+	bad = pcs_utils_sprintf("%s1\t2\t3\t%s\t\n", index, entries[0].md5);
+	count = pack_parse_index(bad, &parsed);
+	pcs_free(bad);
+	CHECK(count == -1, "line without path: got %d, expect -1", count);
+
+	/*数字格式错误*/
+	bad = pcs_utils_sprintf("%sx\t2\t3\t%s\t/pack/c\n", index, entries[0].md5);
+	count = pack_parse_index(bad, &parsed);
+	pcs_free(bad);
+	CHECK(count == -1, "line with a bad offset: got %d, expect -1", count);
+
+	/*只有魔数时没有文件*/
+	count = pack_parse_index(PACK_INDEX_MAGIC "\n", &parsed);
+	CHECK(count == 0, "empty index: got %d, expect 0", count);
+	pcs_free(parsed);
+
+	pcs_free(index);
+	return 0;
+}
+
+#pragma endregion
+
+static const TestCase tests[] = {
+	{ "stress", &test_stress, 2, 0, 0 },
+	{ "fm_batches", &test_fm_batches, 2, 0, 0 },
+	{ "retry", &test_retry, 0, 0, 0 },
+	{ "breaker", &test_breaker, 0, 0, 0 },
+	{ "rate_limit", &test_rate_limit, 0, 0, 0 },
+	{ "transfer_aimd", &test_transfer_aimd, 0, AIMD_BANDWIDTH, 0 },
+	{ "mock_range", &test_mock_range, 0, 0, 0 },
+	{ "download_range", &test_download_range, 0, 0, 0 },
+	{ "pack_index", &test_pack_index, 0, 0, 0 },
+	{ NULL, NULL, 0, 0, 0 }
+};
+
+int main(int argc, char *argv[])
+{
+	const char *filter = NULL;
+	const TestCase *tc;
+	TestEnv env;
+	int i, rc, failed = 0, count = 0;
+	double t;
+
+	for (i = 1; i < argc; i++) {
+		if (strncmp(argv[i], "--filter=", 9) == 0) filter = argv[i] + 9;
+		else {
+			printf("Usage: %s [--filter=str]\n", argv[0]);
+			return 1;
+		}
+	}
+	for (tc = tests; tc->name; tc++) {
+		if (filter && !strstr(tc->name, filter)) continue;
+		t = now_ms();
+		if (env_start(&env, tc)) {
+			printf("FAIL %-24s can't start the mock server\n", tc->name);
+			env_stop(&env);
+			failed++;
+			continue;
+		}
+		rc = (*tc->fn)(&env);
+		env_stop(&env);
+		printf("%s %-24s %8.1f ms\n", rc ? "FAIL" : "PASS", tc->name, now_ms() - t);
+		fflush(stdout);
+		if (rc) failed++;
+		count++;
+	}
+	printf("%d tests, %d failed\n", count, failed);
+	pcs_mem_print_leak();
+	return failed ? 1 : 0;
+}
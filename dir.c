@@ -30,6 +30,8 @@
 
 #endif
 
+#include <errno.h>
+
 #include "pcs/pcs_mem.h"
 #include "dir.h"
 
@@ -385,10 +387,11 @@ int CreateDirectoryRecursive(const char *path)
 				DestroyLocalFileInfo(info);
 			}
 			else {
+				/*并发下载时其他线程可能刚好创建了该目录*/
 #ifdef WIN32
-				if (_mkdir(tmp))
+				if (_mkdir(tmp) && errno != EEXIST)
 #else
-				if (mkdir(tmp, DEFAULT_MKDIR_ACCESS))
+				if (mkdir(tmp, DEFAULT_MKDIR_ACCESS) && errno != EEXIST)
 #endif
 					return MKDIR_FAIL;
 			}
@@ -402,9 +405,9 @@ int CreateDirectoryRecursive(const char *path)
 	}
 	if (p[-1] != '/' && p[-1] != '\\') {
 #ifdef WIN32
-		if (_mkdir(tmp))
+		if (_mkdir(tmp) && errno != EEXIST)
 #else
-		if (mkdir(tmp, DEFAULT_MKDIR_ACCESS))
+		if (mkdir(tmp, DEFAULT_MKDIR_ACCESS) && errno != EEXIST)
 #endif
 			return MKDIR_FAIL;
 	}
@@ -5,223 +5,548 @@
 #include "pcs/pcs_mem.h"
 #include "hashtable.h"
 
-static unsigned int calcHash1(const char *key, int key_size, int ignore_case)
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#  include <emmintrin.h>
+#  define HT_USE_SSE2
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#  include <arm_neon.h>
+#  define HT_USE_NEON
+#endif
+
+#if defined(_MSC_VER)
+#  include <intrin.h>
+#endif
+
+/*
+ * 控制字节：
+ *   0x80      - 空槽位
+ *   0xFE      - 已删除（墓碑）
+ *   0x00~0x7F - 已使用，值为哈希值的低7位
+*/
+#define CTRL_EMPTY		((unsigned char)0x80)
+#define CTRL_DELETED	((unsigned char)0xFE)
+#define CTRL_IS_FULL(c)	(!((c) & 0x80))
+
+#define HT_H2(hash)		((unsigned char)((hash) & 0x7F))
+#define HT_H1(hash)		((hash) >> 7)
+
+/*最大装载率为 7/8*/
+#define HT_MAX_LOAD(real_capacity)	((real_capacity) - (real_capacity) / 8)
+
+#define ARENA_CHUNK_SIZE	(64 * 1024)
+
+struct HashtableArena {
+	HashtableArena	*next;
+	size_t			size;
+	size_t			used;
+	char			data[1];
+};
+
+#pragma region 哈希函数
+
+#define HT_K0	UINT64_CONST(0xa0761d6478bd642f)
+#define HT_K1	UINT64_CONST(0xe7037ed1a0b428db)
+#define HT_K2	UINT64_CONST(0x8ebc6af09c88c6e3)
+#define HT_K3	UINT64_CONST(0x589965cc75374cc3)
+
+/*64位乘法，返回128位结果的高64位与低64位的异或值*/
+static inline UInt64 ht_mum(UInt64 a, UInt64 b)
+{
+#if defined(__SIZEOF_INT128__)
+	unsigned __int128 r = (unsigned __int128)a * b;
+	return (UInt64)r ^ (UInt64)(r >> 64);
+#elif defined(_MSC_VER) && defined(_M_X64)
+	UInt64 hi, lo;
+	lo = _umul128(a, b, &hi);
+	return lo ^ hi;
+#else
+	UInt64 ha = a >> 32, hb = b >> 32, la = (unsigned int)a, lb = (unsigned int)b, hi, lo;
+	UInt64 rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb, t = rl + (rm0 << 32), c = t < rl;
+	lo = t + (rm1 << 32);
+	c += lo < t;
+	hi = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+	return lo ^ hi;
+#endif
+}
+
+static inline UInt64 ht_read8(const unsigned char *p)
+{
+	UInt64 v;
+	memcpy(&v, p, 8);
+	return v;
+}
+
+/*把8个字节中的大写ASCII字母一次性转换为小写*/
+static inline UInt64 ht_fold_case(UInt64 w)
+{
+	UInt64 heptets = w & UINT64_CONST(0x7f7f7f7f7f7f7f7f);
+	UInt64 ge_a = heptets + UINT64_CONST(0x3f3f3f3f3f3f3f3f); /*最高位为1表示 >= 'A'*/
+	UInt64 gt_z = heptets + UINT64_CONST(0x2525252525252525); /*最高位为1表示 > 'Z'*/
+	UInt64 upper = (ge_a ^ gt_z) & ~w & UINT64_CONST(0x8080808080808080);
+	return w | (upper >> 2);
+}
+
+/*
+ * 计算Key的哈希值（wyhash 风格，每次处理16字节）。
+ * ignore_case 为非0值时，ASCII 字母不区分大小写。
+*/
+static unsigned int ht_hash(const char *key, int key_size, int ignore_case)
+{
+	const unsigned char *p = (const unsigned char *)key;
+	UInt64 seed = HT_K0 ^ (UInt64)key_size, a, b;
+	int len = key_size;
+	while (len >= 16) {
+		a = ht_read8(p);
+		b = ht_read8(p + 8);
+		if (ignore_case) {
+			a = ht_fold_case(a);
+			b = ht_fold_case(b);
+		}
+		seed = ht_mum(a ^ HT_K1, b ^ seed);
+		p += 16;
+		len -= 16;
+	}
+	a = 0; b = 0;
+	if (len >= 8) {
+		a = ht_read8(p);
+		p += 8;
+		len -= 8;
+	}
+	if (len > 0)
+		memcpy(&b, p, len);
+	if (ignore_case) {
+		a = ht_fold_case(a);
+		b = ht_fold_case(b);
+	}
+	seed = ht_mum(a ^ HT_K2, b ^ seed ^ HT_K3);
+	seed = ht_mum(seed ^ HT_K1, (UInt64)key_size ^ HT_K3);
+	return (unsigned int)(seed ^ (seed >> 32));
+}
+
+static inline int key_equal(const char *a, const char *b, int size, int ignore_case)
 {
-	register unsigned int nr = 1, nr2 = 4, ch;
 	int i;
-	if (key_size == -1) key_size = strlen(key);
-	for (i = 0; i < key_size; i++) {
-		ch = (unsigned int)key[i];
-		if (ch >= 'A' && ch <= 'Z' && ignore_case && (i == 0 || !(key[i - 1] & 0x80)))
-			ch += 'a' - 'A';
-		nr ^= (((nr & 63) + nr2) * ch) + (nr << 8);
-		nr2 += 3;
+	char ca, cb;
+	if (!ignore_case)
+		return memcmp(a, b, size) == 0;
+	for (i = 0; i < size; i++) {
+		ca = a[i];
+		cb = b[i];
+		if (ca >= 'A' && ca <= 'Z') ca += 'a' - 'A';
+		if (cb >= 'A' && cb <= 'Z') cb += 'a' - 'A';
+		if (ca != cb)
+			return 0;
 	}
-	return nr;
+	return 1;
 }
 
-static unsigned int calcHash2(const char *key, int key_size)
+#pragma endregion
+
+#pragma region 控制字节组
+
+/*返回组内控制字节等于 h2 的槽位掩码，第 i 位为1表示第 i 个槽位匹配*/
+static inline unsigned int group_match(const unsigned char *ctrl, unsigned char h2)
 {
-	unsigned int hash = 0;
+#if defined(HT_USE_SSE2)
+	__m128i g = _mm_loadu_si128((const __m128i *)ctrl);
+	return (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(g, _mm_set1_epi8((char)h2)));
+#elif defined(HT_USE_NEON)
+	static const unsigned char bits[16] = { 1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128 };
+	uint8x16_t m = vandq_u8(vceqq_u8(vld1q_u8(ctrl), vdupq_n_u8(h2)), vld1q_u8(bits));
+	return (unsigned int)vaddv_u8(vget_low_u8(m)) | ((unsigned int)vaddv_u8(vget_high_u8(m)) << 8);
+#else
+	unsigned int mask = 0;
 	int i;
-	if (key_size == -1) key_size = strlen(key);
-	for (i = 0; i < key_size; i++) {
-		hash *= 16777619;
-		hash ^= (unsigned int) key[i];
+	for (i = 0; i < HT_GROUP_WIDTH; i++) {
+		if (ctrl[i] == h2) mask |= 1u << i;
 	}
-	return (hash);
+	return mask;
+#endif
 }
 
-static unsigned int calcHash3(const char *key, int key_size)
+/*返回组内空槽位或已删除槽位的掩码*/
+static inline unsigned int group_match_free(const unsigned char *ctrl)
 {
-	unsigned int h;
+#if defined(HT_USE_SSE2)
+	return (unsigned int)_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)ctrl));
+#elif defined(HT_USE_NEON)
+	static const unsigned char bits[16] = { 1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128 };
+	uint8x16_t m = vandq_u8(vreinterpretq_u8_s8(vshrq_n_s8(vreinterpretq_s8_u8(vld1q_u8(ctrl)), 7)), vld1q_u8(bits));
+	return (unsigned int)vaddv_u8(vget_low_u8(m)) | ((unsigned int)vaddv_u8(vget_high_u8(m)) << 8);
+#else
+	unsigned int mask = 0;
 	int i;
-	if (key_size == -1) key_size = strlen(key);
-	for (h = 0, i = 0; i < key_size; i++)
-		h = 31 * h + ((unsigned int)key[i]);
-	return h;
+	for (i = 0; i < HT_GROUP_WIDTH; i++) {
+		if (!CTRL_IS_FULL(ctrl[i])) mask |= 1u << i;
+	}
+	return mask;
+#endif
 }
 
-static HashtableNode *node_create(const char *key, int key_size, void *value, unsigned int hashA, unsigned int hashB)
+static inline unsigned int group_match_empty(const unsigned char *ctrl)
 {
-	HashtableNode *node;
-	node = (HashtableNode *) pcs_malloc(sizeof(HashtableNode));
-	if (!node)
-		return NULL;
-	memset (node, 0, sizeof(HashtableNode));
-	if (key_size == -1) key_size = strlen(key);
-	node->key = (char *)pcs_malloc(key_size + 1);
-	if (!node->key) {
-		pcs_free(node);
-		return NULL;
+	return group_match(ctrl, CTRL_EMPTY);
+}
+
+/*返回最低位的1所在的位置。mask 不能为0*/
+static inline int lowest_bit(unsigned int mask)
+{
+#if defined(__GNUC__)
+	return __builtin_ctz(mask);
+#elif defined(_MSC_VER)
+	unsigned long index;
+	_BitScanForward(&index, mask);
+	return (int)index;
+#else
+	int i = 0;
+	while (!(mask & 1)) {
+		mask >>= 1;
+		i++;
 	}
-	memcpy(node->key, key, key_size);
-	node->key[key_size] = '\0';
-	node->value = value;
-	node->hashA = hashA;
-	node->hashB = hashB;
-	return node;
-}
-
-static void node_destroy(HashtableNode *node, void(*free_value)(void *))
-{
-	HashtableNode *tmp, *cusor;
-	cusor = node;
-	while(cusor) {
-		tmp = cusor;
-		cusor = cusor->next;
-		if (tmp->key)
-			pcs_free(tmp->key);
-		if (free_value && tmp->value)
-			(*free_value)(tmp->value);
-		pcs_free(tmp);
+	return i;
+#endif
+}
+
+#pragma endregion
+
+#pragma region 槽位表
+
+/*
+ * 在槽位表中查找Key，返回其槽位索引，不存在则返回-1。
+ * 探测按组进行，组序号依次加1、2、3...（三角形探测），在2的幂大小的表上能遍历所有组。
+*/
+static int table_find(const unsigned char *ctrl, const HashtableNode *table, int real_capacity,
+	const char *key, int key_size, unsigned int hash, int ignore_case)
+{
+	unsigned int group_mask = (unsigned int)(real_capacity / HT_GROUP_WIDTH) - 1;
+	unsigned int g = HT_H1(hash) & group_mask, step = 0, mask;
+	unsigned char h2 = HT_H2(hash);
+	const HashtableNode *node;
+	int base, i;
+	for (;;) {
+		base = (int)g * HT_GROUP_WIDTH;
+		mask = group_match(ctrl + base, h2);
+		while (mask) {
+			i = base + lowest_bit(mask);
+			node = &table[i];
+			if (node->hash == hash && node->key_size == key_size && key_equal(node->key, key, key_size, ignore_case))
+				return i;
+			mask &= mask - 1;
+		}
+		if (group_match_empty(ctrl + base))
+			return -1;
+		if (++step > group_mask)
+			return -1;
+		g = (g + step) & group_mask;
 	}
 }
 
-static int table_add_item(HashtableNode **table, int real_capacity, const char *key, int key_size, void *value, int ignore_case)
+/*查找可以放入新项的槽位（空槽位或已删除槽位）*/
+static int table_find_free(const unsigned char *ctrl, int real_capacity, unsigned int hash)
 {
-	//不同的字符串三次hash还会碰撞的几率无限接近于不可能
-	unsigned int nHash, nHashA, nHashB;
-	unsigned int pos;
-	HashtableNode *last = NULL, *p;
-	if (key_size == -1) key_size = strlen(key);
-	nHash = calcHash1(key, ignore_case, key_size);
-	nHashA = calcHash2(key, key_size);
-	nHashB = calcHash3(key, key_size);
-	pos = nHash % real_capacity;
-	p = table[pos];
-	if (!p) {
-		table[pos] = node_create(key, key_size, value, nHashA, nHashB);
-		if (!table[pos])
+	unsigned int group_mask = (unsigned int)(real_capacity / HT_GROUP_WIDTH) - 1;
+	unsigned int g = HT_H1(hash) & group_mask, step = 0, mask;
+	int base;
+	for (;;) {
+		base = (int)g * HT_GROUP_WIDTH;
+		mask = group_match_free(ctrl + base);
+		if (mask)
+			return base + lowest_bit(mask);
+		if (++step > group_mask)
 			return -1;
-		return 0;
+		g = (g + step) & group_mask;
 	}
-	while (p) {
-		if (p->hashA == nHashA && p->hashB == nHashB) {
-			break;
-		}
-		last = p;
-		p = p->next;
+}
+
+/*
+ * 把节点放入槽位表。调用者需保证Key不存在且表中还有空闲槽位。
+ * 如果占用的是空槽位则返回1，占用的是已删除的槽位则返回0
+*/
+static int table_insert(unsigned char *ctrl, HashtableNode *table, int real_capacity, const HashtableNode *node)
+{
+	int i = table_find_free(ctrl, real_capacity, node->hash);
+	int was_empty = ctrl[i] == CTRL_EMPTY;
+	ctrl[i] = HT_H2(node->hash);
+	table[i] = *node;
+	return was_empty;
+}
+
+/*
+ * 移除槽位 i。
+ * 如果槽位所在的组中还有空槽位，说明没有任何探测序列越过该组，可以直接标记为空；
+ * 否则需标记为已删除，以免中断其他Key的探测序列。
+ * 标记为空时返回1，否则返回0
+*/
+static int table_erase(unsigned char *ctrl, int i)
+{
+	int base = i & ~(HT_GROUP_WIDTH - 1);
+	if (group_match_empty(ctrl + base)) {
+		ctrl[i] = CTRL_EMPTY;
+		return 1;
 	}
-	if (p) {
+	ctrl[i] = CTRL_DELETED;
+	return 0;
+}
+
+static int table_alloc(int real_capacity, unsigned char **pCtrl, HashtableNode **pTable)
+{
+	unsigned char *ctrl;
+	HashtableNode *table;
+	ctrl = (unsigned char *)pcs_malloc(real_capacity);
+	if (!ctrl)
+		return -1;
+	table = (HashtableNode *)pcs_malloc(real_capacity * sizeof(HashtableNode));
+	if (!table) {
+		pcs_free(ctrl);
 		return -1;
 	}
-	else {
-		p = node_create(key, key_size, value, nHashA, nHashB);
-		if (!p)
-			return -1;
-		last->next = p;
-	}
+	memset(ctrl, CTRL_EMPTY, real_capacity);
+	*pCtrl = ctrl;
+	*pTable = table;
 	return 0;
 }
 
-static int table_set_item(HashtableNode **table, int real_capacity, const char *key, int key_size, void *value, int ignore_case, int *pHasOld, void **pOldVal)
+static void table_free_values(const unsigned char *ctrl, HashtableNode *table, int real_capacity, void(*free_value)(void *))
 {
-	//不同的字符串三次hash还会碰撞的几率无限接近于不可能
-	unsigned int nHash, nHashA, nHashB;
-	unsigned int pos;
-	HashtableNode *last = NULL, *p;
-	if (key_size == -1) key_size = strlen(key);
-	nHash = calcHash1(key, ignore_case, key_size);
-	nHashA = calcHash2(key, key_size);
-	nHashB = calcHash3(key, key_size);
-	pos = nHash % real_capacity;
-	p = table[pos];
-	if (pHasOld) (*pHasOld) = 0;
-	if (!p) {
-		table[pos] = node_create(key, key_size, value, nHashA, nHashB);
-		if (!table[pos]) return -1;
-		return 0;
-	}
-	while (p) {
-		if (p->hashA == nHashA && p->hashB == nHashB) {
-			break;
-		}
-		last = p;
-		p = p->next;
-	}
-	if (p) {
-		if (pHasOld) (*pHasOld) = 1;
-		if (pOldVal) (*pOldVal) = p->value;
-		p->value = value;
-		return 0;
+	int i;
+	if (!free_value)
+		return;
+	for (i = 0; i < real_capacity; i++) {
+		if (CTRL_IS_FULL(ctrl[i]) && table[i].value)
+			(*free_value)(table[i].value);
 	}
-	else {
-		p = node_create(key, key_size, value, nHashA, nHashB);
-		if (!p) return -1;
-		last->next = p;
+}
+
+/*返回能容纳 capacity 项的最小槽位数量*/
+static int table_size_for(int capacity)
+{
+	int real_capacity = HT_GROUP_WIDTH;
+	while (HT_MAX_LOAD(real_capacity) < capacity)
+		real_capacity <<= 1;
+	return real_capacity;
+}
+
+#pragma endregion
+
+#pragma region 字符串池
+
+static void arena_destroy(HashtableArena *arena)
+{
+	HashtableArena *next;
+	while (arena) {
+		next = arena->next;
+		pcs_free(arena);
+		arena = next;
 	}
-	return 0;
 }
 
-static HashtableNode *table_get_item(HashtableNode **table, int real_capacity, const char *key, int key_size, int ignore_case)
+/*复制Key到字符串池中，并在末尾添加'\0'*/
+static char *arena_strdup(Hashtable *ht, const char *key, int key_size)
 {
-	unsigned int nHash, nHashA, nHashB;
-	unsigned int pos;
-	HashtableNode *p;
-	if (key_size == -1) key_size = strlen(key);
-	nHash = calcHash1(key, ignore_case, key_size);
-	pos = nHash % real_capacity;
-	p = table[pos];
-	if (!p) return NULL;
-	nHashA = calcHash2(key, key_size);
-	nHashB = calcHash3(key, key_size);
-	while (p) {
-		if (p->hashA == nHashA && p->hashB == nHashB) {
-			break;
-		}
-		p = p->next;
+	HashtableArena *arena = ht->arena;
+	size_t need = (size_t)key_size + 1, size;
+	char *p;
+	if (!arena || arena->size - arena->used < need) {
+		size = need > ARENA_CHUNK_SIZE ? need : ARENA_CHUNK_SIZE;
+		arena = (HashtableArena *)pcs_malloc(sizeof(HashtableArena) + size);
+		if (!arena)
+			return NULL;
+		arena->next = ht->arena;
+		arena->size = size;
+		arena->used = 0;
+		ht->arena = arena;
 	}
+	p = arena->data + arena->used;
+	memcpy(p, key, key_size);
+	p[key_size] = '\0';
+	arena->used += need;
+	ht->arena_used += need;
 	return p;
 }
 
-static HashtableNode *table_remove_item(HashtableNode **table, int real_capacity, const char *key, int key_size, int ignore_case)
+#pragma endregion
+
+#pragma region 扩容
+
+/*
+ * 把所有项（包括渐进式扩容中尚未迁移的旧表）一次性重建到 real_capacity 个槽位的新表中。
+ * 如果字符串池中被移除的Key占用过多，同时压缩字符串池。
+*/
+static int ht_rehash(Hashtable *ht, int real_capacity)
 {
-	unsigned int nHash, nHashA, nHashB;
-	unsigned int pos;
-	HashtableNode *p, *prev = NULL;
-	if (key_size == -1) key_size = strlen(key);
-	nHash = calcHash1(key, ignore_case, key_size);
-	pos = nHash % real_capacity;
-	p = table[pos];
-	if (p) {
-		nHashA = calcHash2(key, key_size);
-		nHashB = calcHash3(key, key_size);
-		while (p) {
-			if (p->hashA == nHashA && p->hashB == nHashB) {
-				break;
+	unsigned char *ctrl, *src_ctrl;
+	HashtableNode *table, *src_table, node;
+	HashtableArena *old_arena = NULL;
+	size_t old_used = 0, old_dead = 0;
+	int compact, pass, src_capacity, i;
+
+	if (table_alloc(real_capacity, &ctrl, &table))
+		return -1;
+	compact = ht->arena_dead > ARENA_CHUNK_SIZE && ht->arena_dead > ht->arena_used / 2;
+	if (compact) {
+		old_arena = ht->arena;
+		old_used = ht->arena_used;
+		old_dead = ht->arena_dead;
+		ht->arena = NULL;
+		ht->arena_used = 0;
+		ht->arena_dead = 0;
+	}
+	for (pass = 0; pass < 2; pass++) {
+		src_ctrl = pass ? ht->old_ctrl : ht->ctrl;
+		src_table = pass ? ht->old_table : ht->table;
+		src_capacity = pass ? ht->old_real_capacity : ht->real_capacity;
+		if (!src_ctrl)
+			continue;
+		for (i = 0; i < src_capacity; i++) {
+			if (!CTRL_IS_FULL(src_ctrl[i]))
+				continue;
+			node = src_table[i];
+			if (compact) {
+				node.key = arena_strdup(ht, node.key, node.key_size);
+				if (!node.key) {
+					arena_destroy(ht->arena);
+					ht->arena = old_arena;
+					ht->arena_used = old_used;
+					ht->arena_dead = old_dead;
+					pcs_free(ctrl);
+					pcs_free(table);
+					return -1;
+				}
 			}
-			prev = p;
-			p = p->next;
+			table_insert(ctrl, table, real_capacity, &node);
 		}
-		if (p) {
-			if (prev) {
-				prev->next = p->next;
-			}
-			else {
-				table[pos] = NULL;
-			}
-			p->next = NULL;
+	}
+	if (compact)
+		arena_destroy(old_arena);
+	pcs_free(ht->ctrl);
+	pcs_free(ht->table);
+	if (ht->old_ctrl) {
+		pcs_free(ht->old_ctrl);
+		pcs_free(ht->old_table);
+		ht->old_ctrl = NULL;
+		ht->old_table = NULL;
+		ht->old_real_capacity = 0;
+		ht->old_count = 0;
+		ht->migrate_pos = 0;
+	}
+	ht->ctrl = ctrl;
+	ht->table = table;
+	ht->real_capacity = real_capacity;
+	ht->capacity = HT_MAX_LOAD(real_capacity);
+	ht->growth_left = ht->capacity - ht->count;
+	return 0;
+}
+
+/*开始渐进式扩容：分配两倍大小的新表，当前表变为旧表，之后逐步迁移*/
+static int ht_start_migrate(Hashtable *ht)
+{
+	unsigned char *ctrl;
+	HashtableNode *table;
+	int real_capacity = ht->real_capacity * 2;
+	if (table_alloc(real_capacity, &ctrl, &table))
+		return -1;
+	ht->old_ctrl = ht->ctrl;
+	ht->old_table = ht->table;
+	ht->old_real_capacity = ht->real_capacity;
+	ht->old_count = ht->count;
+	ht->migrate_pos = 0;
+	ht->ctrl = ctrl;
+	ht->table = table;
+	ht->real_capacity = real_capacity;
+	ht->capacity = HT_MAX_LOAD(real_capacity);
+	ht->growth_left = ht->capacity;
+	return 0;
+}
+
+/*
+ * 从旧表迁移 groups 组到新表。传入 -1 表示迁移全部。
+ * 迁移后的旧槽位标记为已删除，以保持旧表中其余Key的探测序列完整。
+*/
+static void ht_migrate(Hashtable *ht, int groups)
+{
+	int base, i, group_count;
+	if (!ht->old_ctrl)
+		return;
+	group_count = ht->old_real_capacity / HT_GROUP_WIDTH;
+	while (groups != 0 && ht->migrate_pos < group_count && ht->old_count > 0) {
+		base = ht->migrate_pos * HT_GROUP_WIDTH;
+		for (i = base; i < base + HT_GROUP_WIDTH; i++) {
+			if (!CTRL_IS_FULL(ht->old_ctrl[i]))
+				continue;
+			ht->growth_left -= table_insert(ht->ctrl, ht->table, ht->real_capacity, &ht->old_table[i]);
+			ht->old_ctrl[i] = CTRL_DELETED;
+			ht->old_count--;
 		}
+		ht->migrate_pos++;
+		if (groups > 0) groups--;
+	}
+	if (ht->migrate_pos >= group_count || ht->old_count == 0) {
+		pcs_free(ht->old_ctrl);
+		pcs_free(ht->old_table);
+		ht->old_ctrl = NULL;
+		ht->old_table = NULL;
+		ht->old_real_capacity = 0;
+		ht->old_count = 0;
+		ht->migrate_pos = 0;
 	}
-	return p;
 }
 
-static void table_clear(HashtableNode **table, int real_capacity, void(*free_value)(void *))
+/*确保当前表中至少还有一个空槽位*/
+static int ht_reserve_one(Hashtable *ht)
+{
+	if (ht->growth_left > 0)
+		return 0;
+	if (ht->incremental && !ht->old_ctrl && ht->count >= ht->capacity / 2)
+		return ht_start_migrate(ht);
+	ht_migrate(ht, -1);
+	if (ht->growth_left > 0)
+		return 0;
+	/*墓碑过多时原大小重建即可，否则扩大为两倍*/
+	if (ht->count >= ht->capacity / 2)
+		return ht_rehash(ht, ht->real_capacity * 2);
+	return ht_rehash(ht, ht->real_capacity);
+}
+
+#pragma endregion
+
+/*
+ * 查找Key。找到时返回节点，并通过 pIsOld 返回节点是否位于渐进式扩容的旧表中，pIndex 返回槽位索引。
+*/
+static HashtableNode *ht_find(Hashtable *ht, const char *key, int key_size, unsigned int hash, int *pIsOld, int *pIndex)
 {
 	int i;
-	HashtableNode *node;
-	for(i = 0; i < real_capacity; i++) {
-		node = table[i];
-		node_destroy(node, free_value);
-		table[i] = NULL;
+	i = table_find(ht->ctrl, ht->table, ht->real_capacity, key, key_size, hash, ht->ignore_case);
+	if (i >= 0) {
+		if (pIsOld) *pIsOld = 0;
+		if (pIndex) *pIndex = i;
+		return &ht->table[i];
 	}
+	if (ht->old_ctrl) {
+		i = table_find(ht->old_ctrl, ht->old_table, ht->old_real_capacity, key, key_size, hash, ht->ignore_case);
+		if (i >= 0) {
+			if (pIsOld) *pIsOld = 1;
+			if (pIndex) *pIndex = i;
+			return &ht->old_table[i];
+		}
+	}
+	return NULL;
 }
 
-static void table_destroy(HashtableNode **table, int real_capacity, void(*free_value)(void *))
+/*添加新项。调用者需保证Key不存在*/
+static int ht_insert_new(Hashtable *ht, const char *key, int key_size, unsigned int hash, void *value)
 {
-	table_clear(table, real_capacity, free_value);
-	pcs_free(table);
+	HashtableNode node;
+	if (ht_reserve_one(ht))
+		return -1;
+	node.key = arena_strdup(ht, key, key_size);
+	if (!node.key)
+		return -1;
+	node.key_size = key_size;
+	node.hash = hash;
+	node.value = value;
+	ht->growth_left -= table_insert(ht->ctrl, ht->table, ht->real_capacity, &node);
+	ht->count++;
+	return 0;
 }
 
 Hashtable *ht_create(int capacity, int ignore_case, void (*free_value)(void *))
@@ -232,95 +557,104 @@ Hashtable *ht_create(int capacity, int ignore_case, void (*free_value)(void *))
 		return NULL;
 	memset (ht, 0, sizeof(Hashtable));
 	if (capacity < 17) capacity = 17;
-	ht->capacity = capacity;
-	ht->real_capacity = (int)(ht->capacity * HASH_EXTEND_MULTIPLIER);
+	ht->real_capacity = table_size_for(capacity);
+	ht->capacity = HT_MAX_LOAD(ht->real_capacity);
+	ht->growth_left = ht->capacity;
 	ht->count = 0;
 	ht->free_value = free_value;
-	ht->table = (HashtableNode **)pcs_malloc(ht->real_capacity * sizeof(HashtableNode *));
-	if (!ht->table) {
+	if (table_alloc(ht->real_capacity, &ht->ctrl, &ht->table)) {
 		pcs_free(ht);
 		return NULL;
 	}
-	memset (ht->table, 0, ht->real_capacity * sizeof(HashtableNode *));
 	ht->ignore_case = ignore_case;
 	return ht;
 }
 
 void ht_destroy(Hashtable *ht)
 {
-	table_destroy(ht->table, ht->real_capacity, ht->free_value);
+	ht_clear(ht);
+	pcs_free(ht->ctrl);
+	pcs_free(ht->table);
 	pcs_free(ht);
 }
 
 int ht_expand(Hashtable *ht, int capacity)
 {
-	HashtableNode **table, *node;
-	int real_capacity, i, cnt;
-	real_capacity = (int)(capacity * HASH_EXTEND_MULTIPLIER);
-	table = (HashtableNode **)pcs_malloc(real_capacity * sizeof(HashtableNode *));
-	if (!table) {
-		return -1;
-	}
-	memset (table, 0, real_capacity * sizeof(HashtableNode *));
-	cnt = 0;
-	for(i = 0; i < ht->real_capacity; i++) {
-		node = ht->table[i];
-		while(node) {
-			if (table_add_item(table, real_capacity, node->key, -1, node->value, ht->ignore_case)) {
-				table_destroy(table, real_capacity, NULL);
-				return -1;
-			}
-			cnt++;
-			node = node->next;
-		}
-	}
-	table_destroy(ht->table, ht->real_capacity, NULL);
-	ht->table = table;
-	ht->capacity = capacity;
-	ht->real_capacity = real_capacity;
-	ht->count = cnt;
-	return 0;
+	int real_capacity;
+	ht_migrate(ht, -1);
+	if (capacity < ht->count) capacity = ht->count;
+	real_capacity = table_size_for(capacity);
+	if (real_capacity <= ht->real_capacity)
+		return 0;
+	return ht_rehash(ht, real_capacity);
+}
+
+void ht_set_incremental(Hashtable *ht, int incremental)
+{
+	ht->incremental = incremental;
+	if (!incremental)
+		ht_migrate(ht, -1);
 }
 
 int ht_add(Hashtable *ht, const char *key, int key_size, void *value)
 {
-	if (ht->count >= ht->capacity) {
-		if (ht_expand(ht, ht->count * 2))
-			return -1;
-	}
-	if (table_add_item(ht->table, ht->real_capacity, key, key_size, value, ht->ignore_case))
+	unsigned int hash;
+	if (key_size == -1) key_size = strlen(key);
+	ht_migrate(ht, HT_MIGRATE_GROUPS);
+	hash = ht_hash(key, key_size, ht->ignore_case);
+	if (ht_find(ht, key, key_size, hash, NULL, NULL))
 		return -1;
-	ht->count++;
-	return 0;
+	return ht_insert_new(ht, key, key_size, hash, value);
 }
 
 int ht_set(Hashtable *ht, const char *key, int key_size, void *value, void **pOldVal)
 {
-	void *oldVal = NULL;
-	int rc, pHasOld;
-	rc = table_set_item(ht->table, ht->real_capacity, key, key_size, value, ht->ignore_case, &pHasOld, pOldVal ? pOldVal : &oldVal);
-	if (oldVal && ht->free_value) (*ht->free_value)(oldVal); /*如果pOldVal传入NULL，且有旧值时，自动释放*/
-	if (!pHasOld) ht->count++;
-	return rc;
+	HashtableNode *node;
+	void *oldVal;
+	unsigned int hash;
+	if (key_size == -1) key_size = strlen(key);
+	ht_migrate(ht, HT_MIGRATE_GROUPS);
+	hash = ht_hash(key, key_size, ht->ignore_case);
+	node = ht_find(ht, key, key_size, hash, NULL, NULL);
+	if (node) {
+		oldVal = node->value;
+		node->value = value;
+		if (pOldVal) (*pOldVal) = oldVal;
+		else if (oldVal && ht->free_value) (*ht->free_value)(oldVal); /*如果pOldVal传入NULL，且有旧值时，自动释放*/
+		return 0;
+	}
+	return ht_insert_new(ht, key, key_size, hash, value);
 }
 
 int ht_remove(Hashtable *ht, const char *key, int key_size, void **pVal)
 {
 	HashtableNode *p;
-	p = table_remove_item(ht->table, ht->real_capacity, key, key_size, ht->ignore_case);
-	if (p) {
-		if (pVal) *pVal = p->value;
-		node_destroy(p, pVal ? NULL : ht->free_value);
-		ht->count--;
-		return 0;
+	int is_old, i;
+	void *value;
+	if (key_size == -1) key_size = strlen(key);
+	ht_migrate(ht, HT_MIGRATE_GROUPS);
+	p = ht_find(ht, key, key_size, ht_hash(key, key_size, ht->ignore_case), &is_old, &i);
+	if (!p)
+		return -1;
+	value = p->value;
+	ht->arena_dead += (size_t)p->key_size + 1;
+	if (is_old) {
+		table_erase(ht->old_ctrl, i);
+		ht->old_count--;
+	}
+	else {
+		ht->growth_left += table_erase(ht->ctrl, i);
 	}
-	return -1;
+	ht->count--;
+	if (pVal) *pVal = value;
+	else if (value && ht->free_value) (*ht->free_value)(value);
+	return 0;
 }
 
 void *ht_get(Hashtable *ht, const char *key, int key_size)
 {
 	HashtableNode *p;
-	p = table_get_item(ht->table, ht->real_capacity, key, key_size, ht->ignore_case);
+	p = ht_get_node(ht, key, key_size);
 	if (!p)
 		return NULL;
 	return p->value;
@@ -328,20 +662,35 @@ void *ht_get(Hashtable *ht, const char *key, int key_size)
 
 HashtableNode *ht_get_node(Hashtable *ht, const char *key, int key_size)
 {
-	return table_get_item(ht->table, ht->real_capacity, key, key_size, ht->ignore_case);
+	if (key_size == -1) key_size = strlen(key);
+	return ht_find(ht, key, key_size, ht_hash(key, key_size, ht->ignore_case), NULL, NULL);
 }
 
 int ht_has(Hashtable *ht, const char *key, int key_size)
 {
-	HashtableNode *p;
-	p = table_get_item(ht->table, ht->real_capacity, key, key_size, ht->ignore_case);
-	return (p ? 1 : 0);
+	return (ht_get_node(ht, key, key_size) ? 1 : 0);
 }
 
 int ht_clear(Hashtable *ht)
 {
-	table_clear(ht->table, ht->real_capacity, ht->free_value);
+	table_free_values(ht->ctrl, ht->table, ht->real_capacity, ht->free_value);
+	memset(ht->ctrl, CTRL_EMPTY, ht->real_capacity);
+	if (ht->old_ctrl) {
+		table_free_values(ht->old_ctrl, ht->old_table, ht->old_real_capacity, ht->free_value);
+		pcs_free(ht->old_ctrl);
+		pcs_free(ht->old_table);
+		ht->old_ctrl = NULL;
+		ht->old_table = NULL;
+		ht->old_real_capacity = 0;
+		ht->old_count = 0;
+		ht->migrate_pos = 0;
+	}
+	arena_destroy(ht->arena);
+	ht->arena = NULL;
+	ht->arena_used = 0;
+	ht->arena_dead = 0;
 	ht->count = 0;
+	ht->growth_left = ht->capacity;
 	return 0;
 }
 
@@ -365,29 +714,34 @@ void ht_it_destroy(HashtableIterater *iterater)
 void ht_it_reset(HashtableIterater *iterater)
 {
 	iterater->index = -1;
+	iterater->p = NULL;
 }
 
+/*先遍历当前表，再遍历渐进式扩容中尚未迁移完的旧表*/
 int ht_it_next(HashtableIterater *iterater)
 {
-	if (iterater->ht->count == 0)
+	Hashtable *ht = iterater->ht;
+	int total = ht->real_capacity + (ht->old_ctrl ? ht->old_real_capacity : 0), i;
+	iterater->p = NULL;
+	if (ht->count == 0)
 		return 0;
-	if (iterater->p) {
-		iterater->p = iterater->p->next;
-		if (iterater->p)
-			return 1;
-	}
-	if (iterater->index >= iterater->ht->real_capacity)
-		return 0;
-	iterater->index++;
-
-	while(iterater->index < iterater->ht->real_capacity) {
-		iterater->p = iterater->ht->table[iterater->index];
-		if (iterater->p)
-			break;
-		iterater->index++;
+	while (++iterater->index < total) {
+		i = iterater->index;
+		if (i < ht->real_capacity) {
+			if (CTRL_IS_FULL(ht->ctrl[i])) {
+				iterater->p = &ht->table[i];
+				return 1;
+			}
+		}
+		else {
+			i -= ht->real_capacity;
+			if (CTRL_IS_FULL(ht->old_ctrl[i])) {
+				iterater->p = &ht->old_table[i];
+				return 1;
+			}
+		}
 	}
-	if (iterater->p)
-		return 1;
+	iterater->index = total;
 	return 0;
 }
 
@@ -397,4 +751,3 @@ void *ht_it_current(HashtableIterater *iterater)
 		return iterater->p->value;
 	return NULL;
 }
-
@@ -1,6 +1,8 @@
 ﻿#ifndef _PCS_SHELL_HASHTABLE_H_
 #define _PCS_SHELL_HASHTABLE_H_
 
+#include <stddef.h>
+
 #ifndef HASH_EXTEND_MULTIPLIER
 #define HASH_EXTEND_MULTIPLIER ( 1.75F )
 #endif
@@ -10,23 +12,56 @@ extern "C" {
 #endif
 
 
+/*
+ * 哈希表使用开放寻址法实现：
+ *   每个槽位对应一个控制字节，控制字节按 16 个一组存放，查找时一次比较一整组
+ *   （支持 SSE2 / NEON 时使用 SIMD 指令，否则使用通用的位运算实现）。
+ *   每个 Key 只计算一次 64 位哈希，高位用于定位组，低 7 位存入控制字节用于快速过滤。
+ *   Key 的内容统一存放在哈希表自有的字符串池（arena）中，不再为每个节点单独分配内存。
+ * 注意：节点存放于连续的槽位数组中，任何写操作（添加、设置、移除、扩容）都可能使
+ *   ht_get_node() 返回的节点指针失效。
+*/
+
+#ifndef HT_GROUP_WIDTH
+#define HT_GROUP_WIDTH		16
+#endif
+
+/*渐进式扩容时，每次写操作迁移的组数量*/
+#ifndef HT_MIGRATE_GROUPS
+#define HT_MIGRATE_GROUPS	8
+#endif
+
 typedef struct  HashtableNode HashtableNode;
 struct  HashtableNode { 
-	char			*key;
-	unsigned int	hashA;
-	unsigned int	hashB;
+	char			*key;		/*指向字符串池中以'\0'结尾的 Key*/
+	int				key_size;
+	unsigned int	hash;
 	void			*value;
-	HashtableNode	*next;
 };
 
+typedef struct HashtableArena HashtableArena;
+
 typedef struct Hashtable Hashtable;
 struct Hashtable {
-	int				capacity;
-	int				real_capacity;
+	int				capacity;		/*不触发扩容时最多能容纳的项数*/
+	int				real_capacity;	/*槽位数量，为 HT_GROUP_WIDTH 的整数倍且为2的幂*/
 	int				count;
-	HashtableNode	**table;
+	unsigned char	*ctrl;
+	HashtableNode	*table;
+	int				growth_left;	/*还可以使用的空槽位数量，为0时需要扩容或重建*/
 	void (*free_value)(void *);
 	int				ignore_case;
+
+	HashtableArena	*arena;
+	size_t			arena_used;		/*字符串池中已使用的字节数*/
+	size_t			arena_dead;		/*字符串池中已被移除项占用的字节数*/
+
+	int				incremental;	/*是否使用渐进式扩容*/
+	unsigned char	*old_ctrl;		/*渐进式扩容时，尚未迁移完的旧表*/
+	HashtableNode	*old_table;
+	int				old_real_capacity;
+	int				old_count;
+	int				migrate_pos;	/*旧表中下一个待迁移的组*/
 };
 
 typedef struct HashtableIterater {
@@ -44,8 +79,14 @@ typedef struct HashtableIterater {
 Hashtable *ht_create(int capacity, int ignore_case, void (*free_value)(void *));
 /*释放掉哈希表*/
 void ht_destroy(Hashtable *ht);
-/*扩容哈希表。成功返回0，失败返回非0值。*/
+/*扩容哈希表，使其至少能容纳 capacity 项。成功返回0，失败返回非0值。*/
 int ht_expand(Hashtable *ht, int capacity);
+/*
+ * 设置是否使用渐进式扩容。
+ * 启用后，扩容时不再一次性重建整个表，而是保留旧表，
+ * 之后每次写操作迁移 HT_MIGRATE_GROUPS 组，从而避免单次操作的长时间停顿。
+*/
+void ht_set_incremental(Hashtable *ht, int incremental);
 /*
 添加一项到哈希表中。
 key_size 传入-1时，自动使用strlen()计算
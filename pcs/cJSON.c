@@ -32,7 +32,14 @@
 #include <ctype.h>
 #include "cJSON.h"
 
-static const char *ep;
+/* Each thread keeps its own error pointer, so handles on different threads can parse at the same time. */
+#ifdef WIN32
+# define CJSON_THREAD_LOCAL __declspec(thread)
+#else
+# define CJSON_THREAD_LOCAL __thread
+#endif
+
+static CJSON_THREAD_LOCAL const char *ep;
 
 const char *cJSON_GetErrorPtr(void) {return ep;}
 
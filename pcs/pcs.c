@@ -8,6 +8,7 @@
 #include "openssl_md5.h"
 #else
 # include <alloca.h>
+# include <pthread.h>
 #include <openssl/aes.h>
 #include <openssl/md5.h>
 #endif
@@ -59,9 +60,14 @@ struct pcs {
 
 	char		*buffer;
 	size_t		buffer_size;
+
+	int			fm_batch_size; /*批量文件操作时，每次请求最多包含的文件数量*/
+	int			fm_threads; /*批量文件操作时，并发请求的最大数量*/
 };
 
 #define PCS_BUFFER_SIZE			(AES_BLOCK_SIZE * 1024)
+#define PCS_FM_BATCH_SIZE		100 /*网盘API一次操作文件不可超过100个*/
+#define PCS_FM_THREADS			4
 #define PCS_ACTION_NONE			0
 #define PCS_ACTION_DOWNLOAD		1
 #define PCS_ACTION_UPLOAD		2
@@ -876,117 +882,6 @@ static char *pcs_build_pan_api_url(Pcs handle, const char *action, ...)
 	return url;
 }
 
-/*转换JSON对象为PcsFileInfo对象。
-JSON对象格式为：
-{
-	"fs_id": 123,
-	"path": "/a/b",
-	"server_filename": "b",
-	"mtime": 1899383,
-	"ctime": 1899383,
-	"server_mtime": 1899383,
-	"server_ctime": 1899383,
-	"local_mtime": 1899383,
-	"local_ctime": 1899383,
-	"isdir": 1,
-	"category": 1,
-	"size": 0,
-	"dir_empty": 0,
-	"empty": 0,
-	"ifhassubdir": 0,
-	"md5": "",
-	"dlink": "",
-	"block_list": [ "/a/b/1", "a/b/2" ]
-}
-*/
-static PcsFileInfo *pcs_parse_fileinfo(cJSON * item)
-{
-	cJSON *val, *list;
-	PcsFileInfo *fi = pcs_fileinfo_create();
-	val = cJSON_GetObjectItem(item, "fs_id");
-	if ((val = cJSON_GetObjectItem(item, "fs_id")))
-		fi->fs_id = (UInt64)val->valuedouble;
-
-	val = cJSON_GetObjectItem(item, "path");
-	if (val)
-		fi->path = pcs_utils_strdup(val->valuestring);
-
-	val = cJSON_GetObjectItem(item, "server_filename");
-	if (val)
-		fi->server_filename = pcs_utils_strdup(val->valuestring);
-
-	val = cJSON_GetObjectItem(item, "mtime");
-	if (val)
-		fi->server_mtime = (time_t)val->valuedouble;
-
-	val = cJSON_GetObjectItem(item, "ctime");
-	if (val)
-		fi->server_ctime = (time_t)val->valuedouble;
-
-	val = cJSON_GetObjectItem(item, "server_mtime");
-	if (val)
-		fi->server_mtime = (time_t)val->valuedouble;
-
-	val = cJSON_GetObjectItem(item, "server_ctime");
-	if (val)
-		fi->server_ctime = (time_t)val->valuedouble;
-
-	val = cJSON_GetObjectItem(item, "local_mtime");
-	if (val)
-		fi->local_mtime = (time_t)val->valuedouble;
-
-	val = cJSON_GetObjectItem(item, "local_ctime");
-	if (val)
-		fi->local_ctime = (time_t)val->valuedouble;
-
-	val = cJSON_GetObjectItem(item, "isdir");
-	if (val)
-		fi->isdir = val->valueint ? PcsTrue : PcsFalse;
-
-	val = cJSON_GetObjectItem(item, "category");
-	if (val)
-		fi->category = val->valueint;
-
-	val = cJSON_GetObjectItem(item, "size");
-	if (val)
-		fi->size = (size_t)val->valuedouble;
-
-	val = cJSON_GetObjectItem(item, "dir_empty");
-	if (val)
-		fi->dir_empty = val->valueint ? PcsTrue : PcsFalse;
-
-	val = cJSON_GetObjectItem(item, "empty");
-	if (val)
-		fi->empty = val->valueint ? PcsTrue : PcsFalse;
-
-	val = cJSON_GetObjectItem(item, "ifhassubdir");
-	if (val)
-		fi->ifhassubdir = val->valueint ? PcsTrue : PcsFalse;
-
-	val = cJSON_GetObjectItem(item, "md5");
-	if (val)
-		fi->md5 = pcs_utils_strdup(val->valuestring);
-
-	val = cJSON_GetObjectItem(item, "dlink");
-	if (val)
-		fi->dlink = pcs_utils_strdup(val->valuestring);
-
-	list = cJSON_GetObjectItem(item, "block_list");
-	if (list) {
-		int i, cnt = cJSON_GetArraySize(list);
-		if (cnt > 0) {
-			fi->block_list = (char **) pcs_malloc((cnt + 1) + sizeof(char *));
-			if (!fi->block_list) return fi;
-			memset(fi->block_list, 0, (cnt + 1) + sizeof(char *));
-			for (i = 0; i < cnt; i++) {
-				val = cJSON_GetArrayItem(list, i);
-				fi->block_list[i] = pcs_utils_strdup(val->valuestring);
-			}
-		}
-	}
-	return fi;
-}
-
 /*
 根据传入参数，执行api函数。参数传入方法，参考pcs_build_pan_api_url()函数
 action: list, search
@@ -1082,155 +977,193 @@ static PcsFileInfoList *pcs_pan_api_1(Pcs handle, const char *action, ...)
 	return filist;
 }
 
-/*根据slist字符串链表，构造成数组格式的json字符串，并把数组元素数量写入到count指定的内存中*/
-static char *pcs_build_filelist_1(Pcs handle, PcsSList *slist, int *count)
-{
-	PcsSList *item;
-	char *file_list_string;
-	size_t sz;
-	int cnt = 0;
-
-	if (count) *count = cnt;
-	if (!slist)
-		return NULL;
+/*可自动增长的字符串缓存，用于线性时间内拼接JSON字符串*/
+struct pcs_strbuf {
+	char	*data;
+	size_t	size;
+	size_t	capacity;
+};
 
-	sz = 0;
-	item = slist;
-	while(item) {
-		sz += strlen(item->string);
-		sz += 3;
-		item = item->next;
-		cnt++;
+static PcsBool pcs_strbuf_reserve(struct pcs_strbuf *buf, size_t sz)
+{
+	char *p;
+	size_t cap;
+	if (buf->size + sz + 1 <= buf->capacity)
+		return PcsTrue;
+	cap = buf->capacity ? buf->capacity : 256;
+	while (cap < buf->size + sz + 1)
+		cap <<= 1;
+	p = (char *)pcs_malloc(cap);
+	if (!p)
+		return PcsFalse;
+	if (buf->data) {
+		memcpy(p, buf->data, buf->size);
+		pcs_free(buf->data);
 	}
-	sz += 2;
-	if (count) *count = cnt;
+	buf->data = p;
+	buf->capacity = cap;
+	return PcsTrue;
+}
 
-	file_list_string = (char *) pcs_malloc(sz);
-	if (!file_list_string) {
-		pcs_set_errmsg(handle, "Can't alloc memory: size=0x%x", sz);
-		return NULL;
-	}
+static PcsBool pcs_strbuf_append(struct pcs_strbuf *buf, const char *s, size_t sz)
+{
+	if (!pcs_strbuf_reserve(buf, sz))
+		return PcsFalse;
+	memcpy(buf->data + buf->size, s, sz);
+	buf->size += sz;
+	buf->data[buf->size] = '\0';
+	return PcsTrue;
+}
 
-	strcpy(file_list_string, "[");
-	item = slist;
-	while(item) {
-		strcat(file_list_string, "\"");
-		strcat(file_list_string, item->string);
-		strcat(file_list_string, "\",");
-		item = item->next;
+/*以JSON字符串的格式追加s，包括两端的双引号。双引号、反斜杠及控制字符将被转义*/
+static PcsBool pcs_strbuf_append_json(struct pcs_strbuf *buf, const char *s)
+{
+	static const char hex[] = "0123456789abcdef";
+	const unsigned char *p = (const unsigned char *)s;
+	char *dst;
+	size_t sz = 2;
+	while (*p) {
+		if (*p == '"' || *p == '\\') sz += 2;
+		else if (*p < 0x20) sz += 6;
+		else sz++;
+		p++;
 	}
-	file_list_string[sz - 2] = ']';
-	file_list_string[sz - 1] = '\0';
-	return file_list_string;
+	if (!pcs_strbuf_reserve(buf, sz))
+		return PcsFalse;
+	dst = buf->data + buf->size;
+	*dst++ = '"';
+	for (p = (const unsigned char *)s; *p; p++) {
+		if (*p == '"' || *p == '\\') {
+			*dst++ = '\\';
+			*dst++ = (char)*p;
+		}
+		else if (*p < 0x20) {
+			*dst++ = '\\'; *dst++ = 'u'; *dst++ = '0'; *dst++ = '0';
+			*dst++ = hex[(*p >> 4) & 0xF];
+			*dst++ = hex[*p & 0xF];
+		}
+		else {
+			*dst++ = (char)*p;
+		}
+	}
+	*dst++ = '"';
+	buf->size += sz;
+	buf->data[buf->size] = '\0';
+	return PcsTrue;
 }
 
-/*根据slist字符串链表，构造成数组格式的json字符串，并把数组元素数量写入到count指定的内存中*/
-static char *pcs_build_filelist_2(Pcs handle, PcsSList2 *slist, int *count)
+/*
+根据slist字符串链表，构造成数组格式的json字符串，并把数组元素数量写入到count指定的内存中。
+最多处理max_count项，*pslist将指向下一批次的第一项
+*/
+static char *pcs_build_filelist_1(Pcs handle, PcsSList **pslist, int max_count, int *count)
 {
-	PcsSList2 *item;
-	char *file_list_string, *p;
-	size_t sz;
+	PcsSList *item = *pslist;
+	struct pcs_strbuf buf = { 0 };
+	PcsBool ok;
 	int cnt = 0;
 
 	if (count) *count = cnt;
-	if (!slist)
+	if (!item)
 		return NULL;
 
-	sz = 0;
-	item = slist;
-	while(item) {
-		sz += strlen(item->string1);
-		sz += strlen(item->string2);
-		sz += 25;
+	ok = pcs_strbuf_append(&buf, "[", 1);
+	while(ok && item && cnt < max_count) {
+		if (cnt > 0) ok = pcs_strbuf_append(&buf, ",", 1);
+		if (ok) ok = pcs_strbuf_append_json(&buf, item->string);
 		item = item->next;
 		cnt++;
 	}
-	sz += 2;
-	if (count) *count = cnt;
-
-	file_list_string = (char *) pcs_malloc(sz);
-	if (!file_list_string) {
-		pcs_set_errmsg(handle, "Can't alloc memory: size=0x%x", sz);
+	if (ok) ok = pcs_strbuf_append(&buf, "]", 1);
+	if (!ok) {
+		if (buf.data) pcs_free(buf.data);
+		pcs_set_errmsg(handle, "Can't alloc memory: size=0x%x", buf.capacity);
 		return NULL;
 	}
-
-	strcpy(file_list_string, "[");
-	p = file_list_string;
-	item = slist;
-	while(item) {
-		while(*p) p++;
-		sprintf(p, "{\"path\":\"%s\",\"newname\":\"%s\"},", item->string1, item->string2);
-		p += 25;
-		item = item->next;
-	}
-	file_list_string[sz - 2] = ']';
-	file_list_string[sz - 1] = '\0';
-
-	return file_list_string;
+	if (count) *count = cnt;
+	*pslist = item;
+	return buf.data;
 }
 
-/*根据slist字符串链表，构造成数组格式的json字符串，并把数组元素数量写入到count指定的内存中*/
-static char *pcs_build_filelist_3(Pcs handle, PcsSList2 *slist, int *count)
+/*同pcs_build_filelist_1，每项格式为{"path":string1,"newname":string2}*/
+static char *pcs_build_filelist_2(Pcs handle, PcsSList2 **pslist, int max_count, int *count)
 {
-	PcsSList2 *item;
-	char *file_list_string, *p, *dir, *filename;
-	size_t sz;
+	PcsSList2 *item = *pslist;
+	struct pcs_strbuf buf = { 0 };
+	PcsBool ok;
 	int cnt = 0;
 
 	if (count) *count = cnt;
-	if (!slist)
+	if (!item)
 		return NULL;
 
-	sz = 0;
-	item = slist;
-	while(item) {
-		sz += strlen(item->string1);
-		sz += strlen(item->string2);
-		sz += 35;
+	ok = pcs_strbuf_append(&buf, "[", 1);
+	while(ok && item && cnt < max_count) {
+		if (cnt > 0) ok = pcs_strbuf_append(&buf, ",", 1);
+		if (ok) ok = pcs_strbuf_append(&buf, "{\"path\":", 8);
+		if (ok) ok = pcs_strbuf_append_json(&buf, item->string1);
+		if (ok) ok = pcs_strbuf_append(&buf, ",\"newname\":", 11);
+		if (ok) ok = pcs_strbuf_append_json(&buf, item->string2);
+		if (ok) ok = pcs_strbuf_append(&buf, "}", 1);
 		item = item->next;
 		cnt++;
 	}
-	sz += 2;
+	if (ok) ok = pcs_strbuf_append(&buf, "]", 1);
+	if (!ok) {
+		if (buf.data) pcs_free(buf.data);
+		pcs_set_errmsg(handle, "Can't alloc memory: size=0x%x", buf.capacity);
+		return NULL;
+	}
 	if (count) *count = cnt;
+	*pslist = item;
+	return buf.data;
+}
 
-	file_list_string = (char *) pcs_malloc(sz);
-	if (!file_list_string) {
-		pcs_set_errmsg(handle, "Can't alloc memory: size=0x%x", sz);
+/*同pcs_build_filelist_1，每项格式为{"path":string1,"dest":basedir(string2),"newname":filename(string2)}*/
+static char *pcs_build_filelist_3(Pcs handle, PcsSList2 **pslist, int max_count, int *count)
+{
+	PcsSList2 *item = *pslist;
+	struct pcs_strbuf buf = { 0 };
+	char *dir, *filename;
+	PcsBool ok;
+	int cnt = 0;
+
+	if (count) *count = cnt;
+	if (!item)
 		return NULL;
-	}
-	memset(file_list_string, 0, sz);
-	strcpy(file_list_string, "[");
-	p = file_list_string;
-	item = slist;
-	while(item) {
-		while(*p) p++;
+
+	ok = pcs_strbuf_append(&buf, "[", 1);
+	while(ok && item && cnt < max_count) {
 		dir = pcs_utils_basedir(item->string2);
 		filename = pcs_utils_filename(item->string2);
 		if (!dir || !filename) {
-			pcs_free(file_list_string);
-			pcs_set_errmsg(handle, "Can't alloc memory: size=0x%x", sz);
-			return NULL;
+			if (dir) pcs_free(dir);
+			if (filename) pcs_free(filename);
+			ok = PcsFalse;
+			break;
 		}
-		sprintf(p, "{\"path\":\"%s\",\"dest\":\"%s\",\"newname\":\"%s\"},", 
-			item->string1, dir, filename);
+		if (cnt > 0) ok = pcs_strbuf_append(&buf, ",", 1);
+		if (ok) ok = pcs_strbuf_append(&buf, "{\"path\":", 8);
+		if (ok) ok = pcs_strbuf_append_json(&buf, item->string1);
+		if (ok) ok = pcs_strbuf_append(&buf, ",\"dest\":", 8);
+		if (ok) ok = pcs_strbuf_append_json(&buf, dir);
+		if (ok) ok = pcs_strbuf_append(&buf, ",\"newname\":", 11);
+		if (ok) ok = pcs_strbuf_append_json(&buf, filename);
+		if (ok) ok = pcs_strbuf_append(&buf, "}", 1);
 		pcs_free(dir);
 		pcs_free(filename);
-		p += 35;
 		item = item->next;
+		cnt++;
 	}
-	p = file_list_string + sz - 1;
-	while (p > file_list_string) {
-		if (*p == ',')
-			break;
-		p--;
-	}
-	if (*p == ',') {
-		*p = ']';
-		p++;
-		*p = '\0';
+	if (ok) ok = pcs_strbuf_append(&buf, "]", 1);
+	if (!ok) {
+		if (buf.data) pcs_free(buf.data);
+		pcs_set_errmsg(handle, "Can't alloc memory: size=0x%x", buf.capacity);
+		return NULL;
 	}
-
-	return file_list_string;
+	if (count) *count = cnt;
+	*pslist = item;
+	return buf.data;
 }
 
 /*
@@ -1271,8 +1204,8 @@ static PcsPanApiRes *pcs_pan_api_filemanager(Pcs handle, const char *opera, cons
 	pcs_free(postdata);
 	if (!html) {
 		errmsg = pcs_http_strerror(pcs->http);
-		if (!errmsg)
-			pcs_set_errmsg(handle, errmsg);
+		if (errmsg)
+			pcs_set_errmsg(handle, "%s", errmsg);
 		else
 			pcs_set_errmsg(handle, "Can't get response from the remote server.");
 		return NULL;
@@ -1387,6 +1320,282 @@ static PcsPanApiRes *pcs_pan_api_filemanager(Pcs handle, const char *opera, cons
 	return res;
 }
 
+/*批量文件操作中的一个批次*/
+struct pcs_fm_batch {
+	char			*filelist;
+	int				file_count;
+	PcsPanApiRes	*res;
+	char			*errmsg;
+};
+
+#ifndef WIN32
+/*并发执行批次时，多个线程共享的状态*/
+struct pcs_fm_batch_state {
+	const char			*opera;
+	struct pcs_fm_batch	*batches;
+	int					batch_count;
+	int					next;
+	pthread_mutex_t		mutex;
+};
+
+/*工作线程，worker.http在创建线程前由调用线程复制*/
+struct pcs_fm_batch_worker {
+	struct pcs_fm_batch_state	*state;
+	struct pcs					worker;
+	pthread_t					thread;
+};
+
+/*工作线程：使用独立的PcsHttp对象，依次领取未执行的批次并执行*/
+static void *pcs_fm_batch_thread(void *arg)
+{
+	struct pcs_fm_batch_worker *w = (struct pcs_fm_batch_worker *)arg;
+	struct pcs_fm_batch_state *state = w->state;
+	struct pcs_fm_batch *batch;
+	int i;
+
+	while (1) {
+		pthread_mutex_lock(&state->mutex);
+		i = state->next++;
+		pthread_mutex_unlock(&state->mutex);
+		if (i >= state->batch_count)
+			break;
+		batch = &state->batches[i];
+		batch->res = pcs_pan_api_filemanager(&w->worker, state->opera, batch->filelist, batch->file_count);
+		batch->errmsg = w->worker.errmsg;
+		w->worker.errmsg = NULL;
+	}
+	return NULL;
+}
+#endif
+
+/*
+为请求失败的批次构造结果：filelist中的每一项生成一个错误码为PCS_PAN_API_ERR_REQUEST的项。
+filelist的每一项为路径字符串，或者包含path字段的对象。返回链表的尾部，失败时返回NULL。
+*/
+static PcsPanApiResInfoList *pcs_fm_batch_failed_items(const char *filelist, PcsPanApiResInfoList **head)
+{
+	cJSON *json, *item, *val;
+	PcsPanApiResInfoList *ri, *tail = NULL;
+	int cnt, i;
+
+	*head = NULL;
+	json = cJSON_Parse(filelist);
+	if (!json)
+		return NULL;
+	cnt = cJSON_GetArraySize(json);
+	for (i = 0; i < cnt; i++) {
+		item = cJSON_GetArrayItem(json, i);
+		val = item->type == cJSON_String ? item : cJSON_GetObjectItem(item, "path");
+		ri = pcs_pan_api_res_infolist_create();
+		if (!ri)
+			break;
+		if (val && val->valuestring)
+			ri->info.path = pcs_utils_strdup(val->valuestring);
+		ri->info.error = PCS_PAN_API_ERR_REQUEST;
+		if (tail) tail->next = ri;
+		else *head = ri;
+		tail = ri;
+	}
+	cJSON_Delete(json);
+	return tail;
+}
+
+/*
+执行所有批次，并按输入顺序合并结果。
+当批次数量大于1时，最多使用pcs->fm_threads个线程并发提交。
+部分批次失败时，仍返回合并后的结果，失败批次中的每一项的错误码为PCS_PAN_API_ERR_REQUEST，
+res->error不为0，错误消息为第一个失败批次的错误消息。所有批次都失败时返回NULL。
+*/
+static PcsPanApiRes *pcs_pan_api_filemanager_batches(Pcs handle, const char *opera, struct pcs_fm_batch *batches, int batch_count)
+{
+	struct pcs *pcs = (struct pcs *)handle;
+	PcsPanApiRes *res = NULL;
+	PcsPanApiResInfoList *tail = NULL;
+	const char *errmsg = NULL;
+	PcsBool succ = PcsFalse;
+	int i;
+
+	if (batch_count == 1)
+		return pcs_pan_api_filemanager(handle, opera, batches[0].filelist, batches[0].file_count);
+
+#ifndef WIN32
+	if (pcs->fm_threads > 1) {
+		struct pcs_fm_batch_state state;
+		struct pcs_fm_batch_worker *workers;
+		int thread_count = pcs->fm_threads < batch_count ? pcs->fm_threads : batch_count,
+			started = 0;
+		state.opera = opera;
+		state.batches = batches;
+		state.batch_count = batch_count;
+		state.next = 0;
+		pthread_mutex_init(&state.mutex, NULL);
+		workers = (struct pcs_fm_batch_worker *)pcs_malloc(sizeof(struct pcs_fm_batch_worker) * thread_count);
+		if (workers) {
+			/*PcsHttp需在使用它的线程中复制，所以在创建线程前复制好所有工作线程的对象*/
+			for (i = 0; i < thread_count; i++) {
+				workers[started].state = &state;
+				memcpy(&workers[started].worker, pcs, sizeof(struct pcs));
+				workers[started].worker.errmsg = NULL;
+				workers[started].worker.http = pcs_http_clone(pcs->http);
+				if (!workers[started].worker.http)
+					continue;
+				if (pthread_create(&workers[started].thread, NULL, &pcs_fm_batch_thread, &workers[started])) {
+					pcs_http_destroy(workers[started].worker.http);
+					continue;
+				}
+				started++;
+			}
+			for (i = 0; i < started; i++) {
+				pthread_join(workers[i].thread, NULL);
+				pcs_http_destroy(workers[i].worker.http);
+			}
+			pcs_free(workers);
+		}
+		pthread_mutex_destroy(&state.mutex);
+		/*线程创建失败时，剩余的批次在当前线程中执行*/
+		for (i = state.next; i < batch_count; i++) {
+			batches[i].res = pcs_pan_api_filemanager(handle, opera, batches[i].filelist, batches[i].file_count);
+			batches[i].errmsg = pcs->errmsg;
+			pcs->errmsg = NULL;
+		}
+	}
+	else
+#endif
+	{
+		for (i = 0; i < batch_count; i++) {
+			batches[i].res = pcs_pan_api_filemanager(handle, opera, batches[i].filelist, batches[i].file_count);
+			batches[i].errmsg = pcs->errmsg;
+			pcs->errmsg = NULL;
+		}
+	}
+
+	for (i = 0; i < batch_count; i++) {
+		if (batches[i].res)
+			succ = PcsTrue;
+		if (!errmsg) {
+			if (batches[i].errmsg)
+				errmsg = batches[i].errmsg;
+			else if (!batches[i].res)
+				errmsg = "Can't get response from the remote server.";
+		}
+	}
+	if (errmsg)
+		pcs_set_errmsg(handle, "%s", errmsg);
+	if (succ) {
+		res = pcs_pan_api_res_create();
+		if (!res) {
+			pcs_set_errmsg(handle, "Can't create the object: PcsPanApiRes");
+			succ = PcsFalse;
+		}
+	}
+	for (i = 0; succ && i < batch_count; i++) {
+		PcsPanApiResInfoList *head, *last;
+		if (batches[i].res) {
+			if (!res->error)
+				res->error = batches[i].res->error;
+			head = batches[i].res->info_list;
+			batches[i].res->info_list = NULL;
+			last = head;
+			while (last && last->next) last = last->next;
+		}
+		else {
+			/*该批次的请求失败，其中的文件是否已被处理未知*/
+			res->error = PCS_PAN_API_ERR_REQUEST;
+			last = pcs_fm_batch_failed_items(batches[i].filelist, &head);
+		}
+		if (head) {
+			if (tail) tail->next = head;
+			else res->info_list = head;
+			tail = last;
+		}
+	}
+	for (i = 0; i < batch_count; i++) {
+		if (batches[i].res) {
+			pcs_pan_api_res_destroy(batches[i].res);
+			batches[i].res = NULL;
+		}
+		if (batches[i].errmsg) {
+			pcs_free(batches[i].errmsg);
+			batches[i].errmsg = NULL;
+		}
+	}
+	return res;
+}
+
+/*释放批次数组*/
+static void pcs_fm_batches_destroy(struct pcs_fm_batch *batches, int batch_count)
+{
+	int i;
+	for (i = 0; i < batch_count; i++) {
+		if (batches[i].filelist)
+			pcs_free(batches[i].filelist);
+	}
+	pcs_free(batches);
+}
+
+/*根据slist构造批次数组，每个批次最多包含pcs->fm_batch_size个文件*/
+static struct pcs_fm_batch *pcs_fm_batches_1(Pcs handle, PcsSList *slist, int *batch_count)
+{
+	struct pcs *pcs = (struct pcs *)handle;
+	struct pcs_fm_batch *batches;
+	PcsSList *item = slist;
+	int cnt = 0, n, i;
+
+	while (item) {
+		cnt++;
+		item = item->next;
+	}
+	n = (cnt + pcs->fm_batch_size - 1) / pcs->fm_batch_size;
+	batches = (struct pcs_fm_batch *)pcs_malloc(sizeof(struct pcs_fm_batch) * n);
+	if (!batches) {
+		pcs_set_errmsg(handle, "Can't alloc memory: size=0x%x", sizeof(struct pcs_fm_batch) * n);
+		return NULL;
+	}
+	memset(batches, 0, sizeof(struct pcs_fm_batch) * n);
+	item = slist;
+	for (i = 0; i < n; i++) {
+		batches[i].filelist = pcs_build_filelist_1(handle, &item, pcs->fm_batch_size, &batches[i].file_count);
+		if (!batches[i].filelist) {
+			pcs_fm_batches_destroy(batches, i);
+			return NULL;
+		}
+	}
+	*batch_count = n;
+	return batches;
+}
+
+/*同pcs_fm_batches_1，build为pcs_build_filelist_2或pcs_build_filelist_3*/
+static struct pcs_fm_batch *pcs_fm_batches_2(Pcs handle, PcsSList2 *slist, int *batch_count,
+	char *(*build)(Pcs handle, PcsSList2 **pslist, int max_count, int *count))
+{
+	struct pcs *pcs = (struct pcs *)handle;
+	struct pcs_fm_batch *batches;
+	PcsSList2 *item = slist;
+	int cnt = 0, n, i;
+
+	while (item) {
+		cnt++;
+		item = item->next;
+	}
+	n = (cnt + pcs->fm_batch_size - 1) / pcs->fm_batch_size;
+	batches = (struct pcs_fm_batch *)pcs_malloc(sizeof(struct pcs_fm_batch) * n);
+	if (!batches) {
+		pcs_set_errmsg(handle, "Can't alloc memory: size=0x%x", sizeof(struct pcs_fm_batch) * n);
+		return NULL;
+	}
+	memset(batches, 0, sizeof(struct pcs_fm_batch) * n);
+	item = slist;
+	for (i = 0; i < n; i++) {
+		batches[i].filelist = (*build)(handle, &item, pcs->fm_batch_size, &batches[i].file_count);
+		if (!batches[i].filelist) {
+			pcs_fm_batches_destroy(batches, i);
+			return NULL;
+		}
+	}
+	*batch_count = n;
+	return batches;
+}
+
 static int pcs_get_errno_from_api_res(Pcs handle, const char *html)
 {
 	int res;
@@ -1482,6 +1691,8 @@ PCS_API Pcs pcs_create(const char *cookie_file)
 	if (!pcs)
 		return NULL;
 	memset(pcs, 0, sizeof(struct pcs));
+	pcs->fm_batch_size = PCS_FM_BATCH_SIZE;
+	pcs->fm_threads = PCS_FM_THREADS;
 	pcs->http = pcs_http_create(cookie_file);
 	if (!pcs->http) {
 		pcs_free(pcs);
@@ -1490,6 +1701,35 @@ PCS_API Pcs pcs_create(const char *cookie_file)
 	return pcs;
 }
 
+PCS_API Pcs pcs_clone(Pcs handle)
+{
+	struct pcs *src = (struct pcs *)handle;
+	struct pcs *pcs;
+
+	pcs = (struct pcs *) pcs_malloc(sizeof(struct pcs));
+	if (!pcs)
+		return NULL;
+	memset(pcs, 0, sizeof(struct pcs));
+	pcs->http = pcs_http_clone(src->http);
+	if (!pcs->http) {
+		pcs_free(pcs);
+		return NULL;
+	}
+	if (src->username) pcs->username = pcs_utils_strdup(src->username);
+	if (src->password) pcs->password = pcs_utils_strdup(src->password);
+	if (src->bdstoken) pcs->bdstoken = pcs_utils_strdup(src->bdstoken);
+	if (src->bduss) pcs->bduss = pcs_utils_strdup(src->bduss);
+	if (src->sysUID) pcs->sysUID = pcs_utils_strdup(src->sysUID);
+	if (src->secure_key) pcs->secure_key = pcs_utils_strdup(src->secure_key);
+	pcs->secure_method = src->secure_method;
+	pcs->secure_enable = src->secure_enable;
+	pcs->captcha_func = src->captcha_func;
+	pcs->captcha_data = src->captcha_data;
+	pcs->fm_batch_size = src->fm_batch_size;
+	pcs->fm_threads = src->fm_threads;
+	return pcs;
+}
+
 PCS_API void pcs_destroy(Pcs handle)
 {
 	struct pcs *pcs = (struct pcs *)handle;
@@ -1592,6 +1832,30 @@ PCS_API PcsRes pcs_setopt(Pcs handle, PcsOption opt, void *value)
 	case PCS_OPTION_CONNECTTIMEOUT:
 		pcs_http_setopt(pcs->http, PCS_HTTP_OPTION_CONNECTTIMEOUT, value);
 		break;
+	case PCS_OPTION_FILEMANAGER_BATCH_SIZE:
+		pcs->fm_batch_size = (int)((long)value);
+		if (pcs->fm_batch_size < 1) pcs->fm_batch_size = 1;
+		if (pcs->fm_batch_size > PCS_FM_BATCH_SIZE) pcs->fm_batch_size = PCS_FM_BATCH_SIZE;
+		break;
+	case PCS_OPTION_FILEMANAGER_THREADS:
+		pcs->fm_threads = (int)((long)value);
+		if (pcs->fm_threads < 1) pcs->fm_threads = 1;
+		break;
+	case PCS_OPTION_RETRY_MAX:
+		pcs_http_setopt(pcs->http, PCS_HTTP_OPTION_RETRY_MAX, value);
+		break;
+	case PCS_OPTION_RETRY_DELAY:
+		pcs_http_setopt(pcs->http, PCS_HTTP_OPTION_RETRY_DELAY, value);
+		break;
+	case PCS_OPTION_RETRY_MAX_DELAY:
+		pcs_http_setopt(pcs->http, PCS_HTTP_OPTION_RETRY_MAX_DELAY, value);
+		break;
+	case PCS_OPTION_BREAKER_THRESHOLD:
+		pcs_http_setopt(pcs->http, PCS_HTTP_OPTION_BREAKER_THRESHOLD, value);
+		break;
+	case PCS_OPTION_BREAKER_COOLDOWN:
+		pcs_http_setopt(pcs->http, PCS_HTTP_OPTION_BREAKER_COOLDOWN, value);
+		break;
 	}
 	return res;
 }
@@ -2052,77 +2316,77 @@ PCS_API PcsFileInfo *pcs_meta(Pcs handle, const char *path)
 
 PCS_API PcsPanApiRes *pcs_delete(Pcs handle, PcsSList *slist)
 {
-	char *filelist;
+	struct pcs_fm_batch *batches;
 	PcsPanApiRes *res;
-	int file_count;
+	int batch_count;
 	pcs_clear_errmsg(handle);
 	if (!slist) {
 		pcs_set_errmsg(handle, "Wrong Arguments: No File");
 		return NULL;
 	}
-	filelist = pcs_build_filelist_1(handle, slist, &file_count);
-	if (!filelist) {
+	batches = pcs_fm_batches_1(handle, slist, &batch_count);
+	if (!batches) {
 		return NULL;
 	}
-	res = pcs_pan_api_filemanager(handle, "delete", filelist, file_count);
-	pcs_free(filelist);
+	res = pcs_pan_api_filemanager_batches(handle, "delete", batches, batch_count);
+	pcs_fm_batches_destroy(batches, batch_count);
 	return res;
 }
 
 PCS_API PcsPanApiRes *pcs_rename(Pcs handle, PcsSList2 *slist)
 {
-	char *filelist;
+	struct pcs_fm_batch *batches;
 	PcsPanApiRes *res;
-	int file_count;
+	int batch_count;
 	pcs_clear_errmsg(handle);
 	if (!slist) {
 		pcs_set_errmsg(handle, "Wrong Arguments: No File");
 		return NULL;
 	}
-	filelist = pcs_build_filelist_2(handle, slist, &file_count);
-	if (!filelist) {
+	batches = pcs_fm_batches_2(handle, slist, &batch_count, &pcs_build_filelist_2);
+	if (!batches) {
 		return NULL;
 	}
-	res = pcs_pan_api_filemanager(handle, "rename", filelist, file_count);
-	pcs_free(filelist);
+	res = pcs_pan_api_filemanager_batches(handle, "rename", batches, batch_count);
+	pcs_fm_batches_destroy(batches, batch_count);
 	return res;
 }
 
 PCS_API PcsPanApiRes *pcs_move(Pcs handle, PcsSList2 *slist)
 {
-	char *filelist;
+	struct pcs_fm_batch *batches;
 	PcsPanApiRes *res;
-	int file_count;
+	int batch_count;
 	pcs_clear_errmsg(handle);
 	if (!slist) {
 		pcs_set_errmsg(handle, "Wrong Arguments: No File");
 		return NULL;
 	}
-	filelist = pcs_build_filelist_3(handle, slist, &file_count);
-	if (!filelist) {
+	batches = pcs_fm_batches_2(handle, slist, &batch_count, &pcs_build_filelist_3);
+	if (!batches) {
 		return NULL;
 	}
-	res = pcs_pan_api_filemanager(handle, "move", filelist, file_count);
-	pcs_free(filelist);
+	res = pcs_pan_api_filemanager_batches(handle, "move", batches, batch_count);
+	pcs_fm_batches_destroy(batches, batch_count);
 	return res;
 }
 
 PCS_API PcsPanApiRes *pcs_copy(Pcs handle, PcsSList2 *slist)
 {
-	char *filelist;
+	struct pcs_fm_batch *batches;
 	PcsPanApiRes *res;
-	int file_count;
+	int batch_count;
 	pcs_clear_errmsg(handle);
 	if (!slist) {
 		pcs_set_errmsg(handle, "Wrong Arguments: No File");
 		return NULL;
 	}
-	filelist = pcs_build_filelist_3(handle, slist, &file_count);
-	if (!filelist) {
+	batches = pcs_fm_batches_2(handle, slist, &batch_count, &pcs_build_filelist_3);
+	if (!batches) {
 		return NULL;
 	}
-	res = pcs_pan_api_filemanager(handle, "copy", filelist, file_count);
-	pcs_free(filelist);
+	res = pcs_pan_api_filemanager_batches(handle, "copy", batches, batch_count);
+	pcs_fm_batches_destroy(batches, batch_count);
 	return res;
 }
 
@@ -2144,7 +2408,7 @@ static struct PcsAesState *createPcsAesState(Pcs handle, int bits, int mod, int
 {
 	struct pcs *pcs = (struct pcs *)handle;
 	struct PcsAesState *state = NULL;
-	const char *key;
+	unsigned char key[PCS_MD5_SIZE];
 	int rc;
 	if (!pcs->secure_key || !pcs->secure_key[0]) {
 		pcs_set_errmsg(handle, "The key is not specify.");
@@ -2164,7 +2428,7 @@ static struct PcsAesState *createPcsAesState(Pcs handle, int bits, int mod, int
 	state->head.bits = bits;
 	state->head.polish = polish;
 	state->mod = mod;
-	key = md5_string_raw(pcs->secure_key);
+	md5_string_raw_r(pcs->secure_key, key);
 	memcpy(state->key, key, AES_BLOCK_SIZE);
 	switch (mod)
 	{
@@ -2435,7 +2699,8 @@ static PcsRes pcs_download_secure(Pcs handle, const char *path, PcsHttpWriteFunc
 	return PCS_FAIL;
 }
 
-static PcsRes pcs_download_normal(Pcs handle, const char *path, PcsHttpWriteFunction write, void *write_state)
+/*length 大于0时只下载从 offset 开始的 length 个字节*/
+static PcsRes pcs_download_normal(Pcs handle, const char *path, Int64 offset, Int64 length, PcsHttpWriteFunction write, void *write_state)
 {
 	struct pcs *pcs = (struct pcs *)handle;
 	char *url;
@@ -2459,7 +2724,7 @@ static PcsRes pcs_download_normal(Pcs handle, const char *path, PcsHttpWriteFunc
 		pcs_set_errmsg(handle, "Can't build the url.");
 		return PCS_BUILD_URL;
 	}
-	if (pcs_http_get_download(pcs->http, url, PcsTrue)) {
+	if (pcs_http_get_download_range(pcs->http, url, PcsTrue, offset, length)) {
 		pcs_free(url);
 		return PCS_OK;
 	}
@@ -2478,7 +2743,24 @@ PCS_API PcsRes pcs_download(Pcs handle, const char *path)
 	if (pcs->secure_enable)
 		return pcs_download_secure(handle, path, pcs->download_func, pcs->download_data);
 	else
-		return pcs_download_normal(handle, path, pcs->download_func, pcs->download_data);
+		return pcs_download_normal(handle, path, 0, 0, pcs->download_func, pcs->download_data);
+}
+
+PCS_API PcsRes pcs_download_range(Pcs handle, const char *path, Int64 offset, Int64 length)
+{
+	struct pcs *pcs = (struct pcs *)handle;
+	if (pcs->secure_enable) {
+		/*加密的文件需要整个下载后才能解密*/
+		pcs_clear_errmsg(handle);
+		pcs_set_errmsg(handle, "Can't download a range of the file when the secure is enabled.");
+		return PCS_FAIL;
+	}
+	if (offset < 0 || length <= 0) {
+		pcs_clear_errmsg(handle);
+		pcs_set_errmsg(handle, "Wrong range.");
+		return PCS_FAIL;
+	}
+	return pcs_download_normal(handle, path, offset, length, pcs->download_func, pcs->download_data);
 }
 
 static size_t pcs_cat_write_func(char *ptr, size_t size, size_t contentlength, void *userdata)
@@ -2516,7 +2798,7 @@ PCS_API const char *pcs_cat(Pcs handle, const char *path, size_t *dstsz)
 		rc = pcs_download_secure(handle, path, &pcs_cat_write_func, pcs);
 	}
 	else {
-		rc = pcs_download_normal(handle, path, &pcs_cat_write_func, pcs);
+		rc = pcs_download_normal(handle, path, 0, 0, &pcs_cat_write_func, pcs);
 	}
 	if (rc != PCS_OK) {
 		return NULL;
@@ -2747,3 +3029,21 @@ PCS_API const char *pcs_req_rawdata(Pcs handle, int *size, const char **encode)
 	struct pcs *pcs = (struct pcs *)handle;
 	return pcs_http_rawdata(pcs->http, size, encode);
 }
+
+PCS_API PcsRes pcs_getstats(Pcs handle, PcsHttpStats *stats)
+{
+	struct pcs *pcs = (struct pcs *)handle;
+	pcs_http_getstats(pcs->http, stats);
+	return PCS_OK;
+}
+
+PCS_API Int64 pcs_transferred(Pcs handle)
+{
+	struct pcs *pcs = (struct pcs *)handle;
+	return pcs_http_transferred(pcs->http);
+}
+
+PCS_API void pcs_set_rate_limit(Int64 upload, Int64 download)
+{
+	pcs_http_set_rate_limit(upload, download);
+}
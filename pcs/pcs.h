@@ -8,6 +8,7 @@
 #include "pcs_http.h"
 #include "pcs_slist.h"
 #include "pcs_utils.h"
+#include "pcs_trace.h"
 
 #define PCS_API_VERSION "v1.0.8"
 
@@ -55,6 +56,20 @@ typedef enum PcsOption {
 	PCS_OPTION_TIMEOUT,
 	/*设置连接前的等待时间，值为long类型*/
 	PCS_OPTION_CONNECTTIMEOUT,
+	/*设置批量文件操作（删除、重命名、移动、复制）时，每次请求最多包含的文件数量，值为long类型，默认100*/
+	PCS_OPTION_FILEMANAGER_BATCH_SIZE,
+	/*设置批量文件操作时，同时发送请求的最大数量，值为long类型，默认4*/
+	PCS_OPTION_FILEMANAGER_THREADS,
+	/*设置请求失败后最多重试的次数，值为long类型，默认3。设置为0时不重试。重试的条件见pcs_http.h*/
+	PCS_OPTION_RETRY_MAX,
+	/*设置第一次重试前的等待时间（毫秒），之后每次重试翻倍，值为long类型，默认500*/
+	PCS_OPTION_RETRY_DELAY,
+	/*设置重试前最长的等待时间（毫秒），值为long类型，默认30000*/
+	PCS_OPTION_RETRY_MAX_DELAY,
+	/*设置同一主机连续多少个请求失败（重试用完后仍然失败）后熔断，值为long类型，默认5。设置为0时不熔断*/
+	PCS_OPTION_BREAKER_THRESHOLD,
+	/*设置熔断的时间（秒），值为long类型，默认30*/
+	PCS_OPTION_BREAKER_COOLDOWN,
 
 
 } PcsOption;
@@ -111,6 +126,15 @@ PCS_API const char *pcs_version();
 */
 PCS_API Pcs pcs_create(const char *cookie_file);
 
+/*
+ * 复制Pcs，用于在多个线程中并行上传、下载。
+ * 新的Pcs复制handle的登录信息（bdstoken, BDUSS, UID）和加密设置，与handle共享同一个Cookie存储，
+ * 但拥有独立的HTTP连接和错误消息，无需重新登录。
+ * 需在使用handle的线程中调用，之后两个对象可分别在不同线程中使用。
+ * 成功后返回新的handle，否则返回NULL。使用完成后需调用pcs_destroy()释放
+*/
+PCS_API Pcs pcs_clone(Pcs handle);
+
 /*
  * 释放Pcs对象
 */
@@ -303,6 +327,16 @@ PCS_API const char *pcs_cat(Pcs handle, const char *path, size_t *dstsz);
  */
 PCS_API PcsRes pcs_download(Pcs handle, const char *path);
 
+/*
+ * 下载文件中的一段
+ *   path   待下载的文件，地址需写全，如/temp/file.txt
+ *   offset 开始位置
+ *   length 字节数，必须大于0
+ * 写入函数与 pcs_download() 相同，contentlength 参数为 length。启用加密时不支持。
+ * 成功后返回PCS_OK，失败则返回错误编号
+ */
+PCS_API PcsRes pcs_download_range(Pcs handle, const char *path, Int64 offset, Int64 length);
+
 /*
  * 把内存中的字节序上传到网盘
  *   path		目标文件，地址需写全，如/temp/file.txt
@@ -345,4 +379,23 @@ PCS_API char *pcs_cookie_data(Pcs handle);
 */
 PCS_API const char *pcs_req_rawdata(Pcs handle, int *size, const char **encode);
 
+/*
+* 获取HTTP请求的统计：每类接口的请求数、错误数、各阶段耗时、流量和耗时直方图，以及最近的请求明细。
+* 通过pcs_clone()复制的对象和原对象共用同一份统计。
+* @stats 用于接收统计数据
+*/
+PCS_API PcsRes pcs_getstats(Pcs handle, PcsHttpStats *stats);
+
+/*
+* 返回该对象累计上传和下载的字节数，包括正在进行的传输已经完成的部分，可在任一线程中调用。
+* 通过pcs_clone()复制的对象从0开始计数。
+*/
+PCS_API Int64 pcs_transferred(Pcs handle);
+
+/*
+* 设置进程内所有Pcs对象共用的限速，单位为字节/秒，0表示不限速。
+* 上传和下载分别限速，同时进行的传输共用同一份带宽。修改后正在进行的传输也按新的限速执行。
+*/
+PCS_API void pcs_set_rate_limit(Int64 upload, Int64 download);
+
 #endif
@@ -4,6 +4,7 @@
 
 #include "pcs_mem.h"
 #include "pcs_utils.h"
+#include "cJSON.h"
 #include "pcs_fileinfo.h"
 
 PCS_API PcsFileInfo *pcs_fileinfo_create()
@@ -72,6 +73,117 @@ PCS_API PcsFileInfo *pcs_fileinfo_clone(PcsFileInfo *fi)
 	return res;
 }
 
+/*转换JSON对象为PcsFileInfo对象。
+JSON对象格式为：
+{
+	"fs_id": 123,
+	"path": "/a/b",
+	"server_filename": "b",
+	"mtime": 1899383,
+	"ctime": 1899383,
+	"server_mtime": 1899383,
+	"server_ctime": 1899383,
+	"local_mtime": 1899383,
+	"local_ctime": 1899383,
+	"isdir": 1,
+	"category": 1,
+	"size": 0,
+	"dir_empty": 0,
+	"empty": 0,
+	"ifhassubdir": 0,
+	"md5": "",
+	"dlink": "",
+	"block_list": [ "/a/b/1", "a/b/2" ]
+}
+*/
+PCS_API PcsFileInfo *pcs_parse_fileinfo(cJSON *item)
+{
+	cJSON *val, *list;
+	PcsFileInfo *fi = pcs_fileinfo_create();
+	val = cJSON_GetObjectItem(item, "fs_id");
+	if ((val = cJSON_GetObjectItem(item, "fs_id")))
+		fi->fs_id = (UInt64)val->valuedouble;
+
+	val = cJSON_GetObjectItem(item, "path");
+	if (val)
+		fi->path = pcs_utils_strdup(val->valuestring);
+
+	val = cJSON_GetObjectItem(item, "server_filename");
+	if (val)
+		fi->server_filename = pcs_utils_strdup(val->valuestring);
+
+	val = cJSON_GetObjectItem(item, "mtime");
+	if (val)
+		fi->server_mtime = (time_t)val->valuedouble;
+
+	val = cJSON_GetObjectItem(item, "ctime");
+	if (val)
+		fi->server_ctime = (time_t)val->valuedouble;
+
+	val = cJSON_GetObjectItem(item, "server_mtime");
+	if (val)
+		fi->server_mtime = (time_t)val->valuedouble;
+
+	val = cJSON_GetObjectItem(item, "server_ctime");
+	if (val)
+		fi->server_ctime = (time_t)val->valuedouble;
+
+	val = cJSON_GetObjectItem(item, "local_mtime");
+	if (val)
+		fi->local_mtime = (time_t)val->valuedouble;
+
+	val = cJSON_GetObjectItem(item, "local_ctime");
+	if (val)
+		fi->local_ctime = (time_t)val->valuedouble;
+
+	val = cJSON_GetObjectItem(item, "isdir");
+	if (val)
+		fi->isdir = val->valueint ? PcsTrue : PcsFalse;
+
+	val = cJSON_GetObjectItem(item, "category");
+	if (val)
+		fi->category = val->valueint;
+
+	val = cJSON_GetObjectItem(item, "size");
+	if (val)
+		fi->size = (size_t)val->valuedouble;
+
+	val = cJSON_GetObjectItem(item, "dir_empty");
+	if (val)
+		fi->dir_empty = val->valueint ? PcsTrue : PcsFalse;
+
+	val = cJSON_GetObjectItem(item, "empty");
+	if (val)
+		fi->empty = val->valueint ? PcsTrue : PcsFalse;
+
+	val = cJSON_GetObjectItem(item, "ifhassubdir");
+	if (val)
+		fi->ifhassubdir = val->valueint ? PcsTrue : PcsFalse;
+
+	val = cJSON_GetObjectItem(item, "md5");
+	if (val)
+		fi->md5 = pcs_utils_strdup(val->valuestring);
+
+	val = cJSON_GetObjectItem(item, "dlink");
+	if (val)
+		fi->dlink = pcs_utils_strdup(val->valuestring);
+
+	list = cJSON_GetObjectItem(item, "block_list");
+	if (list) {
+		int i, cnt = cJSON_GetArraySize(list);
+		if (cnt > 0) {
+			fi->block_list = (char **) pcs_malloc((cnt + 1) * sizeof(char *));
+			if (!fi->block_list) return fi;
+			memset(fi->block_list, 0, (cnt + 1) * sizeof(char *));
+			for (i = 0; i < cnt; i++) {
+				val = cJSON_GetArrayItem(list, i);
+				fi->block_list[i] = pcs_utils_strdup(val->valuestring);
+			}
+		}
+	}
+	return fi;
+}
+
 
 PCS_API PcsFileInfoListItem *pcs_filistitem_create()
 {
@@ -51,6 +51,9 @@ PCS_API PcsFileInfo *pcs_fileinfo_create();
 PCS_API void pcs_fileinfo_destroy(PcsFileInfo *fi);
 /*复制一份PcsFileInfo。注意是深克隆。*/
 PCS_API PcsFileInfo *pcs_fileinfo_clone(PcsFileInfo *fi);
+struct cJSON;
+/*转换网盘接口返回的JSON对象为PcsFileInfo对象，JSON对象的格式见 pcs_fileinfo.c*/
+PCS_API PcsFileInfo *pcs_parse_fileinfo(struct cJSON *item);
 
 PCS_API PcsFileInfoListItem *pcs_filistitem_create();
 PCS_API void pcs_filistitem_destroy(PcsFileInfoListItem *item);
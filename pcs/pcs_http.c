@@ -1,13 +1,19 @@
-﻿#include <string.h>
+﻿#include <stdio.h>
+#include <string.h>
+#include <time.h>
 #ifdef WIN32
 # include <malloc.h>
+# include <windows.h>
 #else
 # include <alloca.h>
+# include <pthread.h>
+# include <unistd.h>
 #endif
 
 #include "pcs_mem.h"
 #include "pcs_utils.h"
 #include "pcs_http.h"
+#include "pcs_trace.h"
 
 #define USAGE "Mozilla/5.0 (Windows NT 6.3; WOW64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/35.0.1916.153 Safari/537.36"
 
@@ -24,11 +30,33 @@
 #define PCS_HTTP_RES_TYPE_RAW			4
 #define PCS_HTTP_RES_TYPE_DOWNLOAD		6
 
+/*服务器暂时不可用的状态码，可以重试*/
+#define PCS_HTTP_IS_TRANSIENT_CODE(code) ((code) >= 500 || (code) == 429)
+
+/*请求结果的分类，决定是否重试以及是否计入熔断*/
+#define PCS_HTTP_RESULT_OK			0 /*收到了响应*/
+#define PCS_HTTP_RESULT_UNSENT		1 /*请求没有发送出去：无法解析域名或无法建立连接*/
+#define PCS_HTTP_RESULT_TRANSIENT	2 /*网络中断、超时，或者服务器返回5xx、429*/
+#define PCS_HTTP_RESULT_FATAL		3 /*其他错误，例如回调函数中止了请求*/
+
+#define PCS_HTTP_BREAKER_HOSTS		16 /*最多记录多少个主机的熔断状态*/
+
+#define PCS_HTTP_RATE_UPLOAD		0
+#define PCS_HTTP_RATE_DOWNLOAD		1
+#define PCS_HTTP_RATE_BURST			0.25 /*令牌桶最多积攒多少秒的令牌*/
+#define PCS_HTTP_RATE_MAX_SLEEP		500 /*每次最多睡眠的毫秒数，醒来后按当前的限速重新计算，限速调整后尽快按新值执行*/
+#define PCS_HTTP_LOW_SPEED_LIMIT	1024 /*低于该速度（字节/秒）持续 PCS_HTTP_LOW_SPEED_TIME 秒时中止请求*/
+#define PCS_HTTP_LOW_SPEED_TIME		10
+
+struct pcs_http_share;
+struct pcs_http_stats_data;
+
 struct pcs_http {
 	char			*strerror;
 	char			*usage;
 
 	CURL			*curl;
+	struct pcs_http_share	*share; /*通过pcs_http_clone()复制的对象共享Cookie, DNS缓存和SSL会话*/
 	int				res_type;
 	int				res_code;
 	char			*res_header;
@@ -50,6 +78,57 @@ struct pcs_http {
 
 	int						timeout;
 	int						connect_timeout;
+
+	struct pcs_http_stats_data	*stats; /*请求统计，创建对象时创建，复制的对象共用。之后不再改变，读取时不需要加锁*/
+	int						endpoint; /*当前请求的接口类别，由pcs_http_prepare()根据地址确定*/
+	int						retries; /*当前请求的重试次数*/
+
+	int						method; /*当前请求的方法，HTTP_METHOD_*/
+	char					host[128]; /*当前请求的主机，熔断按主机统计*/
+	size_t					res_written; /*本次请求已交给write_func的字节数*/
+	int						retry_max;
+	int						retry_delay; /*毫秒*/
+	int						retry_max_delay; /*毫秒*/
+	int						breaker_threshold;
+	int						breaker_cooldown; /*秒*/
+	unsigned int			rand_seed; /*计算重试抖动用的随机数种子*/
+
+	double					rate_ulnow; /*本次请求已经从上传令牌桶中取过令牌的字节数*/
+	double					rate_dlnow; /*本次请求已经从下载令牌桶中取过令牌的字节数*/
+#ifdef WIN32
+	volatile LONGLONG		transferred; /*累计上传和下载的字节数，其他线程会读取，使用原子操作*/
+#else
+	volatile Int64			transferred; /*累计上传和下载的字节数，其他线程会读取，使用原子操作*/
+#endif
+
+	Int64					range_offset; /*范围下载的开始位置*/
+	Int64					range_length; /*范围下载的字节数，0表示不是范围下载*/
+	Int64					range_pos; /*服务器忽略Range返回整个文件时，已经收到的字节数*/
+};
+
+/*多个PcsHttp对象之间共享的数据，使用引用计数管理生命周期*/
+struct pcs_http_share {
+	CURLSH			*sh;
+#ifdef WIN32
+	CRITICAL_SECTION	locks[CURL_LOCK_DATA_LAST];
+	volatile LONG		refcount;
+#else
+	pthread_mutex_t	locks[CURL_LOCK_DATA_LAST];
+	volatile int	refcount;
+#endif
+};
+
+/*请求统计。通过pcs_http_clone()复制的对象共用同一份，使用引用计数管理生命周期*/
+struct pcs_http_stats_data {
+	PcsHttpStats	data; /*data.recent作为环形缓冲区使用*/
+	int				next; /*data.recent中下一个写入的位置*/
+#ifdef WIN32
+	CRITICAL_SECTION	lock;
+	volatile LONG		refcount;
+#else
+	pthread_mutex_t	lock;
+	volatile int	refcount;
+#endif
 };
 
 struct http_post {
@@ -78,6 +157,8 @@ static inline void pcs_http_reset_response(struct pcs_http *http)
 	http->res_content_length = 0;
 	http->res_encode = 0;
 	http->strerror = NULL;
+	http->res_written = 0;
+	http->range_pos = 0;
 }
 
 enum HttpMethod
@@ -87,10 +168,52 @@ enum HttpMethod
 	HTTP_METHOD_POST
 };
 
+/*根据请求地址确定接口类别*/
+static int pcs_http_endpoint_of(const char *url)
+{
+	if (strstr(url, "/api/list"))
+		return PCS_HTTP_ENDPOINT_LIST;
+	if (strstr(url, "/api/search"))
+		return PCS_HTTP_ENDPOINT_SEARCH;
+	if (strstr(url, "/api/filemanager"))
+		return PCS_HTTP_ENDPOINT_FILEMANAGER;
+	if (strstr(url, "/rest/2.0/pcs/file")) {
+		if (strstr(url, "method=upload"))
+			return PCS_HTTP_ENDPOINT_UPLOAD;
+		if (strstr(url, "method=download"))
+			return PCS_HTTP_ENDPOINT_DOWNLOAD;
+	}
+	if (strstr(url, "/disk/home"))
+		return PCS_HTTP_ENDPOINT_HOME;
+	return PCS_HTTP_ENDPOINT_OTHER;
+}
+
+/*从请求地址中取出主机（含端口）*/
+static void pcs_http_host_of(const char *url, char *host, size_t size)
+{
+	const char *p, *end;
+	size_t len;
+	p = strstr(url, "://");
+	p = p ? p + 3 : url;
+	end = p;
+	while (*end && *end != '/' && *end != '?' && *end != '#') end++;
+	len = end - p;
+	if (len >= size) len = size - 1;
+	memcpy(host, p, len);
+	host[len] = '\0';
+}
+
+static int pcs_http_progress(void *clientp, double dltotal, double dlnow, double ultotal, double ulnow);
+static long pcs_http_low_speed_limit();
+
 static inline void pcs_http_prepare(struct pcs_http *http, enum HttpMethod method, const char *url, PcsBool follow_location,
 							 PcsHttpWriteFunction write_func, void *state)
 {
 	pcs_http_reset_response(http);
+	http->endpoint = pcs_http_endpoint_of(url);
+	http->retries = 0;
+	http->method = method;
+	pcs_http_host_of(url, http->host, sizeof(http->host));
 	curl_easy_setopt(http->curl, CURLOPT_USERAGENT, http->usage ? http->usage : USAGE);
 	curl_easy_setopt(http->curl, CURLOPT_URL, url);
 	switch(method)
@@ -113,16 +236,13 @@ static inline void pcs_http_prepare(struct pcs_http *http, enum HttpMethod metho
 	else
 		curl_easy_setopt(http->curl, CURLOPT_FOLLOWLOCATION, 0L);
 
-	if (http->progress) {
-		curl_easy_setopt(http->curl, CURLOPT_PROGRESSFUNCTION, http->progress_func);
-		curl_easy_setopt(http->curl, CURLOPT_PROGRESSDATA, http->progress_data);
-		curl_easy_setopt(http->curl, CURLOPT_NOPROGRESS, (long)0);
-	}
-	else {
-		curl_easy_setopt(http->curl, CURLOPT_PROGRESSFUNCTION, NULL);
-		curl_easy_setopt(http->curl, CURLOPT_PROGRESSDATA, NULL);
-		curl_easy_setopt(http->curl, CURLOPT_NOPROGRESS, (long)1);
-	}
+	/*限速在进度回调中进行，传输过程中修改的限速也能生效，因此总是启用进度回调*/
+	http->rate_ulnow = 0;
+	http->rate_dlnow = 0;
+	curl_easy_setopt(http->curl, CURLOPT_PROGRESSFUNCTION, &pcs_http_progress);
+	curl_easy_setopt(http->curl, CURLOPT_PROGRESSDATA, http);
+	curl_easy_setopt(http->curl, CURLOPT_NOPROGRESS, (long)0);
+	curl_easy_setopt(http->curl, CURLOPT_LOW_SPEED_LIMIT, pcs_http_low_speed_limit());
 }
 
 static inline void skip_cookie_attr(char **p)
@@ -381,11 +501,34 @@ size_t pcs_http_write(char *ptr, size_t size, size_t nmemb, void *userdata)
 			http->res_body_size += sz;
 		}
 		else if (http->res_type == PCS_HTTP_RES_TYPE_DOWNLOAD + 1) {
+			long code = 0;
+			curl_easy_getinfo(http->curl, CURLINFO_RESPONSE_CODE, &code);
+			if (PCS_HTTP_IS_TRANSIENT_CODE(code)) {
+				/*错误页面不交给write_func，保留下来作为错误信息，同时使请求可以重试*/
+				http->res_body = pcs_http_append_bytes(http->res_body, http->res_body_size, ptr, sz);
+				http->res_body_size += sz;
+				return size * nmemb;
+			}
 			if (!http->write_func) {
 				if (http->strerror) pcs_free(http->strerror);
 				http->strerror = pcs_utils_strdup("Have no write function. ");
 				return 0;
 			}
+			if (http->range_length > 0 && code == 200) {
+				/*服务器忽略了Range，只把请求的范围交给write_func*/
+				Int64 first = http->range_offset - http->range_pos,
+					last = http->range_offset + http->range_length - http->range_pos;
+				http->range_pos += sz;
+				if (first < 0) first = 0;
+				if (last > (Int64)sz) last = (Int64)sz;
+				if (last <= first)
+					return size * nmemb;
+				http->res_written += (size_t)(last - first);
+				if ((*http->write_func)(ptr + first, (size_t)(last - first), (size_t)http->range_length, http->write_data) != (size_t)(last - first))
+					return 0;
+				return size * nmemb;
+			}
+			http->res_written += sz;
 			return (*http->write_func)(ptr, sz, http->res_content_length, http->write_data);
 		}
 		else
@@ -395,19 +538,470 @@ size_t pcs_http_write(char *ptr, size_t size, size_t nmemb, void *userdata)
 	return size * nmemb;
 }
 
+static struct pcs_http_stats_data *pcs_http_stats_create()
+{
+	struct pcs_http_stats_data *st;
+
+	st = (struct pcs_http_stats_data *)pcs_malloc(sizeof(struct pcs_http_stats_data));
+	if (!st)
+		return NULL;
+	memset(st, 0, sizeof(struct pcs_http_stats_data));
+#ifdef WIN32
+	InitializeCriticalSection(&st->lock);
+#else
+	pthread_mutex_init(&st->lock, NULL);
+#endif
+	st->refcount = 1;
+	return st;
+}
+
+static void pcs_http_stats_attach(struct pcs_http *http, struct pcs_http_stats_data *st)
+{
+#ifdef WIN32
+	InterlockedIncrement(&st->refcount);
+#else
+	__sync_fetch_and_add(&st->refcount, 1);
+#endif
+	http->stats = st;
+}
+
+/*最后一个使用者释放统计数据*/
+static void pcs_http_stats_release(struct pcs_http_stats_data *st)
+{
+#ifdef WIN32
+	if (InterlockedDecrement(&st->refcount) > 0)
+		return;
+	DeleteCriticalSection(&st->lock);
+#else
+	if (__sync_sub_and_fetch(&st->refcount, 1) > 0)
+		return;
+	pthread_mutex_destroy(&st->lock);
+#endif
+	pcs_free(st);
+}
+
+/*记录刚结束的请求的计时和流量。重试的请求只记一次，计时和流量取最后一次尝试的，retries 为重试的次数*/
+static void pcs_http_stats_record(struct pcs_http *http, CURLcode res, long httpcode)
+{
+	struct pcs_http_stats_data *st;
+	PcsHttpRequestStats r;
+	PcsHttpEndpointStats *es;
+	long header_size = 0, request_size = 0;
+#if LIBCURL_VERSION_NUM >= 0x073700
+	curl_off_t size_in = 0, size_out = 0;
+#else
+	double size_in = 0, size_out = 0;
+#endif
+	double ms;
+	int i;
+
+	st = http->stats;
+
+	memset(&r, 0, sizeof(PcsHttpRequestStats));
+	r.time = time(NULL);
+	r.endpoint = http->endpoint;
+	r.code = (int)httpcode;
+	r.curl_code = (int)res;
+	r.retries = http->retries;
+	curl_easy_getinfo(http->curl, CURLINFO_NAMELOOKUP_TIME, &r.dns);
+	curl_easy_getinfo(http->curl, CURLINFO_CONNECT_TIME, &r.connect);
+	curl_easy_getinfo(http->curl, CURLINFO_APPCONNECT_TIME, &r.tls);
+	curl_easy_getinfo(http->curl, CURLINFO_STARTTRANSFER_TIME, &r.ttfb);
+	curl_easy_getinfo(http->curl, CURLINFO_TOTAL_TIME, &r.total);
+	curl_easy_getinfo(http->curl, CURLINFO_HEADER_SIZE, &header_size);
+	curl_easy_getinfo(http->curl, CURLINFO_REQUEST_SIZE, &request_size);
+#if LIBCURL_VERSION_NUM >= 0x073700
+	curl_easy_getinfo(http->curl, CURLINFO_SIZE_DOWNLOAD_T, &size_in);
+	curl_easy_getinfo(http->curl, CURLINFO_SIZE_UPLOAD_T, &size_out);
+#else
+	curl_easy_getinfo(http->curl, CURLINFO_SIZE_DOWNLOAD, &size_in);
+	curl_easy_getinfo(http->curl, CURLINFO_SIZE_UPLOAD, &size_out);
+#endif
+	r.bytes_in = (double)size_in + header_size;
+	r.bytes_out = (double)size_out + request_size;
+
+	ms = r.total * 1000.0;
+	for (i = 0; i < PCS_HTTP_STATS_BUCKETS - 1 && ms >= (double)(1UL << i); i++);
+
+#ifdef WIN32
+	EnterCriticalSection(&st->lock);
+#else
+	pthread_mutex_lock(&st->lock);
+#endif
+	es = &st->data.endpoints[r.endpoint];
+	es->count++;
+	if (res != CURLE_OK || (httpcode != 200 && !(httpcode == 206 && http->range_length > 0)))
+		es->errors++;
+	es->retries += r.retries;
+	es->dns += r.dns;
+	es->connect += r.connect;
+	es->tls += r.tls;
+	es->ttfb += r.ttfb;
+	es->total += r.total;
+	if (r.total > es->max)
+		es->max = r.total;
+	es->bytes_in += r.bytes_in;
+	es->bytes_out += r.bytes_out;
+	es->buckets[i]++;
+	st->data.recent[st->next] = r;
+	st->next = (st->next + 1) % PCS_HTTP_STATS_RECENT;
+	if (st->data.recent_count < PCS_HTTP_STATS_RECENT)
+		st->data.recent_count++;
+#ifdef WIN32
+	LeaveCriticalSection(&st->lock);
+#else
+	pthread_mutex_unlock(&st->lock);
+#endif
+}
+
+/*
+熔断。按主机记录连续失败的请求数，进程内所有PcsHttp对象共用。
+一个请求的多次重试只计一次，重试用完后仍然失败才算失败。
+*/
+struct pcs_http_breaker {
+	char	host[128];
+	int		failures; /*连续失败的次数*/
+	time_t	open_until; /*熔断到该时间，0表示没有熔断*/
+	int		probing; /*熔断到期后，是否已放行一个试探请求*/
+};
+
+static struct pcs_http_breaker pcs_http_breakers[PCS_HTTP_BREAKER_HOSTS];
+
+#ifdef WIN32
+static volatile LONG pcs_http_breaker_lock = 0;
+# define PCS_HTTP_BREAKER_LOCK()	while (InterlockedExchange(&pcs_http_breaker_lock, 1)) Sleep(0)
+# define PCS_HTTP_BREAKER_UNLOCK()	InterlockedExchange(&pcs_http_breaker_lock, 0)
+#else
+static pthread_mutex_t pcs_http_breaker_lock = PTHREAD_MUTEX_INITIALIZER;
+# define PCS_HTTP_BREAKER_LOCK()	pthread_mutex_lock(&pcs_http_breaker_lock)
+# define PCS_HTTP_BREAKER_UNLOCK()	pthread_mutex_unlock(&pcs_http_breaker_lock)
+#endif
+
+/*查找主机的熔断状态，create非0时不存在则创建。表满时优先复用没有失败记录的项，没有可复用的项时返回NULL。需持有锁*/
+static struct pcs_http_breaker *pcs_http_breaker_find(const char *host, int create)
+{
+	struct pcs_http_breaker *free_item = NULL;
+	int i;
+	for (i = 0; i < PCS_HTTP_BREAKER_HOSTS; i++) {
+		if (pcs_http_breakers[i].host[0] && strcmp(pcs_http_breakers[i].host, host) == 0)
+			return &pcs_http_breakers[i];
+		if (!free_item && pcs_http_breakers[i].failures == 0 && !pcs_http_breakers[i].open_until)
+			free_item = &pcs_http_breakers[i];
+	}
+	if (!create || !free_item)
+		return NULL;
+	memset(free_item, 0, sizeof(struct pcs_http_breaker));
+	strcpy(free_item->host, host);
+	return free_item;
+}
+
+/*是否允许向当前主机发送请求。允许时返回0，否则返回还需要等待的秒数*/
+static int pcs_http_breaker_allow(struct pcs_http *http)
+{
+	struct pcs_http_breaker *b;
+	time_t now;
+	int rc = 0;
+	if (http->breaker_threshold <= 0 || !http->host[0])
+		return 0;
+	time(&now);
+	PCS_HTTP_BREAKER_LOCK();
+	b = pcs_http_breaker_find(http->host, 0);
+	if (b && b->open_until) {
+		if (now < b->open_until)
+			rc = (int)(b->open_until - now);
+		else if (b->probing)
+			rc = 1; /*已有试探请求在执行，等待其结果*/
+		else
+			b->probing = 1;
+	}
+	PCS_HTTP_BREAKER_UNLOCK();
+	return rc;
+}
+
+/*记录请求的结果。连续失败达到阈值，或者试探请求失败时熔断；成功时清除失败记录*/
+static void pcs_http_breaker_report(struct pcs_http *http, int failed)
+{
+	struct pcs_http_breaker *b;
+	if (http->breaker_threshold <= 0 || !http->host[0])
+		return;
+	PCS_HTTP_BREAKER_LOCK();
+	b = pcs_http_breaker_find(http->host, failed);
+	if (b) {
+		if (failed) {
+			b->failures++;
+			if (b->failures >= http->breaker_threshold || b->probing)
+				b->open_until = time(NULL) + http->breaker_cooldown;
+		}
+		else {
+			b->failures = 0;
+			b->open_until = 0;
+		}
+		b->probing = 0;
+	}
+	PCS_HTTP_BREAKER_UNLOCK();
+}
+
+/*
+限速。进程内所有PcsHttp对象共用一个上传令牌桶和一个下载令牌桶。
+每个请求在进度回调中按新传输的字节数取令牌，令牌不足时记为欠账并等待欠账还清。
+所有传输从同一个桶中取令牌，只有少数传输在进行时，每个传输可以分到更多的带宽。
+*/
+struct pcs_http_bucket {
+	Int64	rate; /*字节/秒，0表示不限速*/
+	double	tokens; /*可用的字节数，为负数时表示欠下的字节数*/
+	double	last; /*上次补充令牌的时间，秒*/
+};
+
+static struct pcs_http_bucket pcs_http_buckets[2];
+
+#ifdef WIN32
+static volatile LONG pcs_http_rate_lock = 0;
+# define PCS_HTTP_RATE_LOCK()	while (InterlockedExchange(&pcs_http_rate_lock, 1)) Sleep(0)
+# define PCS_HTTP_RATE_UNLOCK()	InterlockedExchange(&pcs_http_rate_lock, 0)
+#else
+static pthread_mutex_t pcs_http_rate_lock = PTHREAD_MUTEX_INITIALIZER;
+# define PCS_HTTP_RATE_LOCK()	pthread_mutex_lock(&pcs_http_rate_lock)
+# define PCS_HTTP_RATE_UNLOCK()	pthread_mutex_unlock(&pcs_http_rate_lock)
+#endif
+
+static double pcs_http_clock()
+{
+#ifdef WIN32
+	return GetTickCount() / 1000.0;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+#endif
+}
+
+/*从令牌桶中取出bytes个令牌，返回还清欠账需要等待的毫秒数。不限速时返回0*/
+static int pcs_http_bucket_take(int dir, double bytes)
+{
+	struct pcs_http_bucket *b = &pcs_http_buckets[dir];
+	double now, wait = 0;
+	if (!b->rate)
+		return 0;
+	PCS_HTTP_RATE_LOCK();
+	if (b->rate) {
+		now = pcs_http_clock();
+		b->tokens += (now - b->last) * b->rate;
+		if (b->tokens > b->rate * PCS_HTTP_RATE_BURST)
+			b->tokens = b->rate * PCS_HTTP_RATE_BURST;
+		b->last = now;
+		b->tokens -= bytes;
+		if (b->tokens < 0)
+			wait = -b->tokens * 1000.0 / b->rate;
+	}
+	PCS_HTTP_RATE_UNLOCK();
+	return (int)wait;
+}
+
+/*
+限速时，根据较小的限速降低低速中止的阈值，否则被限速的请求会被当作连接已经中断。
+*/
+static long pcs_http_low_speed_limit()
+{
+	Int64 rate = 0;
+	int i;
+	for (i = 0; i < 2; i++) {
+		if (pcs_http_buckets[i].rate && (!rate || pcs_http_buckets[i].rate < rate))
+			rate = pcs_http_buckets[i].rate;
+	}
+	if (rate && rate / 16 < PCS_HTTP_LOW_SPEED_LIMIT)
+		return rate / 16 > 0 ? (long)(rate / 16) : 1L;
+	return PCS_HTTP_LOW_SPEED_LIMIT;
+}
+
+static void pcs_http_sleep(int ms);
+
+/*
+等待令牌桶的欠账还清。wait为 pcs_http_bucket_take() 的返回值。
+每次最多睡眠 PCS_HTTP_RATE_MAX_SLEEP 毫秒，醒来后按当前的限速重新计算剩余的欠账，
+限速调高或取消时（pcs_http_set_rate_limit() 清空欠账）可以提前结束等待。
+*/
+static void pcs_http_bucket_wait(int dir, int wait)
+{
+	while (wait > 0) {
+		pcs_http_sleep(wait > PCS_HTTP_RATE_MAX_SLEEP ? PCS_HTTP_RATE_MAX_SLEEP : wait);
+		wait = pcs_http_bucket_take(dir, 0);
+	}
+}
+
+static void pcs_http_add_transferred(struct pcs_http *http, double bytes)
+{
+#ifdef WIN32
+	InterlockedExchangeAdd64(&http->transferred, (LONGLONG)bytes);
+#else
+	__sync_fetch_and_add(&http->transferred, (Int64)bytes);
+#endif
+}
+
+/*curl的进度回调，先按新传输的字节数限速，再调用使用者设置的进度函数*/
+static int pcs_http_progress(void *clientp, double dltotal, double dlnow, double ultotal, double ulnow)
+{
+	struct pcs_http *http = (struct pcs_http *)clientp;
+	/*重试或跳转后从0重新计数*/
+	if (ulnow < http->rate_ulnow) http->rate_ulnow = 0;
+	if (dlnow < http->rate_dlnow) http->rate_dlnow = 0;
+	if (ulnow > http->rate_ulnow) {
+		pcs_http_add_transferred(http, ulnow - http->rate_ulnow);
+		pcs_http_bucket_wait(PCS_HTTP_RATE_UPLOAD, pcs_http_bucket_take(PCS_HTTP_RATE_UPLOAD, ulnow - http->rate_ulnow));
+		http->rate_ulnow = ulnow;
+	}
+	if (dlnow > http->rate_dlnow) {
+		pcs_http_add_transferred(http, dlnow - http->rate_dlnow);
+		pcs_http_bucket_wait(PCS_HTTP_RATE_DOWNLOAD, pcs_http_bucket_take(PCS_HTTP_RATE_DOWNLOAD, dlnow - http->rate_dlnow));
+		http->rate_dlnow = dlnow;
+	}
+	if (http->progress && http->progress_func)
+		return (*http->progress_func)(http->progress_data, dltotal, dlnow, ultotal, ulnow);
+	return 0;
+}
+
+static int pcs_http_classify(CURLcode res, long httpcode)
+{
+	switch (res)
+	{
+	case CURLE_OK:
+		return PCS_HTTP_IS_TRANSIENT_CODE(httpcode) ? PCS_HTTP_RESULT_TRANSIENT : PCS_HTTP_RESULT_OK;
+	case CURLE_COULDNT_RESOLVE_PROXY:
+	case CURLE_COULDNT_RESOLVE_HOST:
+	case CURLE_COULDNT_CONNECT:
+	case CURLE_SSL_CONNECT_ERROR:
+		return PCS_HTTP_RESULT_UNSENT;
+	case CURLE_OPERATION_TIMEDOUT:
+	case CURLE_SEND_ERROR:
+	case CURLE_RECV_ERROR:
+	case CURLE_GOT_NOTHING:
+	case CURLE_PARTIAL_FILE:
+		return PCS_HTTP_RESULT_TRANSIENT;
+	default:
+		return PCS_HTTP_RESULT_FATAL;
+	}
+}
+
+/*从HTTP头中读取Retry-After，单位为秒。值可以是秒数或HTTP日期，没有时返回-1*/
+static int pcs_http_get_retry_after_from_header(const char *header)
+{
+	const char *p = header, *end;
+	char val[64];
+	time_t t;
+	size_t len;
+	while (p && *p) {
+		if (curl_strnequal(p, "Retry-After:", 12)) {
+			p += 12;
+			PCS_SKIP_SPACE(p);
+			end = p;
+			while (*end && *end != '\r' && *end != '\n') end++;
+			len = end - p;
+			if (len == 0 || len >= sizeof(val))
+				return -1;
+			memcpy(val, p, len);
+			val[len] = '\0';
+			if (val[0] >= '0' && val[0] <= '9')
+				return atoi(val);
+			t = curl_getdate(val, NULL);
+			if (t == (time_t)-1)
+				return -1;
+			t -= time(NULL);
+			return t > 0 ? (int)t : 0;
+		}
+		p = strchr(p, '\n');
+		if (p) p++;
+	}
+	return -1;
+}
+
+/*
+计算下次重试前需要等待的毫秒数，不需要重试时返回-1。
+等待时间为 retry_delay * 2^retries，不超过retry_max_delay，再在其一半到全部之间随机取值，避免多个线程同时重试。
+*/
+static int pcs_http_retry_delay(struct pcs_http *http, int result)
+{
+	int delay, retry_after;
+	if (http->retries >= http->retry_max)
+		return -1;
+	if (result == PCS_HTTP_RESULT_TRANSIENT) {
+		if (http->method != HTTP_METHOD_GET || http->res_written > 0)
+			return -1;
+	}
+	else if (result != PCS_HTTP_RESULT_UNSENT)
+		return -1;
+	delay = http->retry_delay;
+	if (http->retries < 16)
+		delay <<= http->retries;
+	else
+		delay = http->retry_max_delay;
+	if (delay > http->retry_max_delay || delay < 0)
+		delay = http->retry_max_delay;
+	if (delay > 1) {
+		http->rand_seed = http->rand_seed * 1103515245 + 12345;
+		delay = delay / 2 + (int)((http->rand_seed >> 16) % (unsigned int)(delay / 2 + 1));
+	}
+	if (result == PCS_HTTP_RESULT_TRANSIENT && http->res_header) {
+		retry_after = pcs_http_get_retry_after_from_header(http->res_header);
+		if (retry_after >= 0) {
+			if (retry_after > http->retry_max_delay / 1000)
+				return -1;
+			if (retry_after * 1000 > delay)
+				delay = retry_after * 1000;
+		}
+	}
+	return delay;
+}
+
+static void pcs_http_sleep(int ms)
+{
+#ifdef WIN32
+	Sleep(ms);
+#else
+	usleep((useconds_t)ms * 1000);
+#endif
+}
+
 static inline char *pcs_http_perform(struct pcs_http *http)
 {
 	CURLcode res;
 	long httpcode;
+	Int64 trace_start;
+	char detail[16];
+	int res_type = http->res_type, result, wait;
 
-	res = curl_easy_perform(http->curl);
-	curl_easy_getinfo(http->curl, CURLINFO_RESPONSE_CODE, &httpcode);
-	http->res_code = httpcode;
+	/*熔断按请求计：开始前检查一次，重试用完后记录一次结果*/
+	wait = pcs_http_breaker_allow(http);
+	if (wait > 0) {
+		if (http->strerror) pcs_free(http->strerror);
+		http->strerror = pcs_utils_sprintf("The server %s is unavailable, retry after %d seconds. ", http->host, wait);
+		return NULL;
+	}
+	while (1) {
+		trace_start = pcs_trace_now();
+		res = curl_easy_perform(http->curl);
+		curl_easy_getinfo(http->curl, CURLINFO_RESPONSE_CODE, &httpcode);
+		http->res_code = httpcode;
+		if (pcs_trace_enabled()) {
+			sprintf(detail, "%ld", httpcode);
+			pcs_trace_span("http", pcs_http_endpoint_name(http->endpoint), trace_start, detail);
+		}
+		result = pcs_http_classify(res, httpcode);
+		wait = pcs_http_retry_delay(http, result);
+		if (wait < 0)
+			break;
+		pcs_http_sleep(wait);
+		http->retries++;
+		pcs_http_reset_response(http);
+		http->res_type = res_type;
+	}
+	pcs_http_stats_record(http, res, httpcode);
+	/*429说明主机可以访问，只是需要降低频率，不计入熔断*/
+	pcs_http_breaker_report(http, result == PCS_HTTP_RESULT_UNSENT
+		|| (result == PCS_HTTP_RESULT_TRANSIENT && httpcode != 429));
 	if(res != CURLE_OK) {
 		if (!http->strerror) http->strerror = pcs_utils_strdup(curl_easy_strerror(res));
 		return NULL;
 	}
-	if (httpcode != 200) {
+	if (httpcode != 200 && !(httpcode == 206 && http->range_length > 0)) {
 		if (http->strerror) pcs_free(http->strerror);
 		http->strerror = pcs_utils_sprintf("%d %s", httpcode, http->res_body);
 		return NULL;
@@ -417,25 +1011,141 @@ static inline char *pcs_http_perform(struct pcs_http *http)
 	return http->res_body;
 }
 
-PCS_API PcsHttp pcs_http_create(const char *cookie_file)
+static void pcs_http_share_lock(CURL *handle, curl_lock_data data, curl_lock_access access, void *userptr)
+{
+	struct pcs_http_share *share = (struct pcs_http_share *)userptr;
+#ifdef WIN32
+	EnterCriticalSection(&share->locks[data]);
+#else
+	pthread_mutex_lock(&share->locks[data]);
+#endif
+}
+
+static void pcs_http_share_unlock(CURL *handle, curl_lock_data data, void *userptr)
+{
+	struct pcs_http_share *share = (struct pcs_http_share *)userptr;
+#ifdef WIN32
+	LeaveCriticalSection(&share->locks[data]);
+#else
+	pthread_mutex_unlock(&share->locks[data]);
+#endif
+}
+
+static struct pcs_http_share *pcs_http_share_create()
+{
+	struct pcs_http_share *share;
+	int i;
+
+	share = (struct pcs_http_share *)pcs_malloc(sizeof(struct pcs_http_share));
+	if (!share)
+		return NULL;
+	memset(share, 0, sizeof(struct pcs_http_share));
+	share->sh = curl_share_init();
+	if (!share->sh) {
+		pcs_free(share);
+		return NULL;
+	}
+	for (i = 0; i < CURL_LOCK_DATA_LAST; i++) {
+#ifdef WIN32
+		InitializeCriticalSection(&share->locks[i]);
+#else
+		pthread_mutex_init(&share->locks[i], NULL);
+#endif
+	}
+	curl_share_setopt(share->sh, CURLSHOPT_LOCKFUNC, &pcs_http_share_lock);
+	curl_share_setopt(share->sh, CURLSHOPT_UNLOCKFUNC, &pcs_http_share_unlock);
+	curl_share_setopt(share->sh, CURLSHOPT_USERDATA, share);
+	curl_share_setopt(share->sh, CURLSHOPT_SHARE, CURL_LOCK_DATA_COOKIE);
+	curl_share_setopt(share->sh, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+	curl_share_setopt(share->sh, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+	share->refcount = 0;
+	return share;
+}
+
+static void pcs_http_share_attach(struct pcs_http *http, struct pcs_http_share *share)
+{
+#ifdef WIN32
+	InterlockedIncrement(&share->refcount);
+#else
+	__sync_fetch_and_add(&share->refcount, 1);
+#endif
+	curl_easy_setopt(http->curl, CURLOPT_SHARE, share->sh);
+	http->share = share;
+}
+
+/*在curl_easy_cleanup()之后调用。最后一个使用者释放共享数据*/
+static void pcs_http_share_release(struct pcs_http_share *share)
+{
+	int i;
+#ifdef WIN32
+	if (InterlockedDecrement(&share->refcount) > 0)
+		return;
+#else
+	if (__sync_sub_and_fetch(&share->refcount, 1) > 0)
+		return;
+#endif
+	curl_share_cleanup(share->sh);
+	for (i = 0; i < CURL_LOCK_DATA_LAST; i++) {
+#ifdef WIN32
+		DeleteCriticalSection(&share->locks[i]);
+#else
+		pthread_mutex_destroy(&share->locks[i]);
+#endif
+	}
+	pcs_free(share);
+}
+
+#ifndef WIN32
+static pthread_once_t pcs_http_global_once = PTHREAD_ONCE_INIT;
+
+static void pcs_http_global_init()
+{
+	curl_global_init(CURL_GLOBAL_ALL);
+}
+#endif
+
+/*创建对象。stats 不为NULL时与其共用请求统计，否则新建*/
+static struct pcs_http *pcs_http_create_ex(const char *cookie_file, struct pcs_http_stats_data *stats)
 {
 	struct pcs_http *http;
 
+#ifndef WIN32
+	/*curl_global_init()不是线程安全的，确保在多线程中创建对象前只执行一次*/
+	pthread_once(&pcs_http_global_once, &pcs_http_global_init);
+#endif
+
 	http = (struct pcs_http *) pcs_malloc(sizeof(struct pcs_http));
 	if (!http)
 		return NULL;
 	memset(http, 0, sizeof(struct pcs_http));
 	http->timeout = 0;
 	http->connect_timeout = 10;
+	http->retry_max = PCS_HTTP_DEFAULT_RETRY_MAX;
+	http->retry_delay = PCS_HTTP_DEFAULT_RETRY_DELAY;
+	http->retry_max_delay = PCS_HTTP_DEFAULT_RETRY_MAX_DELAY;
+	http->breaker_threshold = PCS_HTTP_DEFAULT_BREAKER_THRESHOLD;
+	http->breaker_cooldown = PCS_HTTP_DEFAULT_BREAKER_COOLDOWN;
+	http->rand_seed = (unsigned int)time(NULL) ^ (unsigned int)((size_t)http >> 4);
+	if (stats) {
+		pcs_http_stats_attach(http, stats);
+	}
+	else {
+		http->stats = pcs_http_stats_create();
+		if (!http->stats) {
+			pcs_free(http);
+			return NULL;
+		}
+	}
 	http->curl = curl_easy_init();
 	if (!http->curl) {
+		pcs_http_stats_release(http->stats);
 		pcs_free(http);
 		return NULL;
 	}
 	curl_easy_setopt(http->curl, CURLOPT_SSL_VERIFYPEER, 0L);
 	curl_easy_setopt(http->curl, CURLOPT_SSL_VERIFYHOST, 0L);
-	curl_easy_setopt(http->curl, CURLOPT_LOW_SPEED_LIMIT, 1024L);
-	curl_easy_setopt(http->curl, CURLOPT_LOW_SPEED_TIME, 10L);
+	curl_easy_setopt(http->curl, CURLOPT_LOW_SPEED_LIMIT, (long)PCS_HTTP_LOW_SPEED_LIMIT);
+	curl_easy_setopt(http->curl, CURLOPT_LOW_SPEED_TIME, (long)PCS_HTTP_LOW_SPEED_TIME);
 	curl_easy_setopt(http->curl, CURLOPT_SSL_VERIFYHOST, 0L);
 	curl_easy_setopt(http->curl, CURLOPT_USERAGENT, USAGE);
 	curl_easy_setopt(http->curl, CURLOPT_FOLLOWLOCATION, 1L);
@@ -449,11 +1159,20 @@ PCS_API PcsHttp pcs_http_create(const char *cookie_file)
 	return http;
 }
 
+PCS_API PcsHttp pcs_http_create(const char *cookie_file)
+{
+	return pcs_http_create_ex(cookie_file, NULL);
+}
+
 PCS_API void pcs_http_destroy(PcsHttp handle)
 {
 	struct pcs_http *http = (struct pcs_http *)handle;
 	if (http->curl)
 		curl_easy_cleanup(http->curl);
+	if (http->share)
+		pcs_http_share_release(http->share);
+	if (http->stats)
+		pcs_http_stats_release(http->stats);
 	if (http->res_header)
 		pcs_free(http->res_header);
 	if (http->res_body)
@@ -467,6 +1186,44 @@ PCS_API void pcs_http_destroy(PcsHttp handle)
 	pcs_free(http);
 }
 
+PCS_API PcsHttp pcs_http_clone(PcsHttp handle)
+{
+	struct pcs_http *http = (struct pcs_http *)handle;
+	struct pcs_http *dst;
+	struct curl_slist *cookies = NULL, *nc;
+
+	if (!http->share) {
+		/*第一次复制时创建共享数据。
+		  CURLOPT_SHARE会丢弃句柄自身的Cookie，因此先导出，设置后再导入到共享的Cookie中*/
+		struct pcs_http_share *share = pcs_http_share_create();
+		if (!share)
+			return NULL;
+		curl_easy_getinfo(http->curl, CURLINFO_COOKIELIST, &cookies);
+		pcs_http_share_attach(http, share);
+		nc = cookies;
+		while (nc) {
+			curl_easy_setopt(http->curl, CURLOPT_COOKIELIST, nc->data);
+			nc = nc->next;
+		}
+		if (cookies)
+			curl_slist_free_all(cookies);
+	}
+	dst = pcs_http_create_ex(NULL, http->stats);
+	if (!dst)
+		return NULL;
+	dst->timeout = http->timeout;
+	dst->connect_timeout = http->connect_timeout;
+	dst->retry_max = http->retry_max;
+	dst->retry_delay = http->retry_delay;
+	dst->retry_max_delay = http->retry_max_delay;
+	dst->breaker_threshold = http->breaker_threshold;
+	dst->breaker_cooldown = http->breaker_cooldown;
+	if (http->usage)
+		dst->usage = pcs_utils_strdup(http->usage);
+	pcs_http_share_attach(dst, http->share);
+	return dst;
+}
+
 PCS_API const char *pcs_http_strerror(PcsHttp handle)
 {
 	struct pcs_http *http = (struct pcs_http *)handle;
@@ -519,6 +1276,25 @@ PCS_API void pcs_http_setopt(PcsHttp handle, PcsHttpOption opt, void *value)
 	case PCS_HTTP_OPTION_CONNECTTIMEOUT:
 		http->connect_timeout = (int)((long)value);
 		break;
+	case PCS_HTTP_OPTION_RETRY_MAX:
+		http->retry_max = (int)((long)value);
+		if (http->retry_max < 0) http->retry_max = 0;
+		break;
+	case PCS_HTTP_OPTION_RETRY_DELAY:
+		http->retry_delay = (int)((long)value);
+		if (http->retry_delay < 0) http->retry_delay = 0;
+		break;
+	case PCS_HTTP_OPTION_RETRY_MAX_DELAY:
+		http->retry_max_delay = (int)((long)value);
+		if (http->retry_max_delay < 0) http->retry_max_delay = 0;
+		break;
+	case PCS_HTTP_OPTION_BREAKER_THRESHOLD:
+		http->breaker_threshold = (int)((long)value);
+		break;
+	case PCS_HTTP_OPTION_BREAKER_COOLDOWN:
+		http->breaker_cooldown = (int)((long)value);
+		if (http->breaker_cooldown < 1) http->breaker_cooldown = 1;
+		break;
 	default:
 		break;
 	}
@@ -774,6 +1550,29 @@ PCS_API PcsBool pcs_http_get_download(PcsHttp handle, const char *url, PcsBool f
 	return http->strerror == NULL ? PcsTrue : PcsFalse;
 }
 
+PCS_API PcsBool pcs_http_get_download_range(PcsHttp handle, const char *url, PcsBool follow_location, Int64 offset, Int64 length)
+{
+	struct pcs_http *http = (struct pcs_http *)handle;
+	char range[64];
+	if (length <= 0)
+		return pcs_http_get_download(handle, url, follow_location);
+	pcs_http_prepare(http, HTTP_METHOD_GET, url, follow_location, &pcs_http_write, http);
+	http->res_type = PCS_HTTP_RES_TYPE_DOWNLOAD;
+	http->range_offset = offset;
+	http->range_length = length;
+	sprintf(range, "%lld-%lld", (long long)offset, (long long)(offset + length - 1));
+	curl_easy_setopt(http->curl, CURLOPT_RANGE, range);
+	pcs_http_perform(http);
+	curl_easy_setopt(http->curl, CURLOPT_RANGE, NULL);
+	http->range_offset = 0;
+	http->range_length = 0;
+	if (!http->strerror && (Int64)http->res_written != length) {
+		http->strerror = pcs_utils_sprintf("The response is shorter than the requested range: %lld/%lld. ",
+			(long long)http->res_written, (long long)length);
+	}
+	return http->strerror == NULL ? PcsTrue : PcsFalse;
+}
+
 PCS_API PcsBool pcs_http_form_addfile(PcsHttp handle, PcsHttpForm *post, const char *param_name, 
 									  const char *filename, const char *simulate_filename)
 {
@@ -949,3 +1748,105 @@ PCS_API const char *pcs_http_rawdata(PcsHttp handle, int *size, const char **enc
 	return http->res_body;
 }
 
+
+PCS_API void pcs_http_getstats(PcsHttp handle, PcsHttpStats *stats)
+{
+	struct pcs_http *http = (struct pcs_http *)handle;
+	struct pcs_http_stats_data *st = http->stats;
+	int i, first;
+
+	memset(stats, 0, sizeof(PcsHttpStats));
+#ifdef WIN32
+	EnterCriticalSection(&st->lock);
+#else
+	pthread_mutex_lock(&st->lock);
+#endif
+	memcpy(stats->endpoints, st->data.endpoints, sizeof(stats->endpoints));
+	stats->recent_count = st->data.recent_count;
+	first = (st->next - st->data.recent_count + PCS_HTTP_STATS_RECENT) % PCS_HTTP_STATS_RECENT;
+	for (i = 0; i < st->data.recent_count; i++)
+		stats->recent[i] = st->data.recent[(first + i) % PCS_HTTP_STATS_RECENT];
+#ifdef WIN32
+	LeaveCriticalSection(&st->lock);
+#else
+	pthread_mutex_unlock(&st->lock);
+#endif
+}
+
+PCS_API Int64 pcs_http_transferred(PcsHttp handle)
+{
+	struct pcs_http *http = (struct pcs_http *)handle;
+#ifdef WIN32
+	return InterlockedCompareExchange64(&http->transferred, 0, 0);
+#else
+	return __sync_fetch_and_add(&http->transferred, 0);
+#endif
+}
+
+PCS_API const char *pcs_http_endpoint_name(int endpoint)
+{
+	switch (endpoint) {
+	case PCS_HTTP_ENDPOINT_HOME:
+		return "home";
+	case PCS_HTTP_ENDPOINT_LIST:
+		return "list";
+	case PCS_HTTP_ENDPOINT_SEARCH:
+		return "search";
+	case PCS_HTTP_ENDPOINT_FILEMANAGER:
+		return "filemanager";
+	case PCS_HTTP_ENDPOINT_UPLOAD:
+		return "upload";
+	case PCS_HTTP_ENDPOINT_DOWNLOAD:
+		return "download";
+	default:
+		return "other";
+	}
+}
+
+PCS_API double pcs_http_stats_percentile(const PcsHttpEndpointStats *stats, double p)
+{
+	unsigned long rank, n = 0;
+	double bound;
+	int i;
+
+	if (stats->count == 0)
+		return 0;
+	rank = (unsigned long)(p / 100.0 * stats->count + 0.999999);
+	if (rank < 1) rank = 1;
+	if (rank > stats->count) rank = stats->count;
+	for (i = 0; i < PCS_HTTP_STATS_BUCKETS - 1; i++) {
+		n += stats->buckets[i];
+		if (n >= rank) {
+			bound = (double)(1UL << i) / 1000.0;
+			return bound < stats->max ? bound : stats->max;
+		}
+	}
+	return stats->max;
+}
+
+PCS_API void pcs_http_set_rate_limit(Int64 upload, Int64 download)
+{
+	Int64 rates[2];
+	double now = pcs_http_clock();
+	int i;
+	rates[PCS_HTTP_RATE_UPLOAD] = upload > 0 ? upload : 0;
+	rates[PCS_HTTP_RATE_DOWNLOAD] = download > 0 ? download : 0;
+	PCS_HTTP_RATE_LOCK();
+	for (i = 0; i < 2; i++) {
+		if (pcs_http_buckets[i].rate == rates[i])
+			continue;
+		/*新的限速从空桶开始，之前的欠账不再计算*/
+		pcs_http_buckets[i].rate = rates[i];
+		pcs_http_buckets[i].tokens = 0;
+		pcs_http_buckets[i].last = now;
+	}
+	PCS_HTTP_RATE_UNLOCK();
+}
+
+PCS_API void pcs_http_get_rate_limit(Int64 *upload, Int64 *download)
+{
+	PCS_HTTP_RATE_LOCK();
+	if (upload) *upload = pcs_http_buckets[PCS_HTTP_RATE_UPLOAD].rate;
+	if (download) *download = pcs_http_buckets[PCS_HTTP_RATE_DOWNLOAD].rate;
+	PCS_HTTP_RATE_UNLOCK();
+}
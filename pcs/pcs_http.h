@@ -2,6 +2,7 @@
 #define _PCS_HTTP_H
 
 #include <stdarg.h>
+#include <time.h>
 #include <curl/curl.h>
 #include "pcs_defs.h"
 
@@ -68,10 +69,102 @@ typedef enum PcsHttpOption {
 	PCS_HTTP_OPTION_TIMEOUT,
 	/*设置连接前的等待时间，值为long类型*/
 	PCS_HTTP_OPTION_CONNECTTIMEOUT,
+	/*设置请求失败后最多重试的次数，值为long类型，默认PCS_HTTP_DEFAULT_RETRY_MAX。设置为0时不重试*/
+	PCS_HTTP_OPTION_RETRY_MAX,
+	/*设置第一次重试前的等待时间（毫秒），之后每次重试翻倍，值为long类型，默认PCS_HTTP_DEFAULT_RETRY_DELAY*/
+	PCS_HTTP_OPTION_RETRY_DELAY,
+	/*设置重试前最长的等待时间（毫秒），值为long类型，默认PCS_HTTP_DEFAULT_RETRY_MAX_DELAY。
+	  服务器通过Retry-After要求等待更长的时间时，不再重试*/
+	PCS_HTTP_OPTION_RETRY_MAX_DELAY,
+	/*设置同一主机连续多少个请求失败（重试用完后仍然失败）后熔断，值为long类型，默认PCS_HTTP_DEFAULT_BREAKER_THRESHOLD。设置为0时不熔断*/
+	PCS_HTTP_OPTION_BREAKER_THRESHOLD,
+	/*设置熔断的时间（秒），值为long类型，默认PCS_HTTP_DEFAULT_BREAKER_COOLDOWN*/
+	PCS_HTTP_OPTION_BREAKER_COOLDOWN,
 
 
 } PcsHttpOption;
 
+/*
+ * 重试和熔断的默认值。
+ * 以下请求失败时会自动重试，每次重试前等待的时间翻倍并加入随机抖动：
+ *   1. 无法解析域名或无法建立连接，此时请求还没有发送出去，任何请求都可以重试；
+ *   2. GET请求遇到网络中断、超时，或者服务器返回5xx、429。下载时已经交给写入函数的数据无法撤回，因此只在还没有写入数据时重试。
+ * 服务器返回Retry-After时，至少等待其要求的时间。
+ * 同一主机连续失败达到阈值后熔断，熔断期间发往该主机的请求直接失败，到期后放行一个试探请求，成功则恢复。
+ * 熔断的状态在进程内所有PcsHttp对象之间共享。
+*/
+#define PCS_HTTP_DEFAULT_RETRY_MAX			3
+#define PCS_HTTP_DEFAULT_RETRY_DELAY		500
+#define PCS_HTTP_DEFAULT_RETRY_MAX_DELAY	30000
+#define PCS_HTTP_DEFAULT_BREAKER_THRESHOLD	5
+#define PCS_HTTP_DEFAULT_BREAKER_COOLDOWN	30
+
+/*请求统计中，按请求地址划分的接口类别*/
+typedef enum PcsHttpEndpoint {
+	PCS_HTTP_ENDPOINT_OTHER = 0,	/*登录、配额等其他请求*/
+	PCS_HTTP_ENDPOINT_HOME,			/*disk/home*/
+	PCS_HTTP_ENDPOINT_LIST,			/*api/list*/
+	PCS_HTTP_ENDPOINT_SEARCH,		/*api/search*/
+	PCS_HTTP_ENDPOINT_FILEMANAGER,	/*api/filemanager，删除、重命名、移动、复制*/
+	PCS_HTTP_ENDPOINT_UPLOAD,		/*rest/2.0/pcs/file?method=upload*/
+	PCS_HTTP_ENDPOINT_DOWNLOAD,		/*rest/2.0/pcs/file?method=download*/
+	PCS_HTTP_ENDPOINT_COUNT
+} PcsHttpEndpoint;
+
+#define PCS_HTTP_STATS_RECENT	64	/*保留最近多少个请求的明细*/
+#define PCS_HTTP_STATS_BUCKETS	16	/*耗时直方图的桶数*/
+
+/*
+ * 一个请求的明细。
+ * dns, connect, tls, ttfb, total 均为从请求开始到该阶段结束的秒数，含义同 CURLINFO_*_TIME：
+ *   dns     域名解析完成（CURLINFO_NAMELOOKUP_TIME）
+ *   connect TCP连接建立（CURLINFO_CONNECT_TIME）
+ *   tls     SSL握手完成，非HTTPS请求为0（CURLINFO_APPCONNECT_TIME）
+ *   ttfb    收到第一个字节（CURLINFO_STARTTRANSFER_TIME）
+ *   total   请求结束（CURLINFO_TOTAL_TIME）
+ * 复用已有连接时dns和connect接近0。
+*/
+typedef struct PcsHttpRequestStats {
+	time_t	time;		/*请求结束的时间*/
+	int		endpoint;	/*PcsHttpEndpoint*/
+	int		code;		/*HTTP状态码，没有收到响应时为0*/
+	int		curl_code;	/*curl_easy_perform()的返回值*/
+	int		retries;	/*重试的次数*/
+	double	dns;
+	double	connect;
+	double	tls;
+	double	ttfb;
+	double	total;
+	double	bytes_in;	/*收到的字节数，含HTTP头*/
+	double	bytes_out;	/*发出的字节数，含HTTP头*/
+} PcsHttpRequestStats;
+
+/*
+ * 一类接口的累计统计。一个请求的多次重试只计一次，retries 累加每个请求重试的次数。
+ * buckets是total的直方图：第0个桶统计1毫秒以内的请求，第i个桶统计[2^(i-1), 2^i)毫秒的请求，
+ * 最后一个桶统计所有更慢的请求。
+*/
+typedef struct PcsHttpEndpointStats {
+	unsigned long	count;
+	unsigned long	errors;		/*网络错误或状态码不是200的请求数，范围下载返回206不算错误*/
+	unsigned long	retries;
+	double			dns;		/*以下为各字段的累加值*/
+	double			connect;
+	double			tls;
+	double			ttfb;
+	double			total;
+	double			max;		/*最慢一次请求的total*/
+	double			bytes_in;
+	double			bytes_out;
+	unsigned long	buckets[PCS_HTTP_STATS_BUCKETS];
+} PcsHttpEndpointStats;
+
+typedef struct PcsHttpStats {
+	PcsHttpEndpointStats	endpoints[PCS_HTTP_ENDPOINT_COUNT];
+	PcsHttpRequestStats		recent[PCS_HTTP_STATS_RECENT]; /*最近的请求，按结束时间先后排列*/
+	int						recent_count;
+} PcsHttpStats;
+
 /*
  * 创建一个PcsHttp对象
  *   cookie_file   指定保存Cookie的文件，如果文件不存在，将自动创建该文件。
@@ -83,6 +176,13 @@ PCS_API PcsHttp pcs_http_create(const char *cookie_file);
  * 释放掉PcsHttp对象
  */
 PCS_API void pcs_http_destroy(PcsHttp handle);
+/*
+ * 复制一个PcsHttp对象。新对象拥有独立的CURL句柄，可在其他线程中使用。
+ * 复制UA、超时设置，并与handle共享同一个Cookie存储（以及DNS缓存和SSL会话），访问共享数据时自动加锁。
+ * 只有handle会把Cookie写回Cookie文件。需在使用handle的线程中调用。
+ * 成功后，返回创建的对象，失败则返回NULL。使用完成后需调用pcs_http_destroy()来释放资源
+ */
+PCS_API PcsHttp pcs_http_clone(PcsHttp handle);
 /*
  * 返回最后一次发生的错误描述
  */
@@ -192,6 +292,13 @@ PCS_API char *pcs_http_post(PcsHttp handle, const char *url, char *post_data, Pc
 */
 PCS_API PcsBool pcs_http_get_download(PcsHttp handle, const char *url, PcsBool follow_location);
 
+/*
+ * 同 pcs_http_get_download()，只下载从 offset 开始的 length 个字节。length 小于等于0时下载整个文件。
+ * 服务器不支持Range而返回整个文件时，只把请求的范围交给写入函数。
+ * 收到的字节数少于 length 时视为失败。
+*/
+PCS_API PcsBool pcs_http_get_download_range(PcsHttp handle, const char *url, PcsBool follow_location, Int64 offset, Int64 length);
+
 /*
  * 向PcsHttpForm对象中添加一个本地文件。
  *   post        文件将添加到该PcsHttpForm对象中。
@@ -242,4 +349,35 @@ PCS_API char *pcs_http_cookie_data(PcsHttp handle);
 
 PCS_API const char *pcs_http_rawdata(PcsHttp handle, int *size, const char **encode);
 
+/*
+ * 获取请求统计，写入stats中。
+ * 通过pcs_http_clone()复制的对象和原对象共用同一份统计，可在任一线程中调用。
+*/
+PCS_API void pcs_http_getstats(PcsHttp handle, PcsHttpStats *stats);
+
+/*
+ * 返回该对象累计上传和下载的字节数，不含HTTP头，包括正在进行的请求已经传输的部分，重试时重新传输的部分也计入。
+ * 可在任一线程中调用，通过pcs_http_clone()复制的对象从0开始计数。
+*/
+PCS_API Int64 pcs_http_transferred(PcsHttp handle);
+
+/*返回接口类别的名字，如 "list"*/
+PCS_API const char *pcs_http_endpoint_name(int endpoint);
+
+/*
+ * 根据直方图估算total的百分位数，p取值为0 ~ 100。
+ * 返回所在桶的上限（秒），落在最后一个桶时返回最大值。没有请求时返回0
+*/
+PCS_API double pcs_http_stats_percentile(const PcsHttpEndpointStats *stats, double p);
+
+/*
+ * 设置限速，单位为字节/秒，0表示不限速。
+ * 进程内所有PcsHttp对象的所有请求共用一个上传令牌桶和一个下载令牌桶，
+ * 同时进行的传输越少，每个传输可以使用的带宽越多。修改后正在进行的传输也按新的限速执行。
+*/
+PCS_API void pcs_http_set_rate_limit(Int64 upload, Int64 download);
+
+/*获取当前的限速，单位为字节/秒，0表示不限速。不需要的值传入NULL*/
+PCS_API void pcs_http_get_rate_limit(Int64 *upload, Int64 *download);
+
 #endif
@@ -1,44 +1,172 @@
 ﻿#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
-#include "pcs_defs.h"
+#include "pcs_mem.h"
+
+void (*_pcs_mem_printf)(const char *format, ...) = (void (*)(const char *format, ...))printf;
+
+#if defined(DEBUG) || defined(_DEBUG)
+
+#ifdef WIN32
+# include <windows.h>
+  typedef volatile LONG pcs_mem_lock_t;
+# define PCS_MEM_LOCK_INIT			0
+# define PCS_MEM_LOCK(l)			while (InterlockedExchange((l), 1)) Sleep(0)
+# define PCS_MEM_UNLOCK(l)			InterlockedExchange((l), 0)
+# define PCS_MEM_THREAD_LOCAL		__declspec(thread)
+# define PCS_ATOMIC_ADD(p, v)		InterlockedExchangeAdd64((volatile LONGLONG *)(p), (LONGLONG)(v))
+# define PCS_ATOMIC_CAS(p, o, n)	(InterlockedCompareExchange64((volatile LONGLONG *)(p), (LONGLONG)(n), (LONGLONG)(o)) == (LONGLONG)(o))
+# define PCS_ATOMIC_INC_INT(p)		(InterlockedIncrement((volatile LONG *)(p)) - 1)
+#else
+# include <pthread.h>
+  typedef pthread_mutex_t pcs_mem_lock_t;
+# define PCS_MEM_LOCK_INIT			PTHREAD_MUTEX_INITIALIZER
+# define PCS_MEM_LOCK(l)			pthread_mutex_lock(l)
+# define PCS_MEM_UNLOCK(l)			pthread_mutex_unlock(l)
+# define PCS_MEM_THREAD_LOCAL		__thread
+# define PCS_ATOMIC_ADD(p, v)		__sync_fetch_and_add((p), (v))
+# define PCS_ATOMIC_CAS(p, o, n)	__sync_bool_compare_and_swap((p), (o), (n))
+# define PCS_ATOMIC_INC_INT(p)		__sync_fetch_and_add((p), 1)
+#endif
+
+#define PCS_MEM_SHARD_COUNT		16   /*分片数量，每个线程固定使用其中一个分片*/
+#define PCS_MEM_SITE_COUNT		4096 /*最多统计的分配位置数量，必须是2的幂*/
+
+/*分配位置（文件名 + 行号）的统计*/
+struct pcs_mem_site {
+	const char * volatile	filename;
+	int						line;
+	volatile Int64			bytes; /*当前未释放的字节数*/
+	volatile Int64			count; /*当前未释放的块数*/
+	volatile Int64			peak;  /*bytes的峰值*/
+	volatile Int64			total; /*累计分配次数*/
+};
+
+struct pcs_mem_shard;
 
 struct pcs_mem {
 	struct pcs_mem	*prev;
 	struct pcs_mem	*next;
 
+	struct pcs_mem_shard	*shard;
+	struct pcs_mem_site		*site;
+	size_t					size;
+
 	void				*ptr;
 	const char			*filename;
 	int					line;
 
 };
 
-static struct pcs_mem *_mem = 0;
-void (*_pcs_mem_printf)(const char *format, ...) = (void (*)(const char *format, ...))printf;
+/*分片。每个分片拥有独立的锁和链表，减少多线程时的锁竞争*/
+struct pcs_mem_shard {
+	pcs_mem_lock_t	lock;
+	struct pcs_mem	*head;
+};
+
+static struct pcs_mem_shard _shards[PCS_MEM_SHARD_COUNT];
+static volatile int _shard_next = 0;
+static PCS_MEM_THREAD_LOCAL int _shard_index = -1;
 
-static inline void append_mem_ent(struct pcs_mem *mem)
+static struct pcs_mem_site _sites[PCS_MEM_SITE_COUNT];
+static pcs_mem_lock_t _sites_lock = PCS_MEM_LOCK_INIT;
+static struct pcs_mem_site _site_overflow = { "(other)", 0, 0, 0, 0, 0 };
+
+#ifndef WIN32
+static pthread_once_t _shards_once = PTHREAD_ONCE_INIT;
+
+static void init_shards()
+{
+	int i;
+	for (i = 0; i < PCS_MEM_SHARD_COUNT; i++) {
+		pthread_mutex_init(&_shards[i].lock, NULL);
+		_shards[i].head = NULL;
+	}
+}
+#endif
+
+/*返回当前线程使用的分片。线程第一次分配内存时，按顺序分配一个分片*/
+static inline struct pcs_mem_shard *current_shard()
 {
-	if (!_mem) {
-		_mem = mem;
+	if (_shard_index < 0) {
+#ifndef WIN32
+		pthread_once(&_shards_once, &init_shards);
+#endif
+		_shard_index = (int)(((unsigned int)PCS_ATOMIC_INC_INT(&_shard_next)) % PCS_MEM_SHARD_COUNT);
+	}
+	return &_shards[_shard_index];
+}
+
+/*查找或创建分配位置的统计项。filename为__FILE__，因此可直接比较指针*/
+static struct pcs_mem_site *get_site(const char *filename, int line)
+{
+	unsigned int h, i, n;
+	struct pcs_mem_site *site;
+
+	h = (unsigned int)(((size_t)filename) >> 3) * 2654435761u ^ (unsigned int)line * 40503u;
+	for (n = 0; n < PCS_MEM_SITE_COUNT; n++) {
+		i = (h + n) & (PCS_MEM_SITE_COUNT - 1);
+		site = &_sites[i];
+		if (!site->filename) {
+			PCS_MEM_LOCK(&_sites_lock);
+			if (!site->filename) {
+				site->line = line;
+				site->filename = filename;
+				PCS_MEM_UNLOCK(&_sites_lock);
+				return site;
+			}
+			PCS_MEM_UNLOCK(&_sites_lock);
+		}
+		if (site->filename == filename && site->line == line)
+			return site;
+	}
+	return &_site_overflow;
+}
+
+static inline void site_add(struct pcs_mem_site *site, Int64 size)
+{
+	Int64 bytes, peak;
+	bytes = PCS_ATOMIC_ADD(&site->bytes, size) + size;
+	PCS_ATOMIC_ADD(&site->count, 1);
+	PCS_ATOMIC_ADD(&site->total, 1);
+	peak = site->peak;
+	while (bytes > peak) {
+		if (PCS_ATOMIC_CAS(&site->peak, peak, bytes))
+			break;
+		peak = site->peak;
+	}
+}
+
+static inline void site_remove(struct pcs_mem_site *site, Int64 size)
+{
+	PCS_ATOMIC_ADD(&site->bytes, -size);
+	PCS_ATOMIC_ADD(&site->count, -1);
+}
+
+static inline void append_mem_ent(struct pcs_mem_shard *shard, struct pcs_mem *mem)
+{
+	if (!shard->head) {
+		shard->head = mem;
 		mem->next = mem;
 		mem->prev = mem;
 	}
 	else {
-		mem->next = _mem;
-		mem->prev = _mem->prev;
-		_mem->prev->next = mem;
-		_mem->prev = mem;
+		mem->next = shard->head;
+		mem->prev = shard->head->prev;
+		shard->head->prev->next = mem;
+		shard->head->prev = mem;
 	}
 }
 
-static inline void remove_mem_ent(struct pcs_mem *mem)
+static inline void remove_mem_ent(struct pcs_mem_shard *shard, struct pcs_mem *mem)
 {
 	if (mem->next == mem) {
-		_mem = 0;
+		shard->head = 0;
 		return;
 	}
 	else {
-		if (mem == _mem) _mem = _mem->next;
+		if (mem == shard->head) shard->head = shard->head->next;
 		mem->prev->next = mem->next;
 		mem->next->prev = mem->prev;
 	}
@@ -47,11 +175,21 @@ static inline void remove_mem_ent(struct pcs_mem *mem)
 PCS_API void *pcs_mem_malloc(size_t size, const char *filename, int line)
 {
 	struct pcs_mem *ent;
-	ent = (struct pcs_mem *) malloc(sizeof(struct pcs_mem) + size);
+	struct pcs_mem_shard *shard;
+	ent = (struct pcs_mem *) PCS_MALLOC(sizeof(struct pcs_mem) + size);
+	if (!ent)
+		return NULL;
+	shard = current_shard();
 	ent->ptr = (void *)(((char *)ent) + sizeof(struct pcs_mem));
 	ent->filename = filename;
 	ent->line = line;
-	append_mem_ent(ent);
+	ent->size = size;
+	ent->shard = shard;
+	ent->site = get_site(filename, line);
+	site_add(ent->site, (Int64)size);
+	PCS_MEM_LOCK(&shard->lock);
+	append_mem_ent(shard, ent);
+	PCS_MEM_UNLOCK(&shard->lock);
 	return ent->ptr;
 }
 
@@ -63,27 +201,70 @@ PCS_API void *pcs_mem_malloc_arg1(size_t sz)
 PCS_API void pcs_mem_free(void *ptr)
 {
 	struct pcs_mem *ent;
+	struct pcs_mem_shard *shard;
+	if (!ptr) return;
 	ent = (struct pcs_mem *)(((char *)ptr) - sizeof(struct pcs_mem));
-	remove_mem_ent(ent);
-	free(ent);
+	shard = ent->shard; /*可能在其他线程中释放，因此使用分配时的分片*/
+	PCS_MEM_LOCK(&shard->lock);
+	remove_mem_ent(shard, ent);
+	PCS_MEM_UNLOCK(&shard->lock);
+	site_remove(ent->site, (Int64)ent->size);
+	PCS_FREE(ent);
 }
 
 PCS_API void pcs_mem_print_leak()
 {
 	struct pcs_mem *ent, *p;
-	if (!_mem) return;
-	ent = _mem;
-	do {
-		_pcs_mem_printf("Memory leak on %p %s, %d\n", ent->ptr, ent->filename, ent->line);
-		ent = ent->next;
-	} while(ent != _mem);
-	ent = _mem;
-	do {
-		p = ent;
-		ent = ent->next;
-		free(p);
-	} while(ent != _mem);
-	_mem = 0;
+	struct pcs_mem_shard *shard;
+	int i;
+	for (i = 0; i < PCS_MEM_SHARD_COUNT; i++) {
+		shard = &_shards[i];
+		if (!shard->head) continue;
+		PCS_MEM_LOCK(&shard->lock);
+		if (!shard->head) {
+			PCS_MEM_UNLOCK(&shard->lock);
+			continue;
+		}
+		ent = shard->head;
+		do {
+			_pcs_mem_printf("Memory leak on %p %s, %d\n", ent->ptr, ent->filename, ent->line);
+			ent = ent->next;
+		} while(ent != shard->head);
+		ent = shard->head;
+		do {
+			p = ent;
+			ent = ent->next;
+			site_remove(p->site, (Int64)p->size);
+			PCS_FREE(p);
+		} while(ent != shard->head);
+		shard->head = 0;
+		PCS_MEM_UNLOCK(&shard->lock);
+	}
 }
 
+PCS_API void pcs_mem_print_stat()
+{
+	struct pcs_mem_site *site;
+	int i;
+	_pcs_mem_printf("%-40s %6s %12s %8s %12s %10s\n", "File", "Line", "Bytes", "Count", "Peak", "Total");
+	for (i = 0; i <= PCS_MEM_SITE_COUNT; i++) {
+		site = i < PCS_MEM_SITE_COUNT ? &_sites[i] : &_site_overflow;
+		if (!site->filename || !site->total) continue;
+		_pcs_mem_printf("%-40s %6d %12lld %8lld %12lld %10lld\n", site->filename, site->line,
+			(long long)site->bytes, (long long)site->count, (long long)site->peak, (long long)site->total);
+	}
+}
+
+#else
+
+PCS_API void *pcs_mem_malloc_arg1(size_t sz)
+{
+	return PCS_MALLOC(sz);
+}
+
+PCS_API void pcs_mem_free(void *ptr)
+{
+	PCS_FREE(ptr);
+}
 
+#endif
@@ -9,22 +9,46 @@
 #endif
 #include "pcs_defs.h"
 
+/*
+ * 发布版本中pcs_malloc, pcs_free直接使用系统的分配器。
+ * 编译时可通过以下宏选择其他分配器：
+ *   PCS_USE_MIMALLOC  使用mimalloc (mi_malloc, mi_free)，需链接 -lmimalloc
+ *   PCS_MALLOC, PCS_FREE  自定义分配函数，例：-DPCS_MALLOC=my_malloc -DPCS_FREE=my_free
+ * jemalloc, tcmalloc等替换系统malloc的分配器，链接即可生效，无需定义宏。
+ */
+#if defined(PCS_USE_MIMALLOC)
+#  include <mimalloc.h>
+#  define PCS_MALLOC	mi_malloc
+#  define PCS_FREE		mi_free
+#elif !defined(PCS_MALLOC) || !defined(PCS_FREE)
+#  include <stdlib.h>
+#  undef PCS_MALLOC
+#  undef PCS_FREE
+#  define PCS_MALLOC	malloc
+#  define PCS_FREE		free
+#endif
+
 extern void (*_pcs_mem_printf)(const char *format, ...);
+
+/*供第三方库（如cJSON）使用的分配函数，与pcs_malloc, pcs_free使用相同的分配器*/
+PCS_API void *pcs_mem_malloc_arg1(size_t sz);
+PCS_API void pcs_mem_free(void *p);
+
 #if defined(DEBUG) || defined(_DEBUG)
 
    PCS_API void *pcs_mem_malloc(size_t size, const char *filename, int line);
-   PCS_API void *pcs_mem_malloc_arg1(size_t sz);
-   PCS_API void pcs_mem_free(void *p);
    /*打印泄漏的内存*/
    PCS_API void pcs_mem_print_leak();
+   /*按分配位置打印内存使用统计：当前字节数、当前块数、峰值字节数、累计分配次数*/
+   PCS_API void pcs_mem_print_stat();
 
 #  define pcs_malloc(size)			pcs_mem_malloc(size, __FILE__, __LINE__)
 #  define pcs_free(ptr)				pcs_mem_free(ptr)
 #else
-#  include <stdlib.h>
 #  define pcs_mem_print_leak()		while(0)
-#  define pcs_malloc(size)			malloc(size)
-#  define pcs_free(ptr)				free(ptr)
+#  define pcs_mem_print_stat()		while(0)
+#  define pcs_malloc(size)			PCS_MALLOC(size)
+#  define pcs_free(ptr)				PCS_FREE(ptr)
 #endif
 
 #endif
@@ -24,6 +24,9 @@ PCS_API const char *pcs_pan_api_res_info_errmsg(int error)
 	case -10: //剩余空间不足
 		errmsg = "剩余空间不足";
 		break;
+	case PCS_PAN_API_ERR_REQUEST: //所在批次的请求失败
+		errmsg = "请求失败";
+		break;
 	default:
 		errmsg = "未知错误";
 	}
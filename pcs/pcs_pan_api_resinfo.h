@@ -1,6 +1,14 @@
 ﻿#ifndef _PCS_PAN_API_RESINFO_H
 #define _PCS_PAN_API_RESINFO_H
 
+#include <limits.h>
+
+/*
+批量操作中，某个批次的请求失败（网络错误或无法解析的响应）时，该批次中每一项的错误码。
+使用服务器不会返回的值，以免与接口的错误码混淆（-1 表示用户名和密码验证失败）
+*/
+#define PCS_PAN_API_ERR_REQUEST		INT_MIN
+
 /*网盘API返回数据格式*/
 typedef struct PcsPanApiResInfo {
 	char	*path;
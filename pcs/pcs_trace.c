@@ -0,0 +1,218 @@
+﻿#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#ifdef WIN32
+# include <windows.h>
+#else
+# include <pthread.h>
+# include <unistd.h>
+#endif
+
+#include "pcs_trace.h"
+
+#define PCS_TRACE_FLUSH_INTERVAL	1000000 /*距上次写盘超过该微秒数时写盘，守护进程被杀死时最多丢失这段时间的事件*/
+
+static FILE *trace_file = NULL;
+static volatile int trace_on = 0;
+static int trace_count = 0; /*已经写入的事件数*/
+static int trace_pid = 0;
+static Int64 trace_origin = 0;
+static Int64 trace_flushed = 0;
+#ifdef WIN32
+static CRITICAL_SECTION trace_lock;
+static volatile LONG trace_lock_inited = 0;
+#else
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static volatile int trace_next_tid = 0;
+static __thread int trace_tid = 0;
+#endif
+
+static Int64 trace_clock()
+{
+#ifdef WIN32
+	LARGE_INTEGER freq, counter;
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&counter);
+	return (Int64)(counter.QuadPart * 1000000.0 / freq.QuadPart);
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (Int64)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+static inline void trace_enter()
+{
+#ifdef WIN32
+	EnterCriticalSection(&trace_lock);
+#else
+	pthread_mutex_lock(&trace_lock);
+#endif
+}
+
+static inline void trace_leave()
+{
+#ifdef WIN32
+	LeaveCriticalSection(&trace_lock);
+#else
+	pthread_mutex_unlock(&trace_lock);
+#endif
+}
+
+/*Chrome trace 中线程以整数区分，这里为每个线程分配一个从1开始的小整数*/
+static int trace_thread_id()
+{
+#ifdef WIN32
+	return (int)GetCurrentThreadId();
+#else
+	if (!trace_tid)
+		trace_tid = __sync_add_and_fetch(&trace_next_tid, 1);
+	return trace_tid;
+#endif
+}
+
+/*写入JSON字符串，包含两侧的引号*/
+static void trace_write_string(const char *s)
+{
+	const unsigned char *p = (const unsigned char *)s;
+	fputc('"', trace_file);
+	while (*p) {
+		if (*p == '"' || *p == '\\')
+			fprintf(trace_file, "\\%c", *p);
+		else if (*p < 0x20)
+			fprintf(trace_file, "\\u%04x", *p);
+		else
+			fputc(*p, trace_file);
+		p++;
+	}
+	fputc('"', trace_file);
+}
+
+/*写入事件的公共部分，调用者负责加锁，并在之后写入args和结尾的 '}' */
+static void trace_write_head(const char *category, const char *name, char ph, Int64 ts)
+{
+	fputs(trace_count++ ? ",\n{" : "\n{", trace_file);
+	fputs("\"name\":", trace_file);
+	trace_write_string(name);
+	if (category) {
+		fputs(",\"cat\":", trace_file);
+		trace_write_string(category);
+	}
+	fprintf(trace_file, ",\"ph\":\"%c\",\"ts\":%lld,\"pid\":%d,\"tid\":%d",
+		ph, (long long)ts, trace_pid, trace_thread_id());
+}
+
+static void trace_write_tail(Int64 now)
+{
+	fputc('}', trace_file);
+	if (now - trace_flushed >= PCS_TRACE_FLUSH_INTERVAL) {
+		fflush(trace_file);
+		trace_flushed = now;
+	}
+}
+
+PCS_API int pcs_trace_open(const char *filename)
+{
+	FILE *fp;
+#ifdef WIN32
+	if (InterlockedCompareExchange(&trace_lock_inited, 1, 0) == 0)
+		InitializeCriticalSection(&trace_lock);
+#endif
+	pcs_trace_close();
+	fp = fopen(filename, "wb");
+	if (!fp)
+		return -1;
+	trace_enter();
+	trace_file = fp;
+	trace_count = 0;
+#ifdef WIN32
+	trace_pid = (int)GetCurrentProcessId();
+#else
+	trace_pid = (int)getpid();
+#endif
+	trace_origin = trace_clock();
+	trace_flushed = 0;
+	fputs("[", trace_file);
+	trace_on = 1;
+	trace_leave();
+	return 0;
+}
+
+PCS_API void pcs_trace_close()
+{
+	if (!trace_on)
+		return;
+	trace_enter();
+	/*其他线程可能已经先关闭*/
+	if (trace_on) {
+		trace_on = 0;
+		fputs("\n]\n", trace_file);
+		fclose(trace_file);
+		trace_file = NULL;
+	}
+	trace_leave();
+}
+
+PCS_API PcsBool pcs_trace_enabled()
+{
+	return trace_on ? PcsTrue : PcsFalse;
+}
+
+PCS_API Int64 pcs_trace_now()
+{
+	if (!trace_on)
+		return 0;
+	return trace_clock() - trace_origin;
+}
+
+PCS_API void pcs_trace_span(const char *category, const char *name, Int64 start, const char *detail)
+{
+	Int64 now;
+	if (!trace_on)
+		return;
+	now = trace_clock() - trace_origin;
+	trace_enter();
+	if (trace_on) {
+		trace_write_head(category, name, 'X', start);
+		fprintf(trace_file, ",\"dur\":%lld", (long long)(now - start));
+		if (detail) {
+			fputs(",\"args\":{\"detail\":", trace_file);
+			trace_write_string(detail);
+			fputc('}', trace_file);
+		}
+		trace_write_tail(now);
+	}
+	trace_leave();
+}
+
+PCS_API void pcs_trace_counter(const char *name, Int64 value)
+{
+	Int64 now;
+	if (!trace_on)
+		return;
+	now = trace_clock() - trace_origin;
+	trace_enter();
+	if (trace_on) {
+		trace_write_head(NULL, name, 'C', now);
+		fprintf(trace_file, ",\"args\":{\"value\":%lld}", (long long)value);
+		trace_write_tail(now);
+	}
+	trace_leave();
+}
+
+PCS_API void pcs_trace_thread_name(const char *name)
+{
+	Int64 now;
+	if (!trace_on)
+		return;
+	now = trace_clock() - trace_origin;
+	trace_enter();
+	if (trace_on) {
+		trace_write_head(NULL, "thread_name", 'M', 0);
+		fputs(",\"args\":{\"name\":", trace_file);
+		trace_write_string(name);
+		fputc('}', trace_file);
+		trace_write_tail(now);
+	}
+	trace_leave();
+}
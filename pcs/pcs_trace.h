@@ -0,0 +1,45 @@
+﻿#ifndef _PCS_TRACE_H
+#define _PCS_TRACE_H
+
+#include "pcs_defs.h"
+
+/*
+ * 以 Chrome trace event 格式记录时间线，生成的文件可以用 chrome://tracing 或 https://ui.perfetto.dev 打开。
+ * 调用 pcs_trace_open() 之前（或 pcs_trace_close() 之后）其他函数只判断一次全局标记就返回，
+ * 因此可以在关键路径上常驻埋点。所有函数都可以在多个线程中同时调用。
+ * 用法：
+ *     Int64 t = pcs_trace_now();
+ *     ...
+ *     pcs_trace_span("shell", "local scan", t, dir);
+*/
+
+/*
+ * 开始记录，事件写入filename中。已经在记录时先结束前一个文件。
+ * 成功返回0，无法创建文件返回-1
+*/
+PCS_API int pcs_trace_open(const char *filename);
+
+/*结束记录并关闭文件*/
+PCS_API void pcs_trace_close();
+
+/*是否正在记录*/
+PCS_API PcsBool pcs_trace_enabled();
+
+/*返回从pcs_trace_open()开始经过的微秒数，没有记录时返回0*/
+PCS_API Int64 pcs_trace_now();
+
+/*
+ * 记录一个从start（pcs_trace_now()的返回值）到现在的区间。
+ *   category 分类，如 "http"、"db"
+ *   name     区间的名字
+ *   detail   附加信息，如文件路径，可以为NULL
+*/
+PCS_API void pcs_trace_span(const char *category, const char *name, Int64 start, const char *detail);
+
+/*记录计数器的当前值，如并发数。同名的计数器在时间线上画成一条曲线*/
+PCS_API void pcs_trace_counter(const char *name, Int64 value);
+
+/*为当前线程命名，显示在时间线的左侧*/
+PCS_API void pcs_trace_thread_name(const char *name);
+
+#endif
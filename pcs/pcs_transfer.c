@@ -0,0 +1,572 @@
+﻿#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifdef WIN32
+# include <windows.h>
+#else
+# include <pthread.h>
+#endif
+
+#include "pcs_mem.h"
+#include "pcs_trace.h"
+#include "pcs_transfer.h"
+
+#define PCS_TRANSFER_AUTO_MIN	1
+#define PCS_TRANSFER_AUTO_MAX	8
+
+/*任务。从提交到被取走，依次经过 small 或 large 队列、running 列表、done 列表*/
+struct pcs_transfer_job {
+	void	*job;
+	int		rc;
+	UInt64	size;
+	double	start; /*开始执行的时间*/
+	struct pcs_transfer_job *next;
+};
+
+struct pcs_transfer_worker {
+	struct pcs_transfer_pool *pool;
+	Pcs		pcs;
+	int		busy; /*是否正在执行任务*/
+	Int64	mark; /*上一次计入吞吐统计时 pcs_transferred() 的值*/
+#ifndef WIN32
+	pthread_t tid;
+#endif
+};
+
+struct pcs_transfer_pool {
+	PcsTransferFunction	func;
+	void	*state;
+	Pcs		pcs; /*WIN32下在当前线程中执行时使用*/
+
+	struct pcs_transfer_job	*small, *small_tail; /*小任务，先进先出*/
+	struct pcs_transfer_job	*large; /*大任务，按大小降序排列*/
+	struct pcs_transfer_job	*running;
+	struct pcs_transfer_job	*done, *done_tail;
+	int		pending_count;
+	int		active; /*正在执行的任务数*/
+	int		large_active; /*正在执行的大任务数*/
+	int		total; /*提交后还没有被取走的任务数*/
+	int		stopping;
+
+	/*进度*/
+	UInt64	pending_bytes;
+	UInt64	running_bytes;
+	UInt64	done_bytes;
+	int		done_count;
+	double	first_start; /*第一个任务开始执行的时间，0表示还没有开始*/
+
+	/*AIMD 控制器*/
+	int		min;
+	int		max;
+	int		limit; /*当前允许同时进行的传输数*/
+	double	window_start;
+	double	window_bytes;
+	int		window_done;
+	int		window_errors;
+	int		window_queued; /*统计期间是否有任务因并发数限制而排队*/
+	double	last_rate; /*上一次统计的吞吐，字节/秒*/
+
+	struct pcs_transfer_worker *workers;
+	int		worker_count;
+#ifndef WIN32
+	pthread_mutex_t	mutex;
+	pthread_cond_t	work_cond; /*有新任务或并发数增加时通知工作线程*/
+	pthread_cond_t	done_cond; /*有任务完成时通知等待结果的线程*/
+	pthread_cond_t	sample_cond; /*结束时通知统计线程*/
+	pthread_t		sampler; /*统计线程，每隔 PCS_TRANSFER_SAMPLE_INTERVAL 秒调整一次并发数*/
+	int				has_sampler;
+#endif
+};
+
+static double pcs_transfer_clock()
+{
+#ifdef WIN32
+	return GetTickCount() / 1000.0;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+#endif
+}
+
+/*记录一个任务的结果。需持有锁*/
+static void pcs_transfer_sample(struct pcs_transfer_pool *pool, int failed)
+{
+	pool->window_done++;
+	if (failed) pool->window_errors++;
+	if (pool->pending_count > 0) pool->window_queued = 1;
+}
+
+#ifndef WIN32
+/*把工作线程从上一次统计到现在传输的字节数计入吞吐。需持有锁*/
+static void pcs_transfer_collect(struct pcs_transfer_worker *w)
+{
+	Int64 now = pcs_transferred(w->pcs);
+	w->pool->window_bytes += (double)(now - w->mark);
+	w->mark = now;
+}
+
+/*
+ * 根据上一次调整以来的吞吐和失败数调整并发数，由统计线程定时调用。需持有锁。
+ * 吞吐按工作线程实际传输的字节数计算，包括还没有完成的任务已经传输的部分，
+ * 因此大文件传输期间没有任务完成时也能调整。
+*/
+static void pcs_transfer_adjust(struct pcs_transfer_pool *pool)
+{
+	double now = pcs_transfer_clock(), elapsed, rate;
+	int limit = pool->limit, i;
+
+	elapsed = now - pool->window_start;
+	if (elapsed <= 0)
+		return;
+	for (i = 0; i < pool->worker_count; i++) {
+		if (pool->workers[i].busy)
+			pcs_transfer_collect(&pool->workers[i]);
+	}
+	if (pool->pending_count > 0) pool->window_queued = 1;
+
+	rate = pool->window_bytes / elapsed;
+	if (pool->window_errors >= pool->window_done * PCS_TRANSFER_ERROR_RATE && pool->window_errors > 0)
+		limit = limit / 2;
+	else if (pool->last_rate > 0 && rate < pool->last_rate * PCS_TRANSFER_DROP_RATIO)
+		limit = (int)(limit * PCS_TRANSFER_DECREASE);
+	else if (pool->window_queued)
+		limit++;
+	if (limit < pool->min) limit = pool->min;
+	if (limit > pool->max) limit = pool->max;
+	if (limit != pool->limit) {
+		pool->limit = limit;
+		pcs_trace_counter("transfer concurrency", limit);
+		pthread_cond_broadcast(&pool->work_cond);
+	}
+	pool->last_rate = rate;
+	pool->window_start = now;
+	pool->window_bytes = 0;
+	pool->window_done = 0;
+	pool->window_errors = 0;
+	pool->window_queued = pool->pending_count > 0;
+}
+#endif
+
+/*把任务放入 small 或 large 队列。需持有锁*/
+static void pcs_transfer_enqueue(struct pcs_transfer_pool *pool, struct pcs_transfer_job *item)
+{
+	struct pcs_transfer_job **pp;
+
+	if (item->size < PCS_TRANSFER_LARGE_SIZE) {
+		if (pool->small_tail)
+			pool->small_tail->next = item;
+		else
+			pool->small = item;
+		pool->small_tail = item;
+	}
+	else {
+		/*同样大小的任务保持提交顺序*/
+		pp = &pool->large;
+		while (*pp && (*pp)->size >= item->size)
+			pp = &(*pp)->next;
+		item->next = *pp;
+		*pp = item;
+	}
+	pool->pending_count++;
+	pool->pending_bytes += item->size;
+}
+
+/*
+ * 取出下一个要执行的任务，并发数已满或没有排队的任务时返回NULL。需持有锁。
+ * 有小任务在排队时，大任务最多占用一半的并发，其余留给小任务。
+*/
+static struct pcs_transfer_job *pcs_transfer_dequeue(struct pcs_transfer_pool *pool)
+{
+	struct pcs_transfer_job *item;
+
+	if (pool->active >= pool->limit)
+		return NULL;
+	if (pool->large && (!pool->small || pool->large_active < (pool->limit + 1) / 2)) {
+		item = pool->large;
+		pool->large = item->next;
+		pool->large_active++;
+	}
+	else if (pool->small) {
+		item = pool->small;
+		pool->small = item->next;
+		if (!pool->small) pool->small_tail = NULL;
+	}
+	else {
+		return NULL;
+	}
+	item->start = pcs_transfer_clock();
+	if (pool->first_start == 0) pool->first_start = item->start;
+	item->next = pool->running;
+	pool->running = item;
+	pool->pending_count--;
+	pool->pending_bytes -= item->size;
+	pool->running_bytes += item->size;
+	pool->active++;
+	return item;
+}
+
+/*估计进度。需持有锁*/
+static void pcs_transfer_estimate(struct pcs_transfer_pool *pool, PcsTransferProgress *pg)
+{
+	struct pcs_transfer_job *item;
+	double now = pcs_transfer_clock(), remaining, largest = 0, left;
+
+	memset(pg, 0, sizeof(PcsTransferProgress));
+	pg->pending = pool->pending_count;
+	pg->running = pool->active;
+	pg->done = pool->done_count;
+	pg->pending_bytes = pool->pending_bytes;
+	pg->running_bytes = pool->running_bytes;
+	pg->done_bytes = pool->done_bytes;
+	pg->limit = pool->limit;
+	pg->eta = -1;
+	if (pool->first_start > 0 && now > pool->first_start)
+		pg->rate = pool->done_bytes / (now - pool->first_start);
+	if (pool->pending_count == 0 && pool->active == 0) {
+		pg->eta = 0;
+		return;
+	}
+	if (pg->rate <= 0)
+		return;
+	/*执行中的任务按平均吞吐均分估计已经传输的部分*/
+	remaining = (double)pool->pending_bytes;
+	for (item = pool->running; item; item = item->next) {
+		left = (now - item->start) * pg->rate / pool->active;
+		left = left < (double)item->size ? (double)item->size - left : 0;
+		remaining += left;
+		if (left > largest) largest = left;
+	}
+	/*排队中最大的任务是 large 队列的第一个，小任务忽略*/
+	if (pool->large && (double)pool->large->size > largest)
+		largest = (double)pool->large->size;
+	pg->eta = remaining / pg->rate;
+	left = largest / (pg->rate / pool->limit);
+	if (left > pg->eta) pg->eta = left;
+}
+
+static void pcs_transfer_run(struct pcs_transfer_pool *pool, Pcs pcs, struct pcs_transfer_job *item, size_t *bytes)
+{
+	*bytes = 0;
+	item->rc = (*pool->func)(pcs, item->job, bytes, pool->state);
+}
+
+/*把完成的任务从 running 列表移到 done 列表。需持有锁*/
+static void pcs_transfer_finish(struct pcs_transfer_pool *pool, struct pcs_transfer_job *item, size_t bytes)
+{
+	struct pcs_transfer_job **pp;
+	PcsTransferProgress pg;
+
+	pp = &pool->running;
+	while (*pp && *pp != item)
+		pp = &(*pp)->next;
+	if (*pp) *pp = item->next;
+	pool->active--;
+	if (item->size >= PCS_TRANSFER_LARGE_SIZE) pool->large_active--;
+	pool->running_bytes -= item->size;
+	pool->done_bytes += bytes;
+	pool->done_count++;
+
+	item->next = NULL;
+	if (pool->done_tail)
+		pool->done_tail->next = item;
+	else
+		pool->done = item;
+	pool->done_tail = item;
+	pcs_transfer_sample(pool, item->rc != 0);
+	if (pcs_trace_enabled()) {
+		pcs_transfer_estimate(pool, &pg);
+		if (pg.eta >= 0) pcs_trace_counter("transfer eta", (Int64)pg.eta);
+	}
+}
+
+#ifndef WIN32
+static void *pcs_transfer_worker_main(void *arg)
+{
+	struct pcs_transfer_worker *w = (struct pcs_transfer_worker *)arg;
+	struct pcs_transfer_pool *pool = w->pool;
+	struct pcs_transfer_job *item;
+	size_t bytes;
+
+	pcs_trace_thread_name("transfer");
+	pthread_mutex_lock(&pool->mutex);
+	while (1) {
+		if (!(item = pcs_transfer_dequeue(pool))) {
+			if (pool->stopping && pool->pending_count == 0)
+				break;
+			if (pool->pending_count > 0) pool->window_queued = 1;
+			pthread_cond_wait(&pool->work_cond, &pool->mutex);
+			continue;
+		}
+		w->busy = 1;
+		w->mark = pcs_transferred(w->pcs);
+		pthread_mutex_unlock(&pool->mutex);
+		pcs_transfer_run(pool, w->pcs, item, &bytes);
+		pthread_mutex_lock(&pool->mutex);
+		pcs_transfer_collect(w);
+		w->busy = 0;
+		pcs_transfer_finish(pool, item, bytes);
+		pthread_cond_broadcast(&pool->done_cond);
+		pthread_cond_broadcast(&pool->work_cond);
+	}
+	pthread_mutex_unlock(&pool->mutex);
+	return NULL;
+}
+
+/*定时调整并发数，不依赖任务完成*/
+static void *pcs_transfer_sampler_main(void *arg)
+{
+	struct pcs_transfer_pool *pool = (struct pcs_transfer_pool *)arg;
+	struct timespec deadline;
+
+	pcs_trace_thread_name("transfer sampler");
+	pthread_mutex_lock(&pool->mutex);
+	while (!pool->stopping) {
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += (time_t)PCS_TRANSFER_SAMPLE_INTERVAL;
+		deadline.tv_nsec += (long)((PCS_TRANSFER_SAMPLE_INTERVAL - (time_t)PCS_TRANSFER_SAMPLE_INTERVAL) * 1000000000);
+		if (deadline.tv_nsec >= 1000000000) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000;
+		}
+		pthread_cond_timedwait(&pool->sample_cond, &pool->mutex, &deadline);
+		if (!pool->stopping)
+			pcs_transfer_adjust(pool);
+	}
+	pthread_mutex_unlock(&pool->mutex);
+	return NULL;
+}
+#endif
+
+PCS_API PcsTransferPool pcs_transfer_pool_create(Pcs pcs, int min, int max, PcsTransferFunction func, void *state)
+{
+	struct pcs_transfer_pool *pool;
+	int i;
+
+	if (min < 1) min = 1;
+	if (max < min) max = min;
+	pool = (struct pcs_transfer_pool *)pcs_malloc(sizeof(struct pcs_transfer_pool));
+	if (!pool)
+		return NULL;
+	memset(pool, 0, sizeof(struct pcs_transfer_pool));
+	pool->func = func;
+	pool->state = state;
+	pool->pcs = pcs;
+	pool->min = min;
+	pool->max = max;
+	pool->limit = min;
+	pool->window_start = pcs_transfer_clock();
+#ifndef WIN32
+	pthread_mutex_init(&pool->mutex, NULL);
+	pthread_cond_init(&pool->work_cond, NULL);
+	pthread_cond_init(&pool->done_cond, NULL);
+	pthread_cond_init(&pool->sample_cond, NULL);
+	pool->workers = (struct pcs_transfer_worker *)pcs_malloc(sizeof(struct pcs_transfer_worker) * max);
+	if (!pool->workers) {
+		pcs_transfer_pool_destroy(pool);
+		return NULL;
+	}
+	memset(pool->workers, 0, sizeof(struct pcs_transfer_worker) * max);
+	for (i = 0; i < max; i++) {
+		struct pcs_transfer_worker *w = &pool->workers[pool->worker_count];
+		w->pool = pool;
+		w->pcs = pcs_clone(pcs);
+		if (!w->pcs)
+			break;
+		if (pthread_create(&w->tid, NULL, &pcs_transfer_worker_main, w)) {
+			pcs_destroy(w->pcs);
+			w->pcs = NULL;
+			break;
+		}
+		pool->worker_count++;
+	}
+	if (pool->worker_count == 0) {
+		pcs_transfer_pool_destroy(pool);
+		return NULL;
+	}
+	/*线程数不足时，并发数最多为实际创建的线程数*/
+	if (pool->max > pool->worker_count) pool->max = pool->worker_count;
+	if (pool->min > pool->max) pool->min = pool->max;
+	if (pool->limit > pool->max) pool->limit = pool->max;
+	if (pool->min < pool->max && pthread_create(&pool->sampler, NULL, &pcs_transfer_sampler_main, pool) == 0)
+		pool->has_sampler = 1;
+#else
+	(void)i;
+	pool->min = pool->max = pool->limit = 1;
+#endif
+	pcs_trace_counter("transfer concurrency", pool->limit);
+	return pool;
+}
+
+PCS_API void pcs_transfer_pool_destroy(PcsTransferPool handle)
+{
+	struct pcs_transfer_pool *pool = (struct pcs_transfer_pool *)handle;
+	struct pcs_transfer_job *item;
+	int i;
+
+#ifndef WIN32
+	pthread_mutex_lock(&pool->mutex);
+	pool->stopping = 1;
+	pthread_cond_broadcast(&pool->work_cond);
+	pthread_cond_broadcast(&pool->sample_cond);
+	pthread_mutex_unlock(&pool->mutex);
+	if (pool->has_sampler)
+		pthread_join(pool->sampler, NULL);
+	for (i = 0; i < pool->worker_count; i++) {
+		pthread_join(pool->workers[i].tid, NULL);
+		pcs_destroy(pool->workers[i].pcs);
+	}
+	if (pool->workers) pcs_free(pool->workers);
+	pthread_mutex_destroy(&pool->mutex);
+	pthread_cond_destroy(&pool->work_cond);
+	pthread_cond_destroy(&pool->done_cond);
+	pthread_cond_destroy(&pool->sample_cond);
+#else
+	(void)i;
+#endif
+	while (pool->done) {
+		item = pool->done;
+		pool->done = item->next;
+		pcs_free(item);
+	}
+	pcs_free(pool);
+}
+
+PCS_API void pcs_transfer_submit(PcsTransferPool handle, void *job, UInt64 size)
+{
+	struct pcs_transfer_pool *pool = (struct pcs_transfer_pool *)handle;
+	struct pcs_transfer_job *item;
+#ifdef WIN32
+	size_t bytes;
+#endif
+
+	item = (struct pcs_transfer_job *)pcs_malloc(sizeof(struct pcs_transfer_job));
+	memset(item, 0, sizeof(struct pcs_transfer_job));
+	item->job = job;
+	item->size = size;
+#ifdef WIN32
+	pool->total++;
+	pcs_transfer_enqueue(pool, item);
+	item = pcs_transfer_dequeue(pool);
+	pcs_transfer_run(pool, pool->pcs, item, &bytes);
+	pcs_transfer_finish(pool, item, bytes);
+#else
+	pthread_mutex_lock(&pool->mutex);
+	pool->total++;
+	pcs_transfer_enqueue(pool, item);
+	pthread_cond_signal(&pool->work_cond);
+	pthread_mutex_unlock(&pool->mutex);
+#endif
+}
+
+/*从 done 列表中取出任务，job为NULL时取第一个。需持有锁*/
+static struct pcs_transfer_job *pcs_transfer_take(struct pcs_transfer_pool *pool, void *job)
+{
+	struct pcs_transfer_job *item = pool->done, *prev = NULL;
+	while (item && job && item->job != job) {
+		prev = item;
+		item = item->next;
+	}
+	if (!item)
+		return NULL;
+	if (prev)
+		prev->next = item->next;
+	else
+		pool->done = item->next;
+	if (pool->done_tail == item)
+		pool->done_tail = prev;
+	pool->total--;
+	return item;
+}
+
+PCS_API void *pcs_transfer_wait(PcsTransferPool handle, void *job, int *rc)
+{
+	return pcs_transfer_wait_timeout(handle, job, -1, rc);
+}
+
+PCS_API void *pcs_transfer_wait_timeout(PcsTransferPool handle, void *job, int timeout, int *rc)
+{
+	struct pcs_transfer_pool *pool = (struct pcs_transfer_pool *)handle;
+	struct pcs_transfer_job *item = NULL;
+	void *res = NULL;
+#ifndef WIN32
+	struct timespec deadline;
+
+	if (timeout >= 0) {
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += timeout / 1000;
+		deadline.tv_nsec += (long)(timeout % 1000) * 1000000;
+		if (deadline.tv_nsec >= 1000000000) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000;
+		}
+	}
+	pthread_mutex_lock(&pool->mutex);
+	while (pool->total > 0 && !(item = pcs_transfer_take(pool, job))) {
+		if (timeout < 0)
+			pthread_cond_wait(&pool->done_cond, &pool->mutex);
+		else if (pthread_cond_timedwait(&pool->done_cond, &pool->mutex, &deadline))
+			break;
+	}
+	/*超时的同时任务恰好完成*/
+	if (!item && pool->total > 0)
+		item = pcs_transfer_take(pool, job);
+	pthread_mutex_unlock(&pool->mutex);
+#else
+	(void)timeout;
+	item = pcs_transfer_take(pool, job);
+#endif
+	if (item) {
+		res = item->job;
+		if (rc) *rc = item->rc;
+		pcs_free(item);
+	}
+	return res;
+}
+
+PCS_API void pcs_transfer_progress(PcsTransferPool handle, PcsTransferProgress *progress)
+{
+	struct pcs_transfer_pool *pool = (struct pcs_transfer_pool *)handle;
+#ifndef WIN32
+	pthread_mutex_lock(&pool->mutex);
+	pcs_transfer_estimate(pool, progress);
+	pthread_mutex_unlock(&pool->mutex);
+#else
+	pcs_transfer_estimate(pool, progress);
+#endif
+}
+
+PCS_API int pcs_transfer_limit(PcsTransferPool handle)
+{
+	struct pcs_transfer_pool *pool = (struct pcs_transfer_pool *)handle;
+	return pool->limit;
+}
+
+PCS_API int pcs_transfer_parse_range(const char *str, int *min, int *max)
+{
+	char *end;
+	long a, b;
+	if (!str || !str[0])
+		return -1;
+	if (strcmp(str, "auto") == 0) {
+		*min = PCS_TRANSFER_AUTO_MIN;
+		*max = PCS_TRANSFER_AUTO_MAX;
+		return 0;
+	}
+	a = strtol(str, &end, 10);
+	if (end == str || a < 1)
+		return -1;
+	if (*end == '\0') {
+		*min = *max = (int)a;
+		return 0;
+	}
+	if (*end != '-')
+		return -1;
+	str = end + 1;
+	b = strtol(str, &end, 10);
+	if (end == str || *end != '\0' || b < a)
+		return -1;
+	*min = (int)a;
+	*max = (int)b;
+	return 0;
+}
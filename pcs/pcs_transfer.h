@@ -0,0 +1,100 @@
+﻿#ifndef _PCS_TRANSFER_H
+#define _PCS_TRANSFER_H
+
+#include "pcs.h"
+
+/*
+ * 并发传输池。
+ * 在多个工作线程中执行上传或下载，每个工作线程使用由 pcs_clone() 复制的Pcs对象。
+ * 同时进行的传输数在 [min, max] 之间由 AIMD 控制器自动调整：
+ * 每隔 PCS_TRANSFER_SAMPLE_INTERVAL 秒统计一次工作线程实际传输的字节数（包括执行中的任务已经传输的部分）和失败数，
+ *   失败率达到 PCS_TRANSFER_ERROR_RATE 时，并发数减半；
+ *   吞吐比上一次统计低于 PCS_TRANSFER_DROP_RATIO 时，并发数乘以 PCS_TRANSFER_DECREASE；
+ *   否则，如果统计期间有任务在排队，并发数加1。
+ * min 等于 max 时并发数固定。WIN32下不创建工作线程，任务在 pcs_transfer_submit() 中直接执行。
+ * 任务按提交时给出的大小分为两类：
+ *   小于 PCS_TRANSFER_LARGE_SIZE 的小任务按提交顺序执行，可占满所有并发；
+ *   大任务按从大到小的顺序执行（最长任务优先，缩短整体完成时间），
+ *   有小任务在排队时，大任务最多占用一半的并发。
+ * 用法：
+ *     pool = pcs_transfer_pool_create(pcs, 1, 8, &run, NULL);
+ *     pcs_transfer_submit(pool, job1, size1);
+ *     pcs_transfer_submit(pool, job2, size2);
+ *     while ((job = pcs_transfer_wait(pool, NULL, &rc)) != NULL) { ...处理结果... }
+ *     pcs_transfer_pool_destroy(pool);
+*/
+
+#define PCS_TRANSFER_SAMPLE_INTERVAL	2.0
+#define PCS_TRANSFER_ERROR_RATE		0.1
+#define PCS_TRANSFER_DROP_RATIO		0.7
+#define PCS_TRANSFER_DECREASE		0.75
+#define PCS_TRANSFER_LARGE_SIZE		(16 * 1024 * 1024)
+
+typedef void *PcsTransferPool;
+
+/*传输池的进度，由 pcs_transfer_progress() 填充*/
+typedef struct PcsTransferProgress {
+	int		pending; /*排队中的任务数*/
+	int		running; /*执行中的任务数*/
+	int		done; /*已完成的任务数*/
+	UInt64	pending_bytes; /*排队中的任务的总大小*/
+	UInt64	running_bytes; /*执行中的任务的总大小*/
+	UInt64	done_bytes; /*已完成的任务传输的字节数*/
+	double	rate; /*从第一个任务开始到现在的平均吞吐，字节/秒*/
+	double	eta; /*预计剩余的秒数，无法估计时为-1*/
+	int		limit; /*当前允许同时进行的传输数*/
+} PcsTransferProgress;
+
+/*
+ * 在工作线程中执行一个任务。
+ *   pcs    该工作线程专用的Pcs对象
+ *   job    pcs_transfer_submit() 传入的任务
+ *   bytes  用于接收成功传输的字节数，计入进度。吞吐按pcs实际传输的字节数统计，任务应使用该pcs传输
+ *   state  pcs_transfer_pool_create() 传入的state
+ * 成功返回0，失败返回非0值
+*/
+typedef int (*PcsTransferFunction)(Pcs pcs, void *job, size_t *bytes, void *state);
+
+/*
+ * 创建传输池，工作线程的Pcs对象从pcs复制，需在使用pcs的线程中调用。
+ * min和max为并发数的范围，min小于1时视为1，max小于min时视为min。
+ * 成功返回创建的对象，失败返回NULL。
+*/
+PCS_API PcsTransferPool pcs_transfer_pool_create(Pcs pcs, int min, int max, PcsTransferFunction func, void *state);
+
+/*等待所有任务完成后，结束工作线程并释放资源。没有被 pcs_transfer_wait() 取走的结果一并丢弃*/
+PCS_API void pcs_transfer_pool_destroy(PcsTransferPool pool);
+
+/*提交一个任务。size为任务要传输的字节数，用于安排执行顺序和估计剩余时间*/
+PCS_API void pcs_transfer_submit(PcsTransferPool pool, void *job, UInt64 size);
+
+/*
+ * 等待任务完成并取走其结果。
+ * job为NULL时等待任意一个任务，否则等待指定的任务。rc用于接收PcsTransferFunction的返回值。
+ * 返回完成的任务；没有未取走的任务时返回NULL。
+*/
+PCS_API void *pcs_transfer_wait(PcsTransferPool pool, void *job, int *rc);
+
+/*
+ * 同 pcs_transfer_wait()，最多等待 timeout 毫秒，timeout为0时不等待，小于0时一直等待。
+ * 超时或者没有未取走的任务时返回NULL。
+*/
+PCS_API void *pcs_transfer_wait_timeout(PcsTransferPool pool, void *job, int timeout, int *rc);
+
+/*
+ * 获取传输池的进度。
+ * 预计剩余时间按排队和执行中的任务的总大小除以平均吞吐估计，
+ * 并且不少于最大的剩余任务以单个传输的速度完成所需的时间。
+*/
+PCS_API void pcs_transfer_progress(PcsTransferPool pool, PcsTransferProgress *progress);
+
+/*当前允许同时进行的传输数*/
+PCS_API int pcs_transfer_limit(PcsTransferPool pool);
+
+/*
+ * 解析并发数的设置："N" 表示固定为N，"MIN-MAX" 表示在该范围内自动调整，"auto" 等同于 "1-8"。
+ * 成功返回0，格式错误返回-1。
+*/
+PCS_API int pcs_transfer_parse_range(const char *str, int *min, int *max);
+
+#endif
@@ -178,19 +178,33 @@ PCS_API PcsBool pcs_utils_streq(const char *str1, const char *str2, int len)
 }
 
 
+/*把16字节的MD5值转换为32个字符的十六进制字符串，写入buf中*/
+static inline char *md5_tostr(const unsigned char *md, char *buf)
+{
+	static const char hex[] = "0123456789abcdef";
+	int i;
+	for (i = 0; i < 16; i++) {
+		buf[i * 2] = hex[(md[i] >> 4) & 0xF];
+		buf[i * 2 + 1] = hex[md[i] & 0xF];
+	}
+	buf[32] = '\0';
+	return buf;
+}
+
 /**
 * 字符串md5
 */
 PCS_API const char *md5_string(const char *str)
 {
 	static char tmp[33] = { '\0' };
+	return md5_string_r(str, tmp);
+}
+
+PCS_API char *md5_string_r(const char *str, char *buf)
+{
 	unsigned char md[16];
-	int i;
 	MD5((const unsigned char*)str, strlen(str), md);
-	for (i = 0; i<16; i++){
-		sprintf(&tmp[i * 2], "%02x", md[i]);
-	}
-	return tmp;
+	return md5_tostr(md, buf);
 }
 
 /**
@@ -199,6 +213,11 @@ PCS_API const char *md5_string(const char *str)
 PCS_API const unsigned char *md5_string_raw(const char *str)
 {
 	static unsigned char md[16];
+	return md5_string_raw_r(str, md);
+}
+
+PCS_API unsigned char *md5_string_raw_r(const char *str, unsigned char *md)
+{
 	MD5((const unsigned char*)str, strlen(str), md);
 	return md;
 }
@@ -226,9 +245,14 @@ PCS_API const unsigned char *md5_string_raw(const char *str)
 PCS_API const char *md5_file(const char *file_name)
 {
 	static char tmp[33] = { '\0' };
+	return md5_file_r(file_name, tmp);
+}
+
+PCS_API char *md5_file_r(const char *file_name, char *buf)
+{
 	MD5_CTX md5;
 	unsigned char md[16];
-	int length, i;
+	int length;
 	char buffer[1024];
 	FILE *file;
 	MD5_Init(&md5);
@@ -237,14 +261,11 @@ PCS_API const char *md5_file(const char *file_name)
 		printf("%s can't be openedn", file_name);
 		return 0;
 	}
-	while (length = fread(buffer, 1, 1024, file))
+	while ((length = fread(buffer, 1, 1024, file)) > 0)
 		MD5_Update(&md5, buffer, length);
 	MD5_Final(md, &md5);
 	fclose(file);
-	for (i = 0; i<16; i++){
-		sprintf(&tmp[i * 2], "%02x", md[i]);
-	}
-	return tmp;
+	return md5_tostr(md, buf);
 }
 
 /*把32位整数按从高位到低位顺序填充到buf的4个字节中。
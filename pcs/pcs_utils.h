@@ -29,16 +29,31 @@ PCS_API int pcs_utils_strcmpi(const char *str1, const char *str2);
 PCS_API PcsBool pcs_utils_streq(const char *str1, const char *str2, int len);
 /**
 * 字符串md5
+* 返回值指向静态内存，非线程安全，多线程中请使用md5_string_r
 */
 PCS_API const char *md5_string(const char *str);
 /**
 * 字符串md5。返回16字节的MD5值
+* 返回值指向静态内存，非线程安全，多线程中请使用md5_string_raw_r
 */
 PCS_API const unsigned char *md5_string_raw(const char *str);
 /**
 * 文件 md5
+* 返回值指向静态内存，非线程安全，多线程中请使用md5_file_r
 */
 PCS_API const char *md5_file(const char *file_name);
+/**
+* 字符串md5的可重入版本。结果写入buf中，buf至少33字节。返回buf
+*/
+PCS_API char *md5_string_r(const char *str, char *buf);
+/**
+* 字符串md5的可重入版本。16字节的MD5值写入md中，md至少16字节。返回md
+*/
+PCS_API unsigned char *md5_string_raw_r(const char *str, unsigned char *md);
+/**
+* 文件md5的可重入版本。结果写入buf中，buf至少33字节。成功返回buf，文件无法打开则返回NULL
+*/
+PCS_API char *md5_file_r(const char *file_name, char *buf);
 
 /*把32位整数按从高位到低位顺序填充到buf的4个字节中。
 * 例：0xF1E2D3C4 填充后 buf[0] = 0xF1, buf[1] = 0xE2, buf[2] = 0xD3, buf[3] = 0xC4.buf中其他项无改动
@@ -45,9 +45,75 @@ rb_red_blk_tree* RBTreeCreate(int (*CompFunc) (const void*, const void*, void*),
   temp->parent=temp->left=temp->right=newTree->nil;
   temp->key=0;
   temp->red=0;
+  newTree->slabs=NULL;
+  newTree->freeNodes=NULL;
   return(newTree);
 }
 
+/***********************************************************************/
+/*  FUNCTION:  RBNodeSlabCreate */
+/**/
+/*  INPUTS:  tree is the tree that will own the slab and count is the */
+/*           number of nodes in the slab */
+/**/
+/*  OUTPUT:  the new slab, already linked into tree->slabs */
+/**/
+/*  Modifies Input: tree */
+/***********************************************************************/
+
+static rb_node_slab* RBNodeSlabCreate(rb_red_blk_tree* tree, int count) {
+  rb_node_slab* slab;
+
+  slab=(rb_node_slab*) SafeMalloc(sizeof(rb_node_slab) + (count - 1) * sizeof(rb_red_blk_node));
+  slab->count=count;
+  slab->used=0;
+  slab->next=tree->slabs;
+  tree->slabs=slab;
+  return(slab);
+}
+
+/***********************************************************************/
+/*  FUNCTION:  RBNodeAlloc */
+/**/
+/*  INPUTS:  tree is the tree the node is for */
+/**/
+/*  OUTPUT:  an uninitialized node, taken from the free list if possible */
+/*           and otherwise from the current slab */
+/**/
+/*  Modifies Input: tree */
+/***********************************************************************/
+
+static rb_red_blk_node* RBNodeAlloc(rb_red_blk_tree* tree) {
+  rb_red_blk_node* x;
+  rb_node_slab* slab=tree->slabs;
+
+  if ((x=tree->freeNodes)) { /* assignment intentional */
+    tree->freeNodes=x->left;
+    return(x);
+  }
+  if (!slab || slab->used == slab->count) {
+    slab=RBNodeSlabCreate(tree, RB_NODE_SLAB_SIZE);
+  }
+  return(&slab->nodes[slab->used++]);
+}
+
+/***********************************************************************/
+/*  FUNCTION:  RBNodeFree */
+/**/
+/*  INPUTS:  tree is the tree x belongs to and x is a node that is no */
+/*           longer in the tree */
+/**/
+/*  EFFECTS:  puts x on the free list so that it can be reused.  The */
+/*            memory itself is released by RBTreeDestroy. */
+/**/
+/*  Modifies Input: tree, x */
+/***********************************************************************/
+
+static void RBNodeFree(rb_red_blk_tree* tree, rb_red_blk_node* x) {
+  x->left=tree->freeNodes;
+  tree->freeNodes=x;
+}
+
 /***********************************************************************/
 /*  FUNCTION:  LeftRotate */
 /**/
@@ -226,7 +292,7 @@ rb_red_blk_node * RBTreeInsert(rb_red_blk_tree* tree, void* key, void* info) {
   rb_red_blk_node * x;
   rb_red_blk_node * newNode;
 
-  x=(rb_red_blk_node*) SafeMalloc(sizeof(rb_red_blk_node));
+  x=RBNodeAlloc(tree);
   x->key=key;
   x->info=info;
 
@@ -347,15 +413,59 @@ rb_red_blk_node* TreePredecessor(rb_red_blk_tree* tree, rb_red_blk_node* x) {
   }
 }
 
+/***********************************************************************/
+/*  FUNCTION:  TreeMinimum */
+/**/
+/*    INPUTS:  tree is the tree in question, and x is the root of a subtree */
+/**/
+/*    OUTPUT:  the leftmost node of the subtree rooted at x, or nil if x */
+/*             is nil */
+/**/
+/*    Modifies Input: none */
+/***********************************************************************/
+
+static rb_red_blk_node* TreeMinimum(rb_red_blk_tree* tree, rb_red_blk_node* x) {
+  rb_red_blk_node* nil=tree->nil;
+
+  if (x == nil) return(nil);
+  while(x->left != nil) {
+    x=x->left;
+  }
+  return(x);
+}
+
+/***********************************************************************/
+/*  FUNCTION:  TreeSubtreeEnd */
+/**/
+/*    INPUTS:  tree is the tree in question, and x is the root of a subtree */
+/**/
+/*    OUTPUT:  the inorder successor of the last node of the subtree, i.e. */
+/*             the node at which an inorder walk of the subtree stops */
+/**/
+/*    Modifies Input: none */
+/***********************************************************************/
+
+static rb_red_blk_node* TreeSubtreeEnd(rb_red_blk_tree* tree, rb_red_blk_node* x) {
+  rb_red_blk_node* nil=tree->nil;
+
+  if (x == nil) return(nil);
+  while(x->right != nil) {
+    x=x->right;
+  }
+  return(TreeSuccessor(tree,x));
+}
+
 /***********************************************************************/
 /*  FUNCTION:  InorderTreePrint */
 /**/
-/*    INPUTS:  tree is the tree to print and x is the current inorder node */
+/*    INPUTS:  tree is the tree to print and x is the root of the subtree */
+/*             to print */
 /**/
 /*    OUTPUT:  none  */
 /**/
-/*    EFFECTS:  This function recursively prints the nodes of the tree */
-/*              inorder using the PrintKey and PrintInfo functions. */
+/*    EFFECTS:  This function prints the nodes of the subtree inorder */
+/*              using the PrintKey and PrintInfo functions.  It walks */
+/*              the parent pointers instead of recursing. */
 /**/
 /*    Modifies Input: none */
 /**/
@@ -365,8 +475,9 @@ rb_red_blk_node* TreePredecessor(rb_red_blk_tree* tree, rb_red_blk_node* x) {
 void InorderTreePrint(rb_red_blk_tree* tree, rb_red_blk_node* x) {
   rb_red_blk_node* nil=tree->nil;
   rb_red_blk_node* root=tree->root;
-  if (x != tree->nil) {
-    InorderTreePrint(tree,x->left);
+  rb_red_blk_node* end=TreeSubtreeEnd(tree,x);
+
+  for (x=TreeMinimum(tree,x); x != end; x=TreeSuccessor(tree,x)) {
     printf("info=");
 	tree->PrintInfo(x->info, tree->printInfoState);
     printf("  key="); 
@@ -378,22 +489,16 @@ void InorderTreePrint(rb_red_blk_tree* tree, rb_red_blk_node* x) {
     printf("  p->key=");
 	if (x->parent == root) printf("NULL"); else tree->PrintKey(x->parent->key, tree->printKeyState);
     printf("  red=%i\n",x->red);
-    InorderTreePrint(tree,x->right);
   }
 }
 
 int InorderRBTreeEnumerateInfo(rb_red_blk_tree* tree, rb_red_blk_node* x) {
 	int rc;
-	rb_red_blk_node* nil = tree->nil;
-	rb_red_blk_node* root = tree->root;
-	if (x != tree->nil) {
-		if ((rc = InorderRBTreeEnumerateInfo(tree, x->left)) != 0)
-			return rc;
+	rb_red_blk_node* end = TreeSubtreeEnd(tree, x);
+	for (x = TreeMinimum(tree, x); x != end; x = TreeSuccessor(tree, x)) {
 		if ((rc = tree->EnumerateInfo(x->info, tree->enumerateInfoState)) != 0) {
 			return rc;
 		}
-		if ((rc = InorderRBTreeEnumerateInfo(tree, x->right)) != 0)
-			return rc;
 	}
 	return 0;
 }
@@ -402,12 +507,15 @@ int InorderRBTreeEnumerateInfo(rb_red_blk_tree* tree, rb_red_blk_node* x) {
 /***********************************************************************/
 /*  FUNCTION:  TreeDestHelper */
 /**/
-/*    INPUTS:  tree is the tree to destroy and x is the current node */
+/*    INPUTS:  tree is the tree to destroy and x is the root of the */
+/*             subtree to destroy */
 /**/
 /*    OUTPUT:  none  */
 /**/
-/*    EFFECTS:  This function recursively destroys the nodes of the tree */
-/*              postorder using the DestroyKey and DestroyInfo functions. */
+/*    EFFECTS:  This function destroys the keys and infos of the subtree */
+/*              inorder using the DestroyKey and DestroyInfo functions. */
+/*              The nodes themselves live in the tree's slabs and are */
+/*              released by RBTreeDestroy. */
 /**/
 /*    Modifies Input: tree, x */
 /**/
@@ -415,13 +523,11 @@ int InorderRBTreeEnumerateInfo(rb_red_blk_tree* tree, rb_red_blk_node* x) {
 /***********************************************************************/
 
 void TreeDestHelper(rb_red_blk_tree* tree, rb_red_blk_node* x) {
-  rb_red_blk_node* nil=tree->nil;
-  if (x != nil) {
-    TreeDestHelper(tree,x->left);
-    TreeDestHelper(tree,x->right);
+  rb_red_blk_node* end=TreeSubtreeEnd(tree,x);
+
+  for (x=TreeMinimum(tree,x); x != end; x=TreeSuccessor(tree,x)) {
     tree->DestroyKey(x->key, tree->destroyKeyState);
     tree->DestroyInfo(x->info, tree->destroyInfoState);
-    free(x);
   }
 }
 
@@ -440,7 +546,14 @@ void TreeDestHelper(rb_red_blk_tree* tree, rb_red_blk_node* x) {
 /***********************************************************************/
 
 void RBTreeDestroy(rb_red_blk_tree* tree) {
+  rb_node_slab* slab;
+  rb_node_slab* next;
+
   TreeDestHelper(tree,tree->root->left);
+  for (slab=tree->slabs; slab; slab=next) {
+    next=slab->next;
+    free(slab);
+  }
   free(tree->root);
   free(tree->nil);
   free(tree);
@@ -651,12 +764,12 @@ void RBDelete(rb_red_blk_tree* tree, rb_red_blk_node* z){
     } else {
       z->parent->right=y;
     }
-    free(z); 
+    RBNodeFree(tree,z); 
   } else {
     tree->DestroyKey(y->key, tree->destroyKeyState);
     tree->DestroyInfo(y->info, tree->destroyInfoState);
     if (!(y->red)) RBDeleteFixUp(tree,x);
-    free(y);
+    RBNodeFree(tree,y);
   }
   
 #ifdef DEBUG_ASSERT
@@ -703,4 +816,104 @@ stk_stack* RBEnumerate(rb_red_blk_tree* tree, void* low, void* high) {
   
 
 
+/***********************************************************************/
+/*  FUNCTION:  RBTreeFirst */
+/**/
+/*    INPUTS:  tree is the tree to walk */
+/**/
+/*    OUTPUT:  the smallest node of the tree, or NULL if the tree is empty */
+/**/
+/*    Modifies Input: none */
+/***********************************************************************/
+
+rb_red_blk_node* RBTreeFirst(rb_red_blk_tree* tree) {
+  rb_red_blk_node* x=TreeMinimum(tree,tree->root->left);
+
+  return(x == tree->nil ? NULL : x);
+}
+
+
+/***********************************************************************/
+/*  FUNCTION:  RBTreeNext */
+/**/
+/*    INPUTS:  tree is the tree to walk and x is the current node */
+/**/
+/*    OUTPUT:  the inorder successor of x, or NULL after the last node */
+/**/
+/*    Modifies Input: none */
+/***********************************************************************/
+
+rb_red_blk_node* RBTreeNext(rb_red_blk_tree* tree, rb_red_blk_node* x) {
+  x=TreeSuccessor(tree,x);
+  return(x == tree->nil ? NULL : x);
+}
+
+
+/***********************************************************************/
+/*  FUNCTION:  BulkLoadHelper */
+/**/
+/*    INPUTS:  nodes[lo..hi] are the nodes to link, already holding their */
+/*             keys in sorted order.  depth is the depth of the subtree */
+/*             root and nodes at redDepth are colored red. */
+/**/
+/*    OUTPUT:  the root of the balanced subtree */
+/**/
+/*    Note:    Splitting at the middle keeps every level but the last */
+/*             full, so coloring only the partial last level red gives */
+/*             every path the same number of black nodes. */
+/***********************************************************************/
+
+static rb_red_blk_node* BulkLoadHelper(rb_red_blk_tree* tree, rb_red_blk_node* nodes,
+				       int lo, int hi, int depth, int redDepth,
+				       rb_red_blk_node* parent) {
+  rb_red_blk_node* x;
+  int mid;
+
+  if (lo > hi) return(tree->nil);
+  mid=lo + (hi - lo) / 2;
+  x=&nodes[mid];
+  x->parent=parent;
+  x->red=(depth == redDepth);
+  x->left=BulkLoadHelper(tree,nodes,lo,mid - 1,depth + 1,redDepth,x);
+  x->right=BulkLoadHelper(tree,nodes,mid + 1,hi,depth + 1,redDepth,x);
+  return(x);
+}
+
 
+/***********************************************************************/
+/*  FUNCTION:  RBTreeBulkLoad */
+/**/
+/*    INPUTS:  tree is an empty tree, keys[0..count-1] are sorted in */
+/*             ascending order with respect to the Compare function and */
+/*             infos (which may be NULL) holds the matching infos */
+/**/
+/*    OUTPUT:  0 on success, -1 if the tree is not empty */
+/**/
+/*    EFFECT:  Builds a balanced red-black tree in O(count) time.  All */
+/*             nodes are allocated from a single slab. */
+/**/
+/*    Modifies Input: tree */
+/***********************************************************************/
+
+int RBTreeBulkLoad(rb_red_blk_tree* tree, void** keys, void** infos, int count) {
+  rb_node_slab* slab;
+  int i, height, redDepth;
+
+  if (tree->root->left != tree->nil) return(-1);
+  if (count <= 0) return(0);
+  slab=RBNodeSlabCreate(tree, count);
+  slab->used=count;
+  for (i=0; i < count; i++) {
+    slab->nodes[i].key=keys[i];
+    slab->nodes[i].info=infos ? infos[i] : NULL;
+  }
+  /* height is the depth of the deepest node, root at depth 0 */
+  for (height=0; (2 << height) <= count; height++);
+  redDepth=((2 << height) - 1 == count) ? -1 : height;
+  tree->root->left=BulkLoadHelper(tree,slab->nodes,0,count - 1,0,redDepth,tree->root);
+
+#ifdef DEBUG_ASSERT
+  Assert(!tree->root->left->red,"root not black in RBTreeBulkLoad");
+#endif
+  return(0);
+}
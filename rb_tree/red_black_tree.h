@@ -34,6 +34,20 @@ typedef struct rb_red_blk_node {
   struct rb_red_blk_node* parent;
 } rb_red_blk_node;
 
+/*  Nodes are carved out of slabs instead of being malloced one by one. */
+/*  Deleted nodes go onto a free list and are reused by later inserts, */
+/*  and all slabs are released at once by RBTreeDestroy. */
+#ifndef RB_NODE_SLAB_SIZE
+#define RB_NODE_SLAB_SIZE 1024
+#endif
+
+typedef struct rb_node_slab {
+  struct rb_node_slab* next;
+  int count; /* number of nodes in this slab */
+  int used;  /* number of nodes handed out from this slab */
+  rb_red_blk_node nodes[1];
+} rb_node_slab;
+
 
 /* Compare(a,b) should return 1 if *a > *b, -1 if *a < *b, and 0 otherwise */
 /* Destroy(a) takes a pointer to whatever key might be and frees it accordingly */
@@ -58,6 +72,8 @@ typedef struct rb_red_blk_tree {
   /*  that the root and nil nodes do not require special cases in the code */
   rb_red_blk_node* root;             
   rb_red_blk_node* nil;              
+  rb_node_slab* slabs;
+  rb_red_blk_node* freeNodes;
 } rb_red_blk_tree;
 
 rb_red_blk_tree* RBTreeCreate(int (*CompFunc)(const void*, const void*, void*),
@@ -74,4 +90,11 @@ rb_red_blk_node* TreePredecessor(rb_red_blk_tree*,rb_red_blk_node*);
 rb_red_blk_node* TreeSuccessor(rb_red_blk_tree*,rb_red_blk_node*);
 rb_red_blk_node* RBExactQuery(rb_red_blk_tree*, void*);
 stk_stack * RBEnumerate(rb_red_blk_tree* tree,void* low, void* high);
+/* Non-recursive in-order cursor.  Both return NULL when there are no more nodes: */
+/*   for (x = RBTreeFirst(tree); x; x = RBTreeNext(tree, x)) ... */
+rb_red_blk_node* RBTreeFirst(rb_red_blk_tree* tree);
+rb_red_blk_node* RBTreeNext(rb_red_blk_tree* tree, rb_red_blk_node* x);
+/* Builds a balanced tree in O(n) from keys already sorted by Compare. */
+/* infos may be NULL.  The tree must be empty; returns 0 on success. */
+int RBTreeBulkLoad(rb_red_blk_tree* tree, void** keys, void** infos, int count);
 void NullFunction(void*);
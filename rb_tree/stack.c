@@ -1,76 +1,69 @@
+#include <string.h>
 #include "stack.h"
 
 int StackNotEmpty(stk_stack * theStack) {
-  return( theStack ? ((int)((long) theStack->top)) : 0);
+  return( theStack ? theStack->count : 0);
 }
 
+static void StackReserve(stk_stack * theStack, int count) {
+  if (count > theStack->capacity) {
+    int capacity = theStack->capacity ? theStack->capacity : 16;
+    while (capacity < count) capacity *= 2;
+    theStack->items=(DATA_TYPE *) realloc(theStack->items, capacity * sizeof(DATA_TYPE));
+    if (!theStack->items) {
+      printf("memory overflow: realloc failed in StackReserve.");
+      printf("  Exiting Program.\n");
+      exit(-1);
+    }
+    theStack->capacity=capacity;
+  }
+}
+
+/*  The items of stack1 end up above the items of stack2, so they are */
+/*  popped first, just like the old linked list version. */
 stk_stack * StackJoin(stk_stack * stack1, stk_stack * stack2) {
-  if (!stack1->tail) {
+  if (!stack1->count) {
+    free(stack1->items);
     free(stack1);
     return(stack2);
-  } else {
-    stack1->tail->next=stack2->top;
-    stack1->tail=stack2->tail;
-    free(stack2);
-    return(stack1);
   }
+  StackReserve(stack2, stack2->count + stack1->count);
+  memcpy(stack2->items + stack2->count, stack1->items, stack1->count * sizeof(DATA_TYPE));
+  stack2->count+=stack1->count;
+  free(stack1->items);
+  free(stack1);
+  return(stack2);
 }
 
 stk_stack * StackCreate() {
   stk_stack * newStack;
   
   newStack=(stk_stack *) SafeMalloc(sizeof(stk_stack));
-  newStack->top=newStack->tail=NULL;
+  newStack->items=NULL;
+  newStack->count=newStack->capacity=0;
   return(newStack);
 }
 
 
 void StackPush(stk_stack * theStack, DATA_TYPE newInfoPointer) {
-  stk_stack_node * newNode;
-
-  if(!theStack->top) {
-    newNode=(stk_stack_node *) SafeMalloc(sizeof(stk_stack_node));
-    newNode->info=newInfoPointer;
-    newNode->next=theStack->top;
-    theStack->top=newNode;
-    theStack->tail=newNode;
-  } else {
-    newNode=(stk_stack_node *) SafeMalloc(sizeof(stk_stack_node));
-    newNode->info=newInfoPointer;
-    newNode->next=theStack->top;
-    theStack->top=newNode;
-  }
-  
+  StackReserve(theStack, theStack->count + 1);
+  theStack->items[theStack->count++]=newInfoPointer;
 }
 
 DATA_TYPE StackPop(stk_stack * theStack) {
-  DATA_TYPE popInfo;
-  stk_stack_node * oldNode;
-
-  if(theStack->top) {
-    popInfo=theStack->top->info;
-    oldNode=theStack->top;
-    theStack->top=theStack->top->next;
-    free(oldNode);
-    if (!theStack->top) theStack->tail=NULL;
-  } else {
-    popInfo=NULL;
+  if(theStack->count) {
+    return(theStack->items[--theStack->count]);
   }
-  return(popInfo);
+  return(NULL);
 }
 
 void StackDestroy(stk_stack * theStack,void DestFunc(void * a)) {
-  stk_stack_node * x=theStack->top;
-  stk_stack_node * y;
-
+  int i;
   if(theStack) {
-    while(x) {
-      y=x->next;
-      DestFunc(x->info);
-      free(x);
-      x=y;
+    for (i=theStack->count - 1; i >= 0; i--) {
+      DestFunc(theStack->items[i]);
     }
+    free(theStack->items);
     free(theStack);
   }
 } 
-    
@@ -23,14 +23,12 @@
 #define DATA_TYPE void *
 #endif
 
-typedef struct stk_stack_node {
-  DATA_TYPE info;
-  struct stk_stack_node * next;
-} stk_stack_node;
-
+/*  The stack keeps its items in one growable array instead of one */
+/*  malloced node per item.  items[count-1] is the top of the stack. */
 typedef struct stk_stack { 
-  stk_stack_node * top;
-  stk_stack_node * tail;
+  DATA_TYPE * items;
+  int count;
+  int capacity;
 } stk_stack ;
 
 /*  These functions are all very straightforward and self-commenting so */
@@ -40,4 +38,5 @@ stk_stack * StackCreate();
 void StackPush(stk_stack * theStack, DATA_TYPE newInfoPointer);
 void * StackPop(stk_stack * theStack);
 int StackNotEmpty(stk_stack *);
+void StackDestroy(stk_stack * theStack,void DestFunc(void * a));
 
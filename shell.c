@@ -23,7 +23,8 @@
 #include "pcs/cJSON.h"
 #include "pcs/pcs_utils.h"
 #include "pcs/pcs.h"
-#include "rb_tree/red_black_tree.h"
+#include "pcs/pcs_transfer.h"
+#include "hashtable.h"
 #include "version.h"
 #include "dir.h"
 #include "utils.h"
@@ -40,6 +41,8 @@
 #define PCS_CONTEXT_ENV				"PCS_CONTEXT"
 #define PCS_COOKIE_ENV				"PCS_COOKIE"
 #define PCS_CAPTCHA_ENV				"PCS_CAPTCHA"
+#define PCS_REMOTE_CACHE_ENV		"PCS_REMOTE_CACHE"
+#define REMOTE_CACHE_MAGIC			"PCSTREE 2"		/*网盘目录缓存文件的首行标识*/
 #define TEMP_FILE_SUFFIX			".pcs_temp"
 //#define PCS_DEFAULT_CONTEXT_FILE	"/tmp/pcs_context.json"
 
@@ -86,26 +89,62 @@
 #define FLAG_PARENT_NOT_ON_REMOTE 4
 
 /* 文件元数据*/
+#define META_NONE				0xFFFFFFFFu	/*无效的记录索引，也用于表示没有父目录*/
+#define META_BLOCK_BITS			12
+#define META_BLOCK_SIZE			(1 << META_BLOCK_BITS)
+
+/*
+ * 比较本地和网盘目录时，每个文件（或目录）对应的记录。
+ * 为了在几百万个文件时也能节省内存，记录中不保存完整路径，
+ * 只保存文件名在 MetaStore 字符串池中的偏移和父目录的索引，
+ * 打印或传输时再通过 meta_path(), meta_remote_path() 拼接出完整路径。
+*/
 typedef struct MyMeta MyMeta;
 struct MyMeta
 {
-	char		*path;			/*文件路径*/
+	unsigned int	name;			/*文件名在字符串池中的偏移*/
+	unsigned int	remote_name;	/*网盘中的文件名在字符串池中的偏移，与本地文件名最多只有大小写不同。
+									  remote_full 为1时，指向网盘文件的完整路径*/
+	unsigned int	parent;			/*父目录的索引。META_NONE 表示位于比较的根目录下*/
+
+	unsigned int	flag : 3;
+	unsigned int	op : 4;			/*需要执行的操作*/
+	unsigned int	op_st : 5;		/*操作的结果*/
+	unsigned int	local_isdir : 1;	/*本地文件是否是目录*/
+	unsigned int	remote_isdir : 1;	/*文件在网盘中是否以目录存在*/
+	unsigned int	has_msg : 1;	/*是否有操作失败时的错误消息，消息保存在 MetaStore 的 msgs 中*/
+	unsigned int	remote_full : 1;
+	unsigned int	depth : 16;		/*目录深度，位于比较的根目录下时为0*/
+
+	time_t			local_mtime;	/*本地文件的修改时间*/
+	time_t			remote_mtime;	/*文件在网盘中的最后修改时间*/
+	UInt64			local_size;		/*本地文件的大小，用于安排并发传输*/
+	UInt64			remote_size;	/*文件在网盘中的大小*/
+};
+
+/*保存一次比较中的所有 MyMeta 记录*/
+typedef struct MetaStore MetaStore;
+struct MetaStore
+{
+	MyMeta			**blocks;		/*记录分块存放，添加记录时已有记录的地址不变*/
+	int				block_count;
+	int				block_capacity;
+	unsigned int	count;
 
-	time_t		local_mtime;	/*本地文件的修改时间*/
-	int			local_isdir;	/*本地文件是否是目录。0表示不是目录；非0值表示本地文件是目录*/
+	char			*strs;			/*字符串池，文件名以'\0'结尾依次存放*/
+	size_t			strs_used;
+	size_t			strs_size;
 
-	char		*remote_path;	/*文件路径*/
-	time_t		remote_mtime;	/*文件在网盘中的最后修改时间*/
-	int			remote_isdir;	/*文件在网盘中是以文件存在还是以目录存在。0表示以文件存在；非0值表示以目录存在*/
+	unsigned int	*index;			/*按“父目录 + 文件名（不区分大小写）”查找记录的开放寻址表，
+									  存放记录索引 + 1，0 表示空槽位*/
+	unsigned int	index_size;
 
-	int			flag;
+	unsigned int	*sorted;		/*按完整路径排序后的记录索引，由 meta_store_sort() 生成*/
 
-	int			op;				/*需要执行的操作*/
-	int			op_st;			/*操作的结果*/
-	char		*msg;			/*操作失败时的错误消息*/
+	Hashtable		*msgs;			/*操作失败时的错误消息，Key 为记录的地址*/
 
-	MyMeta		*parent;		/*父目录的元数据*/
-	void		*userdata;		/*用户数据*/
+	char			*path_buf[2];	/*拼接完整路径时使用的缓冲区*/
+	size_t			path_size[2];
 };
 
 struct DownloadState
@@ -113,6 +152,7 @@ struct DownloadState
 	FILE *pf;
 	char *msg;
 	size_t size;
+	int quiet; /*为非0时不显示进度*/
 };
 
 struct RBEnumerateState
@@ -128,7 +168,7 @@ struct RBEnumerateState
 	int		no_print_op;
 	int		no_print_flag;
 
-	rb_red_blk_tree *tree;
+	MetaStore		*store;
 	ShellContext   *context;
 
 	int		page_size;
@@ -169,7 +209,7 @@ struct PcsAesHead
 
 struct ScanLocalFileState
 {
-	rb_red_blk_tree *rb;
+	MetaStore		*store;
 	int				total;
 };
 
@@ -273,8 +313,6 @@ int u8_tombs_size(const char *src, int srcsz)
 }
 # define printf u8_printf
 
-# define sleep(s) Sleep((s) * 1000)
-
 #endif
 
 #pragma region 获取默认路径
@@ -349,6 +387,30 @@ static const char *captchafile()
 	return filename;
 }
 
+/*返回网盘目录缓存文件路径*/
+static const char *remotecachefile()
+{
+	static char filename[1024] = { 0 };
+	char *env_value = getenv(PCS_REMOTE_CACHE_ENV);
+	if (env_value) return env_value;
+	if (!filename[0]){ /*如果已经处理过，则直接返回*/
+#ifdef WIN32
+		strcpy(filename, getenv("UserProfile"));
+		strcat(filename, "\\.pcs");
+		CreateDirectoryRecursive(filename);
+		strcat(filename, "\\");
+		strcat(filename, "remote.cache");
+#else
+		strcpy(filename, getenv("HOME"));
+		strcat(filename, "/.pcs");
+		CreateDirectoryRecursive(filename);
+		strcat(filename, "/");
+		strcat(filename, "remote.cache");
+#endif
+	}
+	return filename;
+}
+
 #pragma endregion
 
 #pragma region 三个回调： 输入验证码、显示上传进度、写下载文件
@@ -409,6 +471,8 @@ static int download_write(char *ptr, size_t size, size_t contentlength, void *us
 	tmp[63] = '\0';
 	i = fwrite(ptr, 1, size, pf);
 	ds->size += i;
+	if (ds->quiet)
+		return i;
 	if (ds->msg)
 		printf("%s", ds->msg);
 	printf("%s", pcs_utils_readable_size(ds->size, tmp, 63, NULL));
@@ -443,10 +507,11 @@ static inline void back_prev_print_line()
 	printf("\033[K");  //清除该行
 }
 
-/*把文件大小转换成字符串*/
-static const char *size_tostr(size_t size, int *fix_width, char ch)
+/*把文件大小转换成字符串，结果写入str中，str至少SIZE_STR_LEN字节*/
+#define SIZE_STR_LEN 128
+static const char *size_tostr(size_t size, int *fix_width, char ch, char *str)
 {
-	static char str[128], *p;
+	char *p;
 	int i;
 	int j, cn, mod;
 	size_t sz;
@@ -466,7 +531,7 @@ static const char *size_tostr(size_t size, int *fix_width, char ch)
 	}
 
 	sz = size;
-	j = 127;
+	j = SIZE_STR_LEN - 1;
 	str[j] = '\0';
 	cn = 0;
 	while (sz != 0) {
@@ -548,6 +613,7 @@ static void print_filelist_head(int size_width)
 static void print_filelist_row(PcsFileInfo *f, int size_width)
 {
 	const char *p;
+	char str[SIZE_STR_LEN];
 
 	if (f->isdir)
 		putchar('d');
@@ -555,7 +621,7 @@ static void print_filelist_row(PcsFileInfo *f, int size_width)
 		putchar('-');
 	putchar(' ');
 
-	p = size_tostr(f->size, &size_width, ' ');
+	p = size_tostr(f->size, &size_width, ' ', str);
 	while (*p) {
 		putchar(*p++);
 	}
@@ -568,7 +634,7 @@ static void print_filelist_row(PcsFileInfo *f, int size_width)
 /*打印文件列表*/
 static void print_filelist(PcsFileInfoList *list, int *pFileCount, int *pDirCount, size_t *pTotalSize)
 {
-	char tmp[64] = { 0 };
+	char tmp[64] = { 0 }, str[SIZE_STR_LEN];
 	int cnt_file = 0,
 		cnt_dir = 0,
 		size_width = 1,
@@ -581,7 +647,7 @@ static void print_filelist(PcsFileInfoList *list, int *pFileCount, int *pDirCoun
 	while (pcs_filist_iterater_next(&iterater)) {
 		file = iterater.current;
 		w = -1;
-		size_tostr(file->size, &w, ' ');
+		size_tostr(file->size, &w, ' ', str);
 		if (size_width < w)
 			size_width = w;
 		total += (size_t)file->size;
@@ -639,12 +705,9 @@ static void print_fileinfo(PcsFileInfo *f, const char *prex)
 static void hook_cjson()
 {
 	cJSON_Hooks hooks = { 0 };
-#if defined(DEBUG) || defined(_DEBUG)
+	/*调试版本中用于检查内存泄漏；发布版本中保证cJSON与pcs_free使用同一个分配器*/
 	hooks.malloc_fn = &pcs_mem_malloc_arg1;
 	hooks.free_fn = &pcs_mem_free;
-#else
-
-#endif
 	cJSON_InitHooks(&hooks);
 }
 
@@ -697,6 +760,10 @@ static char *context2str(ShellContext *context)
 	assert(item);
 	cJSON_AddItemToObject(root, "timeout_retry", item);
 
+	item = cJSON_CreateBool(context->remote_cache);
+	assert(item);
+	cJSON_AddItemToObject(root, "remote_cache", item);
+
 	json = cJSON_Print(root);
 	assert(json);
 
@@ -846,6 +913,11 @@ static int restore_context(ShellContext *context, const char *filename)
 		context->timeout_retry = item->valueint ? 1 : 0;
 	}
 
+	item = cJSON_GetObjectItem(root, "remote_cache");
+	if (item) {
+		context->remote_cache = item->valueint ? 1 : 0;
+	}
+
 	cJSON_Delete(root);
 	pcs_free(filecontent);
 	if (context->contextfile) pcs_free(context->contextfile);
@@ -870,6 +942,7 @@ static void init_context(ShellContext *context, struct args *arg)
 	context->secure_enable = 1;
 
 	context->timeout_retry = 1;
+	context->remote_cache = 0;
 }
 
 /*释放上下文*/
@@ -884,6 +957,7 @@ static void free_context(ShellContext *context)
 	if (context->secure_method) pcs_free(context->secure_method);
 	if (context->secure_key) pcs_free(context->secure_key);
 	if (context->contextfile) pcs_free(context->contextfile);
+	if (context->remote_tree) ht_destroy(context->remote_tree);
 	memset(context, 0, sizeof(ShellContext));
 }
 
@@ -892,16 +966,16 @@ static void init_pcs_secure(ShellContext *context)
 {
 	int method = 0;
 	if (context->secure_method && context->secure_method[0]) {
-		if (strcmp(context->secure_method, "aes-cbc-128")) {
+		if (strcmp(context->secure_method, "aes-cbc-128") == 0) {
 			method = PCS_SECURE_AES_CBC_128;
 		}
-		else if (strcmp(context->secure_method, "aes-cbc-192")) {
+		else if (strcmp(context->secure_method, "aes-cbc-192") == 0) {
 			method = PCS_SECURE_AES_CBC_192;
 		}
-		else if (strcmp(context->secure_method, "aes-cbc-256")) {
+		else if (strcmp(context->secure_method, "aes-cbc-256") == 0) {
 			method = PCS_SECURE_AES_CBC_256;
 		}
-		else if (strcmp(context->secure_method, "plaintext")) {
+		else if (strcmp(context->secure_method, "plaintext") == 0) {
 			method = PCS_SECURE_PLAINTEXT;
 		}
 	}
@@ -933,6 +1007,9 @@ static void init_pcs(ShellContext *context)
 		//PCS_OPTION_TIMEOUT, (void *)((long)TIMEOUT),
 		PCS_OPTION_CONNECTTIMEOUT, (void *)((long)CONNECTTIMEOUT),
 		PCS_OPTION_END);
+	/*失败后的重试由pcs_http按默认策略处理，见pcs_http.h*/
+	if (!context->timeout_retry)
+		pcs_setopt(context->pcs, PCS_OPTION_RETRY_MAX, (void *)((long)0));
 	init_pcs_secure(context);
 }
 
@@ -1280,6 +1357,7 @@ static void usage_set()
 	printf("  list_page_size       UInt       >0\n");
 	printf("  list_sort_direction  Enum       asc|desc\n");
 	printf("  list_sort_name       Enum       name|time|size\n");
+	printf("  remote_cache         Boolean    true|false\n");
 	printf("  secure_enable        Boolean    true|false\n");
 	printf("  secure_key           String     not null when 'secure_method' is not 'plaintext'\n");
 	printf("  secure_method        Enum       plaintext|aes-cbc-128|aes-cbc-192|aes-cbc-256\n");
@@ -1309,11 +1387,29 @@ static void usage_search()
 	printf("  %s search \"/music/Europe and America\" \"dst 2.mp3\"\n", app_name);
 }
 
+/*打印stats命令用法*/
+static void usage_stats()
+{
+	version();
+	printf("\nUsage: %s stats <command> [options] [arg1|arg2...]\n", app_name);
+	printf("\nDescription:\n");
+	printf("  Execute the command, and then print the statistics of the HTTP requests \n"
+		"  it sent: count, errors, average DNS/connect/TLS/first byte/total time, \n"
+		"  total time percentiles and traffic per endpoint, followed by the most \n"
+		"  recent requests. The statistics are printed to stderr.\n");
+	printf("\nOptions:\n");
+	printf("  The options are passed to the command.\n");
+	printf("\nSamples:\n");
+	printf("  %s stats list /music\n", app_name);
+	printf("  %s stats compare -r ~/music /music\n", app_name);
+	printf("  %s stats synch -ru ~/music /music\n", app_name);
+}
+
 /*打印synch命令用法*/
 static void usage_synch()
 {
 	version();
-	printf("\nUsage: %s synch [-cdehnru] <local path> <net disk path>\n", app_name);
+	printf("\nUsage: %s synch [-cdehnru] [--parallel=<n|min-max|auto>] <local path> <net disk path>\n", app_name);
 	printf("\nDescription:\n");
 	printf("  Synch between local and net disk. \n"
 		   "  Default options is '-cdu', means download newer files, upload newer files \n"
@@ -1337,6 +1433,10 @@ static void usage_synch()
 		   "        This option will upload new files from the net disk.\n"
 		   "        You can use 'compare -ur <local dir> <disk dir>' to view \n"
 		   "        how many and which files will upload.\n");
+	printf("  --parallel=<n|min-max|auto>\n"
+		   "        Transfer files concurrently. 'n' means n files at a time, \n"
+		   "        'min-max' adjusts the concurrency between min and max according to \n"
+		   "        the throughput and failures, 'auto' means '1-8'.\n");
 	printf("\nSamples:\n");
 	printf("  %s synch -h\n", app_name);
 	printf("  %s synch ~/music /music  \n", app_name);
@@ -1345,6 +1445,7 @@ static void usage_synch()
 	printf("  %s synch -c music /music\n", app_name);
 	printf("  %s synch -cdu music /music\n", app_name);
 	printf("  %s synch -r music /music\n", app_name);
+	printf("  %s synch -ru --parallel=auto music /music\n", app_name);
 }
 
 /*打印upload命令用法*/
@@ -1406,6 +1507,8 @@ static void usage()
 		app_name, app_name, app_name);
 	printf("\nOptions:\n");
 	printf("  --context=<file path>  Specify context.\n");
+	printf("  --trace=<file path>    Write the timeline of the command in Chrome trace format,\n"
+		"                         which can be opened by chrome://tracing or ui.perfetto.dev.\n");
 	printf("\nCommands:\n"
 		"  cat      Print the file content\n"
 		"  cd       Change the work directory\n"
@@ -1428,6 +1531,7 @@ static void usage()
 		"  rename   Rename the file|directory\n"
 		"  set      Change the context, you can print the context by 'context' command\n"
 		"  search   Search the files in the specify directory\n"
+		"  stats    Execute the command and print the statistics of HTTP requests\n"
 		"  synch    Synch between local and net disk. You can 'compare' first.\n"
 		"  upload   Upload the file\n"
 		"  version  Print the version\n"
@@ -1439,6 +1543,7 @@ static void usage()
 	printf("  %s cat /note.txt\n", app_name);
 	printf("  %s cd /temp\n", app_name);
 	printf("  %s cat /note.txt --context=/home/gang/.pcs_context\n", app_name);
+	printf("  %s synch -ru ~/music /music --trace=/tmp/synch.json\n", app_name);
 }
 
 #pragma endregion
@@ -1563,137 +1668,696 @@ static int set_secure_enable(ShellContext *context, const char *val)
 	return 0;
 }
 
+static int set_remote_cache(ShellContext *context, const char *val)
+{
+	if (!val || !val[0]) return -1;
+	if (strcmp(val, "true") == 0 || strcmp(val, "1") == 0) {
+		context->remote_cache = 1;
+	}
+	else if (strcmp(val, "false") == 0 || strcmp(val, "0") == 0) {
+		context->remote_cache = 0;
+	}
+	else {
+		return -1;
+	}
+	return 0;
+}
+
 #pragma endregion
 
-#pragma region Meta 相关方法
+#pragma region 网盘目录缓存
 
-static void meta_destroy(MyMeta *meta);
+/*
+ * 网盘目录缓存，默认关闭，可执行 'set --remote_cache=true' 启用。
+ * 缓存中记录每个已列出过的网盘目录的 server_mtime 和其下的直接子项，保存在 remotecachefile() 中。
+ * 再次比较时，如果目录的 server_mtime 没有变化，则直接使用缓存中的子项，不再请求服务器列出该目录。
+ * 目录的 server_mtime 只在其直接子项变化时更新，更深层的变化不一定反映到上级目录，
+ * 所以启用缓存后，比较结果可能遗漏这些变化。
+ *
+ * 缓存文件为文本格式，首行为 "PCSTREE 2\t<UID>"，之后每个目录为：
+ *   D\t<server_mtime>\t<子项数量>\t<目录路径>
+ *   <isdir>\t<server_mtime>\t<size>\t<文件名>      （每个子项一行）
+*/
 
-#pragma region 红黑树的几个回调函数
+/*网盘目录缓存中的一个子项*/
+typedef struct RemoteCacheEntry
+{
+	char	*name;
+	time_t	mtime;
+	UInt64	size;
+	int		isdir;
+} RemoteCacheEntry;
+
+/*网盘目录缓存中的一个目录*/
+typedef struct RemoteCacheDir
+{
+	char				*path;
+	time_t				mtime;		/*列出该目录时，目录的 server_mtime*/
+	RemoteCacheEntry	*entries;	/*目录下的直接子项*/
+	int					count;
+	int					capacity;
+} RemoteCacheDir;
+
+static RemoteCacheDir *remote_cache_dir_create(const char *path, time_t mtime)
+{
+	RemoteCacheDir *dir;
+	dir = (RemoteCacheDir *)pcs_malloc(sizeof(RemoteCacheDir));
+	memset(dir, 0, sizeof(RemoteCacheDir));
+	dir->path = pcs_utils_strdup(path);
+	dir->mtime = mtime;
+	return dir;
+}
 
-/*红黑树中用于释放 key */
-static void rb_destory_key(void *a, void *state)
+static void remote_cache_dir_destroy(void *p)
 {
+	RemoteCacheDir *dir = (RemoteCacheDir *)p;
+	int i;
+	if (!dir) return;
+	for (i = 0; i < dir->count; i++)
+		pcs_free(dir->entries[i].name);
+	if (dir->entries) pcs_free(dir->entries);
+	if (dir->path) pcs_free(dir->path);
+	pcs_free(dir);
+}
 
+static void remote_cache_dir_add(RemoteCacheDir *dir, const char *name, int len, time_t mtime, UInt64 size, int isdir)
+{
+	RemoteCacheEntry *ent;
+	if (dir->count == dir->capacity) {
+		RemoteCacheEntry *entries;
+		dir->capacity = dir->capacity ? dir->capacity * 2 : 16;
+		entries = (RemoteCacheEntry *)pcs_malloc(dir->capacity * sizeof(RemoteCacheEntry));
+		if (dir->count) memcpy(entries, dir->entries, dir->count * sizeof(RemoteCacheEntry));
+		if (dir->entries) pcs_free(dir->entries);
+		dir->entries = entries;
+	}
+	ent = &dir->entries[dir->count++];
+	ent->name = (char *)pcs_malloc(len + 1);
+	memcpy(ent->name, name, len);
+	ent->name[len] = '\0';
+	ent->mtime = mtime;
+	ent->size = size;
+	ent->isdir = isdir;
 }
 
-/*红黑树中用于释放 info */
-static void rb_destory_info(void *a, void *state)
+/*拼接 dir 下子项 name 的完整路径，返回的字符串需调用 pcs_free() 释放*/
+static char *remote_cache_child_path(const char *dir, const char *name)
 {
-	if (a) meta_destroy((MyMeta *)a);
+	char *path;
+	int dlen = strlen(dir), nlen = strlen(name), sep;
+	sep = (dlen > 0 && dir[dlen - 1] == '/') ? 0 : 1;
+	path = (char *)pcs_malloc(dlen + sep + nlen + 1);
+	memcpy(path, dir, dlen);
+	if (sep) path[dlen] = '/';
+	memcpy(path + dlen + sep, name, nlen + 1);
+	return path;
 }
 
-/*红黑树中用于比较 key 值。当 *a > *b 时，返回 1; 当 *a < *b 时，返回 -1; 当相等时，返回 0。 */
-static int rb_compare(const void *a, const void *b, void *state)
+/*读取一行，并把行尾的'\n'替换为'\0'。返回下一行的开始位置，没有更多行时返回NULL*/
+static char *remote_cache_next_line(char *p, char **line)
 {
-	int rc;
-	if (!a && !b) return 0;
-	if (!a) return -1;
-	if (!b) return 1;
-	rc = pcs_utils_strcmpi(a, b);
-	return (rc < 0 ? -1 : (rc > 0 ? 1 : 0));
+	char *end;
+	if (!p || !*p) return NULL;
+	*line = p;
+	end = strchr(p, '\n');
+	if (end) {
+		*end = '\0';
+		return end + 1;
+	}
+	return p + strlen(p);
+}
+
+/*
+ * 返回网盘目录缓存，第一次调用时从缓存文件中加载。
+ * 缓存文件属于其他帐号或已损坏时，返回空的缓存。
+*/
+static Hashtable *remote_cache_load(ShellContext *context)
+{
+	Hashtable *tree;
+	RemoteCacheDir *dir = NULL;
+	char *content = NULL, *p, *line, *name;
+	const char *uid;
+	long long mtime;
+	unsigned long long size;
+	int count = 0, isdir, n;
+
+	if (context->remote_tree) return context->remote_tree;
+	tree = ht_create(1024, 0, &remote_cache_dir_destroy);
+	context->remote_tree = tree;
+
+	if (read_file(remotecachefile(), &content) <= 0) {
+		if (content) pcs_free(content);
+		return tree;
+	}
+	uid = pcs_sysUID(context->pcs);
+	p = remote_cache_next_line(content, &line);
+	if (!p || strncmp(line, REMOTE_CACHE_MAGIC "\t", sizeof(REMOTE_CACHE_MAGIC)) != 0
+		|| !uid || strcmp(line + sizeof(REMOTE_CACHE_MAGIC), uid) != 0) {
+		pcs_free(content);
+		return tree;
+	}
+	while ((p = remote_cache_next_line(p, &line)) != NULL) {
+		if (count == 0) {
+			if (sscanf(line, "D\t%lld\t%d\t%n", &mtime, &count, &n) < 2 || count < 0)
+				break;
+			dir = remote_cache_dir_create(line + n, (time_t)mtime);
+			ht_set(tree, dir->path, -1, dir, NULL);
+		}
+		else {
+			if (sscanf(line, "%d\t%lld\t%llu\t%n", &isdir, &mtime, &size, &n) < 3)
+				break;
+			name = line + n;
+			remote_cache_dir_add(dir, name, strlen(name), (time_t)mtime, (UInt64)size, isdir);
+			count--;
+		}
+	}
+	if (count != 0 && dir) /*文件被截断，丢弃不完整的目录*/
+		ht_remove(tree, dir->path, -1, NULL);
+	pcs_free(content);
+	return tree;
 }
 
-/*红黑树中用于打印 key */
-static void rb_print_key(const void *a, void *state)
+/*把网盘目录缓存写入缓存文件。先写入临时文件，再替换原文件，避免写入中断时损坏缓存*/
+static int remote_cache_save(ShellContext *context)
 {
-	printf("%s", a);
+	HashtableIterater *it;
+	RemoteCacheDir *dir;
+	const char *filename, *uid;
+	char *tmpfile;
+	FILE *pf;
+	int i, rc = 0;
+
+	if (!context->remote_tree) return 0;
+	uid = pcs_sysUID(context->pcs);
+	if (!uid) return -1;
+	filename = remotecachefile();
+	tmpfile = (char *)pcs_malloc(strlen(filename) + 5);
+	strcpy(tmpfile, filename);
+	strcat(tmpfile, ".tmp");
+	pf = fopen(tmpfile, "wb");
+	if (!pf) {
+		fprintf(stderr, "Error: Can't open the file: %s\n", tmpfile);
+		pcs_free(tmpfile);
+		return -1;
+	}
+	fprintf(pf, REMOTE_CACHE_MAGIC "\t%s\n", uid);
+	it = ht_it_create(context->remote_tree);
+	while (ht_it_next(it)) {
+		dir = (RemoteCacheDir *)ht_it_current(it);
+		fprintf(pf, "D\t%lld\t%d\t%s\n", (long long)dir->mtime, dir->count, dir->path);
+		for (i = 0; i < dir->count; i++)
+			fprintf(pf, "%d\t%lld\t%llu\t%s\n", dir->entries[i].isdir, (long long)dir->entries[i].mtime,
+				(unsigned long long)dir->entries[i].size, dir->entries[i].name);
+	}
+	ht_it_destroy(it);
+	if (fclose(pf)) rc = -1;
+	if (!rc) {
+#ifdef WIN32
+		remove(filename);
+#endif
+		rc = rename(tmpfile, filename);
+	}
+	if (rc) {
+		fprintf(stderr, "Error: Can't write the remote cache file: %s\n", filename);
+		remove(tmpfile);
+	}
+	pcs_free(tmpfile);
+	return rc;
 }
 
-/*红黑树中用于打印 info */
-static void rb_print_info(void *a, void *state)
+/*从缓存中移除 path 目录及其下所有已缓存的子目录*/
+static void remote_cache_drop(Hashtable *tree, const char *path)
 {
-	MyMeta *meta = (MyMeta *)a;
-	if (!meta) {
-		printf("null\n");
-		return;
+	RemoteCacheDir *dir = NULL;
+	char *child;
+	int i;
+	if (ht_remove(tree, path, -1, (void **)&dir) || !dir) return;
+	for (i = 0; i < dir->count; i++) {
+		if (!dir->entries[i].isdir) continue;
+		child = remote_cache_child_path(path, dir->entries[i].name);
+		remote_cache_drop(tree, child);
+		pcs_free(child);
+	}
+	remote_cache_dir_destroy(dir);
+}
+
+/*
+ * 用新列出的目录替换缓存中的旧目录。
+ * 旧目录中存在、但新目录中不再存在的子目录，其缓存将被一并移除。
+*/
+static void remote_cache_put(Hashtable *tree, RemoteCacheDir *dir)
+{
+	RemoteCacheDir *old = NULL;
+	Hashtable *names;
+	char *child;
+	int i;
+	ht_set(tree, dir->path, -1, dir, (void **)&old);
+	if (!old || old == dir) return;
+	names = ht_create(dir->count * 2 + 1, 0, NULL);
+	for (i = 0; i < dir->count; i++) {
+		if (dir->entries[i].isdir)
+			ht_add(names, dir->entries[i].name, -1, dir->entries[i].name);
+	}
+	for (i = 0; i < old->count; i++) {
+		if (old->entries[i].isdir && !ht_has(names, old->entries[i].name, -1)) {
+			child = remote_cache_child_path(dir->path, old->entries[i].name);
+			remote_cache_drop(tree, child);
+			pcs_free(child);
+		}
 	}
-	printf("{\n");
+	ht_destroy(names);
+	remote_cache_dir_destroy(old);
+}
 
-	printf("  path: \"%s\",\n", meta->path);
+/*
+ * 返回网盘目录 path 下的直接子项。
+ *   mtime - 目录的 server_mtime，为0时表示未知，此时总是请求服务器
+ * 启用缓存且 mtime 与缓存中的记录一致时，直接返回缓存中的目录，否则请求服务器列出目录，并更新缓存。
+ * 未启用缓存时，调用者需使用 remote_cache_dir_destroy() 释放返回值。
+ * 失败时返回NULL。
+*/
+static RemoteCacheDir *remote_list_dir(ShellContext *context, const char *path, time_t mtime, int *total_cnt)
+{
+	PcsFileInfoList *list = NULL;
+	PcsFileInfoListIterater iterater;
+	PcsFileInfo *info = NULL;
+	RemoteCacheDir *dir;
+	const char *name;
+	int page_index = 1,
+		page_size = 1000;
+	int cnt = 0;
 
-	printf("  local_exist: %s,\n", (meta->flag & FLAG_ON_LOCAL) ? "true" : "false");
-	print_time("  local_mtime: \"%s\",\n", meta->local_mtime);
-	printf("  local_isdir: %s,\n", meta->local_isdir ? "true" : "false");
-	
-	printf("  remote_path: \"%s\",\n", meta->remote_path);
-	printf("  remote_exist: %s,\n", (meta->flag & FLAG_ON_REMOTE) ? "true" : "false");
-	print_time("  remote_mtime: \"%s\",\n", meta->remote_mtime);
-	printf("  remote_isdir: %s\n", meta->remote_isdir ? "true" : "false");
+	if (context->remote_cache) {
+		dir = (RemoteCacheDir *)ht_get(remote_cache_load(context), path, -1);
+		if (dir && mtime && dir->mtime == mtime) {
+			if (total_cnt) {
+				(*total_cnt) += dir->count;
+				printf("Fetch %d                     \r", *total_cnt);
+				fflush(stdout);
+			}
+			return dir;
+		}
+	}
+
+	dir = remote_cache_dir_create(path, mtime);
+	while (1) {
+		list = pcs_list(context->pcs, path,
+			page_index, page_size,
+			"name", PcsFalse);
+		if (!list) {
+			if (pcs_strerror(context->pcs)) {
+				fprintf(stderr, "Error: %s \n", pcs_strerror(context->pcs));
+				remote_cache_dir_destroy(dir);
+				return NULL;
+			}
+			break;
+		}
+
+		cnt = list->count;
+		if (total_cnt) (*total_cnt) += cnt;
+		if (total_cnt && cnt > 0) {
+			printf("Fetch %d                     \r", *total_cnt);
+			fflush(stdout);
+		}
 
-	printf("}\n");
+		pcs_filist_iterater_init(list, &iterater, PcsFalse);
+		while (pcs_filist_iterater_next(&iterater)) {
+			info = iterater.current;
+			name = strrchr(info->path, '/');
+			name = name ? name + 1 : info->path;
+			remote_cache_dir_add(dir, name, strlen(name), (time_t)info->server_mtime, (UInt64)info->size, info->isdir ? 1 : 0);
+		}
+		pcs_filist_destroy(list);
+		if (cnt < page_size) {
+			break;
+		}
+		page_index++;
+	}
+	if (context->remote_cache && mtime)
+		remote_cache_put(remote_cache_load(context), dir);
+	return dir;
 }
 
 #pragma endregion
 
-/*创建一个MyMeta*/
-static MyMeta *meta_create(const char *path)
+#pragma region Meta 相关方法
+
+#define META_AT(store, i)			(&(store)->blocks[(i) >> META_BLOCK_BITS][(i) & (META_BLOCK_SIZE - 1)])
+#define META_STR(store, offset)		((store)->strs + (offset))
+
+#define meta_path(store, meta)			meta_build_path((store), (meta), 0, 0)
+#define meta_remote_path(store, meta)	meta_build_path((store), (meta), 1, 1)
+
+static inline int meta_lower(int ch)
+{
+	return (ch >= 'A' && ch <= 'Z') ? ch + ('a' - 'A') : ch;
+}
+
+static void meta_free_msg(void *msg)
+{
+	pcs_free(msg);
+}
+
+/*创建一个 MetaStore*/
+static MetaStore *meta_store_create()
+{
+	MetaStore *store;
+	store = (MetaStore *)pcs_malloc(sizeof(MetaStore));
+	memset(store, 0, sizeof(MetaStore));
+	store->msgs = ht_create(17, 0, &meta_free_msg);
+	return store;
+}
+
+/*释放掉 MetaStore 及其中的所有记录*/
+static void meta_store_destroy(MetaStore *store)
+{
+	int i;
+	if (!store) return;
+	for (i = 0; i < store->block_count; i++)
+		pcs_free(store->blocks[i]);
+	if (store->blocks) pcs_free(store->blocks);
+	if (store->strs) pcs_free(store->strs);
+	if (store->index) pcs_free(store->index);
+	if (store->sorted) pcs_free(store->sorted);
+	if (store->msgs) ht_destroy(store->msgs);
+	if (store->path_buf[0]) pcs_free(store->path_buf[0]);
+	if (store->path_buf[1]) pcs_free(store->path_buf[1]);
+	pcs_free(store);
+}
+
+/*复制字符串到字符串池中，返回其偏移。注意字符串池扩容后，之前通过 META_STR() 得到的指针将失效*/
+static unsigned int meta_store_str(MetaStore *store, const char *str, int len)
+{
+	unsigned int offset;
+	if (store->strs_used + len + 1 > store->strs_size) {
+		size_t size = store->strs_size ? store->strs_size * 2 : 64 * 1024;
+		char *strs;
+		while (size < store->strs_used + len + 1) size *= 2;
+		strs = (char *)pcs_malloc(size);
+		if (store->strs_used) memcpy(strs, store->strs, store->strs_used);
+		if (store->strs) pcs_free(store->strs);
+		store->strs = strs;
+		store->strs_size = size;
+	}
+	offset = (unsigned int)store->strs_used;
+	memcpy(store->strs + offset, str, len);
+	store->strs[offset + len] = '\0';
+	store->strs_used += len + 1;
+	return offset;
+}
+
+static unsigned int meta_name_hash(unsigned int parent, const char *name, int len)
+{
+	unsigned int h = 2166136261u ^ parent;
+	int i;
+	for (i = 0; i < len; i++) {
+		h ^= (unsigned char)meta_lower(name[i]);
+		h *= 16777619u;
+	}
+	return h ^ (h >> 16);
+}
+
+/*比较以'\0'结尾的文件名 s 和长度为 len 的 name 是否相同（不区分大小写）*/
+static int meta_name_equal(const char *s, const char *name, int len)
+{
+	int i;
+	for (i = 0; i < len; i++) {
+		if (!s[i] || meta_lower(s[i]) != meta_lower(name[i]))
+			return 0;
+	}
+	return s[i] == '\0';
+}
+
+static void meta_index_insert(MetaStore *store, unsigned int i)
+{
+	MyMeta *meta = META_AT(store, i);
+	const char *name = META_STR(store, meta->name);
+	unsigned int mask = store->index_size - 1,
+		pos = meta_name_hash(meta->parent, name, strlen(name)) & mask;
+	while (store->index[pos])
+		pos = (pos + 1) & mask;
+	store->index[pos] = i + 1;
+}
+
+/*查找表扩大一倍并重建，保持装载率不超过 1/2*/
+static void meta_index_grow(MetaStore *store)
+{
+	unsigned int i;
+	if (store->index) pcs_free(store->index);
+	store->index_size = store->index_size ? store->index_size * 2 : 1024;
+	store->index = (unsigned int *)pcs_malloc(store->index_size * sizeof(unsigned int));
+	memset(store->index, 0, store->index_size * sizeof(unsigned int));
+	for (i = 0; i < store->count; i++)
+		meta_index_insert(store, i);
+}
+
+/*查找 parent 目录下名为 name 的记录（不区分大小写），返回其索引。不存在时返回 META_NONE*/
+static unsigned int meta_store_find(MetaStore *store, unsigned int parent, const char *name, int len)
+{
+	unsigned int mask, pos, i;
+	MyMeta *meta;
+	if (!store->index) return META_NONE;
+	mask = store->index_size - 1;
+	pos = meta_name_hash(parent, name, len) & mask;
+	while ((i = store->index[pos]) != 0) {
+		meta = META_AT(store, i - 1);
+		if (meta->parent == parent && meta_name_equal(META_STR(store, meta->name), name, len))
+			return i - 1;
+		pos = (pos + 1) & mask;
+	}
+	return META_NONE;
+}
+
+/*在 parent 目录下添加名为 name 的记录，返回其索引*/
+static unsigned int meta_store_add(MetaStore *store, unsigned int parent, const char *name, int len)
 {
 	MyMeta *meta;
-	meta = (MyMeta *)pcs_malloc(sizeof(MyMeta));
+	unsigned int i = store->count;
+	if ((int)(i >> META_BLOCK_BITS) >= store->block_count) {
+		if (store->block_count == store->block_capacity) {
+			MyMeta **blocks;
+			store->block_capacity = store->block_capacity ? store->block_capacity * 2 : 16;
+			blocks = (MyMeta **)pcs_malloc(store->block_capacity * sizeof(MyMeta *));
+			if (store->block_count) memcpy(blocks, store->blocks, store->block_count * sizeof(MyMeta *));
+			if (store->blocks) pcs_free(store->blocks);
+			store->blocks = blocks;
+		}
+		store->blocks[store->block_count++] = (MyMeta *)pcs_malloc(META_BLOCK_SIZE * sizeof(MyMeta));
+	}
+	meta = META_AT(store, i);
 	memset(meta, 0, sizeof(MyMeta));
-	if (path) {
-		meta->path = pcs_utils_strdup(path);
+	meta->name = meta->remote_name = meta_store_str(store, name, len);
+	meta->parent = parent;
+	meta->depth = (parent == META_NONE) ? 0 : META_AT(store, parent)->depth + 1;
+	store->count++;
+	if (store->count * 2 > store->index_size)
+		meta_index_grow(store);
+	else
+		meta_index_insert(store, i);
+	return i;
+}
+
+/*返回记录完整路径的长度。remote 为0时计算本地路径，否则计算网盘路径*/
+static int meta_path_len(MetaStore *store, const MyMeta *meta, int remote)
+{
+	int len = 0;
+	if (remote && meta->remote_full)
+		return strlen(META_STR(store, meta->remote_name));
+	for (;;) {
+		len += strlen(META_STR(store, remote ? meta->remote_name : meta->name));
+		if (meta->parent == META_NONE) break;
+		len++; /*目录分隔符*/
+		meta = META_AT(store, meta->parent);
 	}
-	return meta;
+	return len;
 }
 
-/*释放掉一个MyMeta*/
-static void meta_destroy(MyMeta *meta)
+/*
+ * 拼接记录的完整路径（相对于比较的根目录）。
+ *   remote - 为0时返回本地路径，否则返回网盘路径
+ *   which  - 使用哪一个缓冲区（0 或 1）
+ * 返回的字符串位于 store 的缓冲区中，下一次使用同一缓冲区时将被覆盖。
+*/
+static const char *meta_build_path(MetaStore *store, const MyMeta *meta, int remote, int which)
+{
+	const char *name;
+	char *p;
+	int len, n;
+	if (remote && meta->remote_full)
+		return META_STR(store, meta->remote_name);
+	len = meta_path_len(store, meta, remote);
+	if (store->path_size[which] < (size_t)len + 1) {
+		if (store->path_buf[which]) pcs_free(store->path_buf[which]);
+		store->path_size[which] = len + 256;
+		store->path_buf[which] = (char *)pcs_malloc(store->path_size[which]);
+	}
+	p = store->path_buf[which] + len;
+	*p = '\0';
+	for (;;) {
+		name = META_STR(store, remote ? meta->remote_name : meta->name);
+		n = strlen(name);
+		p -= n;
+		memcpy(p, name, n);
+		if (meta->parent == META_NONE) break;
+		*(--p) = '/';
+		meta = META_AT(store, meta->parent);
+	}
+	return store->path_buf[which];
+}
+
+/*返回记录的错误消息，没有时返回NULL*/
+static const char *meta_msg(MetaStore *store, const MyMeta *meta)
 {
-	if (!meta) return;
-	if (meta->path) pcs_free(meta->path);
-	if (meta->remote_path) pcs_free(meta->remote_path);
-	if (meta->msg) pcs_free(meta->msg);
-	pcs_free(meta);
+	if (!meta->has_msg) return NULL;
+	return (const char *)ht_get(store->msgs, (const char *)&meta, sizeof(meta));
+}
+
+/*设置记录的错误消息。msg 需由 pcs_malloc() 分配，之后由 store 负责释放；传入NULL表示清除*/
+static void meta_set_msg(MetaStore *store, MyMeta *meta, char *msg)
+{
+	if (meta->has_msg) {
+		ht_remove(store->msgs, (const char *)&meta, sizeof(meta), NULL);
+		meta->has_msg = 0;
+	}
+	if (msg) {
+		ht_set(store->msgs, (const char *)&meta, sizeof(meta), msg, NULL);
+		meta->has_msg = 1;
+	}
+}
+
+static int meta_strcmpi(const char *a, const char *b)
+{
+	int ca, cb;
+	do {
+		ca = meta_lower((unsigned char)*a++);
+		cb = meta_lower((unsigned char)*b++);
+	} while (ca && ca == cb);
+	return ca < cb ? -1 : (ca > cb ? 1 : 0);
+}
+
+/*
+ * 按完整路径（不区分大小写）比较两条记录，结果与比较拼接出的完整路径相同。
+ * 先沿父目录上溯到同一目录下的两项，再只比较这两项的文件名，无需拼接路径。
+*/
+static int meta_compare(MetaStore *store, const MyMeta *a, const MyMeta *b)
+{
+	const MyMeta *pa = a, *pb = b;
+	const char *sa, *sb;
+	int ca, cb;
+	if (a == b) return 0;
+	while (pa->depth > pb->depth) pa = META_AT(store, pa->parent);
+	while (pb->depth > pa->depth) pb = META_AT(store, pb->parent);
+	if (pa == pb) /*一方是另一方的上级目录，上级目录的路径是前缀，排在前面*/
+		return a->depth < b->depth ? -1 : 1;
+	while (pa->parent != pb->parent) {
+		pa = META_AT(store, pa->parent);
+		pb = META_AT(store, pb->parent);
+	}
+	sa = META_STR(store, pa->name);
+	sb = META_STR(store, pb->name);
+	while (*sa && meta_lower((unsigned char)*sa) == meta_lower((unsigned char)*sb)) {
+		sa++;
+		sb++;
+	}
+	/*文件名之后的字符：还有下级时为'/'，否则为'\0'*/
+	ca = *sa ? meta_lower((unsigned char)*sa) : (pa != a ? '/' : '\0');
+	cb = *sb ? meta_lower((unsigned char)*sb) : (pb != b ? '/' : '\0');
+	if (ca != cb) return ca < cb ? -1 : 1;
+	if (ca == '\0') return 0;
+	/*两个文件名只有大小写不同，且都还有下级，此时比较完整路径*/
+	return meta_strcmpi(meta_build_path(store, a, 0, 0), meta_build_path(store, b, 0, 1));
+}
+
+/*
+ * 按完整路径对所有记录排序，结果保存在 store->sorted 中。
+ * 比较时需要 store，qsort() 的比较函数无法传入状态，所以使用自底向上的归并排序。
+*/
+static void meta_store_sort(MetaStore *store)
+{
+	unsigned int *src, *dst, *tmp, n = store->count, width, lo, mid, hi, i, j, k;
+	if (store->sorted) pcs_free(store->sorted);
+	store->sorted = NULL;
+	if (n == 0) return;
+	store->sorted = (unsigned int *)pcs_malloc(n * sizeof(unsigned int));
+	tmp = (unsigned int *)pcs_malloc(n * sizeof(unsigned int));
+	for (i = 0; i < n; i++)
+		store->sorted[i] = i;
+	src = store->sorted;
+	dst = tmp;
+	for (width = 1; width < n; width *= 2) {
+		for (lo = 0; lo < n; lo += 2 * width) {
+			mid = lo + width < n ? lo + width : n;
+			hi = lo + 2 * width < n ? lo + 2 * width : n;
+			i = lo; j = mid; k = lo;
+			while (i < mid && j < hi) {
+				if (meta_compare(store, META_AT(store, src[j]), META_AT(store, src[i])) < 0)
+					dst[k++] = src[j++];
+				else
+					dst[k++] = src[i++];
+			}
+			while (i < mid) dst[k++] = src[i++];
+			while (j < hi) dst[k++] = src[j++];
+		}
+		tmp = src;
+		src = dst;
+		dst = tmp;
+	}
+	/*src 为最后一趟的结果，dst 为另一个缓冲区*/
+	if (src != store->sorted) {
+		memcpy(store->sorted, src, n * sizeof(unsigned int));
+		pcs_free(src);
+	}
+	else {
+		pcs_free(dst);
+	}
 }
 
 /*meta_load()函数中当获取到一个文件后的回调函数*/
 static void onGotLocalFile(LocalFileInfo *info, LocalFileInfo *parent, void *state)
 {
 	struct ScanLocalFileState *st = (struct ScanLocalFileState *)state;
-	rb_red_blk_tree *rb = st->rb;
 	MyMeta *meta;
+	unsigned int i;
 	if (!info->isdir && endsWith(info->path, TEMP_FILE_SUFFIX)) {
 		return;
 	}
-	fix_unix_path(info->path);
-	meta = meta_create(info->path);
+	i = meta_store_add(st->store,
+		(parent && parent->userdata) ? (unsigned int)((size_t)parent->userdata - 1) : META_NONE,
+		info->filename, strlen(info->filename));
+	meta = META_AT(st->store, i);
 	meta->flag |= FLAG_ON_LOCAL;
 	meta->local_mtime = info->mtime;
+	meta->local_size = info->size;
 	meta->local_isdir = info->isdir;
-	meta->parent = (parent ? (MyMeta *)parent->userdata : NULL);
-	info->userdata = meta;
-	RBTreeInsert(rb, (void *)meta->path, (void *)meta);
+	info->userdata = (void *)((size_t)i + 1);
 	st->total++;
 	printf("Scanned %d                     \r", st->total);
 	fflush(stdout);
 }
 
 /*
- * 从本地文件系统的目录树中创建<MyMeta>对象，并存入红黑树中
- * 返回红黑树对象
+ * 从本地文件系统的目录树中创建<MyMeta>记录，并存入 MetaStore 中
+ * 返回 MetaStore 对象
 */
-static rb_red_blk_tree *meta_load(const char *dir, int recursive)
+static MetaStore *meta_load(const char *dir, int recursive)
 {
-	rb_red_blk_tree *rb = NULL;
+	MetaStore *store;
 	LocalFileInfo *link = NULL;
 	int cnt = 0;
 	struct ScanLocalFileState state = { 0 };
 
-	rb = RBTreeCreate(&rb_compare, &rb_destory_key, &rb_destory_info, &rb_print_key, &rb_print_info);
-
-	state.rb = rb;
+	store = meta_store_create();
+	state.store = store;
 	state.total = 0;
 	cnt = GetDirectoryFiles(&link, dir, recursive, &onGotLocalFile, &state);
 	if (cnt < 0) {
-		RBTreeDestroy(rb);
+		meta_store_destroy(store);
 		return NULL;
 	}
 	if (cnt > 0) putchar('\n');
 	if (link)
 		DestroyLocalFileInfoLink(link);
-	return rb;
+	return store;
 }
 
 /*
@@ -1764,10 +2428,12 @@ static void print_meta_list_head(int first, int second, int other)
 *   first  - 第一列宽度，第一列为操作成功还是失败的标记列。不存在时，传入0
 *   second - 第二列宽度，第二列为本地文件的路径
 *   other  - 剩下列的总宽度，不包括第三列。第三列宽度为固定值2
+*   store  - meta 所在的 MetaStore
 *   meta   - 待打印的 meta 
 */
-static void print_meta_list_row(int first, int second, int other, MyMeta *meta)
+static void print_meta_list_row(int first, int second, int other, MetaStore *store, MyMeta *meta)
 {
+	const char *path;
 	int i;
 	if (first > 0) {
 		switch (meta->op_st) {
@@ -1792,9 +2458,10 @@ static void print_meta_list_row(int first, int second, int other, MyMeta *meta)
 		}
 	}
 	if (meta->flag & FLAG_ON_LOCAL) {
-		printf("%s", meta->path);
-		i = strlen(meta->path);
-		if (meta->local_isdir && i > 0 && meta->path[i - 1] != '/' && meta->path[i - 1] != '\\') {
+		path = meta_path(store, meta);
+		printf("%s", path);
+		i = strlen(path);
+		if (meta->local_isdir && i > 0 && path[i - 1] != '/' && path[i - 1] != '\\') {
 			putchar('/');
 			i++;
 		}
@@ -1823,20 +2490,22 @@ static void print_meta_list_row(int first, int second, int other, MyMeta *meta)
 	}
 	putchar(' ');
 	if (meta->flag & FLAG_ON_REMOTE) {
-		printf("%s", meta->remote_path);
-		i = strlen(meta->remote_path);
-		if (meta->remote_isdir && i > 0 && meta->remote_path[i - 1] != '/' && meta->remote_path[i - 1] != '\\') {
+		path = meta_remote_path(store, meta);
+		printf("%s", path);
+		i = strlen(path);
+		if (meta->remote_isdir && i > 0 && path[i - 1] != '/' && path[i - 1] != '\\') {
 			putchar('/');
 		}
 	}
 	putchar('\n');
-	//if (meta->msg) {
-	//	fprintf(stderr, RED "Error: %s" NONE "\n", meta->msg);
+	//if (meta_msg(store, meta)) {
+	//	fprintf(stderr, RED "Error: %s" NONE "\n", meta_msg(store, meta));
 	//}
 }
 
-static void print_meta_list_row_err(int first, int second, int other, MyMeta *meta)
+static void print_meta_list_row_err(int first, int second, int other, MetaStore *store, MyMeta *meta)
 {
+	const char *path;
 	int i;
 	if (first > 0) {
 		switch (meta->op_st) {
@@ -1861,9 +2530,10 @@ static void print_meta_list_row_err(int first, int second, int other, MyMeta *me
 		}
 	}
 	if (meta->flag & FLAG_ON_LOCAL) {
-		fprintf(stderr, "%s", meta->path);
-		i = strlen(meta->path);
-		if (meta->local_isdir && i > 0 && meta->path[i - 1] != '/' && meta->path[i - 1] != '\\') {
+		path = meta_path(store, meta);
+		fprintf(stderr, "%s", path);
+		i = strlen(path);
+		if (meta->local_isdir && i > 0 && path[i - 1] != '/' && path[i - 1] != '\\') {
 			fprintf(stderr, "/");
 			i++;
 		}
@@ -1892,15 +2562,16 @@ static void print_meta_list_row_err(int first, int second, int other, MyMeta *me
 	}
 	fprintf(stderr, " ");
 	if (meta->flag & FLAG_ON_REMOTE) {
-		fprintf(stderr, "%s", meta->remote_path);
-		i = strlen(meta->remote_path);
-		if (meta->remote_isdir && i > 0 && meta->remote_path[i - 1] != '/' && meta->remote_path[i - 1] != '\\') {
+		path = meta_remote_path(store, meta);
+		fprintf(stderr, "%s", path);
+		i = strlen(path);
+		if (meta->remote_isdir && i > 0 && path[i - 1] != '/' && path[i - 1] != '\\') {
 			fprintf(stderr, "/");
 		}
 	}
-	if (meta->msg) {
+	if (meta_msg(store, meta)) {
 		fprintf(stderr, "\n");
-		fprintf(stderr, RED "      %s" NONE, meta->msg);
+		fprintf(stderr, RED "      %s" NONE, meta_msg(store, meta));
 	}
 	fprintf(stderr, "\n");
 }
@@ -1994,7 +2665,7 @@ static int rb_print_meta(void *a, void *state)
 	if (s->process)
 		meta->op_st = OP_ST_PROCESSING;
 
-	print_meta_list_row(s->first, s->second, s->other, meta);
+	print_meta_list_row(s->first, s->second, s->other, s->store, meta);
 	
 	if (s->process) {
 		int rc = (*s->process)(meta, s, s->processState);
@@ -2005,10 +2676,10 @@ static int rb_print_meta(void *a, void *state)
 			fprintf(stderr, "\033[K");  //清除该行
 			fprintf(stderr, "\033[1A"); //先回到上一行
 			fprintf(stderr, "\033[K");  //清除该行
-			print_meta_list_row_err(s->first, s->second, s->other, meta);
+			print_meta_list_row_err(s->first, s->second, s->other, s->store, meta);
 		}
 		else {
-			print_meta_list_row(s->first, s->second, s->other, meta);
+			print_meta_list_row(s->first, s->second, s->other, s->store, meta);
 		}
 		if (rc) return rc;
 	}
@@ -2033,8 +2704,8 @@ static int rb_decide_op(void *a, void *state)
 	decide_op(meta);
 	meta->op_st = OP_ST_NONE;
 
-	if (meta->parent) {
-		if (!(meta->parent->flag & FLAG_ON_REMOTE))
+	if (meta->parent != META_NONE) {
+		if (!(META_AT(s->store, meta->parent)->flag & FLAG_ON_REMOTE))
 			meta->flag |= FLAG_PARENT_NOT_ON_REMOTE;
 	}
 
@@ -2060,7 +2731,7 @@ static int rb_decide_op(void *a, void *state)
 	if (!rb_print_enabled(meta, s)) return 0;
 
 	if ((meta->flag & FLAG_ON_LOCAL)) {
-		len = strlen(meta->path);
+		len = meta_path_len(s->store, meta, 0);
 		if (meta->local_isdir) len++;
 		if (s->second < len) s->second = len;
 	}
@@ -2107,12 +2778,13 @@ static PcsBool is_login(ShellContext *context, const char *msg)
  *   pErrMsg        - 如果下载失败时，用于接收失败消息，如果无需失败消息，则传入NULL
  *                    使用完后需调用pcs_free()
  *   op_st          - 用于接收操作状态的。即 OP_ST_FAIL， OP_ST_SUCC， OP_ST_SKIP
+ *   size           - 用于接收下载的字节数，不需要时传入NULL
  * 成功后返回0，失败后返回非0值
  */
 static inline int do_download(ShellContext *context, 
 	const char *local_file, const char *remote_file, time_t remote_mtime,
 	const char *local_basedir, const char *remote_basedir,
-	char **pErrMsg, int *op_st)
+	char **pErrMsg, int *op_st, size_t *size)
 {
 	PcsRes res;
 	struct DownloadState ds = { 0 };
@@ -2142,6 +2814,7 @@ static inline int do_download(ShellContext *context,
 	strcat(tmp_local_path, TEMP_FILE_SUFFIX);
 
 	/*打开文件*/
+	ds.quiet = context->quiet_progress;
 	ds.pf = fopen(tmp_local_path, "wb");
 	if (!ds.pf) {
 		if (pErrMsg) {
@@ -2224,16 +2897,23 @@ static inline int do_download(ShellContext *context,
 	/*设置文件最后修改时间为网盘文件最后修改时间*/
 	SetFileLastModifyTime(local_path, remote_mtime);
 	if (op_st) (*op_st) = OP_ST_SUCC;
+	if (size) (*size) = ds.size;
 	pcs_free(tmp_local_path);
 	pcs_free(local_path);
 	pcs_free(remote_path);
 	return 0;
 }
 
+/*
+ * 执行上传操作，参数同 do_download()
+ *   is_force       - 网盘中已存在同名文件时是否覆盖
+ *   size           - 用于接收上传的字节数，不需要时传入NULL
+ * 成功后返回0，失败后返回非0值
+ */
 static inline int do_upload(ShellContext *context, 
 	const char *local_file, const char *remote_file, PcsBool is_force,
 	const char *local_basedir, const char *remote_basedir,
-	char **pErrMsg, int *op_st)
+	char **pErrMsg, int *op_st, size_t *size)
 {
 	PcsFileInfo *res = NULL;
 	char *local_path, *remote_path, *dir;
@@ -2245,7 +2925,7 @@ static inline int do_upload(ShellContext *context,
 	pcs_setopts(context->pcs,
 		PCS_OPTION_PROGRESS_FUNCTION, &upload_progress,
 		PCS_OPTION_PROGRESS_FUNCTION_DATE, NULL,
-		PCS_OPTION_PROGRESS, (void *)((long)PcsTrue),
+		PCS_OPTION_PROGRESS, (void *)((long)(context->quiet_progress ? PcsFalse : PcsTrue)),
 		//PCS_OPTION_TIMEOUT, (void *)0L,
 		PCS_OPTION_END);
 	res = pcs_upload(context->pcs, remote_path, is_force, local_path);
@@ -2265,6 +2945,7 @@ static inline int do_upload(ShellContext *context,
 		return -1;
 	}
 	if (op_st) (*op_st) = OP_ST_SUCC;
+	if (size) (*size) = (size_t)res->size;
 	if (res) pcs_fileinfo_destroy(res);
 	pcs_free(local_path);
 	pcs_free(remote_path);
@@ -2412,8 +3093,13 @@ struct compare_arg
 
 	int			check_local_dir_exist;
 
+	int			parallel_min;	/*同时进行的传输数的下限，为0时逐个传输*/
+	int			parallel_max;	/*同时进行的传输数的上限，大于parallel_min时根据吞吐自动调整*/
+
 	/*当State准备好后调用一次本方法*/
-	void (*onRBEnumerateStatePrepared)(ShellContext *context, compare_arg *arg, rb_red_blk_tree *rb, struct RBEnumerateState *state, void *st);
+	void (*onRBEnumerateStatePrepared)(ShellContext *context, compare_arg *arg, MetaStore *store, struct RBEnumerateState *state, void *st);
+	/*打印完成后调用一次本方法*/
+	void (*onRBEnumerateCompleted)(ShellContext *context, compare_arg *arg, MetaStore *store, struct RBEnumerateState *state, void *st);
 };
 
 /*
@@ -2437,23 +3123,26 @@ static int parse_compare_args(struct args *g, compare_arg *cmpArg)
 
 /*
 * 比较两个文件的异同。
+*   store       - 保存比较结果的 MetaStore
 *   local       - 本地文件对象
 *   remote		- 网盘文件对象
-*   skip        - 目录跳过的字节数。
 */
-static MyMeta *compare_file(const LocalFileInfo *local, const PcsFileInfo *remote)
+static MyMeta *compare_file(MetaStore *store, const LocalFileInfo *local, const PcsFileInfo *remote)
 {
 	MyMeta *meta = NULL;
 
-	meta = meta_create(local->path);
+	meta = META_AT(store, meta_store_add(store, META_NONE, local->path, strlen(local->path)));
 	meta->flag |= FLAG_ON_LOCAL;
 	meta->local_mtime = local->mtime;
+	meta->local_size = local->size;
 	meta->local_isdir = local->isdir;
 
 	if (remote) {
 		meta->flag |= FLAG_ON_REMOTE;
-		meta->remote_path = pcs_utils_strdup(remote->path);
+		meta->remote_full = 1;
+		meta->remote_name = meta_store_str(store, remote->path, strlen(remote->path));
 		meta->remote_mtime = remote->server_mtime;
+		meta->remote_size = remote->size;
 		meta->remote_isdir = remote->isdir;
 	}
 
@@ -2463,126 +3152,80 @@ static MyMeta *compare_file(const LocalFileInfo *local, const PcsFileInfo *remot
 }
 
 /*
-* 列出网盘目录文件，并把结果合并到代表本地文件元数据的红黑树中。
+* 列出网盘目录文件，并把结果合并到代表本地文件元数据的 MetaStore 中。
+* 启用网盘目录缓存时，server_mtime 没有变化的目录直接使用缓存的内容。
 *   context     - 上下文
-*   rb          - 自己维护的一个文件元数据
+*   store       - 自己维护的文件元数据
 *   remote_dir  - 网盘文件对象
+*   remote_mtime - remote_dir 的 server_mtime，未知时传入0
+*   parent      - remote_dir 对应的记录的索引，remote_dir 为比较的根目录时传入 META_NONE
 *   recursive   - 表示是否递归
-*   skip        - 从什么位置开始截取路径，截取后的路径作为红黑树中项的Key
 *   total_cnt   - 用于统计
 *   check_local_dir_exist - 如果传入非0值的话，
 *                     将判断网盘目录在本地是否存在，只有存在时，才会继续加载其下文件和目录
 * 成功则返回0；否则返回非0值
 */
-static int combin_with_remote_dir_files(ShellContext *context, rb_red_blk_tree *rb,
-	const char *remote_dir, int recursive, int skip, int *total_cnt, int check_local_dir_exist)
-{
-	PcsFileInfoList *list = NULL;
-	PcsFileInfoListIterater iterater;
-	PcsFileInfo *info = NULL;
-	int page_index = 1,
-		page_size = 1000;
-	int cnt = 0, second;
-	rb_red_blk_node *rbn;
+static int combin_with_remote_dir_files(ShellContext *context, MetaStore *store,
+	const char *remote_dir, time_t remote_mtime, unsigned int parent, int recursive, int *total_cnt, int check_local_dir_exist)
+{
+	RemoteCacheDir *dir;
+	RemoteCacheEntry *ent;
+	char *child;
+	unsigned int i;
+	int k, rc = 0;
 	MyMeta *meta;
 
-	while (1) {
-		list = pcs_list(context->pcs, remote_dir,
-			page_index, page_size,
-			"name", PcsFalse);
-		if (!list) {
-			if (pcs_strerror(context->pcs)) {
-				fprintf(stderr, "Error: %s \n", pcs_strerror(context->pcs));
-				if (context->timeout_retry && strstr(pcs_strerror(context->pcs), "Can't get response from the remote server") >= 0) {
-					second = 10;
-					while (second > 0) {
-						printf("Retry after %d second...\n", second);
-						sleep(1);
-						second--;
-					}
-					//printf("Retrying...\n");
-					continue;
-				}
-				return -1;
-			}
-			return 0;
-		}
-
-		cnt = list->count;
-		if (total_cnt) (*total_cnt) += cnt;
-		if (total_cnt && cnt > 0) {
-			printf("Fetch %d                     \r", *total_cnt);
-			fflush(stdout);
-		}
-
-		pcs_filist_iterater_init(list, &iterater, PcsFalse);
-		while (pcs_filist_iterater_next(&iterater)) {
-			info = iterater.current;
-			rbn = RBExactQuery(rb, (void *)(info->path + skip));
-			if (rbn) {
-				meta = (MyMeta *)rbn->info;
-				meta->flag |= FLAG_ON_REMOTE;
-				if (meta->remote_path) pcs_free(meta->remote_path);
-				meta->remote_path = pcs_utils_strdup(info->path + skip);
-				meta->remote_mtime = info->server_mtime;
-				meta->remote_isdir = info->isdir;
-			}
-			else {
-				meta = meta_create(info->path + skip);
-				meta->flag |= FLAG_ON_REMOTE;
-				meta->remote_path = pcs_utils_strdup(info->path + skip);
-				meta->remote_mtime = info->server_mtime;
-				meta->remote_isdir = info->isdir;
-				RBTreeInsert(rb, (void *)meta->path, (void *)meta);
-			}
-		}
-
-		if (recursive) {
-			pcs_filist_iterater_init(list, &iterater, PcsFalse);
-			while (pcs_filist_iterater_next(&iterater)) {
-				info = iterater.current;
-				if (info->isdir) {
-					if (check_local_dir_exist) {
-						rbn = RBExactQuery(rb, (void *)(info->path + skip));
-						meta = (MyMeta *)rbn->info;
-						if (meta->flag & FLAG_ON_LOCAL) {
-							if (combin_with_remote_dir_files(context, rb, info->path, recursive, skip, total_cnt, check_local_dir_exist)) {
-								pcs_filist_destroy(list); 
-								return -1;
-							}
-						}
-					}
-					else if (combin_with_remote_dir_files(context, rb, info->path, recursive, skip, total_cnt, check_local_dir_exist)) {
-						pcs_filist_destroy(list); 
-						return -1;
-					}
-				}
-			}
-		}
-		pcs_filist_destroy(list);
-		if (cnt < page_size) {
-			break;
+	dir = remote_list_dir(context, remote_dir, remote_mtime, total_cnt);
+	if (!dir) return -1;
+
+	for (k = 0; k < dir->count; k++) {
+		ent = &dir->entries[k];
+		i = meta_store_find(store, parent, ent->name, strlen(ent->name));
+		if (i == META_NONE)
+			i = meta_store_add(store, parent, ent->name, strlen(ent->name));
+		meta = META_AT(store, i);
+		if (strcmp(META_STR(store, meta->name), ent->name)) /*只有大小写不同时，才单独保存网盘中的文件名*/
+			meta->remote_name = meta_store_str(store, ent->name, strlen(ent->name));
+		meta->flag |= FLAG_ON_REMOTE;
+		meta->remote_mtime = ent->mtime;
+		meta->remote_size = ent->size;
+		meta->remote_isdir = ent->isdir;
+	}
+
+	if (recursive) {
+		for (k = 0; k < dir->count && !rc; k++) {
+			ent = &dir->entries[k];
+			if (!ent->isdir) continue;
+			i = meta_store_find(store, parent, ent->name, strlen(ent->name));
+			if (check_local_dir_exist && !(META_AT(store, i)->flag & FLAG_ON_LOCAL))
+				continue;
+			child = remote_cache_child_path(remote_dir, ent->name);
+			rc = combin_with_remote_dir_files(context, store, child, ent->mtime, i, recursive, total_cnt, check_local_dir_exist);
+			pcs_free(child);
 		}
-		page_index++;
 	}
-	return 0;
+	if (!context->remote_cache || !remote_mtime)
+		remote_cache_dir_destroy(dir);
+	return rc;
 }
 
-static int on_compared_file(ShellContext *context, compare_arg *arg, MyMeta *mm, void *state)
+static int on_compared_file(ShellContext *context, compare_arg *arg, MetaStore *store, MyMeta *mm, void *state)
 {
 	int first, second, other;
-	first = 0; second = strlen(mm->path); other = 13;
+	first = 0; second = meta_path_len(store, mm, 0); other = 13;
 	if (second < 10) second = 10;
 	print_meta_list_head(first, second, other);
-	print_meta_list_row(first, second, other, mm);
+	print_meta_list_row(first, second, other, store, mm);
 	print_meta_list_notes(first, second, other);
 	return 0;
 }
 
-static int on_compared_dir(ShellContext *context, compare_arg *arg, rb_red_blk_tree *rb, void *st)
+static int on_compared_dir(ShellContext *context, compare_arg *arg, MetaStore *store, void *st)
 {
 	struct RBEnumerateState state = { 0 };
+	unsigned int i;
 	int printed_count = 0;
+	Int64 trace_start;
 	if (!arg->print_eq && !arg->print_left && !arg->print_right && !arg->print_confuse) {
 		arg->print_left = arg->print_right = arg->print_confuse = 1;
 	}
@@ -2592,7 +3235,7 @@ static int on_compared_dir(ShellContext *context, compare_arg *arg, rb_red_blk_t
 	//if (arg->print_confuse) state.print_op |= OP_CONFUSE;
 	state.print_flag = FLAG_ON_LOCAL | FLAG_ON_REMOTE;
 	state.no_print_flag = FLAG_PARENT_NOT_ON_REMOTE;
-	state.tree = rb;
+	state.store = store;
 	state.context = context;
 	state.page_size = context->list_page_size;
 	state.page_index = 1;
@@ -2600,17 +3243,19 @@ static int on_compared_dir(ShellContext *context, compare_arg *arg, rb_red_blk_t
 	state.dry_run = arg->dry_run;
 	state.local_basedir = arg->local_file;
 	state.remote_basedir = arg->remote_file;
-	rb->enumerateInfoState = &state;
-	rb->EnumerateInfo = &rb_decide_op;
 	printf("Comparing...\n");
-	RBTreeEnumerateInfo(rb);
+	trace_start = pcs_trace_now();
+	for (i = 0; i < store->count; i++) {
+		if (rb_decide_op(META_AT(store, store->sorted[i]), &state)) break;
+	}
+	pcs_trace_span("synch", "compare", trace_start, NULL);
 	if (state.cnt_total > 0) putchar('\n');
 	printf("Completed\n");
 	state.first = 0;
 	if (state.second < 10) state.second = 10;
 	state.other = 13;
 	if (arg->onRBEnumerateStatePrepared) {
-		(*arg->onRBEnumerateStatePrepared)(context, arg, rb, &state, st);
+		(*arg->onRBEnumerateStatePrepared)(context, arg, store, &state, st);
 	}
 	else {
 		printf("\nPrint Download: %s, Print Upload: %s, Print Confuse: %s, Print Equal: %s\n",
@@ -2619,10 +3264,13 @@ static int on_compared_dir(ShellContext *context, compare_arg *arg, rb_red_blk_t
 			arg->print_confuse ? "on" : "off",
 			arg->print_eq ? "on" : "off");
 	}
-	rb->EnumerateInfo = &rb_print_meta;
 	if (state.print_op && state.print_flag) {
 		printf("Printing|Synching...\n");
-		RBTreeEnumerateInfo(rb);
+		trace_start = pcs_trace_now();
+		for (i = 0; i < store->count; i++) {
+			if (rb_print_meta(META_AT(store, store->sorted[i]), &state)) break;
+		}
+		pcs_trace_span("synch", state.process ? "transfers" : "print", trace_start, NULL);
 		printed_count += state.printed_count;
 		printf("Completed\n");
 		/*if (state.printed_count == 0)
@@ -2638,10 +3286,15 @@ static int on_compared_dir(ShellContext *context, compare_arg *arg, rb_red_blk_t
 		state.prefixion = "[Confuse] ";
 		putchar('\n');
 		printf("Printing Confuse...\n");
-		RBTreeEnumerateInfo(rb);
+		for (i = 0; i < store->count; i++) {
+			if (rb_print_meta(META_AT(store, store->sorted[i]), &state)) break;
+		}
 		printf("Completed\n");
 		printed_count += state.printed_count;
 	}
+	if (arg->onRBEnumerateCompleted) {
+		(*arg->onRBEnumerateCompleted)(context, arg, store, &state, st);
+	}
 	if (printed_count == 0) {
 		print_meta_list_head(state.first, state.second, state.other);
 	}
@@ -2653,9 +3306,9 @@ static int on_compared_dir(ShellContext *context, compare_arg *arg, rb_red_blk_t
 }
 
 static int compare(ShellContext *context, compare_arg *arg, 
-	int (*onComparedFile)(ShellContext *context, compare_arg *arg, MyMeta *mm, void *state),
+	int (*onComparedFile)(ShellContext *context, compare_arg *arg, MetaStore *store, MyMeta *mm, void *state),
 	void *comparedFileState,
-	int(*onComparedDir)(ShellContext *context, compare_arg *arg, rb_red_blk_tree *rb, void *state),
+	int(*onComparedDir)(ShellContext *context, compare_arg *arg, MetaStore *store, void *state),
 	void *comparedDirState)
 {
 	char *path = NULL;
@@ -2719,12 +3372,14 @@ static int compare(ShellContext *context, compare_arg *arg,
 
 	/*本地和远端都是文件*/
 	if (!local->isdir && !remote->isdir) {
+		MetaStore *store;
 		MyMeta *mm = NULL;
-		int rc;
-		mm = compare_file(local, remote);
+		int rc = 0;
+		store = meta_store_create();
+		mm = compare_file(store, local, remote);
 		if (onComparedFile)
-			rc = (*onComparedFile)(context, arg, mm, comparedFileState);
-		meta_destroy(mm);
+			rc = (*onComparedFile)(context, arg, store, mm, comparedFileState);
+		meta_store_destroy(store);
 		DestroyLocalFileInfo(local);
 		pcs_fileinfo_destroy(remote);
 		pcs_free(path);
@@ -2733,12 +3388,15 @@ static int compare(ShellContext *context, compare_arg *arg,
 
 	/*本地和远端都是目录*/
 	if (local->isdir && remote->isdir) {
-		rb_red_blk_tree *rb = NULL;
-		int skip = 0, total_cnt = 0;
-		int rc;
+		MetaStore *store = NULL;
+		int total_cnt = 0;
+		int rc = 0;
+		Int64 trace_start;
 		printf("Scanning local file system...\n");
-		rb = meta_load(arg->local_file, arg->recursive);
-		if (!rb) {
+		trace_start = pcs_trace_now();
+		store = meta_load(arg->local_file, arg->recursive);
+		pcs_trace_span("synch", "local scan", trace_start, arg->local_file);
+		if (!store) {
 			fprintf(stderr, "Error: Can't list the local directory.\n");
 			DestroyLocalFileInfo(local);
 			pcs_fileinfo_destroy(remote);
@@ -2746,12 +3404,13 @@ static int compare(ShellContext *context, compare_arg *arg,
 			return -1;
 		}
 		printf("Completed\n");
-		skip = strlen(remote->path);
-		if (remote->path[skip - 1] != '/' && remote->path[skip - 1] != '\\') skip++;
 		printf("Fetching net disk file list...\n");
-		if (combin_with_remote_dir_files(context, rb, remote->path, arg->recursive, skip, &total_cnt, arg->check_local_dir_exist)) {
+		trace_start = pcs_trace_now();
+		rc = combin_with_remote_dir_files(context, store, remote->path, (time_t)remote->server_mtime, META_NONE, arg->recursive, &total_cnt, arg->check_local_dir_exist);
+		pcs_trace_span("synch", "remote fetch", trace_start, remote->path);
+		if (rc) {
 			fprintf(stderr, "Error: Can't list the remote directory.\n");
-			RBTreeDestroy(rb);
+			meta_store_destroy(store);
 			DestroyLocalFileInfo(local);
 			pcs_fileinfo_destroy(remote);
 			pcs_free(path);
@@ -2759,9 +3418,17 @@ static int compare(ShellContext *context, compare_arg *arg,
 		}
 		if (total_cnt > 0) putchar('\n');
 		printf("Completed\n");
+		if (context->remote_cache) {
+			trace_start = pcs_trace_now();
+			remote_cache_save(context);
+			pcs_trace_span("synch", "cache save", trace_start, NULL);
+		}
+		trace_start = pcs_trace_now();
+		meta_store_sort(store);
+		pcs_trace_span("synch", "sort", trace_start, NULL);
 		if (onComparedDir)
-			rc = (*onComparedDir)(context, arg, rb, comparedDirState);
-		RBTreeDestroy(rb);
+			rc = (*onComparedDir)(context, arg, store, comparedDirState);
+		meta_store_destroy(store);
 		DestroyLocalFileInfo(local);
 		pcs_fileinfo_destroy(remote);
 		pcs_free(path);
@@ -2888,7 +3555,7 @@ static int cmd_download(ShellContext *context, struct args *arg)
 	if (do_download(context,
 		locPath, meta->path, meta->server_mtime,
 		"", context->workdir,
-		&errmsg, NULL)) {
+		&errmsg, NULL, NULL)) {
 		fprintf(stderr, "Error: %s\n", errmsg);
 		pcs_fileinfo_destroy(meta);
 		if (errmsg) pcs_free(errmsg);
@@ -2993,7 +3660,7 @@ static int encrypt_file(const char *src, const char *dst, int secure_method, con
 	unsigned char		key[AES_BLOCK_SIZE] = { 0 };
 	unsigned char		iv[AES_BLOCK_SIZE] = { 0 };
 	int rc;
-	rc = AES_set_encrypt_key(md5_string_raw(secure_key), secure_method, &aes);
+	rc = AES_set_encrypt_key(md5_string_raw_r(secure_key, key), secure_method, &aes);
 	if (rc < 0) {
 		fprintf(stderr, "Error: Can't set encrypt key.\n");
 		return -1;
@@ -3155,7 +3822,7 @@ int decrypt_file(ShellContext *context, const char *src, const char *dst, const
 		return -1;
 	}
 
-	rc = AES_set_decrypt_key(md5_string_raw(secure_key), head.bits, &aes);
+	rc = AES_set_decrypt_key(md5_string_raw_r(secure_key, key), head.bits, &aes);
 	if (rc < 0) {
 		fprintf(stderr, "Error: Can't set decrypt key.\n");
 		fclose(srcFile);
@@ -3241,9 +3908,9 @@ int decrypt_file(ShellContext *context, const char *src, const char *dst, const
 static inline int get_secure_method(ShellContext *context)
 {
 	if (!context->secure_method) return -1;
-	if (strcmp(context->secure_method, "aes-cbc-128")) return PCS_SECURE_AES_CBC_128;
-	if (strcmp(context->secure_method, "aes-cbc-192")) return PCS_SECURE_AES_CBC_192;
-	if (strcmp(context->secure_method, "aes-cbc-256")) return PCS_SECURE_AES_CBC_256;
+	if (strcmp(context->secure_method, "aes-cbc-128") == 0) return PCS_SECURE_AES_CBC_128;
+	if (strcmp(context->secure_method, "aes-cbc-192") == 0) return PCS_SECURE_AES_CBC_192;
+	if (strcmp(context->secure_method, "aes-cbc-256") == 0) return PCS_SECURE_AES_CBC_256;
 	return -1;
 }
 
@@ -3423,6 +4090,10 @@ static int cmd_help(ShellContext *context, struct args *arg)
 		usage_search();
 		rc = 0;
 	}
+	else if (strcmp(cmd, "stats") == 0) {
+		usage_stats();
+		rc = 0;
+	}
 	else if (strcmp(cmd, "synch") == 0
 		|| strcmp(cmd, "s") == 0) {
 		usage_synch();
@@ -3875,7 +4546,7 @@ static int cmd_set(ShellContext *context, struct args *arg)
 	if (test_arg(arg, 0, 0, 
 		"cookie_file", "captcha_file", 
 		"list_page_size", "list_sort_name", "list_sort_direction",
-		"secure_method", "secure_key", "secure_enable",
+		"secure_method", "secure_key", "secure_enable", "remote_cache",
 		"h", "help", NULL) && arg->optc == 0) {
 		usage_set();
 		return -1;
@@ -3940,6 +4611,13 @@ static int cmd_set(ShellContext *context, struct args *arg)
 			return -1;
 		}
 	}
+
+	if (has_optEx(arg, "remote_cache", &val)) {
+		if (set_remote_cache(context, val)) {
+			usage_set();
+			return -1;
+		}
+	}
 	printf("Success. You can view context by '%s context'\n", app_name);
 	return 0;
 }
@@ -4003,10 +4681,189 @@ static int cmd_search(ShellContext *context, struct args *arg)
 	return 0;
 }
 
+/*打印HTTP请求统计。时间以毫秒为单位*/
+static void print_stats(PcsHttpStats *stats)
+{
+	PcsHttpEndpointStats *es;
+	PcsHttpRequestStats *r;
+	char in[32], out[32];
+	double n;
+	int i;
+
+	fprintf(stderr, "\n%-12s %6s %6s %7s %8s %8s %8s %8s %8s %8s %8s %8s %8s %10s %10s\n",
+		"Endpoint", "Count", "Errors", "Retries", "DNS", "Connect", "TLS", "TTFB", "Total",
+		"P50", "P90", "P99", "Max", "In", "Out");
+	for (i = 0; i < PCS_HTTP_ENDPOINT_COUNT; i++) {
+		es = &stats->endpoints[i];
+		if (es->count == 0)
+			continue;
+		n = (double)es->count;
+		pcs_utils_readable_size(es->bytes_in, in, 30, NULL);
+		pcs_utils_readable_size(es->bytes_out, out, 30, NULL);
+		fprintf(stderr, "%-12s %6lu %6lu %7lu %8.1f %8.1f %8.1f %8.1f %8.1f %8.1f %8.1f %8.1f %8.1f %10s %10s\n",
+			pcs_http_endpoint_name(i), es->count, es->errors, es->retries,
+			es->dns * 1000.0 / n, es->connect * 1000.0 / n, es->tls * 1000.0 / n,
+			es->ttfb * 1000.0 / n, es->total * 1000.0 / n,
+			pcs_http_stats_percentile(es, 50) * 1000.0, pcs_http_stats_percentile(es, 90) * 1000.0,
+			pcs_http_stats_percentile(es, 99) * 1000.0, es->max * 1000.0, in, out);
+	}
+	if (stats->recent_count == 0)
+		return;
+	fprintf(stderr, "\nRecent requests:\n%-8s %-12s %5s %7s %8s %8s %10s %10s\n",
+		"Time", "Endpoint", "Code", "Retries", "TTFB", "Total", "In", "Out");
+	for (i = 0; i < stats->recent_count; i++) {
+		struct tm *tm;
+		r = &stats->recent[i];
+		tm = localtime(&r->time);
+		pcs_utils_readable_size(r->bytes_in, in, 30, NULL);
+		pcs_utils_readable_size(r->bytes_out, out, 30, NULL);
+		fprintf(stderr, "%02d:%02d:%02d %-12s %5d %7d %8.1f %8.1f %10s %10s\n",
+			tm->tm_hour, tm->tm_min, tm->tm_sec, pcs_http_endpoint_name(r->endpoint),
+			r->code, r->retries, r->ttfb * 1000.0, r->total * 1000.0, in, out);
+	}
+}
+
+static int exec_cmd(ShellContext *context, struct args *arg);
+
+/*执行一个命令，然后打印该命令发出的HTTP请求的统计*/
+static int cmd_stats(ShellContext *context, struct args *arg)
+{
+	PcsHttpStats stats;
+	char *cmd;
+	int rc;
+
+	if (arg->argc == 0) {
+		usage_stats();
+		return has_opts(arg, "h", "help", NULL) ? 0 : -1;
+	}
+	/*第一个参数作为命令，其余参数和所有选项交给该命令*/
+	cmd = arg->cmd;
+	arg->cmd = arg->argv[0];
+	arg->argv++;
+	arg->argc--;
+	rc = exec_cmd(context, arg);
+	arg->argc++;
+	arg->argv--;
+	arg->cmd = cmd;
+	if (context->pcs) {
+		pcs_getstats(context->pcs, &stats);
+		print_stats(&stats);
+	}
+	return rc;
+}
+
 #pragma region synch
 
+/*并发同步时的一个传输任务*/
+struct SynchJob
+{
+	MyMeta	*meta;
+	int		op;				/*OP_LEFT 或 OP_RIGHT*/
+	char	*local_file;
+	char	*remote_file;
+	time_t	remote_mtime;
+	int		op_st;
+	char	*msg;
+};
+
+/*并发同步的状态，保存在 RBEnumerateState.processState 中*/
+struct SynchParallel
+{
+	ShellContext		*context;
+	const char			*local_basedir;
+	const char			*remote_basedir;
+	PcsTransferPool		pool;
+	struct SynchJob		**jobs;		/*按打印顺序排列的任务*/
+	int					count;
+	int					next;		/*下一个需取走结果的任务*/
+};
+
+/*在传输池的工作线程中执行一个任务，使用工作线程自己的Pcs对象，不显示进度*/
+static int synchTransfer(Pcs pcs, void *job, size_t *bytes, void *state)
+{
+	struct SynchJob *j = (struct SynchJob *)job;
+	struct SynchParallel *p = (struct SynchParallel *)state;
+	ShellContext context = *p->context;
+	Int64 trace_start;
+	int rc;
+
+	context.pcs = pcs;
+	context.quiet_progress = 1;
+	trace_start = pcs_trace_now();
+	if (j->op == OP_LEFT) {
+		rc = do_download(&context,
+			j->local_file, j->remote_file, j->remote_mtime,
+			p->local_basedir, p->remote_basedir,
+			&j->msg, &j->op_st, bytes);
+		pcs_trace_span("transfer", "download", trace_start, j->remote_file);
+	}
+	else {
+		rc = do_upload(&context,
+			j->local_file, j->remote_file, PcsTrue,
+			p->local_basedir, p->remote_basedir,
+			&j->msg, &j->op_st, bytes);
+		pcs_trace_span("transfer", "upload", trace_start, j->local_file);
+	}
+	return rc;
+}
+
+static void synchJobFree(struct SynchJob *j)
+{
+	if (j->local_file) pcs_free(j->local_file);
+	if (j->remote_file) pcs_free(j->remote_file);
+	if (j->msg) pcs_free(j->msg);
+	pcs_free(j);
+}
+
+/*在进度行显示传输池中剩余的文件数、大小和预计剩余时间*/
+static void synchPrintProgress(struct SynchParallel *p)
+{
+	PcsTransferProgress pg;
+	char size[64], rate[64];
+	int eta;
+
+	size[63] = rate[63] = '\0';
+	pcs_transfer_progress(p->pool, &pg);
+	printf("Left %d files, %s", pg.pending + pg.running,
+		pcs_utils_readable_size((double)(pg.pending_bytes + pg.running_bytes), size, 63, NULL));
+	if (pg.eta >= 0) {
+		eta = (int)(pg.eta + 0.5);
+		printf(", %s/s, ETA %d:%02d:%02d", pcs_utils_readable_size(pg.rate, rate, 63, NULL),
+			eta / 3600, (eta / 60) % 60, eta % 60);
+	}
+	printf(", Parallel %d      \r", pg.limit);
+	fflush(stdout);
+}
+
+/*
+ * 如果meta的传输已提交到传输池，则等待其完成并把结果写回meta。
+ * 等待期间每秒刷新一次进度。
+ * 结果的写回都在主线程中进行，MetaStore 不会被工作线程访问。
+ * 已处理返回1；没有对应的任务返回0
+*/
+static int synchWait(MyMeta *meta, struct RBEnumerateState *s, struct SynchParallel *p)
+{
+	struct SynchJob *j;
+	int rc;
+
+	if (!p || p->next >= p->count || p->jobs[p->next]->meta != meta)
+		return 0;
+	j = p->jobs[p->next++];
+	while (!pcs_transfer_wait_timeout(p->pool, j, 1000, &rc))
+		synchPrintProgress(p);
+	meta->op_st = j->op_st;
+	meta_set_msg(s->store, meta, j->msg);
+	j->msg = NULL;
+	synchJobFree(j);
+	return 1;
+}
+
 static int synchDownload(MyMeta *meta, struct RBEnumerateState *s, void *state)
 {
+	char *msg = NULL;
+	int op_st = meta->op_st, rc;
+	Int64 trace_start;
+
 	if (s->dry_run) { /*演示操作，模拟成功*/
 		meta->op_st = OP_ST_SUCC;
 		return 0;
@@ -4017,14 +4874,23 @@ static int synchDownload(MyMeta *meta, struct RBEnumerateState *s, void *state)
 		return 0;
 	}
 
-	return do_download(s->context, 
-		meta->path, meta->remote_path, meta->remote_mtime, 
+	trace_start = pcs_trace_now();
+	rc = do_download(s->context, 
+		meta_path(s->store, meta), meta_remote_path(s->store, meta), meta->remote_mtime, 
 		s->local_basedir, s->remote_basedir,
-		&meta->msg, &meta->op_st);
+		&msg, &op_st, NULL);
+	pcs_trace_span("transfer", "download", trace_start, meta_remote_path(s->store, meta));
+	meta->op_st = op_st;
+	meta_set_msg(s->store, meta, msg);
+	return rc;
 }
 
 static int synchUpload(MyMeta *meta, struct RBEnumerateState *s, void *state)
 {
+	char *msg = NULL;
+	int op_st = meta->op_st, rc;
+	Int64 trace_start;
+
 	if (s->dry_run) { /*演示操作，模拟成功*/
 		meta->op_st = OP_ST_SUCC;
 		return 0;
@@ -4035,25 +4901,29 @@ static int synchUpload(MyMeta *meta, struct RBEnumerateState *s, void *state)
 		return 0;
 	}
 
-	return do_upload(s->context,
-		meta->path, (meta->flag & FLAG_ON_REMOTE) ? meta->remote_path : meta->path, PcsTrue,
+	trace_start = pcs_trace_now();
+	rc = do_upload(s->context,
+		meta_path(s->store, meta), (meta->flag & FLAG_ON_REMOTE) ? meta_remote_path(s->store, meta) : meta_path(s->store, meta), PcsTrue,
 		s->local_basedir, s->remote_basedir,
-		&meta->msg, &meta->op_st);
+		&msg, &op_st, NULL);
+	pcs_trace_span("transfer", "upload", trace_start, meta_path(s->store, meta));
+	meta->op_st = op_st;
+	meta_set_msg(s->store, meta, msg);
+	return rc;
 }
 
 static int synchOnPrepare(MyMeta *meta, struct RBEnumerateState *s, void *state)
 {
-	if (meta->msg) {
-		pcs_free(meta->msg);
-		meta->msg = NULL;
-	}
+	meta_set_msg(s->store, meta, NULL);
 	switch (meta->op) {
 	case OP_LEFT: {
-		synchDownload(meta, s, state);
+		if (!synchWait(meta, s, (struct SynchParallel *)state))
+			synchDownload(meta, s, state);
 		break;
 	}
 	case OP_RIGHT: {
-		synchUpload(meta, s, state);
+		if (!synchWait(meta, s, (struct SynchParallel *)state))
+			synchUpload(meta, s, state);
 		break;
 	}
 	case OP_EQ:
@@ -4069,7 +4939,63 @@ static int synchOnPrepare(MyMeta *meta, struct RBEnumerateState *s, void *state)
 	return 0;
 }
 
-static void synchOnRBEnumStatePrepared(ShellContext *context, compare_arg *arg, rb_red_blk_tree *rb, struct RBEnumerateState *state, void *st)
+/*
+ * 把所有需要传输的文件按打印顺序提交到传输池，打印时再按顺序等待各自的结果。
+ * 传输池按文件大小安排实际的执行顺序。创建传输池失败时逐个传输。
+*/
+static void synchStartParallel(ShellContext *context, compare_arg *arg, MetaStore *store, struct RBEnumerateState *state)
+{
+	struct SynchParallel *p;
+	struct SynchJob *j;
+	MyMeta *meta;
+	unsigned int i;
+	UInt64 total = 0, size;
+	char tmp[64];
+
+	p = (struct SynchParallel *)pcs_malloc(sizeof(struct SynchParallel));
+	memset(p, 0, sizeof(struct SynchParallel));
+	p->context = context;
+	p->local_basedir = state->local_basedir;
+	p->remote_basedir = state->remote_basedir;
+	p->pool = pcs_transfer_pool_create(context->pcs, arg->parallel_min, arg->parallel_max, &synchTransfer, p);
+	if (!p->pool) {
+		fprintf(stderr, "Warning: Can't create the transfer threads, synch one by one.\n");
+		pcs_free(p);
+		return;
+	}
+	p->jobs = (struct SynchJob **)pcs_malloc(sizeof(struct SynchJob *) * (store->count + 1));
+	for (i = 0; i < store->count; i++) {
+		meta = META_AT(store, store->sorted[i]);
+		if (!rb_print_enabled(meta, state))
+			continue;
+		if (!(meta->op == OP_LEFT && !meta->remote_isdir) && !(meta->op == OP_RIGHT && !meta->local_isdir))
+			continue;
+		j = (struct SynchJob *)pcs_malloc(sizeof(struct SynchJob));
+		memset(j, 0, sizeof(struct SynchJob));
+		j->meta = meta;
+		j->op = meta->op;
+		j->op_st = OP_ST_PROCESSING;
+		j->local_file = pcs_utils_strdup(meta_path(store, meta));
+		if (meta->op == OP_LEFT || (meta->flag & FLAG_ON_REMOTE))
+			j->remote_file = pcs_utils_strdup(meta_remote_path(store, meta));
+		else
+			j->remote_file = pcs_utils_strdup(j->local_file);
+		j->remote_mtime = meta->remote_mtime;
+		p->jobs[p->count++] = j;
+		size = meta->op == OP_LEFT ? meta->remote_size : meta->local_size;
+		total += size;
+		pcs_transfer_submit(p->pool, j, size);
+	}
+	state->processState = p;
+	tmp[63] = '\0';
+	if (arg->parallel_min == arg->parallel_max)
+		printf("Parallel: %d", arg->parallel_max);
+	else
+		printf("Parallel: %d-%d (adaptive)", arg->parallel_min, arg->parallel_max);
+	printf(", Queued: %d files, %s\n", p->count, pcs_utils_readable_size((double)total, tmp, 63, NULL));
+}
+
+static void synchOnRBEnumStatePrepared(ShellContext *context, compare_arg *arg, MetaStore *store, struct RBEnumerateState *state, void *st)
 {
 	/*state->print_op &= OP_NONE;
 	if (!arg->print_eq && !arg->print_left && !arg->print_right && !arg->print_confuse)
@@ -4091,34 +5017,64 @@ static void synchOnRBEnumStatePrepared(ShellContext *context, compare_arg *arg,
 		arg->print_right ? "on" : "off",
 		arg->print_confuse ? "on" : "off",
 		arg->print_eq ? "on" : "off");
+
+	if (arg->parallel_max > 0 && !arg->dry_run)
+		synchStartParallel(context, arg, store, state);
 }
 
-static int synchFile(ShellContext *context, compare_arg *arg, MyMeta *meta, void *state)
+/*等待剩余的任务，并释放传输池*/
+static void synchOnRBEnumCompleted(ShellContext *context, compare_arg *arg, MetaStore *store, struct RBEnumerateState *state, void *st)
 {
-	int first, second, other;
-	if (meta->msg) {
-		pcs_free(meta->msg);
-		meta->msg = NULL;
+	struct SynchParallel *p = (struct SynchParallel *)state->processState;
+	int i;
+
+	if (!p) return;
+	for (i = p->next; i < p->count; i++) {
+		pcs_transfer_wait(p->pool, p->jobs[i], NULL);
+		synchJobFree(p->jobs[i]);
 	}
+	pcs_transfer_pool_destroy(p->pool);
+	pcs_free(p->jobs);
+	pcs_free(p);
+	state->processState = NULL;
+}
+
+static int synchFile(ShellContext *context, compare_arg *arg, MetaStore *store, MyMeta *meta, void *state)
+{
+	int first, second, other;
+	char *msg = NULL;
+	int op_st = meta->op_st;
+	Int64 trace_start;
+	meta_set_msg(store, meta, NULL);
 	switch (meta->op) {
 	case OP_LEFT: {
 		if (arg->dry_run)
 			meta->op_st = OP_ST_SUCC;
-		else
+		else {
+			trace_start = pcs_trace_now();
 			do_download(context,
-				meta->path, meta->remote_path, meta->remote_mtime,
+				meta_path(store, meta), meta_remote_path(store, meta), meta->remote_mtime,
 				arg->local_file, arg->remote_file,
-				&meta->msg, &meta->op_st);
+				&msg, &op_st, NULL);
+			pcs_trace_span("transfer", "download", trace_start, meta_remote_path(store, meta));
+			meta->op_st = op_st;
+			meta_set_msg(store, meta, msg);
+		}
 		break;
 	}
 	case OP_RIGHT: {
 		if (arg->dry_run)
 			meta->op_st = OP_ST_SUCC;
-		else
+		else {
+			trace_start = pcs_trace_now();
 			do_upload(context,
-				meta->path, (meta->flag & FLAG_ON_REMOTE) ? meta->remote_path : meta->path, PcsTrue,
+				meta_path(store, meta), (meta->flag & FLAG_ON_REMOTE) ? meta_remote_path(store, meta) : meta_path(store, meta), PcsTrue,
 				arg->local_file, arg->remote_file,
-				&meta->msg, &meta->op_st);
+				&msg, &op_st, NULL);
+			pcs_trace_span("transfer", "upload", trace_start, meta_path(store, meta));
+			meta->op_st = op_st;
+			meta_set_msg(store, meta, msg);
+		}
 		break;
 	}
 	case OP_EQ:
@@ -4131,10 +5087,10 @@ static int synchFile(ShellContext *context, compare_arg *arg, MyMeta *meta, void
 		meta->op_st = OP_ST_NONE;
 		break;
 	}
-	first = 6; second = strlen(meta->path); other = 13;
+	first = 6; second = meta_path_len(store, meta, 0); other = 13;
 	if (second < 10) second = 10;
 	print_meta_list_head(first, second, other);
-	print_meta_list_row(first, second, other, meta);
+	print_meta_list_row(first, second, other, store, meta);
 	print_meta_list_notes(first, second, other);
 	return 0;
 }
@@ -4143,8 +5099,9 @@ static int synchFile(ShellContext *context, compare_arg *arg, MyMeta *meta, void
 static int cmd_synch(ShellContext *context, struct args *arg)
 {
 	compare_arg cmpArg = { 0 };
+	char *val = NULL;
 
-	if (test_arg(arg, 2, 2, "c", "d", "e", "n", "r", "u", "h", "help", NULL)) {
+	if (test_arg(arg, 2, 2, "c", "d", "e", "n", "r", "u", "parallel", "h", "help", NULL)) {
 		usage_synch();
 		return -1;
 	}
@@ -4156,8 +5113,15 @@ static int cmd_synch(ShellContext *context, struct args *arg)
 		usage_compare();
 		return -1;
 	}
+	if (has_optEx(arg, "parallel", &val)
+		&& pcs_transfer_parse_range(val, &cmpArg.parallel_min, &cmpArg.parallel_max)) {
+		fprintf(stderr, "Error: Invalid --parallel value: %s\n", val ? val : "");
+		usage_synch();
+		return -1;
+	}
 	cmpArg.check_local_dir_exist = 0;
 	cmpArg.onRBEnumerateStatePrepared = &synchOnRBEnumStatePrepared;
+	cmpArg.onRBEnumerateCompleted = &synchOnRBEnumCompleted;
 
 	return compare(context, &cmpArg, &synchFile, NULL, &on_compared_dir, NULL);
 }
@@ -4239,7 +5203,7 @@ static int cmd_upload(ShellContext *context, struct args *arg)
 	if (do_upload(context,
 		locPath, path, is_force ? PcsTrue : PcsFalse,
 		"", context->workdir,
-		&errmsg, NULL)) {
+		&errmsg, NULL, NULL)) {
 		fprintf(stderr, "Error: %s\n", errmsg);
 		if (errmsg) pcs_free(errmsg);
 		pcs_free(path);
@@ -4375,6 +5339,9 @@ static int exec_cmd(ShellContext *context, struct args *arg)
 	else if (strcmp(cmd, "search") == 0) {
 		rc = cmd_search(context, arg);
 	}
+	else if (strcmp(cmd, "stats") == 0) {
+		rc = cmd_stats(context, arg);
+	}
 	else if (strcmp(cmd, "synch") == 0
 		|| strcmp(cmd, "s") == 0) {
 		rc = cmd_synch(context, arg);
@@ -4425,14 +5392,24 @@ int main(int argc, char *argv[])
 	else {
 		restore_context(&context, NULL);
 	}
+	if (has_optEx(&arg, "trace", &val)) {
+		if (!val || !val[0] || pcs_trace_open(val)) {
+			fprintf(stderr, "Error: Can't create the trace file: %s\n", val ? val : "");
+			rc = -1;
+			goto exit_main;
+		}
+		remove_opt(&arg, "trace", NULL);
+	}
 	if (errmsg) {
 		printf("%s\n", errmsg);
 		pcs_free(errmsg);
 	}
 	init_pcs(&context);
+	pcs_trace_thread_name("main");
 	rc = exec_cmd(&context, &arg);
 	save_context(&context);
 exit_main:
+	pcs_trace_close();
 	free_context(&context);
 	free_args(&arg);
 	pcs_mem_print_leak();
@@ -25,7 +25,11 @@ typedef struct ShellContext
 	char		*secure_key;    /*加密时的KEY*/
 	int			secure_enable;  /*是否启用加密*/
 
-	int			timeout_retry;  /*是否启用超时后重试*/
+	int			timeout_retry;  /*请求失败后是否自动重试，为0时设置PCS_OPTION_RETRY_MAX为0*/
+
+	int			remote_cache;   /*是否启用网盘目录缓存，启用后目录的 server_mtime 没有变化时不再重新列出该目录*/
+	struct Hashtable *remote_tree; /*已加载的网盘目录缓存，Key 为目录路径，Value 为 RemoteCacheDir*/
+	int			quiet_progress; /*为非0时上传和下载不显示进度，并发传输的工作线程使用*/
 } ShellContext;
 
 #endif
@@ -2,27 +2,51 @@
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <errno.h>
 #if defined(WIN32)
 #  include <direct.h>
 #  define mkdir _mkdir
 #  define chdir _chdir
 #  define D_SLEEP(s) Sleep((s) * 1000)
 #  define snprintf _snprintf
+#  define D_THREAD_LOCAL __declspec(thread)
+#  define D_LOCALTIME(t, tm) localtime_s((tm), (t))
 #else
 #  include <unistd.h>
+#  include <pthread.h>
+#  include <sys/socket.h>
+#  include <sys/un.h>
+#  include <netinet/in.h>
+#  include <arpa/inet.h>
 #  define D_SLEEP(s) sleep(s)
+#  define D_THREAD_LOCAL __thread
+#  define D_LOCALTIME(t, tm) localtime_r((t), (tm))
 #endif
 
 #include <sqlite3.h>
 
 #include "../pcs/cJSON.h"
 #include "../pcs/pcs.h"
+#include "../pcs/pcs_transfer.h"
 #include "logger.h"
 #include "dir.h"
 #include "shell_args.h"
+#include "pack_index.h"
 
 #define APP_NAME		(config.run_in_daemon ? "pcs(svc)" : "pcs")
 
+#define DEFAULT_CONCURRENCY		2 /*默认最多同时执行的任务数*/
+#define DEFAULT_CRAWL_THREADS	4 /*更新缓存时，默认同时列出目录的线程数*/
+#define UPDATE_PAGE_SIZE		1000 /*更新缓存时，每次请求列出的项数*/
+#define LOG_BACKUPS				3 /*日志文件轮转时保留的旧文件数*/
+#define DB_BUSY_TIMEOUT			60000 /*其他连接持有写锁时，最多等待的毫秒数*/
+#define RETRY_DELAY				60 /*单个文件操作失败后，第一次重试前等待的秒数，之后每次加倍*/
+#define RETRY_MAX_DELAY			(6 * 60 * 60) /*两次重试之间最多等待的秒数*/
+#define RETRY_MAX_ATTEMPTS		10 /*超过该失败次数后不再重试，等待任务下次完整执行*/
+#define RETRY_ABORT_FAILS		20 /*连续失败的次数超过该值时，认为网络或者账号出现问题，中止任务*/
+#define DEFAULT_PACK_SIZE		64 /*打包上传小文件时，每个包的默认大小（MB）*/
+#define PACK_DIR_NAME			".pcspack" /*包所在的目录名，位于任务的网盘目录下*/
+
 #ifndef TRUE
 #  define TRUE 1
 #endif
@@ -74,18 +98,42 @@ typedef struct BackupItem {
 	int		md5; /*是否启用MD5*/
 	time_t	next_run_time; /* 下次执行时间 */
 	time_t	last_run_time;
+	time_t	next_retry_time; /*重试队列中最早的重试时间，0表示没有需要重试的项*/
+	int		running; /*是否正在执行*/
+	time_t	last_end_time; /*上次完整执行结束的时间，0表示本次启动后还没有执行过*/
+	int		last_duration; /*上次完整执行的耗时（秒）*/
+	int		last_result; /*上次完整执行的结果，0表示成功*/
 	void	*state; /*附加数据*/
 } BackupItem;
 
+/*一个时间段内的限速*/
+typedef struct BandwidthLimit {
+	int		start; /*开始时间，值为一天从零点开始的秒数*/
+	int		end; /*结束时间，小于 start 时表示到第二天的该时间，等于 start 时表示全天*/
+	Int64	upload; /*上传限速，字节/秒，0表示不限速*/
+	Int64	download; /*下载限速，字节/秒，0表示不限速*/
+} BandwidthLimit;
+
 typedef struct Config {
 	char		*configFilePath; /*配置文件路径*/
 	char		*cookieFilePath; /*从配置文件中读入的Cookie配置项，即使用的cookie文件路径*/
 	char		*cacheFilePath; /*缓存文件的路径*/
 	char		*logFilePath; /*日志文件的路径*/
+	int			logMaxSize; /*日志文件超过该大小（MB）时轮转，0表示不轮转*/
 	BackupItem	*items; /*需要备份|还原的项*/
 	int			itemCount;
 	char		*secure_key;
 	int			secure_method;
+	int			concurrency; /*最多同时执行的任务数*/
+	int			crawl_threads; /*更新缓存时，同时列出目录的线程数*/
+	int			prune_dirs; /*更新缓存时，server_mtime 没有变化的目录不再列出*/
+	char		*metrics_listen; /*监控指标的监听地址，"host:port" 或 Unix socket 的路径，NULL表示不启用*/
+	int			transfer_min; /*备份目录时同时上传的文件数的下限，为0时逐个上传*/
+	int			transfer_max; /*备份目录时同时上传的文件数的上限，大于 transfer_min 时根据吞吐自动调整*/
+	BandwidthLimit	*bandwidth; /*按时间段的限速，不在任何时间段内时不限速*/
+	int			bandwidthCount;
+	Int64		pack_threshold; /*备份目录时，小于该大小（字节）的文件打包上传，0表示不打包*/
+	Int64		pack_size; /*每个包的大小（字节）*/
 
 	int			run_in_daemon;
 	int			log_enabled;
@@ -122,8 +170,33 @@ typedef struct BackupState {
 	int skipDir;
 	int removeDir;
 	int totalDir;
+
+	int failFiles; /*失败并加入重试队列的文件数*/
+	int failDir;
+	int continuousFails; /*连续失败的次数*/
+	const char *taskLocalPath; /*所属任务的本地路径，失败的项以此加入重试队列*/
+	const char *taskRemotePath;
 } BackupState;
 
+/*重试队列中的一项*/
+typedef struct RetryItem {
+	char	*localPath;
+	char	*remotePath;
+	int		isdir;
+	int		attempts;
+	struct RetryItem *next;
+} RetryItem;
+
+/*备份工作列表中的一项*/
+typedef struct BackupWorkItem {
+	char		*remotePath;
+	my_dirent	local;
+	PcsFileInfo	remote; /*网盘缓存，不存在时 fs_id 为0*/
+	PcsFileInfo	*uploaded; /*并发上传成功后网盘中的文件信息*/
+	int			packed; /*是否已经打包上传过*/
+	char		*packMd5; /*打包上传时文件的md5*/
+} BackupWorkItem;
+
 /*下载时的用户自定义数据结构，用于传入数据到下载的写入函数中*/
 typedef struct DownloadState {
 	FILE *pf;
@@ -131,6 +204,19 @@ typedef struct DownloadState {
 	size_t size;
 } DownloadState;
 
+/*正在写入的包。文件先依次写入本地的临时文件，达到 pack_size 后整个上传*/
+typedef struct PackBuilder {
+	char		*remoteDir; /*包所在的网盘目录*/
+	char		*localFile; /*本地临时文件的路径*/
+	FILE		*pf;
+	Int64		size;
+	PackEntry	*entries;
+	int			count;
+	int			capacity;
+	int			seq; /*本次任务中已经上传的包数，用于包的文件名*/
+	int			dirReady; /*包所在的网盘目录是否已经创建*/
+} PackBuilder;
+
 /*记录比较结果的链表
 例：用类似于"+ D L:/var/www/upload"的字符串表示一个CompareItem对象
 （该字符串可通过printf("%c %c %c:%s\n", p->op, p->type, p->position, p->path)来获得），
@@ -171,11 +257,95 @@ typedef struct TaskInfo {
 } TaskInfo;
 
 static Config config = {0};
-static sqlite3 *db = NULL;
-static Pcs pcs = NULL;
+/*每个执行任务的线程使用各自的数据库连接和Pcs对象*/
+static D_THREAD_LOCAL sqlite3 *db = NULL;
+static D_THREAD_LOCAL Pcs pcs = NULL;
 
 static void print_taks();
 
+/*
+监控指标。由各工作线程更新，监控线程（见 metrics_start()）读取后以 Prometheus 文本格式输出。
+耗时直方图和 PcsHttpEndpointStats 使用相同的分桶：第0个桶为1毫秒以内，第i个桶为[2^(i-1), 2^i)毫秒。
+*/
+typedef struct MetricHistogram {
+	UInt64	count;
+	double	sum; /*秒*/
+	UInt64	buckets[PCS_HTTP_STATS_BUCKETS];
+} MetricHistogram;
+
+typedef struct Metrics {
+	UInt64	uploaded_bytes;
+	UInt64	downloaded_bytes;
+	UInt64	uploaded_files;
+	UInt64	downloaded_files;
+	UInt64	skipped_files;
+	UInt64	failed_files; /*加入重试队列的文件数*/
+	int		active_transfers; /*正在上传或下载的文件数*/
+	MetricHistogram	db_commit; /*SQLite提交写事务的耗时*/
+} Metrics;
+
+static Metrics metrics = {0};
+
+#ifdef WIN32
+#  define METRICS_LOCK()
+#  define METRICS_UNLOCK()
+#else
+static pthread_mutex_t metrics_mutex = PTHREAD_MUTEX_INITIALIZER;
+#  define METRICS_LOCK()	pthread_mutex_lock(&metrics_mutex)
+#  define METRICS_UNLOCK()	pthread_mutex_unlock(&metrics_mutex)
+#endif
+
+/*单调时钟，单位为秒*/
+static double metrics_clock()
+{
+#ifdef WIN32
+	return GetTickCount() / 1000.0;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+#endif
+}
+
+static void metrics_observe(MetricHistogram *h, double seconds)
+{
+	double ms = seconds * 1000.0;
+	int i;
+	for (i = 0; i < PCS_HTTP_STATS_BUCKETS - 1 && ms >= (double)(1UL << i); i++);
+	METRICS_LOCK();
+	h->count++;
+	h->sum += seconds;
+	h->buckets[i]++;
+	METRICS_UNLOCK();
+}
+
+static void metrics_add(UInt64 *counter, UInt64 value)
+{
+	METRICS_LOCK();
+	(*counter) += value;
+	METRICS_UNLOCK();
+}
+
+/*开始上传或下载一个文件*/
+static void metrics_transfer_begin()
+{
+	METRICS_LOCK();
+	metrics.active_transfers++;
+	METRICS_UNLOCK();
+}
+
+/*上传或下载结束。bytes为成功传输的字节数，失败时为0*/
+static void metrics_transfer_end(UInt64 *files, UInt64 *bytes, int succ, UInt64 size)
+{
+	METRICS_LOCK();
+	metrics.active_transfers--;
+	if (succ) {
+		(*files)++;
+		(*bytes) += size;
+	}
+	METRICS_UNLOCK();
+}
+
 /*返回数据库文件的路径*/
 //static const char *db_file_path()
 //{
@@ -233,11 +403,11 @@ static void d_mem_printf(const char *fmt, ...)
 
 static const char *format_time(time_t time)
 {
-	static char strTime[32] = {0};
-	struct tm* ptm;
+	static D_THREAD_LOCAL char strTime[32] = {0};
+	struct tm tm;
 	if (time == 0) return "0000-00-00 00:00:00";
-	ptm = localtime(&time);  
-	snprintf(strTime, 31, "%04d-%02d-%02d %02d:%02d:%02d", 1900 + ptm->tm_year, ptm->tm_mon + 1, ptm->tm_mday, ptm->tm_hour, ptm->tm_min, ptm->tm_sec);
+	D_LOCALTIME(&time, &tm); /*工作线程中也会调用，localtime() 的结果是进程共享的*/
+	snprintf(strTime, 31, "%04d-%02d-%02d %02d:%02d:%02d", 1900 + tm.tm_year, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec);
 	return strTime;
 }
 
@@ -271,6 +441,8 @@ static void freeConfig(int keepGlobal)
 	if (config.cacheFilePath) pcs_free(config.cacheFilePath);
 	if (config.logFilePath) pcs_free(config.logFilePath);
 	if (config.secure_key) pcs_free(config.secure_key);
+	if (config.metrics_listen) pcs_free(config.metrics_listen);
+	if (config.bandwidth) pcs_free(config.bandwidth);
 	if (config.items) {
 		int ii;
 		for(ii = 0; ii < config.itemCount; ii++) {
@@ -421,6 +593,9 @@ static int readConfigFile()
 	else
 		config.logFilePath = NULL;
 
+	item = cJSON_GetObjectItem(json, "logMaxSize");
+	config.logMaxSize = item && item->valueint > 0 ? item->valueint : 0;
+
 	item = cJSON_GetObjectItem(json, "secureMethod");
 	if (item && item->valuestring[0]) {
 		if (strcmp(item->valuestring, "plaintext") == 0)
@@ -459,6 +634,61 @@ static int readConfigFile()
 	item = cJSON_GetObjectItem(json, "RunInDaemon");
 	if (item) config.run_in_daemon = item->valueint;
 
+	item = cJSON_GetObjectItem(json, "concurrency");
+	config.concurrency = item ? item->valueint : DEFAULT_CONCURRENCY;
+	if (config.concurrency < 1) config.concurrency = 1;
+
+	item = cJSON_GetObjectItem(json, "crawlThreads");
+	config.crawl_threads = item ? item->valueint : DEFAULT_CRAWL_THREADS;
+	if (config.crawl_threads < 1) config.crawl_threads = 1;
+
+	item = cJSON_GetObjectItem(json, "pruneUnchangedDirs");
+	if (item) config.prune_dirs = item->valueint;
+
+	item = cJSON_GetObjectItem(json, "metricsListen");
+	if (item && item->valuestring && item->valuestring[0])
+		config.metrics_listen = pcs_utils_strdup(item->valuestring);
+
+	item = cJSON_GetObjectItem(json, "parallelTransfers");
+	if (item && item->valuestring && item->valuestring[0]) {
+		if (pcs_transfer_parse_range(item->valuestring, &config.transfer_min, &config.transfer_max)) {
+			PRINT_FATAL("Invalidate \"parallelTransfers\" option (%s). The value should be N, MIN-MAX or auto.", item->valuestring);
+			cJSON_Delete(json);
+			return -1;
+		}
+	}
+
+	item = cJSON_GetObjectItem(json, "packSmallFiles");
+	if (item && item->valueint > 0) config.pack_threshold = (Int64)item->valueint * 1024;
+	item = cJSON_GetObjectItem(json, "packSize");
+	config.pack_size = (Int64)(item && item->valueint > 0 ? item->valueint : DEFAULT_PACK_SIZE) * 1024 * 1024;
+
+	items = cJSON_GetObjectItem(json, "bandwidthLimits");
+	if (items && cJSON_GetArraySize(items) > 0) {
+		int i;
+		char buf[32], *p;
+		config.bandwidthCount = cJSON_GetArraySize(items);
+		config.bandwidth = (BandwidthLimit *)pcs_malloc(sizeof(BandwidthLimit) * config.bandwidthCount);
+		memset(config.bandwidth, 0, sizeof(BandwidthLimit) * config.bandwidthCount);
+		for (i = 0; i < config.bandwidthCount; i++) {
+			item = cJSON_GetArrayItem(items, i);
+			value = cJSON_GetObjectItem(item, "time");
+			if (!value || !value->valuestring || strlen(value->valuestring) >= sizeof(buf)
+				|| !(p = strchr(strcpy(buf, value->valuestring), '-'))) {
+				PRINT_FATAL("Invalidate \"time\" option in bandwidthLimits[%d] (%s). The value should be HH:MM-HH:MM.", i, config.configFilePath);
+				cJSON_Delete(json);
+				return -1;
+			}
+			*p++ = '\0';
+			config.bandwidth[i].start = convert_to_time_t(buf);
+			config.bandwidth[i].end = convert_to_time_t(p);
+			value = cJSON_GetObjectItem(item, "upload");
+			if (value && value->valueint > 0) config.bandwidth[i].upload = (Int64)value->valueint * 1024;
+			value = cJSON_GetObjectItem(item, "download");
+			if (value && value->valueint > 0) config.bandwidth[i].download = (Int64)value->valueint * 1024;
+		}
+	}
+
 	items = cJSON_GetObjectItem(json, "items");
 	if (!items) {
 		PRINT_FATAL("No \"items\" option (%s)", config.configFilePath);
@@ -545,13 +775,13 @@ static void init_schedule()
 {
 	int i;
 	time_t now, date;
-	struct tm* ptm;
+	struct tm tm;
 	time(&now);
-	ptm = localtime(&now);  
-	ptm->tm_hour = 0;
-	ptm->tm_min = 0;
-	ptm->tm_sec = 0;
-	date = mktime(ptm);
+	D_LOCALTIME(&now, &tm);
+	tm.tm_hour = 0;
+	tm.tm_min = 0;
+	tm.tm_sec = 0;
+	date = mktime(&tm);
 	for (i = 0; i < config.itemCount; i++) {
 		config.items[i].next_run_time = config.items[i].schedule + date;
 		if (config.items[i].next_run_time <= now)
@@ -559,6 +789,53 @@ static void init_schedule()
 	}
 }
 
+/*
+根据当前时间设置限速，返回下一个时间段边界的时间，之后需要再次调用。没有配置限速时返回0。
+多个时间段重叠时使用第一个。
+*/
+static time_t bandwidth_apply(time_t now)
+{
+	static int current = -2; /*当前使用的时间段，-1表示不限速*/
+	int i, sec, match = -1, next = -1, t;
+	time_t date;
+	struct tm tm;
+	if (config.bandwidthCount == 0)
+		return 0;
+	D_LOCALTIME(&now, &tm);
+	sec = tm.tm_hour * 60 * 60 + tm.tm_min * 60 + tm.tm_sec;
+	tm.tm_hour = 0;
+	tm.tm_min = 0;
+	tm.tm_sec = 0;
+	date = mktime(&tm);
+	for (i = 0; i < config.bandwidthCount; i++) {
+		BandwidthLimit *b = &config.bandwidth[i];
+		if (match < 0) {
+			if (b->start == b->end
+				|| (b->start < b->end && sec >= b->start && sec < b->end)
+				|| (b->start > b->end && (sec >= b->start || sec < b->end)))
+				match = i;
+		}
+		/*下一个边界，已经过去的边界算作第二天的*/
+		t = b->start > sec ? b->start : b->start + 24 * 60 * 60;
+		if (next < 0 || t < next) next = t;
+		t = b->end > sec ? b->end : b->end + 24 * 60 * 60;
+		if (next < 0 || t < next) next = t;
+	}
+	if (match != current) {
+		current = match;
+		if (match >= 0) {
+			pcs_set_rate_limit(config.bandwidth[match].upload, config.bandwidth[match].download);
+			PRINT_NOTICE("Bandwidth limit: upload %d KB/s, download %d KB/s (0 means unlimited)",
+				(int)(config.bandwidth[match].upload / 1024), (int)(config.bandwidth[match].download / 1024));
+		}
+		else {
+			pcs_set_rate_limit(0, 0);
+			PRINT_NOTICE("Bandwidth limit: unlimited");
+		}
+	}
+	return date + next;
+}
+
 static void freeTaskInfo(TaskInfo *info)
 {
 	if (info->local_path) { pcs_free(info->local_path); info->local_path = NULL; }
@@ -632,8 +909,23 @@ static int db_check_update()
 {
 	int verno;
 	verno = db_get_version();
-	if (verno < DB_VERSION) {
+	if (verno < 0) return -1;
+	if (verno < 3) {
 		sqlite3_exec(db, SQL_UPDATE_DB_FROM_VER0, NULL, NULL, NULL);
+	}
+	if (verno < 4) {
+		/*版本4：pcs_cache 增加 parent_id，列出目录的直接子项改为按 parent_id 查找*/
+		if (sqlite3_exec(db, SQL_BEGIN, NULL, NULL, NULL)) return -1;
+		sqlite3_exec(db, SQL_UPDATE_DB_FROM_VER3, NULL, NULL, NULL); /*新建的数据库已经有该列，忽略错误*/
+		if (sqlite3_exec(db, SQL_CACHE_HIERARCHY_CREATOR, NULL, NULL, NULL)
+			|| sqlite3_exec(db, SQL_UPDATE_DB_FILL_PARENT, NULL, NULL, NULL)) {
+			PRINT_FATAL("Can't upgrade the cache to version 4: %s", sqlite3_errmsg(db));
+			sqlite3_exec(db, "ROLLBACK", NULL, NULL, NULL);
+			return -1;
+		}
+		if (sqlite3_exec(db, SQL_COMMIT, NULL, NULL, NULL)) return -1;
+	}
+	if (verno < DB_VERSION) {
 		db_set_version(DB_VERSION);
 	}
 	return 0;
@@ -648,6 +940,11 @@ static int db_open()
 		PRINT_FATAL("Can't open database(%s): %s", config.cacheFilePath, sqlite3_errmsg(db));
 		return -1;
 	}
+	/*多个任务并行时，各自的连接会竞争写锁*/
+	sqlite3_busy_timeout(db, DB_BUSY_TIMEOUT);
+	if (sqlite3_exec(db, SQL_PRAGMA_TUNE, NULL, NULL, NULL)) {
+		PRINT_WARNING("Can't tune the database(%s): %s", config.cacheFilePath, sqlite3_errmsg(db));
+	}
 	rc = sqlite3_prepare_v2(db, SQL_TABLE_EXISTS, -1, &stmt, NULL);
 	if (rc) {
 		PRINT_FATAL("Can't build the sql %s: %s", SQL_TABLE_EXISTS, sqlite3_errmsg(db));
@@ -657,7 +954,7 @@ static int db_open()
 	}
 
 	// TABLE_NAME_CACHE
-	if (db_check_table(stmt, TABLE_NAME_CACHE, TABLE_CACHE_CREATOR, TABLE_CACHE_INDEX_CREATOR, NULL)) {
+	if (db_check_table(stmt, TABLE_NAME_CACHE, TABLE_CACHE_CREATOR, TABLE_CACHE_INDEX_CREATOR, SQL_CACHE_HIERARCHY_CREATOR)) {
 		sqlite3_finalize(stmt);
 		sqlite3_close(db);
 		db = NULL;
@@ -680,6 +977,32 @@ static int db_open()
 		return -1;
 	}
 
+	// TABLE_NAME_RETRY
+	if (db_check_table(stmt, TABLE_NAME_RETRY, TABLE_RETRY_CREATOR, TABLE_RETRY_INDEX_CREATOR, NULL)) {
+		sqlite3_finalize(stmt);
+		sqlite3_close(db);
+		db = NULL;
+		return -1;
+	}
+
+	// TABLE_NAME_PACK
+	if (db_check_table(stmt, TABLE_NAME_PACK, TABLE_PACK_CREATOR, NULL, NULL)
+		|| db_check_table(stmt, TABLE_NAME_PACK_FILE, TABLE_PACK_FILE_CREATOR, TABLE_PACK_FILE_INDEX_CREATOR, TABLE_PACK_FILE_TRIGGER_CREATOR)) {
+		sqlite3_finalize(stmt);
+		sqlite3_close(db);
+		db = NULL;
+		return -1;
+	}
+
+	// 本地扫描结果，临时表只在当前连接中存在
+	if (sqlite3_exec(db, TABLE_LOCAL_CREATOR, NULL, NULL, NULL)) {
+		PRINT_FATAL("Can't create the temp table: %s", sqlite3_errmsg(db));
+		sqlite3_finalize(stmt);
+		sqlite3_close(db);
+		db = NULL;
+		return -1;
+	}
+
 	sqlite3_finalize(stmt);
 
 	if (db_check_update()) {
@@ -765,6 +1088,111 @@ static void db_prepare_destroy(DbPrepare *pre)
 	}
 }
 
+/*
+绑定path目录下所有子项的路径范围到语句的第index和index+1个参数，
+对应的SQL条件为 "server_path >= ?index AND server_path < ?(index+1)"。
+'0'紧接在'/'之后，所以以"path/"开头的路径均满足 "path/" <= x < "path0"，
+与 LIKE 'path/%' 不同，范围条件可以使用 server_path 上的索引。
+*/
+static int db_bind_path_range(sqlite3_stmt *stmt, int index, const char *path)
+{
+	int rc, sz;
+	char *val;
+	sz = strlen(path);
+	if (sz > 0 && path[sz - 1] == '/') sz--;
+	val = (char *)pcs_malloc(sz + 2);
+	memcpy(val, path, sz);
+	val[sz] = '/'; val[sz + 1] = '\0';
+	rc = sqlite3_bind_text(stmt, index, val, sz + 1, SQLITE_TRANSIENT);
+	if (!rc) {
+		val[sz] = '/' + 1;
+		rc = sqlite3_bind_text(stmt, index + 1, val, sz + 1, SQLITE_TRANSIENT);
+	}
+	pcs_free(val);
+	return rc;
+}
+
+/*
+绑定目录路径到语句的第index个参数，去掉路径末尾的'/'（根目录"/"除外），
+以便与 pcs_cache 中 server_path 的格式一致。
+*/
+static int db_bind_dir_path(sqlite3_stmt *stmt, int index, const char *path)
+{
+	int sz;
+	sz = strlen(path);
+	while (sz > 1 && path[sz - 1] == '/') sz--;
+	return sqlite3_bind_text(stmt, index, path, sz, SQLITE_TRANSIENT);
+}
+
+/*
+批量写入。
+不在事务中时，每条写语句都是一个独立的事务，都需要同步磁盘。
+db_begin_batch() 和 db_end_batch() 之间的写操作合并到事务中，
+每 DB_BATCH_SIZE 次写操作或每 DB_BATCH_SECONDS 秒提交一次，
+既减少同步磁盘的次数，又避免中断时丢失太多进度。可以嵌套调用。
+事务在第一次写操作前才以 BEGIN IMMEDIATE 开始，并且在耗时较长的网络操作前提交，
+以免并行执行的其他任务长时间等待写锁。
+*/
+#define DB_BATCH_SIZE		5000
+#define DB_BATCH_SECONDS	5
+
+static D_THREAD_LOCAL int db_batch_depth = 0;
+static D_THREAD_LOCAL int db_batch_pending = 0;
+static D_THREAD_LOCAL time_t db_batch_time = 0;
+
+static void db_begin_batch()
+{
+	if (db_batch_depth++ > 0) return;
+	db_batch_pending = 0;
+}
+
+/*提交当前的写事务*/
+static void db_batch_flush()
+{
+	Int64 traceStart;
+	double start;
+	if (sqlite3_get_autocommit(db)) return;
+	traceStart = pcs_trace_now();
+	start = metrics_clock();
+	if (sqlite3_exec(db, SQL_COMMIT, NULL, NULL, NULL)) {
+		PRINT_FATAL("Can't commit the transaction: %s", sqlite3_errmsg(db));
+	}
+	metrics_observe(&metrics.db_commit, metrics_clock() - start);
+	pcs_trace_span("db", "commit", traceStart, NULL);
+	db_batch_pending = 0;
+}
+
+static void db_end_batch()
+{
+	if (db_batch_depth <= 0 || --db_batch_depth > 0) return;
+	db_batch_flush();
+}
+
+/*每次写操作前调用*/
+static void db_batch_lock()
+{
+	if (db_batch_depth <= 0 || !sqlite3_get_autocommit(db)) return;
+	if (sqlite3_exec(db, SQL_BEGIN_IMMEDIATE, NULL, NULL, NULL)) {
+		PRINT_WARNING("Can't begin the transaction: %s", sqlite3_errmsg(db));
+		return;
+	}
+	db_batch_pending = 0;
+	time(&db_batch_time);
+}
+
+/*每完成一次写操作后调用*/
+static void db_batch_step()
+{
+	time_t now;
+	if (db_batch_depth <= 0 || sqlite3_get_autocommit(db)) return;
+	db_batch_pending++;
+	if (db_batch_pending < DB_BATCH_SIZE) {
+		time(&now);
+		if (now - db_batch_time < DB_BATCH_SECONDS) return;
+	}
+	db_batch_flush();
+}
+
 static int db_get_task(TaskInfo *dst, int method, const char *localPath, const char *remotePath)
 {
 	int rc;
@@ -1018,40 +1446,24 @@ static int db_clear_caches(const char *path)
 {
 	int rc;
 	sqlite3_stmt *stmt = NULL;
-	int sz;
-	char *val;
 	rc = sqlite3_prepare_v2(db, SQL_CACHE_CLEAR, -1, &stmt, NULL);
 	if (rc) {
 		PRINT_FATAL("Can't build the sql %s: %s", SQL_CACHE_CLEAR, sqlite3_errmsg(db));
 		return -1;
 	}
-	sz = strlen(path);
-	val = (char *)pcs_malloc(sz + 3);
-	memcpy(val, path, sz + 1);
-	if (val[sz - 1] != '/') {
-		val[sz] = '/'; val[sz + 1] = '%'; val[sz + 2] = '\0';
-		sz += 2;
-	}
-	else {
-		val[sz] = '%'; val[sz + 1] = '\0';
-		sz++;
-	}
-	rc = sqlite3_bind_text(stmt, 1, val, sz, SQLITE_STATIC);
+	rc = db_bind_path_range(stmt, 1, path);
 	if (rc) {
 		PRINT_FATAL("Can't bind the text into the statement %s: %s", SQL_CACHE_CLEAR, sqlite3_errmsg(db));
 		sqlite3_finalize(stmt);
-		pcs_free(val);
 		return -1;
 	}
 	rc = sqlite3_step(stmt);
 	if (rc != SQLITE_ROW && rc != SQLITE_DONE) {
 		PRINT_FATAL("Can't execute the statement %s: %s", SQL_CACHE_CLEAR, sqlite3_errmsg(db));
 		sqlite3_finalize(stmt);
-		pcs_free(val);
 		return -1;
 	}
 	sqlite3_finalize(stmt);
-	pcs_free(val);
 	return 0;
 }
 
@@ -1092,8 +1504,6 @@ static int db_set_cache_flags(const char *path, int flag)
 {
 	int rc;
 	sqlite3_stmt *stmt = NULL;
-	int sz;
-	char *val;
 	time_t now;
 	time(&now);
 	rc = sqlite3_prepare_v2(db, SQL_CACHE_SET_FLAG_SUB, -1, &stmt, NULL);
@@ -1101,30 +1511,17 @@ static int db_set_cache_flags(const char *path, int flag)
 		PRINT_FATAL("Can't build the sql %s: %s", SQL_CACHE_SET_FLAG_SUB, sqlite3_errmsg(db));
 		return -1;
 	}
-	sz = strlen(path);
-	val = (char *)pcs_malloc(sz + 3);
-	memcpy(val, path, sz + 1);
-	if (val[sz - 1] != '/') {
-		val[sz] = '/'; val[sz + 1] = '%'; val[sz + 2] = '\0';
-		sz += 2;
-	}
-	else {
-		val[sz] = '%'; val[sz + 1] = '\0';
-		sz++;
-	}
-	rc = sqlite3_bind_text(stmt, 1, val, sz, SQLITE_STATIC);
-	rc = sqlite3_bind_int(stmt, 2, flag);
-	rc = sqlite3_bind_int64(stmt, 3, now);
-	rc = sqlite3_bind_text(stmt, 4, APP_NAME, -1, SQLITE_STATIC);
+	rc = db_bind_path_range(stmt, 1, path);
+	rc = sqlite3_bind_int(stmt, 3, flag);
+	rc = sqlite3_bind_int64(stmt, 4, now);
+	rc = sqlite3_bind_text(stmt, 5, APP_NAME, -1, SQLITE_STATIC);
 	rc = sqlite3_step(stmt);
 	if (rc != SQLITE_ROW && rc != SQLITE_DONE) {
 		PRINT_FATAL("Can't execute the statement %s: %s", SQL_CACHE_SET_FLAG_SUB, sqlite3_errmsg(db));
 		sqlite3_finalize(stmt);
-		pcs_free(val);
 		return -1;
 	}
 	sqlite3_finalize(stmt);
-	pcs_free(val);
 	return 0;
 }
 
@@ -1157,6 +1554,31 @@ static int db_set_cache_flag(const char *path, int flag)
 	return 0;
 }
 
+/*设置所有本地存在的项（临时表 pcs_local 中的项）的缓存标识*/
+static int db_set_local_flags(int flag)
+{
+	int rc;
+	sqlite3_stmt *stmt = NULL;
+	time_t now;
+	time(&now);
+	rc = sqlite3_prepare_v2(db, SQL_LOCAL_SET_FLAG, -1, &stmt, NULL);
+	if (rc) {
+		PRINT_FATAL("Can't build the sql %s: %s", SQL_LOCAL_SET_FLAG, sqlite3_errmsg(db));
+		return -1;
+	}
+	rc = sqlite3_bind_int(stmt, 1, flag);
+	rc = sqlite3_bind_int64(stmt, 2, now);
+	rc = sqlite3_bind_text(stmt, 3, APP_NAME, -1, SQLITE_STATIC);
+	rc = sqlite3_step(stmt);
+	if (rc != SQLITE_ROW && rc != SQLITE_DONE) {
+		PRINT_FATAL("Can't execute the statement %s: %s", SQL_LOCAL_SET_FLAG, sqlite3_errmsg(db));
+		sqlite3_finalize(stmt);
+		return -1;
+	}
+	sqlite3_finalize(stmt);
+	return 0;
+}
+
 //static int db_clear_all_cache()
 //{
 //	if (sqlite3_exec(db, SQL_CACHE_CLEAR_ALL, NULL, NULL, NULL)) {
@@ -1171,7 +1593,9 @@ static int db_add_cache(PcsFileInfo *info, DbPrepare *pre)
 	time_t now;
 	int rc;
 	sqlite3_stmt *stmt;
+	const char *p;
 	time(&now);
+	db_batch_lock();
 	stmt = pre->stmts[0];
 	sqlite3_bind_int64(stmt,  1, info->fs_id);
 	sqlite3_bind_text(stmt,  2, info->path, -1, SQLITE_STATIC);
@@ -1189,6 +1613,9 @@ static int db_add_cache(PcsFileInfo *info, DbPrepare *pre)
 	sqlite3_bind_int64(stmt, 14, now);
 	sqlite3_bind_text(stmt, 15, APP_NAME, -1, SQLITE_STATIC);
 	sqlite3_bind_int(stmt, 16, info->user_flag);
+	/*父目录路径，用于计算 parent_id*/
+	p = strrchr(info->path, '/');
+	sqlite3_bind_text(stmt, 17, info->path, (p && p > info->path) ? (int)(p - info->path) : 1, SQLITE_STATIC);
 
 	rc = sqlite3_step(stmt);
 	if (rc != SQLITE_ROW && rc != SQLITE_DONE) {
@@ -1197,6 +1624,7 @@ static int db_add_cache(PcsFileInfo *info, DbPrepare *pre)
 		return -1;
 	}
 	sqlite3_reset(stmt);
+	db_batch_step();
 	return 0;
 }
 
@@ -1206,6 +1634,7 @@ static int db_update_cache(PcsFileInfo *info, DbPrepare *pre)
 	int rc;
 	sqlite3_stmt *stmt;
 	time(&now);
+	db_batch_lock();
 	stmt = pre->stmts[3];
 	sqlite3_bind_int64(stmt,  1, info->fs_id);
 	sqlite3_bind_text(stmt,  2, info->path, -1, SQLITE_STATIC);
@@ -1231,6 +1660,7 @@ static int db_update_cache(PcsFileInfo *info, DbPrepare *pre)
 		return -1;
 	}
 	sqlite3_reset(stmt);
+	db_batch_step();
 	return 0;
 }
 
@@ -1285,6 +1715,7 @@ static int db_remove_cache_by_pre(DbPrepare *pre, const char *path)
 {
 	int rc;
 	sqlite3_stmt *stmt = NULL;
+	db_batch_lock();
 	stmt = pre->stmts[2];
 	rc = sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
 	if (rc) {
@@ -1299,6 +1730,7 @@ static int db_remove_cache_by_pre(DbPrepare *pre, const char *path)
 		return 0;
 	}
 	sqlite3_reset(stmt);
+	db_batch_step();
 	return 0;
 }
 
@@ -1308,6 +1740,7 @@ static int db_set_cache_flag_by_pre(DbPrepare *pre, const char *path, int flag)
 	sqlite3_stmt *stmt = NULL;
 	time_t now;
 	time(&now);
+	db_batch_lock();
 	stmt = pre->stmts[4];
 	rc = sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
 	rc = sqlite3_bind_int(stmt, 2, flag);
@@ -1320,107 +1753,614 @@ static int db_set_cache_flag_by_pre(DbPrepare *pre, const char *path, int flag)
 		return -1;
 	}
 	sqlite3_reset(stmt);
+	db_batch_step();
 	return 0;
 }
 
-static int quota(UInt64 *usedByteSize, UInt64 *totalByteSize)
+/*
+记录一次失败的文件操作，下次重试时间按失败次数指数退避。
+连续失败超过 RETRY_ABORT_FAILS 次，或者写入失败时返回-1，调用者应中止任务。
+*/
+static int db_add_retry(int method, BackupState *st, const char *localPath, const char *remotePath, int isdir)
 {
-	PcsRes pcsres;
-	UInt64 total, used;
-	pcsres = pcs_quota(pcs, &total, &used);
-	if (pcsres != PCS_OK) {
-		PRINT_WARNING("Get quota failed: %s", pcs_strerror(pcs));
+	int rc;
+	sqlite3_stmt *stmt = NULL;
+	time_t now;
+	time(&now);
+	db_batch_lock();
+	rc = sqlite3_prepare_v2(db, SQL_RETRY_ADD, -1, &stmt, NULL);
+	if (rc) {
+		PRINT_FATAL("Can't build the sql %s: %s", SQL_RETRY_ADD, sqlite3_errmsg(db));
+		return -1;
+	}
+	sqlite3_bind_int(stmt, 1, method);
+	sqlite3_bind_text(stmt, 2, st->taskLocalPath, -1, SQLITE_STATIC);
+	sqlite3_bind_text(stmt, 3, st->taskRemotePath, -1, SQLITE_STATIC);
+	sqlite3_bind_text(stmt, 4, localPath, -1, SQLITE_STATIC);
+	sqlite3_bind_text(stmt, 5, remotePath, -1, SQLITE_STATIC);
+	sqlite3_bind_int(stmt, 6, isdir);
+	sqlite3_bind_int64(stmt, 7, now);
+	sqlite3_bind_int(stmt, 8, RETRY_DELAY);
+	sqlite3_bind_int(stmt, 9, RETRY_MAX_DELAY);
+	rc = sqlite3_step(stmt);
+	if (rc != SQLITE_ROW && rc != SQLITE_DONE) {
+		PRINT_FATAL("Can't execute the statement %s: %s", SQL_RETRY_ADD, sqlite3_errmsg(db));
+		sqlite3_finalize(stmt);
+		return -1;
+	}
+	sqlite3_finalize(stmt);
+	db_batch_step();
+	if (isdir)
+		st->failDir++;
+	else {
+		st->failFiles++;
+		metrics_add(&metrics.failed_files, 1);
+	}
+	PRINT_WARNING("Retry later: %s", isdir ? remotePath : localPath);
+	if (++st->continuousFails > RETRY_ABORT_FAILS) {
+		PRINT_FATAL("Too many continuous failures, abort the task");
 		return -1;
 	}
-	*usedByteSize = used;
-	*totalByteSize = total;
 	return 0;
 }
 
-/* 返回直接或间接文件数量 */
-static int method_update_folder(const char *path, DbPrepare *pre, int *pFileCount, int *pDirectFileCount)
+static int db_remove_retry(int method, const char *localPath, const char *remotePath)
 {
-	PcsFileInfoList *list = NULL;
-	PcsFileInfoListIterater iterater;
-	PcsFileInfoListItem *listitem;
-	PcsFileInfo *info = NULL;
-	int page_index = 1,
-		page_size = 100;
-	int cnt = 0;
-	while(1) {
-		list = pcs_list(pcs, path, page_index, page_size, "name", PcsFalse);
-		if (!list) {
-			if (pcs_strerror(pcs)) {
-				PRINT_FATAL("Cannot list the server directory %s: %s", path, pcs_strerror(pcs));
-				return -1;
-			}
-			else {
-				break;
-			}
-		}
-		cnt = list->count;
-		if (pFileCount) {
-			*pFileCount += cnt;
-			if (config.printf_enabled) {
-				printf("File Count: %d                 \r", *pFileCount);
-				fflush(stdout);
-			}
-		}
-		if (pDirectFileCount) *pDirectFileCount += cnt;
-
-		pcs_filist_iterater_init(list, &iterater, PcsTrue);
-		while(pcs_filist_iterater_next(&iterater)) {
-			info = iterater.current;
-			listitem = iterater.cursor;
-			pcs_filist_remove(list, listitem, &iterater);
-			if (db_add_cache(info, pre)) {
-				pcs_filistitem_destroy(listitem);
-				pcs_filist_destroy(list);
-				return -1;
-			}
-			if (info->isdir) {
-				if (method_update_folder(info->path, pre, pFileCount, NULL)) {
-					pcs_filistitem_destroy(listitem);
-					pcs_filist_destroy(list);
-					return -1;
-				}
-			}
-			pcs_filistitem_destroy(listitem);
-		}
-		pcs_filist_destroy(list);
-		if (cnt < page_size) {
-			break;
-		}
-		page_index++;
+	int rc;
+	sqlite3_stmt *stmt = NULL;
+	db_batch_lock();
+	rc = sqlite3_prepare_v2(db, SQL_RETRY_DELETE, -1, &stmt, NULL);
+	if (rc) {
+		PRINT_FATAL("Can't build the sql %s: %s", SQL_RETRY_DELETE, sqlite3_errmsg(db));
+		return -1;
+	}
+	sqlite3_bind_int(stmt, 1, method);
+	sqlite3_bind_text(stmt, 2, localPath, -1, SQLITE_STATIC);
+	sqlite3_bind_text(stmt, 3, remotePath, -1, SQLITE_STATIC);
+	rc = sqlite3_step(stmt);
+	if (rc != SQLITE_ROW && rc != SQLITE_DONE) {
+		PRINT_FATAL("Can't execute the statement %s: %s", SQL_RETRY_DELETE, sqlite3_errmsg(db));
+		sqlite3_finalize(stmt);
+		return -1;
 	}
+	sqlite3_finalize(stmt);
+	db_batch_step();
 	return 0;
 }
 
-static int method_update(const char *remotePath)
+/*任务完整执行后，删除 startTime 之后没有再失败的项*/
+static int db_clear_retry(int method, const char *localPath, const char *remotePath, time_t startTime)
 {
-	DbPrepare pre = {0};
-	int fileCount = 0, directFileCount = 0;
-	char *action = NULL;
-	PcsFileInfo *meta = NULL;
-	ActionInfo actionInfo = {0};
-
-	PRINT_NOTICE("Update Local Cache - Start");
-	if (pcs_islogin(pcs) != PCS_LOGIN) {
-		PRINT_FATAL("Not login or session time out");
-		PRINT_NOTICE("Update Local Cache - End");
+	int rc;
+	sqlite3_stmt *stmt = NULL;
+	db_batch_lock();
+	rc = sqlite3_prepare_v2(db, SQL_RETRY_CLEAR_STALE, -1, &stmt, NULL);
+	if (rc) {
+		PRINT_FATAL("Can't build the sql %s: %s", SQL_RETRY_CLEAR_STALE, sqlite3_errmsg(db));
 		return -1;
 	}
-	PRINT_NOTICE("UID: %s", pcs_sysUID(pcs));
-	PRINT_NOTICE("Server Path: %s", remotePath);
-	action = (char *)pcs_malloc(strlen(remotePath) + 16);
-	strcpy(action, "UPDATE: "); strcat(action, remotePath);
-	//获取当前的ACTION
-	if (db_get_action(&actionInfo, action)) {
-		pcs_free(action);
-		PRINT_NOTICE("Update Local Cache - End");
+	sqlite3_bind_int(stmt, 1, method);
+	sqlite3_bind_text(stmt, 2, localPath, -1, SQLITE_STATIC);
+	sqlite3_bind_text(stmt, 3, remotePath, -1, SQLITE_STATIC);
+	sqlite3_bind_int64(stmt, 4, startTime);
+	rc = sqlite3_step(stmt);
+	if (rc != SQLITE_ROW && rc != SQLITE_DONE) {
+		PRINT_FATAL("Can't execute the statement %s: %s", SQL_RETRY_CLEAR_STALE, sqlite3_errmsg(db));
+		sqlite3_finalize(stmt);
 		return -1;
 	}
-	//检查ACTION状态
+	sqlite3_finalize(stmt);
+	db_batch_step();
+	return 0;
+}
+
+static void freeRetryItems(RetryItem *list)
+{
+	RetryItem *next;
+	while (list) {
+		next = list->next;
+		if (list->localPath) pcs_free(list->localPath);
+		if (list->remotePath) pcs_free(list->remotePath);
+		pcs_free(list);
+		list = next;
+	}
+}
+
+/*读取任务中已经到期的重试项，按网盘路径排序*/
+static int db_get_retry_items(int method, const char *localPath, const char *remotePath, RetryItem **pList)
+{
+	int rc;
+	sqlite3_stmt *stmt = NULL;
+	RetryItem *head = NULL, *tail = NULL, *item;
+	time_t now;
+	time(&now);
+	*pList = NULL;
+	rc = sqlite3_prepare_v2(db, SQL_RETRY_SELECT_DUE, -1, &stmt, NULL);
+	if (rc) {
+		PRINT_FATAL("Can't build the sql %s: %s", SQL_RETRY_SELECT_DUE, sqlite3_errmsg(db));
+		return -1;
+	}
+	sqlite3_bind_int(stmt, 1, method);
+	sqlite3_bind_text(stmt, 2, localPath, -1, SQLITE_STATIC);
+	sqlite3_bind_text(stmt, 3, remotePath, -1, SQLITE_STATIC);
+	sqlite3_bind_int64(stmt, 4, now);
+	sqlite3_bind_int(stmt, 5, RETRY_MAX_ATTEMPTS);
+	while (1) {
+		rc = sqlite3_step(stmt);
+		if (rc == SQLITE_DONE) break;
+		if (rc != SQLITE_ROW) {
+			PRINT_FATAL("Can't execute the statement %s: %s", SQL_RETRY_SELECT_DUE, sqlite3_errmsg(db));
+			freeRetryItems(head);
+			sqlite3_finalize(stmt);
+			return -1;
+		}
+		item = (RetryItem *)pcs_malloc(sizeof(RetryItem));
+		memset(item, 0, sizeof(RetryItem));
+		item->localPath = pcs_utils_strdup((const char *)sqlite3_column_text(stmt, 0));
+		item->remotePath = pcs_utils_strdup((const char *)sqlite3_column_text(stmt, 1));
+		item->isdir = sqlite3_column_int(stmt, 2);
+		item->attempts = sqlite3_column_int(stmt, 3);
+		if (tail) tail->next = item;
+		else head = item;
+		tail = item;
+	}
+	sqlite3_finalize(stmt);
+	*pList = head;
+	return 0;
+}
+
+/*任务的重试队列中最早的重试时间，没有需要重试的项时返回0*/
+static time_t db_get_retry_time(const char *localPath, const char *remotePath)
+{
+	int rc;
+	sqlite3_stmt *stmt = NULL;
+	time_t t = 0;
+	rc = sqlite3_prepare_v2(db, SQL_RETRY_NEXT_TIME, -1, &stmt, NULL);
+	if (rc) {
+		PRINT_FATAL("Can't build the sql %s: %s", SQL_RETRY_NEXT_TIME, sqlite3_errmsg(db));
+		return 0;
+	}
+	sqlite3_bind_text(stmt, 1, localPath, -1, SQLITE_STATIC);
+	sqlite3_bind_text(stmt, 2, remotePath, -1, SQLITE_STATIC);
+	sqlite3_bind_int(stmt, 3, RETRY_MAX_ATTEMPTS);
+	rc = sqlite3_step(stmt);
+	if (rc == SQLITE_ROW && sqlite3_column_type(stmt, 0) != SQLITE_NULL)
+		t = (time_t)sqlite3_column_int64(stmt, 0);
+	sqlite3_finalize(stmt);
+	return t;
+}
+
+static int quota(UInt64 *usedByteSize, UInt64 *totalByteSize)
+{
+	PcsRes pcsres;
+	UInt64 total, used;
+	pcsres = pcs_quota(pcs, &total, &used);
+	if (pcsres != PCS_OK) {
+		PRINT_WARNING("Get quota failed: %s", pcs_strerror(pcs));
+		return -1;
+	}
+	*usedByteSize = used;
+	*totalByteSize = total;
+	return 0;
+}
+
+/*更新缓存时，目录下已缓存的一个直接子项*/
+typedef struct CacheChild {
+	char	*path;
+	UInt64	server_mtime;
+	int		isdir;
+	int		seen; /*是否在网盘中仍然存在*/
+} CacheChild;
+
+static int cache_child_compare(const void *a, const void *b)
+{
+	return strcmp(((const CacheChild *)a)->path, ((const CacheChild *)b)->path);
+}
+
+static void freeCacheChildren(CacheChild *children, int count)
+{
+	int i;
+	for (i = 0; i < count; i++) {
+		if (children[i].path) pcs_free(children[i].path);
+	}
+	if (children) pcs_free(children);
+}
+
+/*
+读取path目录下已缓存的直接子项（不包括更深层的子项），结果按路径排序。
+pre->stmts[5] 需为 SQL_CACHE_SELECT_CHILDREN。
+*/
+static int db_get_cache_children(DbPrepare *pre, const char *path, CacheChild **pChildren, int *pCount)
+{
+	int rc, count = 0, capacity = 0;
+	sqlite3_stmt *stmt = NULL;
+	CacheChild *children = NULL, *tmp;
+
+	stmt = pre->stmts[5];
+	if (db_bind_dir_path(stmt, 1, path)) {
+		PRINT_FATAL("Can't bind the text into the statement: %s", sqlite3_errmsg(db));
+		sqlite3_reset(stmt);
+		return -1;
+	}
+	while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+		if (count == capacity) {
+			capacity = capacity ? capacity * 2 : 64;
+			tmp = (CacheChild *)pcs_malloc(sizeof(CacheChild) * capacity);
+			if (count) memcpy(tmp, children, sizeof(CacheChild) * count);
+			if (children) pcs_free(children);
+			children = tmp;
+		}
+		children[count].path = pcs_utils_strdup((const char *)sqlite3_column_text(stmt, 0));
+		children[count].server_mtime = (UInt64)sqlite3_column_int64(stmt, 1);
+		children[count].isdir = sqlite3_column_int(stmt, 2);
+		children[count].seen = 0;
+		count++;
+	}
+	sqlite3_reset(stmt);
+	if (rc != SQLITE_DONE) {
+		PRINT_FATAL("Can't execute the statement %s: %s", SQL_CACHE_SELECT_CHILDREN, sqlite3_errmsg(db));
+		freeCacheChildren(children, count);
+		return -1;
+	}
+	if (count > 1)
+		qsort(children, count, sizeof(CacheChild), &cache_child_compare);
+	*pChildren = children;
+	*pCount = count;
+	return 0;
+}
+
+/*列出网盘目录下的所有项，合并所有分页。目录为空时 *pList 为NULL*/
+static int update_list_dir(Pcs handle, const char *path, PcsFileInfoList **pList)
+{
+	PcsFileInfoList *list, *all = NULL;
+	int page_index = 1, cnt;
+
+	*pList = NULL;
+	while (1) {
+		list = pcs_list(handle, path, page_index, UPDATE_PAGE_SIZE, "name", PcsFalse);
+		if (!list) {
+			if (pcs_strerror(handle)) {
+				PRINT_FATAL("Cannot list the server directory %s: %s", path, pcs_strerror(handle));
+				if (all) pcs_filist_destroy(all);
+				return -1;
+			}
+			break;
+		}
+		cnt = list->count;
+		if (all) {
+			pcs_filist_combin(all, list);
+			pcs_filist_destroy(list);
+		}
+		else {
+			all = list;
+		}
+		if (cnt < UPDATE_PAGE_SIZE) break;
+		page_index++;
+	}
+	*pList = all;
+	return 0;
+}
+
+/*
+把列出的path目录的所有项 list 与已有缓存比较，写入有变化的项，删除网盘中已经不存在的项。
+需要继续列出的子目录通过 *pDirs 返回。list 为NULL表示目录为空。
+目录的 server_mtime 不变并不能说明其更深层的内容没有变化，所以默认列出所有子目录；
+配置了 pruneUnchangedDirs 时，server_mtime 没有变化的子目录直接沿用已有缓存。
+*/
+static int method_update_apply(const char *path, PcsFileInfoList *list, DbPrepare *pre, PcsSList **pDirs)
+{
+	PcsFileInfoListIterater iterater;
+	PcsFileInfo *info;
+	CacheChild *children = NULL, *child, key;
+	PcsSList *dir;
+	int childCount = 0, i;
+
+	*pDirs = NULL;
+	if (db_get_cache_children(pre, path, &children, &childCount))
+		return -1;
+	if (list) {
+		pcs_filist_iterater_init(list, &iterater, PcsFalse);
+		while(pcs_filist_iterater_next(&iterater)) {
+			info = iterater.current;
+			key.path = info->path;
+			child = childCount > 0
+				? (CacheChild *)bsearch(&key, children, childCount, sizeof(CacheChild), &cache_child_compare)
+				: NULL;
+			if (child) {
+				child->seen = 1;
+				if (child->isdir == (info->isdir ? 1 : 0) && child->server_mtime == info->server_mtime) {
+					/*该项没有变化，无需写入*/
+					if (!info->isdir || config.prune_dirs)
+						continue;
+				}
+				else if (db_update_cache(info, pre) || (child->isdir && !info->isdir && db_clear_caches(info->path))) {
+					freeCacheChildren(children, childCount);
+					pcs_slist_destroy(*pDirs);
+					*pDirs = NULL;
+					return -1;
+				}
+			}
+			else if (db_add_cache(info, pre)) {
+				freeCacheChildren(children, childCount);
+				pcs_slist_destroy(*pDirs);
+				*pDirs = NULL;
+				return -1;
+			}
+			if (info->isdir) {
+				dir = pcs_slist_create_ex(info->path, -1);
+				dir->next = *pDirs;
+				*pDirs = dir;
+			}
+		}
+	}
+	/*删除网盘中已经不存在的项*/
+	for (i = 0; i < childCount; i++) {
+		child = &children[i];
+		if (child->seen) continue;
+		if (db_remove_cache_by_pre(pre, child->path) || (child->isdir && db_clear_caches(child->path))) {
+			freeCacheChildren(children, childCount);
+			pcs_slist_destroy(*pDirs);
+			*pDirs = NULL;
+			return -1;
+		}
+	}
+	freeCacheChildren(children, childCount);
+	return 0;
+}
+
+/*
+在当前线程中逐个列出目录，增量更新path目录的缓存。
+pDirCount 用于统计实际列出的目录数量。
+*/
+static int method_update_folder(const char *path, DbPrepare *pre, int *pFileCount, int *pDirectFileCount, int *pDirCount)
+{
+	PcsFileInfoList *list = NULL;
+	PcsSList *dirs = NULL, *dir;
+	int rc;
+
+	db_batch_flush(); /*列出目录期间不占用写锁*/
+	if (update_list_dir(pcs, path, &list))
+		return -1;
+	if (pDirCount) (*pDirCount)++;
+	if (list) {
+		if (pFileCount) {
+			*pFileCount += list->count;
+			if (config.printf_enabled) {
+				printf("File Count: %d                 \r", *pFileCount);
+				fflush(stdout);
+			}
+		}
+		if (pDirectFileCount) *pDirectFileCount += list->count;
+	}
+	rc = method_update_apply(path, list, pre, &dirs);
+	if (list) pcs_filist_destroy(list);
+	for (dir = dirs; dir && !rc; dir = dir->next) {
+		rc = method_update_folder(dir->string, pre, pFileCount, NULL, pDirCount);
+	}
+	pcs_slist_destroy(dirs);
+	return rc;
+}
+
+#ifndef WIN32
+/*
+并行列出目录。
+多个列目录的线程各自使用由 pcs_clone() 复制的Pcs对象，从共享的队列中取出目录并列出其所有项；
+调用线程是唯一的写入者，依次把列出的结果与缓存比较并写入批量事务，
+再把有变化的子目录放回队列。这样更新的速度取决于并发的网络请求数，而不是单个请求的延迟。
+*/
+typedef struct CrawlJob {
+	char	*path;
+	PcsFileInfoList *list; /*列出的所有项*/
+	int		error;
+	struct CrawlJob *next;
+} CrawlJob;
+
+typedef struct Crawler {
+	pthread_mutex_t	mutex;
+	pthread_cond_t	cond; /*有新的目录需要列出，或者有目录已经列出时通知*/
+	CrawlJob	*todo, *todoTail; /*等待列出的目录*/
+	CrawlJob	*done, *doneTail; /*已经列出，等待写入缓存的目录*/
+	int			stop;
+	int			alive; /*正在运行的列目录线程数*/
+} Crawler;
+
+static void freeCrawlJobs(CrawlJob *job)
+{
+	CrawlJob *next;
+	while (job) {
+		next = job->next;
+		if (job->path) pcs_free(job->path);
+		if (job->list) pcs_filist_destroy(job->list);
+		pcs_free(job);
+		job = next;
+	}
+}
+
+/*放入待列出的队列。需持有锁*/
+static void crawl_push(Crawler *c, const char *path)
+{
+	CrawlJob *job = (CrawlJob *)pcs_malloc(sizeof(CrawlJob));
+	memset(job, 0, sizeof(CrawlJob));
+	job->path = pcs_utils_strdup(path);
+	if (c->todoTail) c->todoTail->next = job;
+	else c->todo = job;
+	c->todoTail = job;
+}
+
+/*列目录线程。handle 由调用线程在启动线程前复制，并在线程结束后释放*/
+typedef struct CrawlThread {
+	Crawler		*crawler;
+	Pcs			handle;
+	pthread_t	tid;
+} CrawlThread;
+
+static void *crawl_thread_main(void *arg)
+{
+	Crawler *c = ((CrawlThread *)arg)->crawler;
+	Pcs handle = ((CrawlThread *)arg)->handle;
+	CrawlJob *job;
+
+	pcs_trace_thread_name("crawler");
+	pthread_mutex_lock(&c->mutex);
+	while (1) {
+		while (!c->todo && !c->stop)
+			pthread_cond_wait(&c->cond, &c->mutex);
+		if (c->stop) break;
+		job = c->todo;
+		c->todo = job->next;
+		if (!c->todo) c->todoTail = NULL;
+		job->next = NULL;
+		pthread_mutex_unlock(&c->mutex);
+		job->error = update_list_dir(handle, job->path, &job->list);
+		pthread_mutex_lock(&c->mutex);
+		if (c->doneTail) c->doneTail->next = job;
+		else c->done = job;
+		c->doneTail = job;
+		pthread_cond_broadcast(&c->cond);
+	}
+	c->alive--;
+	pthread_mutex_unlock(&c->mutex);
+	return NULL;
+}
+
+/*使用 threadCount 个线程并行列出目录，增量更新path目录的缓存。参数同 method_update_folder()*/
+static int method_update_crawl(const char *path, DbPrepare *pre, int threadCount, int *pFileCount, int *pDirectFileCount, int *pDirCount)
+{
+	Crawler c;
+	CrawlJob *job;
+	PcsSList *dirs = NULL, *dir;
+	CrawlThread *threads;
+	int i, started = 0, pending = 1, rc = 0;
+
+	memset(&c, 0, sizeof(Crawler));
+	pthread_mutex_init(&c.mutex, NULL);
+	pthread_cond_init(&c.cond, NULL);
+	crawl_push(&c, path);
+	threads = (CrawlThread *)pcs_malloc(sizeof(CrawlThread) * threadCount);
+	c.alive = threadCount;
+	for (i = 0; i < threadCount; i++) {
+		/*pcs_clone() 读取当前线程的Pcs对象，在启动线程前完成*/
+		threads[started].crawler = &c;
+		threads[started].handle = pcs_clone(pcs);
+		if (!threads[started].handle) {
+			PRINT_WARNING("Can't clone the pcs object");
+			c.alive--;
+			continue;
+		}
+		if (pthread_create(&threads[started].tid, NULL, &crawl_thread_main, &threads[started]) == 0) {
+			started++;
+		}
+		else {
+			pcs_destroy(threads[started].handle);
+			c.alive--;
+		}
+	}
+	if (started == 0) {
+		/*无法创建线程，在当前线程中执行*/
+		pcs_free(threads);
+		freeCrawlJobs(c.todo);
+		pthread_cond_destroy(&c.cond);
+		pthread_mutex_destroy(&c.mutex);
+		return method_update_folder(path, pre, pFileCount, pDirectFileCount, pDirCount);
+	}
+	pthread_mutex_lock(&c.mutex);
+	while (pending > 0 && !rc) {
+		if (!c.done) {
+			/*等待列目录的线程期间不占用写锁*/
+			pthread_mutex_unlock(&c.mutex);
+			db_batch_flush();
+			pthread_mutex_lock(&c.mutex);
+		}
+		while (!c.done && c.alive > 0)
+			pthread_cond_wait(&c.cond, &c.mutex);
+		if (!c.done) {
+			PRINT_FATAL("All of the crawl threads exited");
+			rc = -1;
+			break;
+		}
+		job = c.done;
+		c.done = job->next;
+		if (!c.done) c.doneTail = NULL;
+		job->next = NULL;
+		pending--;
+		pthread_mutex_unlock(&c.mutex);
+
+		rc = job->error;
+		if (!rc) {
+			if (pDirCount) (*pDirCount)++;
+			if (job->list) {
+				if (pFileCount) {
+					*pFileCount += job->list->count;
+					if (config.printf_enabled) {
+						printf("File Count: %d                 \r", *pFileCount);
+						fflush(stdout);
+					}
+				}
+				if (pDirectFileCount && strcmp(job->path, path) == 0) *pDirectFileCount += job->list->count;
+			}
+			rc = method_update_apply(job->path, job->list, pre, &dirs);
+		}
+		freeCrawlJobs(job);
+
+		pthread_mutex_lock(&c.mutex);
+		if (!rc) {
+			for (dir = dirs; dir; dir = dir->next) {
+				crawl_push(&c, dir->string);
+				pending++;
+			}
+			if (dirs) pthread_cond_broadcast(&c.cond);
+		}
+		pcs_slist_destroy(dirs);
+		dirs = NULL;
+	}
+	/*出错时不再列出剩余的目录*/
+	c.stop = 1;
+	pthread_cond_broadcast(&c.cond);
+	pthread_mutex_unlock(&c.mutex);
+	for (i = 0; i < started; i++) {
+		pthread_join(threads[i].tid, NULL);
+		pcs_destroy(threads[i].handle);
+	}
+	pcs_free(threads);
+	freeCrawlJobs(c.todo);
+	freeCrawlJobs(c.done);
+	pthread_cond_destroy(&c.cond);
+	pthread_mutex_destroy(&c.mutex);
+	return rc;
+}
+#endif
+
+/*
+增量更新remotePath的本地缓存，只写入有变化的项。
+配置了 pruneUnchangedDirs 且 remotePath 的 server_mtime 与缓存一致时，认为其下没有任何变化，不再列出任何目录。
+*/
+static int method_update(const char *remotePath)
+{
+	DbPrepare pre = {0};
+	int fileCount = 0, directFileCount = 0, dirCount = 0;
+	char *action = NULL;
+	PcsFileInfo *meta = NULL;
+	PcsFileInfo cache = {0};
+	ActionInfo actionInfo = {0};
+	int rc, threadCount;
+
+	PRINT_NOTICE("Update Local Cache - Start");
+	if (pcs_islogin(pcs) != PCS_LOGIN) {
+		PRINT_FATAL("Not login or session time out");
+		PRINT_NOTICE("Update Local Cache - End");
+		return -1;
+	}
+	PRINT_NOTICE("UID: %s", pcs_sysUID(pcs));
+	PRINT_NOTICE("Server Path: %s", remotePath);
+	action = (char *)pcs_malloc(strlen(remotePath) + 16);
+	strcpy(action, "UPDATE: "); strcat(action, remotePath);
+	//获取当前的ACTION
+	if (db_get_action(&actionInfo, action)) {
+		pcs_free(action);
+		PRINT_NOTICE("Update Local Cache - End");
+		return -1;
+	}
+	//检查ACTION状态
 	if (actionInfo.status == ACTION_STATUS_RUNNING) {
 		PRINT_FATAL("There have another update thread running, which is start by %s at %s", actionInfo.create_app, format_time(actionInfo.start_time));
 		pcs_free(action);
@@ -1435,90 +2375,234 @@ static int method_update(const char *remotePath)
 		PRINT_NOTICE("Update Local Cache - End");
 		return -1;
 	}
-	//删除当前目录的本地缓存
-	if (db_remove_cache(remotePath)) {
-		db_set_action(action, ACTION_STATUS_ERROR, 0);
-		pcs_free(action);
-		PRINT_NOTICE("Update Local Cache - End");
-		return -1;
-	}
 	//获取当前目录的元数据
 	meta = pcs_meta(pcs, remotePath);
 	if (!meta) {
 		PRINT_FATAL("The remote path not exist: %s", remotePath);
+		//删除当前目录及其子目录的本地缓存
+		if (db_remove_cache(remotePath) || db_clear_caches(remotePath)) {
+			db_set_action(action, ACTION_STATUS_ERROR, 0);
+			pcs_free(action);
+			PRINT_NOTICE("Update Local Cache - End");
+			return -1;
+		}
 		db_set_action(action, ACTION_STATUS_FINISHED, 0);
 		pcs_free(action);
 		PRINT_NOTICE("Update Local Cache - End");
 		return 0;
 	}
-	//准备插入数据到缓存表格中的SQL过程
-	if (db_prepare(&pre, SQL_CACHE_INSERT, NULL)) {
+	//准备读写缓存表格的SQL过程
+	if (db_prepare(&pre, SQL_CACHE_INSERT, SQL_CACHE_SELECT, SQL_CACHE_DELETE, SQL_CACHE_UPDATE, SQL_CACHE_SET_FLAG, SQL_CACHE_SELECT_CHILDREN, NULL)) {
 		db_set_action(action, ACTION_STATUS_ERROR, 0);
 		pcs_free(action);
 		pcs_fileinfo_destroy(meta);
 		PRINT_NOTICE("Update Local Cache - End");
 		return -1;
 	}
-	//缓存当前目录的元数据
-	if (db_add_cache(meta, &pre)) {
+	//整个更新过程中的写操作合并到批量事务中
+	db_begin_batch();
+	//读取当前目录已有的缓存
+	if (db_get_cache(&cache, &pre, remotePath)) {
 		db_set_action(action, ACTION_STATUS_ERROR, 0);
 		pcs_free(action);
 		pcs_fileinfo_destroy(meta);
+		db_end_batch();
+		db_prepare_destroy(&pre);
+		PRINT_NOTICE("Update Local Cache - End");
+		return -1;
+	}
+	if (config.prune_dirs && cache.path && cache.isdir && meta->isdir && cache.server_mtime == meta->server_mtime) {
+		PRINT_NOTICE("The remote path not changed since last update: %s", remotePath);
+		db_set_action(action, ACTION_STATUS_FINISHED, 0);
+		pcs_free(action);
+		pcs_fileinfo_destroy(meta);
+		freeCacheInfo(&cache);
+		db_end_batch();
+		db_prepare_destroy(&pre);
+		PRINT_NOTICE("Update Local Cache - End");
+		return 0;
+	}
+	//缓存当前目录的元数据。当前目录之前没有缓存，或由文件变为目录时，其下的旧缓存均不可信，先删除
+	rc = cache.path ? db_update_cache(meta, &pre) : db_add_cache(meta, &pre);
+	if (!rc && (!cache.path || !cache.isdir || !meta->isdir))
+		rc = db_clear_caches(remotePath);
+	freeCacheInfo(&cache);
+	if (rc) {
+		db_set_action(action, ACTION_STATUS_ERROR, 0);
+		pcs_free(action);
+		pcs_fileinfo_destroy(meta);
+		db_end_batch();
 		db_prepare_destroy(&pre);
 		PRINT_NOTICE("Update Local Cache - End");
 		return -1;
 	}
 	if (meta->isdir) {
-		//删除子目录的本地缓存
-		if (db_clear_caches(remotePath)) {
+		//增量更新子目录
+#ifdef WIN32
+		rc = method_update_folder(remotePath, &pre, &fileCount, &directFileCount, &dirCount);
+#else
+		threadCount = config.crawl_threads > 0 ? config.crawl_threads : DEFAULT_CRAWL_THREADS;
+		if (threadCount > 1)
+			rc = method_update_crawl(remotePath, &pre, threadCount, &fileCount, &directFileCount, &dirCount);
+		else
+			rc = method_update_folder(remotePath, &pre, &fileCount, &directFileCount, &dirCount);
+#endif
+		if (rc) {
 			db_set_action(action, ACTION_STATUS_ERROR, 0);
 			pcs_free(action);
 			pcs_fileinfo_destroy(meta);
+			db_end_batch();
 			db_prepare_destroy(&pre);
 			PRINT_NOTICE("Update Local Cache - End");
 			return -1;
 		}
-		//递归更新子目录
-		if (method_update_folder(remotePath, &pre, &fileCount, &directFileCount)) {
-			db_set_action(action, ACTION_STATUS_ERROR, 0);
-			pcs_free(action);
-			pcs_fileinfo_destroy(meta);
-			db_prepare_destroy(&pre);
-			PRINT_NOTICE("Update Local Cache - End");
+		PRINT_NOTICE("Direct: %d, Total: %d, Listed Directories: %d", directFileCount, fileCount, dirCount);
+	}
+	else {
+		PRINT_NOTICE("The remote path is file: %s", remotePath);
+	}
+	db_set_action(action, ACTION_STATUS_FINISHED, 0);
+	pcs_free(action);
+	pcs_fileinfo_destroy(meta);
+	db_end_batch();
+	db_prepare_destroy(&pre);
+	PRINT_NOTICE("Update Local Cache - End");
+	return 0;
+}
+
+/*两个路径是否重叠，即相同或者一个是另一个的上级目录*/
+static int path_overlap(const char *a, const char *b)
+{
+	size_t la, lb;
+	const char *tmp;
+	if (!a || !b || !a[0] || !b[0]) return 0;
+	la = strlen(a);
+	lb = strlen(b);
+	while (la > 1 && (a[la - 1] == '/' || a[la - 1] == '\\')) la--;
+	while (lb > 1 && (b[lb - 1] == '/' || b[lb - 1] == '\\')) lb--;
+	if (la > lb) {
+		tmp = a; a = b; b = tmp;
+		la ^= lb; lb ^= la; la ^= lb;
+	}
+	if (strncmp(a, b, la)) return 0;
+	return la == lb || b[la] == '/' || b[la] == '\\' || a[la - 1] == '/' || a[la - 1] == '\\';
+}
+
+/*路径中是否有名为 PACK_DIR_NAME 的一级，即是否为包或者包所在的目录*/
+static int is_pack_path(const char *path)
+{
+	const char *p = path;
+	size_t sz = strlen(PACK_DIR_NAME);
+	while ((p = strstr(p, PACK_DIR_NAME)) != NULL) {
+		if ((p == path || p[-1] == '/') && (p[sz] == '\0' || p[sz] == '/'))
+			return 1;
+		p += sz;
+	}
+	return 0;
+}
+
+static char *get_remote_path(const char *localPath, const char *localBasePath, const char *remoteBasePath)
+{
+	char *rc;
+	int len;
+
+	len = strlen(localPath) - strlen(localBasePath) + strlen(remoteBasePath) + 2;
+	rc = (char *)pcs_malloc(len);
+	strcpy(rc, remoteBasePath);
+	strcat(rc, localPath + strlen(localBasePath));
+#ifdef WIN32
+	{
+		char *p = rc;
+		while (*p) {
+			if (*p == '\\') *p = '/';
+			p++;
+		}
+	}
+#endif
+	return rc;
+}
+
+static void db_clear_local()
+{
+	if (sqlite3_exec(db, SQL_LOCAL_CLEAR, NULL, NULL, NULL)) {
+		PRINT_WARNING("Can't clear the local files: %s", sqlite3_errmsg(db));
+	}
+}
+
+static int db_load_local_folder(sqlite3_stmt *stmt, const char *localPath, const char *localBasePath, const char *remoteBasePath, int *pFileCount, int *pDirCount)
+{
+	my_dirent *ents = NULL,
+		*ent = NULL;
+	char *dstPath;
+	int rc;
+
+	ents = list_dir(localPath, 0);
+	ent = ents;
+	while (ent) {
+		dstPath = get_remote_path(ent->path, localBasePath, remoteBasePath);
+		sqlite3_bind_text(stmt, 1, dstPath, -1, SQLITE_STATIC);
+		sqlite3_bind_text(stmt, 2, ent->path, -1, SQLITE_STATIC);
+		sqlite3_bind_int(stmt, 3, ent->is_dir ? 1 : 0);
+		sqlite3_bind_int64(stmt, 4, ent->mtime);
+		sqlite3_bind_int64(stmt, 5, ent->size);
+		rc = sqlite3_step(stmt);
+		sqlite3_reset(stmt);
+		pcs_free(dstPath);
+		if (rc != SQLITE_DONE) {
+			PRINT_FATAL("Can't insert into the local files: %s", sqlite3_errmsg(db));
+			my_dirent_destroy(ents);
 			return -1;
 		}
-		PRINT_NOTICE("Direct: %d, Total: %d", directFileCount, fileCount);
-	}
-	else {
-		PRINT_NOTICE("The remote path is file: %s", remotePath);
+		if (ent->is_dir) {
+			(*pDirCount)++;
+			if (db_load_local_folder(stmt, ent->path, localBasePath, remoteBasePath, pFileCount, pDirCount)) {
+				my_dirent_destroy(ents);
+				return -1;
+			}
+		}
+		else {
+			(*pFileCount)++;
+		}
+		if (config.printf_enabled && (*pFileCount + *pDirCount) % 1000 == 0) {
+			printf("Scan: %d        \r", *pFileCount + *pDirCount);
+			fflush(stdout);
+		}
+		ent = ent->next;
 	}
-	db_set_action(action, ACTION_STATUS_FINISHED, 0);
-	pcs_free(action);
-	pcs_fileinfo_destroy(meta);
-	db_prepare_destroy(&pre);
-	PRINT_NOTICE("Update Local Cache - End");
+	my_dirent_destroy(ents);
 	return 0;
 }
 
-static char *get_remote_path(const char *localPath, const char *localBasePath, const char *remoteBasePath)
+/*
+扫描本地目录localPath，把其下所有的文件和目录（不包括localPath本身）写入临时表 pcs_local，
+之后由集合运算得出需要处理的项，而不是逐个文件查询缓存。
+pFileCount 和 pDirCount 用于接收文件数和目录数，可以为NULL。
+*/
+static int db_load_local(const char *localPath, const char *remotePath, int *pFileCount, int *pDirCount)
 {
-	char *rc;
-	int len;
+	sqlite3_stmt *stmt = NULL;
+	int rc, fileCount = 0, dirCount = 0;
 
-	len = strlen(localPath) - strlen(localBasePath) + strlen(remoteBasePath) + 2;
-	rc = (char *)pcs_malloc(len);
-	strcpy(rc, remoteBasePath);
-	strcat(rc, localPath + strlen(localBasePath));
-#ifdef WIN32
-	{
-		char *p = rc;
-		while (*p) {
-			if (*p == '\\') *p = '/';
-			p++;
-		}
+	db_clear_local();
+	rc = sqlite3_prepare_v2(db, SQL_LOCAL_INSERT, -1, &stmt, NULL);
+	if (rc) {
+		PRINT_FATAL("Can't build the sql %s: %s", SQL_LOCAL_INSERT, sqlite3_errmsg(db));
+		return -1;
 	}
-#endif
-	return rc;
+	/*只写入临时表，放在一个事务中，不占用缓存数据库的写锁*/
+	db_batch_flush();
+	sqlite3_exec(db, SQL_BEGIN, NULL, NULL, NULL);
+	rc = db_load_local_folder(stmt, localPath, localPath, remotePath, &fileCount, &dirCount);
+	if (sqlite3_exec(db, SQL_COMMIT, NULL, NULL, NULL)) {
+		PRINT_FATAL("Can't commit the transaction: %s", sqlite3_errmsg(db));
+		rc = -1;
+	}
+	sqlite3_finalize(stmt);
+	if (rc) return -1;
+	PRINT_NOTICE("Scanned Local Files: %d, Dirs: %d", fileCount, dirCount);
+	if (pFileCount) *pFileCount = fileCount;
+	if (pDirCount) *pDirCount = dirCount;
+	return 0;
 }
 
 static int method_reset()
@@ -1579,248 +2663,818 @@ static int method_backup_progress(void *clientp, double dltotal, double dlnow, d
 	return 0;
 }
 
-/*备份文件*/
-static int method_backup_file(const my_dirent *localFile, const char *remotePath, DbPrepare *pre, int md5Enabled, int isForce, int isCombin, BackupState *st)
+/*
+检查文件是否需要上传，dst 为网盘缓存中该路径的信息。
+不需要上传时直接更新缓存标记和统计。
+需要上传返回1，不需要返回0，失败返回-1。失败或不需要上传时释放 dst。
+*/
+static int method_backup_file_check(const my_dirent *localFile, const char *remotePath, PcsFileInfo *dst, DbPrepare *pre, int md5Enabled, int isCombin, BackupState *st)
 {
-	PcsFileInfo dst = {0};
 	int need_backup = 1;
 
-	if (db_get_cache(&dst, pre, remotePath)) {
-		return -1;
-	}
-	if (dst.fs_id && dst.isdir) {
+	if (dst->fs_id && dst->isdir) {
 		PcsPanApiRes *res;
 		PcsSList slist = { (char *)remotePath, NULL };
+		db_batch_flush();
 		res = pcs_delete(pcs, &slist);
 		if (!res) {
 			PRINT_FATAL("Can't remove the dir %s: %s", remotePath, pcs_strerror(pcs));
-			freeCacheInfo(&dst);
+			freeCacheInfo(dst);
 			return -1;
 		}
 		pcs_pan_api_res_destroy(res);
-		if (db_remove_cache_by_pre(pre, remotePath)) {
+		if (db_remove_cache_by_pre(pre, remotePath) || db_clear_caches(remotePath)) {
 			PRINT_FATAL("Can't remove the local cache. %s", remotePath);
-			freeCacheInfo(&dst);
+			freeCacheInfo(dst);
 			return -1;
 		}
-		freeCacheInfo(&dst);
+		freeCacheInfo(dst);
 		if (st) {
 			st->removeDir++;
 		}
 	}
 	if (md5Enabled) {
-		if (dst.fs_id && dst.md5) {
+		if (dst->fs_id && dst->md5) {
 			const char *md5;
-			md5 = md5_file(localFile->path);
+			char md5_buf[33];
+			md5 = md5_file_r(localFile->path, md5_buf);
 			if (!md5) {
 				PRINT_FATAL("Can't calculate md5 for %s.", localFile->path);
-				freeCacheInfo(&dst);
+				freeCacheInfo(dst);
 				return -1;
 			}
-			else if (pcs_utils_strcmpi(md5, dst.md5) == 0) {
+			else if (pcs_utils_strcmpi(md5, dst->md5) == 0) {
 				need_backup = 0;
 			}
 			else if (isCombin) {
-				if (localFile->mtime == ((time_t)dst.server_mtime)) {
+				if (localFile->mtime == ((time_t)dst->server_mtime)) {
 					PRINT_WARNING("Unable to determine which file is newer: "
 						"The local file %s and remote file %s have different md5 (%s : %s), "
 						"they also have same last modify time %s.",
-						localFile->path, remotePath, md5, dst.md5, format_time(localFile->mtime));
-					freeCacheInfo(&dst);
+						localFile->path, remotePath, md5, dst->md5, format_time(localFile->mtime));
+					freeCacheInfo(dst);
 					return -1;
 				}
 				else
-					need_backup = localFile->mtime > ((time_t)dst.server_mtime);
+					need_backup = localFile->mtime > ((time_t)dst->server_mtime);
 			}
 		}
 	}
 	else {
-		need_backup = localFile->mtime > ((time_t)dst.server_mtime);
+		need_backup = localFile->mtime > ((time_t)dst->server_mtime);
 	}
-	if (need_backup) {
-		PcsFileInfo *rc;
-		struct ProgressState state = { localFile->path, remotePath };
-		int cacheRC;
-		if (config.printf_enabled) {
-			printf("Backup %s -> %s\n", localFile->path, remotePath);
+	if (need_backup)
+		return 1;
+	if (db_set_cache_flag_by_pre(pre, remotePath, FLAG_SUCC)) {
+		freeCacheInfo(dst);
+		return -1;
+	}
+	if (st) {
+		st->skipFiles++;
+		st->totalFiles++;
+	}
+	metrics_add(&metrics.skipped_files, 1);
+	freeCacheInfo(dst);
+	return 0;
+}
+
+/*
+使用 worker 上传文件，可以在传输池的工作线程中调用，不访问数据库。
+progress 为非0时显示上传进度。
+成功返回网盘中的文件信息，使用完后需调用 pcs_fileinfo_destroy()；失败返回NULL。
+*/
+static PcsFileInfo *method_backup_file_upload(Pcs worker, const my_dirent *localFile, const char *remotePath, int progress)
+{
+	PcsFileInfo *rc;
+	struct ProgressState state = { localFile->path, remotePath };
+	Int64 traceStart;
+	if (config.printf_enabled) {
+		printf("Backup %s -> %s\n", localFile->path, remotePath);
+	}
+	if (config.printf_enabled && progress) {
+		pcs_setopts(worker,
+			PCS_OPTION_PROGRESS_FUNCTION, method_backup_progress,
+			PCS_OPTION_PROGRESS_FUNCTION_DATE, &state,
+			PCS_OPTION_PROGRESS, (void *)PcsTrue,
+			PCS_OPTION_END);
+	}
+	traceStart = pcs_trace_now();
+	metrics_transfer_begin();
+	rc = pcs_upload(worker, remotePath, PcsTrue, localFile->path);
+	metrics_transfer_end(&metrics.uploaded_files, &metrics.uploaded_bytes, rc != NULL, rc ? rc->size : 0);
+	pcs_trace_span("transfer", "upload", traceStart, localFile->path);
+	if (config.printf_enabled && progress) {
+		pcs_setopts(worker,
+			PCS_OPTION_PROGRESS_FUNCTION, NULL,
+			PCS_OPTION_PROGRESS_FUNCTION_DATE, NULL,
+			PCS_OPTION_PROGRESS, (void *)PcsFalse,
+			PCS_OPTION_END);
+	}
+	if (!rc) {
+		PRINT_FATAL("Can't backup %s to %s: %s   ", localFile->path, remotePath, pcs_strerror(worker));
+		return NULL;
+	}
+	if (config.log_enabled) {
+		log_write(LOG_NOTICE, __FILE__, __LINE__, "Backup %s to %s   ", localFile->path, rc->path);
+	}
+	return rc;
+}
+
+/*上传完成后更新网盘缓存和统计，rc 为 method_backup_file_upload() 的返回值。释放 dst 和 rc*/
+static int method_backup_file_done(PcsFileInfo *rc, const char *remotePath, PcsFileInfo *dst, DbPrepare *pre, BackupState *st)
+{
+	int cacheRC;
+	if (!rc) {
+		freeCacheInfo(dst);
+		return -1;
+	}
+	rc->user_flag = FLAG_SUCC;
+	if (dst->fs_id)
+		cacheRC = db_update_cache(rc, pre);
+	else
+		cacheRC = db_add_cache(rc, pre);
+	pcs_fileinfo_destroy(rc);
+	freeCacheInfo(dst);
+	if (cacheRC) {
+		return -1;
+	}
+	if (st) {
+		st->backupFiles++;
+		st->totalFiles++;
+	}
+	return 0;
+}
+
+/*备份文件，dst 为网盘缓存中该路径的信息*/
+static int method_backup_file_with(const my_dirent *localFile, const char *remotePath, PcsFileInfo *dst, DbPrepare *pre, int md5Enabled, int isForce, int isCombin, BackupState *st)
+{
+	int r;
+	r = method_backup_file_check(localFile, remotePath, dst, pre, md5Enabled, isCombin, st);
+	if (r <= 0)
+		return r;
+	db_batch_flush();
+	return method_backup_file_done(method_backup_file_upload(pcs, localFile, remotePath, 1), remotePath, dst, pre, st);
+}
+
+static int method_backup_file(const my_dirent *localFile, const char *remotePath, DbPrepare *pre, int md5Enabled, int isForce, int isCombin, BackupState *st)
+{
+	PcsFileInfo dst = {0};
+	int rc;
+
+	if (db_get_cache(&dst, pre, remotePath)) {
+		return -1;
+	}
+	rc = method_backup_file_with(localFile, remotePath, &dst, pre, md5Enabled, isForce, isCombin, st);
+	freeCacheInfo(&dst);
+	return rc;
+}
+
+/*创建目录，dst 为网盘缓存中该路径的信息*/
+static int method_backup_mkdir_with(const char *remotePath, PcsFileInfo *dst, DbPrepare *pre, BackupState *st)
+{
+	if (dst->fs_id && !dst->isdir) {
+		PcsPanApiRes *res;
+		PcsSList slist = { (char *)remotePath, NULL };
+		db_batch_flush();
+		res = pcs_delete(pcs, &slist);
+		if (!res) {
+			PRINT_FATAL("Can't remove the remote file %s: %s", remotePath, pcs_strerror(pcs));
+			freeCacheInfo(dst);
+			return -1;
 		}
-		if (config.printf_enabled) {
-			pcs_setopts(pcs,
-				PCS_OPTION_PROGRESS_FUNCTION, method_backup_progress,
-				PCS_OPTION_PROGRESS_FUNCTION_DATE, &state,
-				PCS_OPTION_PROGRESS, (void *)PcsTrue,
-				PCS_OPTION_END);
+		pcs_pan_api_res_destroy(res);
+		if (db_remove_cache_by_pre(pre, remotePath)) {
+			PRINT_FATAL("Can't remove the local cache. %s", remotePath);
+			freeCacheInfo(dst);
+			return -1;
 		}
-		rc = pcs_upload(pcs, remotePath, PcsTrue, localFile->path);
-		if (config.printf_enabled) {
-			pcs_setopts(pcs,
-				PCS_OPTION_PROGRESS_FUNCTION, NULL,
-				PCS_OPTION_PROGRESS_FUNCTION_DATE, NULL,
-				PCS_OPTION_PROGRESS, (void *)PcsFalse,
-				PCS_OPTION_END);
+		freeCacheInfo(dst);
+		if (st) {
+			st->removeFiles++;
 		}
-		if (!rc) {
-			PRINT_FATAL("Can't backup %s to %s: %s   ", localFile->path, remotePath, pcs_strerror(pcs));
-			freeCacheInfo(&dst);
+	}
+	if (!dst->fs_id) { //如果远程目录不存在，则创建
+		PcsRes pcsres = PCS_NONE;
+		//PcsFileInfo *meta = NULL;
+		PcsFileInfo meta = { 0 }; time_t now;
+		db_batch_flush();
+		pcsres = pcs_mkdir(pcs, remotePath);
+		if (pcsres != PCS_OK) {
+			PRINT_FATAL("Can't create the directory %s: %s\n", remotePath, pcs_strerror(pcs));
 			return -1;
 		}
-		if (config.log_enabled) {
-			log_write(LOG_NOTICE, __FILE__, __LINE__, "Backup %s to %s   ", localFile->path, rc->path);
-		}
-		rc->user_flag = FLAG_SUCC;
-		if (dst.fs_id)
-			cacheRC = db_update_cache(rc, pre);
-		else
-			cacheRC = db_add_cache(rc, pre);
-		if (cacheRC) {
-			freeCacheInfo(&dst);
-			pcs_fileinfo_destroy(rc);
+		////创建成功后，获取其元数据并存入本地缓存
+		//meta = pcs_meta(pcs, remotePath);
+		//if (!meta) {
+		//	PRINT_FATAL("Can't get meta: %s", remotePath);
+		//	return -1;
+		//}
+		//meta->user_flag = FLAG_SUCC;
+		//if (db_add_cache(meta, pre)) {
+		//	pcs_fileinfo_destroy(meta);
+		//	return -1;
+		//}
+		//pcs_fileinfo_destroy(meta);
+		meta.fs_id = 1;
+		meta.path = (char *)remotePath;
+		meta.isdir = PcsTrue;
+		time(&now);
+		meta.server_ctime = meta.server_mtime = (UInt64)now;
+		meta.user_flag = FLAG_SUCC;
+		if (db_add_cache(&meta, pre)) {
 			return -1;
 		}
-		pcs_fileinfo_destroy(rc);
 		if (st) {
-			st->backupFiles++;
-			st->totalFiles++;
+			st->backupDir++;
+			st->totalDir++;
 		}
+		return 0;
 	}
 	else {
 		if (db_set_cache_flag_by_pre(pre, remotePath, FLAG_SUCC)) {
-			freeCacheInfo(&dst);
+			freeCacheInfo(dst);
+			return -1;
+		}
+		if (st) {
+			st->skipDir++;
+			st->totalDir++;
+		}
+	}
+	freeCacheInfo(dst);
+	return 0;
+}
+
+static int method_backup_mkdir(const char *remotePath, DbPrepare *pre, BackupState *st)
+{
+	PcsFileInfo dst = {0};
+	int rc;
+
+	if (db_get_cache(&dst, pre, remotePath)) {
+		return -1;
+	}
+	rc = method_backup_mkdir_with(remotePath, &dst, pre, st);
+	freeCacheInfo(&dst);
+	return rc;
+}
+
+#define BACKUP_PAGE_SIZE	1000
+#define BACKUP_TRANSFER_WINDOW	BACKUP_PAGE_SIZE /*提交到传输池中还没有取走结果的上传最多多少个*/
+
+static void freeBackupWorkItem(BackupWorkItem *item)
+{
+	if (item->remotePath) pcs_free(item->remotePath);
+	if (item->local.path) pcs_free(item->local.path);
+	freeCacheInfo(&item->remote);
+	if (item->uploaded) pcs_fileinfo_destroy(item->uploaded);
+	if (item->packMd5) pcs_free(item->packMd5);
+	memset(item, 0, sizeof(BackupWorkItem));
+}
+
+/*
+读取一页备份工作列表，lastPath 为上一页最后一项的网盘路径。
+读完一页后再处理，处理过程中对 pcs_cache 的写操作不会影响正在执行的查询。
+*/
+static int db_get_backup_work(sqlite3_stmt *stmt, const char *lastPath, int md5Enabled, BackupWorkItem *items, int *pCount)
+{
+	int rc, count = 0;
+	BackupWorkItem *item;
+
+	sqlite3_bind_int(stmt, 1, md5Enabled);
+	sqlite3_bind_text(stmt, 2, lastPath, -1, SQLITE_STATIC);
+	sqlite3_bind_int(stmt, 3, BACKUP_PAGE_SIZE);
+	while (1) {
+		rc = sqlite3_step(stmt);
+		if (rc == SQLITE_DONE) break;
+		if (rc != SQLITE_ROW) {
+			PRINT_FATAL("Can't execute the statement %s: %s", SQL_LOCAL_SELECT_BACKUP, sqlite3_errmsg(db));
+			sqlite3_reset(stmt);
+			while (count > 0) freeBackupWorkItem(&items[--count]);
+			return -1;
+		}
+		item = &items[count++];
+		item->remotePath = pcs_utils_strdup((const char *)sqlite3_column_text(stmt, 0));
+		item->local.path = pcs_utils_strdup((const char *)sqlite3_column_text(stmt, 1));
+		item->local.is_dir = sqlite3_column_int(stmt, 2);
+		item->local.mtime = (time_t)sqlite3_column_int64(stmt, 3);
+		item->local.size = (size_t)sqlite3_column_int64(stmt, 4);
+		if (sqlite3_column_type(stmt, 5) != SQLITE_NULL) {
+			item->remote.fs_id = (UInt64)sqlite3_column_int64(stmt, 5);
+			item->remote.isdir = (PcsBool)sqlite3_column_int(stmt, 6);
+			item->remote.server_mtime = (UInt64)sqlite3_column_int64(stmt, 7);
+			item->remote.md5 = pcs_utils_strdup((const char *)sqlite3_column_text(stmt, 8));
+		}
+		if (sqlite3_column_type(stmt, 9) != SQLITE_NULL) {
+			item->packed = 1;
+			if (sqlite3_column_type(stmt, 10) != SQLITE_NULL)
+				item->packMd5 = pcs_utils_strdup((const char *)sqlite3_column_text(stmt, 10));
+		}
+	}
+	sqlite3_reset(stmt);
+	*pCount = count;
+	return 0;
+}
+
+/*并发备份时，在传输池的工作线程中上传一个文件。结果保存在 item->uploaded 中，由 method_backup_folder 写入数据库*/
+static int method_backup_transfer(Pcs worker, void *job, size_t *bytes, void *state)
+{
+	BackupWorkItem *item = (BackupWorkItem *)job;
+	item->uploaded = method_backup_file_upload(worker, &item->local, item->remotePath, 0);
+	if (!item->uploaded)
+		return -1;
+	*bytes = (size_t)item->uploaded->size;
+	return 0;
+}
+
+/*在控制台显示传输池中剩余的文件数、大小和预计剩余时间*/
+static void method_backup_print_transfers(PcsTransferPool transfers, BackupState *st)
+{
+	PcsTransferProgress pg;
+	char tmp[64];
+	int eta;
+
+	tmp[63] = '\0';
+	pcs_transfer_progress(transfers, &pg);
+	printf("Process: %d, Left: %d files, %s", st->totalDir + st->totalFiles, pg.pending + pg.running,
+		pcs_utils_readable_size((double)(pg.pending_bytes + pg.running_bytes), tmp, 63, NULL));
+	if (pg.eta >= 0) {
+		eta = (int)(pg.eta + 0.5);
+		printf(", ETA: %d:%02d:%02d", eta / 3600, (eta / 60) % 60, eta % 60);
+	}
+	printf("        \r");
+	fflush(stdout);
+}
+
+/*
+取走传输池中已经完成的上传，在当前线程中更新缓存和统计，失败的文件加入重试队列。
+排队和执行中的上传多于 window 个时，等待到不多于 window 个为止；window 为0时等待全部完成。
+取走的任务由 method_backup_folder() 分配，在这里释放。返回 db_add_retry() 的结果。
+*/
+static int method_backup_wait_transfers(PcsTransferPool transfers, int window, DbPrepare *pre, BackupState *st)
+{
+	BackupWorkItem *item;
+	PcsTransferProgress pg;
+	int rc = 0, r;
+	while (1) {
+		item = (BackupWorkItem *)pcs_transfer_wait_timeout(transfers, NULL, 0, &r);
+		if (!item) {
+			pcs_transfer_progress(transfers, &pg);
+			if (pg.pending + pg.running <= window) {
+				/*取走统计进度之前刚完成的任务；没有时结束*/
+				if (!(item = (BackupWorkItem *)pcs_transfer_wait_timeout(transfers, NULL, 0, &r)))
+					break;
+			}
+			else {
+				/*等待上传之前提交批量事务，不在等待期间占用数据库*/
+				db_batch_flush();
+				item = (BackupWorkItem *)pcs_transfer_wait_timeout(transfers, NULL, 1000, &r);
+			}
+		}
+		if (!item) {
+			if (st && config.printf_enabled)
+				method_backup_print_transfers(transfers, st);
+			continue;
+		}
+		r = method_backup_file_done(item->uploaded, item->remotePath, &item->remote, pre, st);
+		item->uploaded = NULL;
+		if (r) {
+			if (!rc)
+				rc = db_add_retry(METHOD_BACKUP, st, item->local.path, item->remotePath, 0);
+		}
+		else {
+			st->continuousFails = 0;
+		}
+		freeBackupWorkItem(item);
+		pcs_free(item);
+		if (st && config.printf_enabled)
+			method_backup_print_transfers(transfers, st);
+	}
+	return rc;
+}
+
+/*从 SQL_PACK_FILE_SELECT 等语句的结果中读取一项*/
+static void db_fill_pack_entry(PackEntry *entry, sqlite3_stmt *stmt)
+{
+	const char *md5;
+	memset(entry, 0, sizeof(PackEntry));
+	entry->path = pcs_utils_strdup((const char *)sqlite3_column_text(stmt, 0));
+	entry->offset = sqlite3_column_int64(stmt, 1);
+	entry->length = sqlite3_column_int64(stmt, 2);
+	entry->mtime = (time_t)sqlite3_column_int64(stmt, 3);
+	md5 = (const char *)sqlite3_column_text(stmt, 4);
+	if (md5 && strlen(md5) < sizeof(entry->md5)) strcpy(entry->md5, md5);
+	entry->packPath = pcs_utils_strdup((const char *)sqlite3_column_text(stmt, 5));
+}
+
+/*删除文件的打包索引，文件改为单独上传时调用*/
+static int db_remove_pack_file(const char *path)
+{
+	int rc;
+	sqlite3_stmt *stmt = NULL;
+	db_batch_lock();
+	rc = sqlite3_prepare_v2(db, SQL_PACK_FILE_DELETE, -1, &stmt, NULL);
+	if (rc) {
+		PRINT_FATAL("Can't build the sql %s: %s", SQL_PACK_FILE_DELETE, sqlite3_errmsg(db));
+		return -1;
+	}
+	sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
+	rc = sqlite3_step(stmt);
+	if (rc != SQLITE_ROW && rc != SQLITE_DONE) {
+		PRINT_FATAL("Can't execute the statement %s: %s", SQL_PACK_FILE_DELETE, sqlite3_errmsg(db));
+		sqlite3_finalize(stmt);
+		return -1;
+	}
+	sqlite3_finalize(stmt);
+	db_batch_step();
+	return 0;
+}
+
+/*
+记录上传完成的包及其中的文件，packPath 为包的网盘路径。
+isImport 不为0时为从索引文件导入的包，其中已经记录在更晚上传的包中的文件不导入，见 SQL_PACK_FILE_IMPORT。
+*/
+static int db_add_pack(const char *packPath, Int64 size, const PackEntry *entries, int count, int isImport)
+{
+	const char *sql = isImport ? SQL_PACK_FILE_IMPORT : SQL_PACK_FILE_INSERT;
+	int rc, i;
+	sqlite3_stmt *stmt = NULL;
+	sqlite3_int64 id;
+	time_t now;
+	time(&now);
+	db_batch_lock();
+	rc = sqlite3_prepare_v2(db, SQL_PACK_INSERT, -1, &stmt, NULL);
+	if (rc) {
+		PRINT_FATAL("Can't build the sql %s: %s", SQL_PACK_INSERT, sqlite3_errmsg(db));
+		return -1;
+	}
+	sqlite3_bind_text(stmt, 1, packPath, -1, SQLITE_STATIC);
+	sqlite3_bind_int64(stmt, 2, size);
+	sqlite3_bind_int64(stmt, 3, now);
+	rc = sqlite3_step(stmt);
+	sqlite3_finalize(stmt);
+	if (rc != SQLITE_ROW && rc != SQLITE_DONE) {
+		PRINT_FATAL("Can't execute the statement %s: %s", SQL_PACK_INSERT, sqlite3_errmsg(db));
+		return -1;
+	}
+	id = sqlite3_last_insert_rowid(db);
+	rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+	if (rc) {
+		PRINT_FATAL("Can't build the sql %s: %s", sql, sqlite3_errmsg(db));
+		return -1;
+	}
+	for (i = 0; i < count; i++) {
+		sqlite3_bind_text(stmt, 1, entries[i].path, -1, SQLITE_STATIC);
+		sqlite3_bind_int64(stmt, 2, id);
+		sqlite3_bind_int64(stmt, 3, entries[i].offset);
+		sqlite3_bind_int64(stmt, 4, entries[i].length);
+		sqlite3_bind_int64(stmt, 5, entries[i].mtime);
+		sqlite3_bind_text(stmt, 6, entries[i].md5, -1, SQLITE_STATIC);
+		if (isImport) sqlite3_bind_text(stmt, 7, packPath, -1, SQLITE_STATIC);
+		rc = sqlite3_step(stmt);
+		if (rc != SQLITE_ROW && rc != SQLITE_DONE) {
+			PRINT_FATAL("Can't execute the statement %s: %s", sql, sqlite3_errmsg(db));
+			sqlite3_finalize(stmt);
 			return -1;
 		}
-		if (st) {
-			st->skipFiles++;
-			st->totalFiles++;
-		}
+		sqlite3_reset(stmt);
 	}
-	freeCacheInfo(&dst);
+	sqlite3_finalize(stmt);
+	db_batch_step();
 	return 0;
 }
 
-/*创建目录*/
-static int method_backup_mkdir(const char *remotePath, DbPrepare *pre, BackupState *st)
+/*包所在的网盘目录，使用完后需调用 pcs_free() 释放*/
+static char *pack_dir(const char *taskRemotePath)
 {
-	PcsFileInfo dst = {0};
+	char *rc;
+	size_t sz = strlen(taskRemotePath);
+	while (sz > 0 && taskRemotePath[sz - 1] == '/') sz--;
+	rc = (char *)pcs_malloc(sz + strlen(PACK_DIR_NAME) + 2);
+	memcpy(rc, taskRemotePath, sz);
+	rc[sz] = '/';
+	strcpy(rc + sz + 1, PACK_DIR_NAME);
+	return rc;
+}
 
-	if (db_get_cache(&dst, pre, remotePath)) {
+static PackBuilder *pack_create(BackupState *st)
+{
+	PackBuilder *pack;
+	char *key, md5_buf[33];
+	pack = (PackBuilder *)pcs_malloc(sizeof(PackBuilder));
+	memset(pack, 0, sizeof(PackBuilder));
+	pack->remoteDir = pack_dir(st->taskRemotePath);
+	/*临时文件放在缓存文件旁边，并行执行的任务以各自的路径区分*/
+	key = pcs_utils_sprintf("%s -> %s", st->taskLocalPath, st->taskRemotePath);
+	pack->localFile = pcs_utils_sprintf("%s.%s.pack", config.cacheFilePath, md5_string_r(key, md5_buf));
+	pcs_free(key);
+	return pack;
+}
+
+static void pack_reset(PackBuilder *pack)
+{
+	int i;
+	if (pack->pf) {
+		fclose(pack->pf);
+		pack->pf = NULL;
+	}
+	remove(pack->localFile);
+	for (i = 0; i < pack->count; i++)
+		freePackEntry(&pack->entries[i]);
+	pack->count = 0;
+	pack->size = 0;
+}
+
+static void pack_destroy(PackBuilder *pack)
+{
+	pack_reset(pack);
+	if (pack->entries) pcs_free(pack->entries);
+	pcs_free(pack->remoteDir);
+	pcs_free(pack->localFile);
+	pcs_free(pack);
+}
+
+/*把文件追加到包中，md5 为NULL时计算。失败返回-1，包中已有的内容不受影响*/
+static int pack_add(PackBuilder *pack, BackupWorkItem *item, const char *md5)
+{
+	char md5_buf[33], buf[16 * 1024];
+	FILE *src;
+	size_t sz;
+	Int64 length = 0;
+	PackEntry *entry;
+
+	if (!md5 && !(md5 = md5_file_r(item->local.path, md5_buf))) {
+		PRINT_FATAL("Can't calculate md5 for %s.", item->local.path);
 		return -1;
 	}
-	if (dst.fs_id && !dst.isdir) {
-		PcsPanApiRes *res;
-		PcsSList slist = { (char *)remotePath, NULL };
-		res = pcs_delete(pcs, &slist);
-		if (!res) {
-			PRINT_FATAL("Can't remove the remote file %s: %s", remotePath, pcs_strerror(pcs));
-			freeCacheInfo(&dst);
+	if (!pack->pf && !(pack->pf = fopen(pack->localFile, "wb"))) {
+		PRINT_FATAL("Can't create the local file: %s", pack->localFile);
+		return -1;
+	}
+	src = fopen(item->local.path, "rb");
+	if (!src) {
+		PRINT_FATAL("Can't open the local file: %s", item->local.path);
+		return -1;
+	}
+	while ((sz = fread(buf, 1, sizeof(buf), src)) > 0) {
+		if (fwrite(buf, 1, sz, pack->pf) != sz) {
+			PRINT_FATAL("Can't write the local file: %s", pack->localFile);
+			fclose(src);
+			/*下一个文件覆盖写入了一部分的内容*/
+			fseek(pack->pf, (long)pack->size, SEEK_SET);
 			return -1;
 		}
-		pcs_pan_api_res_destroy(res);
-		if (db_remove_cache_by_pre(pre, remotePath)) {
-			PRINT_FATAL("Can't remove the local cache. %s", remotePath);
-			freeCacheInfo(&dst);
-			return -1;
+		length += sz;
+	}
+	fclose(src);
+	if (pack->count == pack->capacity) {
+		PackEntry *entries;
+		pack->capacity = pack->capacity ? pack->capacity * 2 : 64;
+		entries = (PackEntry *)pcs_malloc(sizeof(PackEntry) * pack->capacity);
+		if (pack->count) memcpy(entries, pack->entries, sizeof(PackEntry) * pack->count);
+		if (pack->entries) pcs_free(pack->entries);
+		pack->entries = entries;
+	}
+	entry = &pack->entries[pack->count++];
+	memset(entry, 0, sizeof(PackEntry));
+	entry->path = pcs_utils_strdup(item->remotePath);
+	entry->localPath = pcs_utils_strdup(item->local.path);
+	entry->offset = pack->size;
+	entry->length = length;
+	entry->mtime = item->local.mtime;
+	strcpy(entry->md5, md5);
+	pack->size += length;
+	return 0;
+}
+
+/*
+上传当前的包，成功后记录打包索引；失败时其中的文件加入重试队列，重试时单独上传。
+db_add_retry() 要求中止任务或者写入数据库失败时返回-1。
+*/
+static int pack_flush(PackBuilder *pack, DbPrepare *pre, BackupState *st)
+{
+	PcsFileInfo *packInfo = NULL, *indexInfo = NULL;
+	char *packPath, *indexPath, *index;
+	size_t indexSize;
+	Int64 traceStart;
+	time_t now;
+	int rc = 0, i;
+
+	if (pack->count == 0) {
+		pack_reset(pack);
+		return 0;
+	}
+	fclose(pack->pf);
+	pack->pf = NULL;
+	time(&now);
+	/*文件名按上传的先后排序，导入索引时以后上传的包为准*/
+	packPath = pcs_utils_sprintf("%s/%lld-%04d.pack", pack->remoteDir, (long long)now, ++pack->seq);
+	indexPath = pcs_utils_sprintf("%s.idx", packPath);
+	if (pack->dirReady || method_backup_mkdir(pack->remoteDir, pre, NULL) == 0) {
+		pack->dirReady = 1;
+		index = pack_build_index(pack->entries, pack->count, &indexSize);
+		db_batch_flush();
+		traceStart = pcs_trace_now();
+		metrics_transfer_begin();
+		/*先上传索引，只有索引的包在导入时会被忽略*/
+		indexInfo = pcs_upload_buffer(pcs, indexPath, PcsTrue, index, indexSize);
+		if (indexInfo)
+			packInfo = pcs_upload(pcs, packPath, PcsTrue, pack->localFile);
+		metrics_transfer_end(&metrics.uploaded_files, &metrics.uploaded_bytes, packInfo != NULL, packInfo ? packInfo->size : 0);
+		pcs_trace_span("transfer", "upload pack", traceStart, packPath);
+		pcs_free(index);
+	}
+	if (!packInfo) {
+		PRINT_FATAL("Can't backup %d files to %s: %s", pack->count, packPath, pcs_strerror(pcs));
+		for (i = 0; i < pack->count && !rc; i++)
+			rc = db_add_retry(METHOD_BACKUP, st, pack->entries[i].localPath, pack->entries[i].path, 0);
+	}
+	else {
+		indexInfo->user_flag = FLAG_SUCC;
+		packInfo->user_flag = FLAG_SUCC;
+		if (db_add_cache(indexInfo, pre) || db_add_cache(packInfo, pre)
+			|| db_add_pack(packPath, pack->size, pack->entries, pack->count, 0)) {
+			rc = -1;
 		}
-		freeCacheInfo(&dst);
-		if (st) {
-			st->removeFiles++;
+		else {
+			if (config.log_enabled) {
+				log_write(LOG_NOTICE, __FILE__, __LINE__, "Backup %d files to %s   ", pack->count, packPath);
+			}
+			/*包中的每个文件都计为一个上传的文件*/
+			metrics_add(&metrics.uploaded_files, pack->count - 1);
+			st->backupFiles += pack->count;
+			st->totalFiles += pack->count;
+			st->continuousFails = 0;
 		}
 	}
-	if (!dst.fs_id) { //如果远程目录不存在，则创建
-		PcsRes pcsres = PCS_NONE;
-		//PcsFileInfo *meta = NULL;
-		PcsFileInfo meta = { 0 }; time_t now;
-		pcsres = pcs_mkdir(pcs, remotePath);
-		if (pcsres != PCS_OK) {
-			PRINT_FATAL("Can't create the directory %s: %s\n", remotePath, pcs_strerror(pcs));
-			return -1;
-		}
-		////创建成功后，获取其元数据并存入本地缓存
-		//meta = pcs_meta(pcs, remotePath);
-		//if (!meta) {
-		//	PRINT_FATAL("Can't get meta: %s", remotePath);
-		//	return -1;
-		//}
-		//meta->user_flag = FLAG_SUCC;
-		//if (db_add_cache(meta, pre)) {
-		//	pcs_fileinfo_destroy(meta);
-		//	return -1;
-		//}
-		//pcs_fileinfo_destroy(meta);
-		meta.fs_id = 1;
-		meta.path = (char *)remotePath;
-		meta.isdir = PcsTrue;
-		time(&now);
-		meta.server_ctime = meta.server_mtime = (UInt64)now;
-		meta.user_flag = FLAG_SUCC;
-		if (db_add_cache(&meta, pre)) {
+	if (indexInfo) pcs_fileinfo_destroy(indexInfo);
+	if (packInfo) pcs_fileinfo_destroy(packInfo);
+	pcs_free(indexPath);
+	pcs_free(packPath);
+	pack_reset(pack);
+	return rc;
+}
+
+/*
+检查是否打包上传文件，item 为网盘缓存中不存在的文件。pack 为NULL时不再打包，只检查以前的打包。
+已经写入包中或者不需要上传返回0，需要单独上传返回1，失败返回-1。
+*/
+static int method_backup_pack_file(PackBuilder *pack, BackupWorkItem *item, int md5Enabled, BackupState *st)
+{
+	const char *md5 = NULL;
+	char md5_buf[33];
+
+	if (item->packed && md5Enabled && item->packMd5) {
+		md5 = md5_file_r(item->local.path, md5_buf);
+		if (!md5) {
+			PRINT_FATAL("Can't calculate md5 for %s.", item->local.path);
 			return -1;
 		}
-		if (st) {
-			st->backupDir++;
-			st->totalDir++;
+		if (pcs_utils_strcmpi(md5, item->packMd5) == 0) {
+			st->skipFiles++;
+			st->totalFiles++;
+			metrics_add(&metrics.skipped_files, 1);
+			return 0;
 		}
-		return 0;
 	}
-	else {
-		if (db_set_cache_flag_by_pre(pre, remotePath, FLAG_SUCC)) {
-			freeCacheInfo(&dst);
+	if (!pack || (Int64)item->local.size >= config.pack_threshold) {
+		/*以前打包过的文件改为单独上传，删除其打包索引，以免还原时取到旧的内容*/
+		if (item->packed && db_remove_pack_file(item->remotePath))
 			return -1;
-		}
-		if (st) {
-			st->skipDir++;
-			st->totalDir++;
-		}
+		return 1;
 	}
-	freeCacheInfo(&dst);
-	return 0;
+	return pack_add(pack, item, md5);
 }
 
-/*备份目录*/
+/*
+备份目录：先把本地目录树扫描到临时表中，再只处理网盘缓存中不存在或者有变化的项。
+单个文件或目录失败时加入重试队列，继续处理其他项。st 不能为NULL。
+配置了 parallelTransfers 时，需要上传的文件提交到传输池中并发上传，
+目录的创建、md5比较和数据库的读写仍在当前线程中按顺序进行。传输池在各页之间持续运行，
+完成的上传随时在当前线程中写入缓存，未完成的超过 BACKUP_TRANSFER_WINDOW 个时才等待，最后等待全部完成。
+配置了 packSmallFiles 时，小文件依次写入包中，每个包达到 packSize 后整个上传，见 pack_flush()。
+*/
 static int method_backup_folder(const char *localPath, const char *remotePath, DbPrepare *pre, int md5Enabled, int isForce, int isCombin, BackupState *st)
 {
-	my_dirent *ents = NULL,
-		*ent = NULL;
-	char *dstPath;
+	sqlite3_stmt *stmt = NULL;
+	BackupWorkItem *items, *job;
+	PcsTransferPool transfers = NULL;
+	PackBuilder *pack = NULL;
+	char *lastPath, *failedDir = NULL;
+	int rc = 0, i, count = 0, r,
+		fileCount = 0, dirCount = 0,
+		workFiles = 0, workDirs = 0;
+	Int64 traceStart;
 
 	if (method_backup_mkdir(remotePath, pre, st)) {
 		return -1;
 	}
-	ents = list_dir(localPath, 0);
-	if (!ents) { //如果是空目录
-		return 0;
+	traceStart = pcs_trace_now();
+	rc = db_load_local(localPath, remotePath, &fileCount, &dirCount);
+	pcs_trace_span("backup", "local scan", traceStart, localPath);
+	if (rc) {
+		return -1;
 	}
-	ent = ents;
-	while(ent) {
-		dstPath = get_remote_path(ent->path, localPath, remotePath);
-		if (ent->is_dir) {
-			if (method_backup_folder(ent->path, dstPath, pre, md5Enabled, isForce, isCombin, st)) {
-				pcs_free(dstPath);
-				my_dirent_destroy(ents);
-				return -1;
+	if (sqlite3_prepare_v2(db, SQL_LOCAL_SELECT_BACKUP, -1, &stmt, NULL)) {
+		PRINT_FATAL("Can't build the sql %s: %s", SQL_LOCAL_SELECT_BACKUP, sqlite3_errmsg(db));
+		return -1;
+	}
+	items = (BackupWorkItem *)pcs_malloc(sizeof(BackupWorkItem) * BACKUP_PAGE_SIZE);
+	memset(items, 0, sizeof(BackupWorkItem) * BACKUP_PAGE_SIZE);
+	if (config.transfer_max > 0) {
+		transfers = pcs_transfer_pool_create(pcs, config.transfer_min, config.transfer_max, &method_backup_transfer, NULL);
+		if (!transfers)
+			PRINT_WARNING("Can't create the transfer threads, backup one by one: %s", localPath);
+	}
+	/*加密的文件需要整个下载后才能解密，不能从包中按位置还原*/
+	if (config.pack_threshold > 0 && config.secure_method == PCS_SECURE_NONE)
+		pack = pack_create(st);
+	lastPath = pcs_utils_strdup("");
+	while (!rc) {
+		traceStart = pcs_trace_now();
+		rc = db_get_backup_work(stmt, lastPath, md5Enabled, items, &count);
+		pcs_trace_span("backup", "compare", traceStart, lastPath);
+		if (rc || count == 0) break;
+		pcs_free(lastPath);
+		lastPath = pcs_utils_strdup(items[count - 1].remotePath);
+		/*按路径排序，目录总是在其子项之前处理*/
+		for (i = 0; i < count; i++) {
+			if (items[i].local.is_dir) workDirs++;
+			else workFiles++;
+			/*创建失败的目录会整体重试，跳过其子项*/
+			if (!rc && !(failedDir && path_overlap(failedDir, items[i].remotePath))) {
+				if (!items[i].local.is_dir && !items[i].remote.fs_id && (pack || items[i].packed)
+					&& (r = method_backup_pack_file(pack, &items[i], md5Enabled, st)) <= 0) {
+					/*已经写入包中，或者不需要上传*/
+				}
+				else if (items[i].local.is_dir)
+					r = method_backup_mkdir_with(items[i].remotePath, &items[i].remote, pre, st);
+				else if (transfers) {
+					r = method_backup_file_check(&items[i].local, items[i].remotePath, &items[i].remote, pre, md5Enabled, isCombin, st);
+					if (r > 0) {
+						/*任务在取走结果后释放，不受本页结束的影响*/
+						job = (BackupWorkItem *)pcs_malloc(sizeof(BackupWorkItem));
+						memcpy(job, &items[i], sizeof(BackupWorkItem));
+						memset(&items[i], 0, sizeof(BackupWorkItem));
+						pcs_transfer_submit(transfers, job, (UInt64)job->local.size);
+						r = method_backup_wait_transfers(transfers, BACKUP_TRANSFER_WINDOW, pre, st);
+						if (!rc) rc = r;
+						continue;
+					}
+				}
+				else
+					r = method_backup_file_with(&items[i].local, items[i].remotePath, &items[i].remote, pre, md5Enabled, isForce, isCombin, st);
+				if (r) {
+					rc = db_add_retry(METHOD_BACKUP, st, items[i].local.path, items[i].remotePath, items[i].local.is_dir);
+					if (items[i].local.is_dir) {
+						if (failedDir) pcs_free(failedDir);
+						failedDir = pcs_utils_strdup(items[i].remotePath);
+					}
+				}
+				else {
+					st->continuousFails = 0;
+				}
+				if (!rc && pack && pack->size >= config.pack_size)
+					rc = pack_flush(pack, pre, st);
 			}
-		}
-		else {
-			if (method_backup_file(ent, dstPath, pre, md5Enabled, isForce, isCombin, st)) {
-				pcs_free(dstPath);
-				my_dirent_destroy(ents);
-				return -1;
+			freeBackupWorkItem(&items[i]);
+			if (st && config.printf_enabled) {
+				printf("Process: %d        \r", st->totalDir + st->totalFiles);
+				fflush(stdout);
 			}
 		}
-		ent = ent->next;
-		pcs_free(dstPath);
-		if (st && config.printf_enabled) {
-			printf("Process: %d        \r", st->totalDir + st->totalFiles);
-			fflush(stdout);
-		}
+		if (count < BACKUP_PAGE_SIZE) break;
 	}
-	my_dirent_destroy(ents);
-	return 0;
+	if (transfers) {
+		r = method_backup_wait_transfers(transfers, 0, pre, st);
+		if (!rc) rc = r;
+		pcs_transfer_pool_destroy(transfers);
+	}
+	if (pack) {
+		if (!rc) rc = pack_flush(pack, pre, st);
+		pack_destroy(pack);
+	}
+	pcs_free(lastPath);
+	if (failedDir) pcs_free(failedDir);
+	pcs_free(items);
+	sqlite3_finalize(stmt);
+	if (rc) {
+		return -1;
+	}
+	/*不在工作列表中的项，网盘中已经是最新的*/
+	{
+		st->skipFiles += fileCount - workFiles;
+		metrics_add(&metrics.skipped_files, fileCount - workFiles);
+		st->totalFiles += fileCount - workFiles;
+		st->skipDir += dirCount - workDirs;
+		st->totalDir += dirCount - workDirs;
+	}
+	return db_set_local_flags(FLAG_SUCC);
 }
 
 static int method_backup_remove_files(PcsSList *slist, DbPrepare *pre, const char *remotePath)
 {
 	PcsPanApiRes *res;
 	PcsPanApiResInfoList *info;
+	int failed = 0;
 	if (!slist) return 0;
 	res = pcs_delete(pcs, slist);
 	if (!res) {
@@ -1828,15 +3482,15 @@ static int method_backup_remove_files(PcsSList *slist, DbPrepare *pre, const cha
 		return -1;
 	}
 
+	/*部分批次失败时，其他批次已删除的文件仍需从缓存中移除*/
 	info = res->info_list;
 	while (info) {
 		if (info->info.error) {
-			PRINT_FATAL("Can't remove the remote file %s", info->info.path);
-			pcs_pan_api_res_destroy(res);
-			return -1;
+			PRINT_FATAL("Can't remove the remote file %s: %s", info->info.path, pcs_pan_api_res_info_errmsg(info->info.error));
+			failed = 1;
 		}
 		else {
-			if (db_remove_cache_by_pre(pre, info->info.path)) {
+			if (db_remove_cache_by_pre(pre, info->info.path) || db_clear_caches(info->info.path)) {
 				PRINT_FATAL("Can't remove the local cache. %s", info->info.path);
 				pcs_pan_api_res_destroy(res);
 				return -1;
@@ -1846,50 +3500,39 @@ static int method_backup_remove_files(PcsSList *slist, DbPrepare *pre, const cha
 		info = info->next;
 	}
 	pcs_pan_api_res_destroy(res);
-	return 0;
+	return failed ? -1 : 0;
 }
 
-/*删除本地已经移除的文件或目录*/
+/*删除本地已经移除的文件或目录，pre->stmts[5] 需为 SQL_LOCAL_SELECT_UNTRACK*/
 static int method_backup_remove_untrack(const char *remotePath, DbPrepare *pre, BackupState *st) 
 {
-	int rc, is_dir;
+	int rc, is_dir, sz;
 	sqlite3_stmt *stmt = pre->stmts[5];
-	int sz;
-	char *val;
-	PcsSList *slist = NULL, *it;
-	sz = strlen(remotePath);
-	val = (char *)pcs_malloc(sz + 3);
-	memcpy(val, remotePath, sz + 1);
-	if (val[sz - 1] != '/') {
-		val[sz] = '/'; val[sz + 1] = '%'; val[sz + 2] = '\0';
-		sz += 2;
-	}
-	else {
-		val[sz] = '%'; val[sz + 1] = '\0';
-		sz++;
-	}
-	rc = sqlite3_bind_text(stmt, 1, val, sz, SQLITE_STATIC);
+	PcsSList *slist = NULL, *it, *next;
+	rc = db_bind_path_range(stmt, 1, remotePath);
+	if (!rc) rc = db_bind_dir_path(stmt, 3, remotePath);
 	if (rc) {
 		PRINT_FATAL("Can't bind the text into the statement: %s", sqlite3_errmsg(db));
 		sqlite3_reset(stmt);
 		return -1;
 	}
-	sz = 0;
+	/*先读出全部需要删除的项，删除时会修改 pcs_cache*/
 	while (1) {
 		rc = sqlite3_step(stmt);
 		if (rc == SQLITE_DONE) break;
 		if (rc != SQLITE_ROW) {
 			PRINT_FATAL("Can't execute the statement: %s", sqlite3_errmsg(db));
-			pcs_free(val);
 			pcs_slist_destroy(slist);
 			sqlite3_reset(stmt);
 			return -1;
 		}
-		it = pcs_slist_create_ex((const char *)sqlite3_column_text(stmt, 1), -1);
-		is_dir = sqlite3_column_int(stmt, 7);
+		/*包由 method_backup_remove_packs() 处理*/
+		if (is_pack_path((const char *)sqlite3_column_text(stmt, 0)))
+			continue;
+		it = pcs_slist_create_ex((const char *)sqlite3_column_text(stmt, 0), -1);
+		is_dir = sqlite3_column_int(stmt, 1);
 		it->next = slist;
 		slist = it;
-		sz++;
 		if (st) {
 			if (is_dir) {
 				st->removeDir++;
@@ -1898,34 +3541,277 @@ static int method_backup_remove_untrack(const char *remotePath, DbPrepare *pre,
 				st->removeFiles++;
 			}
 		}
-		if (sz >= 10) {
-			if (method_backup_remove_files(slist, pre, remotePath)) {
-				pcs_free(val);
-				pcs_slist_destroy(slist);
-				sqlite3_reset(stmt);
-				return -1;
-			}
+	}
+	sqlite3_reset(stmt);
+	/*每次最多删除10项*/
+	it = slist;
+	while (it) {
+		PcsSList *head = it;
+		for (sz = 1; sz < 10 && it->next; sz++)
+			it = it->next;
+		next = it->next;
+		it->next = NULL;
+		rc = method_backup_remove_files(head, pre, remotePath);
+		it->next = next;
+		if (rc) {
 			pcs_slist_destroy(slist);
-			slist = NULL;
-			sz = 0;
+			return -1;
 		}
+		it = next;
 		if (st && config.printf_enabled) {
 			printf("Process: %d        \r", st->totalDir + st->totalFiles);
 			fflush(stdout);
 		}
 	}
-	if (slist) {
-		if (method_backup_remove_files(slist, pre, remotePath)) {
-			pcs_free(val);
-			pcs_slist_destroy(slist);
-			sqlite3_reset(stmt);
-			return -1;
-		}
+	pcs_slist_destroy(slist);
+	return 0;
+}
+
+/*读取包中的所有文件，按在包中的位置排序，返回文件数，失败返回-1。使用完后需释放 *pEntries 及其中的每一项*/
+static int db_get_pack_entries(const char *packPath, PackEntry **pEntries)
+{
+	int rc, count = 0, capacity = 16;
+	sqlite3_stmt *stmt = NULL;
+	PackEntry *entries, *tmp;
+	rc = sqlite3_prepare_v2(db, SQL_PACK_FILE_SELECT_PACK, -1, &stmt, NULL);
+	if (rc) {
+		PRINT_FATAL("Can't build the sql %s: %s", SQL_PACK_FILE_SELECT_PACK, sqlite3_errmsg(db));
+		return -1;
+	}
+	sqlite3_bind_text(stmt, 1, packPath, -1, SQLITE_STATIC);
+	entries = (PackEntry *)pcs_malloc(sizeof(PackEntry) * capacity);
+	while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+		if (count == capacity) {
+			capacity *= 2;
+			tmp = (PackEntry *)pcs_malloc(sizeof(PackEntry) * capacity);
+			memcpy(tmp, entries, sizeof(PackEntry) * count);
+			pcs_free(entries);
+			entries = tmp;
+		}
+		db_fill_pack_entry(&entries[count++], stmt);
+	}
+	sqlite3_finalize(stmt);
+	if (rc != SQLITE_DONE) {
+		PRINT_FATAL("Can't execute the statement %s: %s", SQL_PACK_FILE_SELECT_PACK, sqlite3_errmsg(db));
+		while (count > 0) freePackEntry(&entries[--count]);
+		pcs_free(entries);
+		return -1;
+	}
+	*pEntries = entries;
+	return count;
+}
+
+/*
+重新上传有文件被删除或者移到其他包中的包的索引文件，以免在另一台电脑上还原时取回这些文件。
+上传失败时保留标记，下次备份时再上传。
+*/
+static int method_backup_update_pack_index(const char *packDir, DbPrepare *pre)
+{
+	int rc, count;
+	sqlite3_stmt *stmt = NULL;
+	PcsSList *slist = NULL, *it;
+	PackEntry *entries;
+	PcsFileInfo *info;
+	char *index, *indexPath;
+	size_t indexSize;
+
+	rc = sqlite3_prepare_v2(db, SQL_PACK_SELECT_DIRTY, -1, &stmt, NULL);
+	if (rc) {
+		PRINT_FATAL("Can't build the sql %s: %s", SQL_PACK_SELECT_DIRTY, sqlite3_errmsg(db));
+		return -1;
+	}
+	db_bind_path_range(stmt, 1, packDir);
+	while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+		it = pcs_slist_create_ex((const char *)sqlite3_column_text(stmt, 0), -1);
+		it->next = slist;
+		slist = it;
+	}
+	sqlite3_finalize(stmt);
+	if (rc != SQLITE_DONE) {
+		PRINT_FATAL("Can't execute the statement %s: %s", SQL_PACK_SELECT_DIRTY, sqlite3_errmsg(db));
+		pcs_slist_destroy(slist);
+		return -1;
+	}
+	rc = 0;
+	for (it = slist; it && !rc; it = it->next) {
+		count = db_get_pack_entries(it->string, &entries);
+		if (count < 0) {
+			rc = -1;
+			break;
+		}
+		index = pack_build_index(entries, count, &indexSize);
+		while (count > 0) freePackEntry(&entries[--count]);
+		pcs_free(entries);
+		indexPath = pcs_utils_sprintf("%s.idx", it->string);
+		db_batch_flush();
+		info = pcs_upload_buffer(pcs, indexPath, PcsTrue, index, indexSize);
+		pcs_free(index);
+		if (!info) {
+			PRINT_WARNING("Can't update the index %s: %s", indexPath, pcs_strerror(pcs));
+			pcs_free(indexPath);
+			continue;
+		}
+		pcs_free(indexPath);
+		info->user_flag = FLAG_SUCC;
+		rc = db_update_cache(info, pre);
+		pcs_fileinfo_destroy(info);
+		if (rc) break;
+		db_batch_lock();
+		if (sqlite3_prepare_v2(db, SQL_PACK_SET_CLEAN, -1, &stmt, NULL)) {
+			PRINT_FATAL("Can't build the sql %s: %s", SQL_PACK_SET_CLEAN, sqlite3_errmsg(db));
+			rc = -1;
+			break;
+		}
+		sqlite3_bind_text(stmt, 1, it->string, -1, SQLITE_STATIC);
+		sqlite3_step(stmt);
+		sqlite3_finalize(stmt);
+		db_batch_step();
+	}
+	pcs_slist_destroy(slist);
+	return rc;
+}
+
+/*
+删除网盘中存在，但是本地没有记录的包和索引文件。
+pack_flush() 上传包之后、写入数据库之前失败或者进程中止时会留下这样的包，其中的文件在下次备份时已经重新打包。
+进程中止时网盘缓存中也没有这些文件，所以直接列出包所在的目录。列出或删除失败时只给出提示，下次备份时再删除。
+*/
+static int method_backup_remove_orphan_packs(const char *packDir, DbPrepare *pre)
+{
+	int rc;
+	sqlite3_stmt *stmt = NULL;
+	PcsFileInfo dir = {0};
+	PcsFileInfoList *list = NULL;
+	PcsFileInfoListIterater iterater;
+	PcsFileInfo *info;
+	PcsSList *slist = NULL, *it;
+	size_t sz;
+
+	if (db_get_cache(&dir, pre, packDir))
+		return -1;
+	rc = dir.path && dir.isdir;
+	freeCacheInfo(&dir);
+	/*还没有上传过包*/
+	if (!rc)
+		return 0;
+	db_batch_flush();
+	if (update_list_dir(pcs, packDir, &list) || !list)
+		return 0;
+	rc = sqlite3_prepare_v2(db, SQL_PACK_EXISTS, -1, &stmt, NULL);
+	if (rc) {
+		PRINT_FATAL("Can't build the sql %s: %s", SQL_PACK_EXISTS, sqlite3_errmsg(db));
+		pcs_filist_destroy(list);
+		return -1;
+	}
+	rc = SQLITE_DONE;
+	pcs_filist_iterater_init(list, &iterater, PcsFalse);
+	while (pcs_filist_iterater_next(&iterater)) {
+		info = iterater.current;
+		if (info->isdir) continue;
+		/*索引文件按其对应的包检查*/
+		sz = strlen(info->path);
+		if (sz > 4 && strcmp(info->path + sz - 4, ".idx") == 0) sz -= 4;
+		sqlite3_bind_text(stmt, 1, info->path, (int)sz, SQLITE_STATIC);
+		rc = sqlite3_step(stmt);
+		sqlite3_reset(stmt);
+		if (rc == SQLITE_ROW) continue;
+		if (rc != SQLITE_DONE) break;
+		it = pcs_slist_create_ex(info->path, -1);
+		it->next = slist;
+		slist = it;
+	}
+	sqlite3_finalize(stmt);
+	pcs_filist_destroy(list);
+	if (rc != SQLITE_ROW && rc != SQLITE_DONE) {
+		PRINT_FATAL("Can't execute the statement %s: %s", SQL_PACK_EXISTS, sqlite3_errmsg(db));
+		pcs_slist_destroy(slist);
+		return -1;
+	}
+	if (slist && method_backup_remove_files(slist, pre, packDir))
+		PRINT_WARNING("Can't remove all orphan packs in %s", packDir);
+	pcs_slist_destroy(slist);
+	return 0;
+}
+
+/*
+删除本地已经不存在的文件的打包索引，以及其中已经没有任何文件的包，并更新其他有变化的包的索引文件。
+本地没有记录的包也一并删除，见 method_backup_remove_orphan_packs()。
+包中部分失效的内容不回收，直到整个包都失效后才删除。
+*/
+static int method_backup_remove_packs(const char *remotePath, DbPrepare *pre, BackupState *st)
+{
+	int rc, i;
+	sqlite3_stmt *stmt = NULL;
+	PcsSList *slist = NULL, *it;
+	char *packDir;
+	const char *sqls[] = { SQL_PACK_FILE_DELETE_UNTRACK, SQL_PACK_FILE_DELETE_UPLOADED };
+
+	for (i = 0; i < 2; i++) {
+		db_batch_lock();
+		rc = sqlite3_prepare_v2(db, sqls[i], -1, &stmt, NULL);
+		if (rc) {
+			PRINT_FATAL("Can't build the sql %s: %s", sqls[i], sqlite3_errmsg(db));
+			return -1;
+		}
+		db_bind_path_range(stmt, 1, remotePath);
+		rc = sqlite3_step(stmt);
+		sqlite3_finalize(stmt);
+		if (rc != SQLITE_ROW && rc != SQLITE_DONE) {
+			PRINT_FATAL("Can't execute the statement %s: %s", sqls[i], sqlite3_errmsg(db));
+			return -1;
+		}
+		/*只有本地已经不存在的文件计为删除*/
+		if (i == 0 && st) st->removeFiles += sqlite3_changes(db);
+		db_batch_step();
+	}
+
+	packDir = pack_dir(remotePath);
+	if (method_backup_remove_orphan_packs(packDir, pre)) {
+		pcs_free(packDir);
+		return -1;
+	}
+	rc = sqlite3_prepare_v2(db, SQL_PACK_SELECT_EMPTY, -1, &stmt, NULL);
+	if (rc) {
+		PRINT_FATAL("Can't build the sql %s: %s", SQL_PACK_SELECT_EMPTY, sqlite3_errmsg(db));
+		pcs_free(packDir);
+		return -1;
+	}
+	db_bind_path_range(stmt, 1, packDir);
+	while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+		it = pcs_slist_create_ex((const char *)sqlite3_column_text(stmt, 0), -1);
+		it->next = slist;
+		slist = it;
+	}
+	sqlite3_finalize(stmt);
+	if (rc != SQLITE_DONE) {
+		PRINT_FATAL("Can't execute the statement %s: %s", SQL_PACK_SELECT_EMPTY, sqlite3_errmsg(db));
 		pcs_slist_destroy(slist);
+		pcs_free(packDir);
+		return -1;
 	}
-	pcs_free(val);
-	sqlite3_reset(stmt);
-	return 0;
+	rc = 0;
+	for (it = slist; it && !rc; it = it->next) {
+		char *indexPath = pcs_utils_sprintf("%s.idx", it->string);
+		PcsSList idx = { indexPath, NULL }, pk = { it->string, &idx };
+		rc = method_backup_remove_files(&pk, pre, packDir);
+		pcs_free(indexPath);
+		if (rc) break;
+		db_batch_lock();
+		if (sqlite3_prepare_v2(db, SQL_PACK_DELETE, -1, &stmt, NULL)) {
+			PRINT_FATAL("Can't build the sql %s: %s", SQL_PACK_DELETE, sqlite3_errmsg(db));
+			rc = -1;
+			break;
+		}
+		sqlite3_bind_text(stmt, 1, it->string, -1, SQLITE_STATIC);
+		sqlite3_step(stmt);
+		sqlite3_finalize(stmt);
+		db_batch_step();
+	}
+	pcs_slist_destroy(slist);
+	if (!rc)
+		rc = method_backup_update_pack_index(packDir, pre);
+	pcs_free(packDir);
+	return rc;
 }
 
 int method_backup(const char *localPath, const char *remotePath, int md5Enabled, int isForce, int isCombin)
@@ -1936,8 +3822,13 @@ int method_backup(const char *localPath, const char *remotePath, int md5Enabled,
 	int rc = 0;
 	my_dirent *ent = NULL;
 	BackupState st = {0};
+	time_t startTime;
+	Int64 traceStart;
 
 	PRINT_NOTICE("Backup - Start");
+	time(&startTime);
+	st.taskLocalPath = localPath;
+	st.taskRemotePath = remotePath;
 	if (pcs_islogin(pcs) != PCS_LOGIN) {
 		PRINT_FATAL("Not login or session time out");
 		return -1;
@@ -1995,7 +3886,10 @@ int method_backup(const char *localPath, const char *remotePath, int md5Enabled,
 	}
 	if (!ai.rowid || ai.status != ACTION_STATUS_FINISHED) {
 		PRINT_NOTICE("Update local cache for %s", remotePath);
-		if (method_update(remotePath)) {
+		traceStart = pcs_trace_now();
+		rc = method_update(remotePath);
+		pcs_trace_span("backup", "remote fetch", traceStart, remotePath);
+		if (rc) {
 			PRINT_FATAL("Can't update local cache for %s", remotePath);
 			db_set_action(action, ACTION_STATUS_ERROR, 0);
 			pcs_free(updateAction);
@@ -2034,28 +3928,34 @@ int method_backup(const char *localPath, const char *remotePath, int md5Enabled,
 		PRINT_NOTICE("Backup - End");
 		return -1;
 	}
-	if (db_prepare(&pre, SQL_CACHE_INSERT, SQL_CACHE_SELECT, SQL_CACHE_DELETE, SQL_CACHE_UPDATE, SQL_CACHE_SET_FLAG, SQL_CACHE_SELECT_UNTRACK, NULL)) {
+	if (db_prepare(&pre, SQL_CACHE_INSERT, SQL_CACHE_SELECT, SQL_CACHE_DELETE, SQL_CACHE_UPDATE, SQL_CACHE_SET_FLAG, SQL_LOCAL_SELECT_UNTRACK, NULL)) {
 		db_set_action(action, ACTION_STATUS_ERROR, 0);
 		pcs_free(action);
 		my_dirent_destroy(ent);
 		PRINT_NOTICE("Backup - End");
 		return -1;
 	}
+	//备份过程中对缓存的写操作合并到批量事务中
+	db_begin_batch();
 	if (rc == 2) { //类型为目录
 		if (method_backup_folder(localPath, remotePath, &pre, md5Enabled, isForce, isCombin, &st)) {
 			db_set_action(action, ACTION_STATUS_ERROR, 0);
 			pcs_free(action);
 			my_dirent_destroy(ent);
+			db_end_batch();
 			db_prepare_destroy(&pre);
 			PRINT_NOTICE("Backup - End");
 			return -1;
 		}
 	}
 	else if (rc == 1) { //类型为文件
-		if (method_backup_file(ent, remotePath, &pre, md5Enabled, isForce, isCombin, &st)) {
+		db_clear_local();
+		if (method_backup_file(ent, remotePath, &pre, md5Enabled, isForce, isCombin, &st)
+			&& db_add_retry(METHOD_BACKUP, &st, localPath, remotePath, 0)) {
 			db_set_action(action, ACTION_STATUS_ERROR, 0);
 			pcs_free(action);
 			my_dirent_destroy(ent);
+			db_end_batch();
 			db_prepare_destroy(&pre);
 			PRINT_NOTICE("Backup - End");
 			return -1;
@@ -2066,25 +3966,39 @@ int method_backup(const char *localPath, const char *remotePath, int md5Enabled,
 		db_set_action(action, ACTION_STATUS_ERROR, 0);
 		pcs_free(action);
 		my_dirent_destroy(ent);
+		db_end_batch();
 		db_prepare_destroy(&pre);
 		PRINT_NOTICE("Backup - End");
 		return -1;
 	}
 	my_dirent_destroy(ent);
 	//移除服务器中，本地不存在的文件
-	if (!isCombin && method_backup_remove_untrack(remotePath, &pre, &st)) {
+	traceStart = pcs_trace_now();
+	rc = isCombin ? 0 : method_backup_remove_untrack(remotePath, &pre, &st);
+	if (!rc && !isCombin)
+		rc = method_backup_remove_packs(remotePath, &pre, &st);
+	pcs_trace_span("backup", "remove untrack", traceStart, remotePath);
+	if (rc) {
 		//PRINT_FATAL("Can't remove untrack files from the server: %s", remotePath);
 		db_set_action(action, ACTION_STATUS_ERROR, 0);
 		pcs_free(action);
+		db_end_batch();
 		db_prepare_destroy(&pre);
 		PRINT_NOTICE("Backup - End");
 		return -1;
 	}
+	db_clear_local();
+	//本次没有再失败的项已经处理完成，从重试队列中移除
+	db_clear_retry(METHOD_BACKUP, localPath, remotePath, startTime);
 	db_set_action(action, ACTION_STATUS_FINISHED, 0);
 	pcs_free(action);
+	db_end_batch();
 	db_prepare_destroy(&pre);
 	PRINT_NOTICE("Backup File: %d, Skip File: %d, Remove File: %d, Total File: %d", st.backupFiles, st.skipFiles, st.removeFiles, st.totalFiles);
 	PRINT_NOTICE("Backup Dir : %d, Skip Dir : %d, Remove Dir : %d, Total Dir : %d", st.backupDir, st.skipDir, st.removeDir, st.totalDir);
+	if (st.failFiles || st.failDir) {
+		PRINT_WARNING("Failed File: %d, Failed Dir: %d. They will be retried later.", st.failFiles, st.failDir);
+	}
 	PRINT_NOTICE("Backup - End");
 	return 0;
 }
@@ -2107,11 +4021,13 @@ static int method_restore_write(char *ptr, size_t size, size_t contentlength, vo
 	return i;
 }
 
-static int method_restore_file(const char *localPath, PcsFileInfo *remote, DbPrepare *pre, int md5Enabled, int isForce, int isCombin, BackupState *st)
+/*还原文件，packed 不为NULL时 remote 为打包上传的文件，从包中按位置下载*/
+static int method_restore_file(const char *localPath, PcsFileInfo *remote, const PackEntry *packed, DbPrepare *pre, int md5Enabled, int isForce, int isCombin, BackupState *st)
 {
 	my_dirent *ent = NULL;
 	int rc;
 	int need_restore = 1;
+	Int64 traceStart;
 	rc = get_file_ent(&ent, localPath);
 	if (rc == 2) { //是目录
 		if (my_dirent_remove(localPath)) {
@@ -2127,7 +4043,8 @@ static int method_restore_file(const char *localPath, PcsFileInfo *remote, DbPre
 	if (md5Enabled) {
 		if (ent && remote->md5) {
 			const char *md5;
-			md5 = md5_file((char *)localPath);
+			char md5_buf[33];
+			md5 = md5_file_r((char *)localPath, md5_buf);
 			if (!md5) {
 				PRINT_FATAL("Can't calculate md5 for %s.", localPath);
 				my_dirent_destroy(ent);
@@ -2170,14 +4087,36 @@ static int method_restore_file(const char *localPath, PcsFileInfo *remote, DbPre
 			printf("Restore %s <- %s\n", localPath, remote->path);
 		}
 		pcs_setopt(pcs, PCS_OPTION_DOWNLOAD_WRITE_FUNCTION_DATA, &ds);
-		res = pcs_download(pcs, remote->path);
+		db_batch_flush();
+		traceStart = pcs_trace_now();
+		metrics_transfer_begin();
+		if (!packed)
+			res = pcs_download(pcs, remote->path);
+		else if (packed->length > 0)
+			res = pcs_download_range(pcs, packed->packPath, packed->offset, packed->length);
+		else
+			res = PCS_OK;
+		metrics_transfer_end(&metrics.downloaded_files, &metrics.downloaded_bytes, res == PCS_OK, ds.size);
+		pcs_trace_span("transfer", "download", traceStart, remote->path);
 		pcs_setopt(pcs, PCS_OPTION_DOWNLOAD_WRITE_FUNCTION_DATA, NULL);
 		fclose(ds.pf);
 		if (res != PCS_OK) {
 			PRINT_FATAL("Can't restore %s <- %s    ", localPath, remote->path);
+			/*删除不完整的文件，否则其修改时间比网盘中的新，重试时会被跳过*/
+			remove(localPath);
 			my_dirent_destroy(ent);
 			return -1;
 		}
+		/*包中的文件以打包时的md5校验，防止索引与包不一致*/
+		if (packed && packed->md5[0]) {
+			char md5_buf[33];
+			if (!md5_file_r((char *)localPath, md5_buf) || pcs_utils_strcmpi(md5_buf, packed->md5)) {
+				PRINT_FATAL("The content of %s is different from the pack %s", localPath, packed->packPath);
+				remove(localPath);
+				my_dirent_destroy(ent);
+				return -1;
+			}
+		}
 		my_dirent_utime(localPath, remote->server_mtime);
 		if (config.log_enabled) {
 			log_write(LOG_NOTICE, __FILE__, __LINE__, "Restore %s <- %s      ", localPath, remote->path);
@@ -2187,9 +4126,12 @@ static int method_restore_file(const char *localPath, PcsFileInfo *remote, DbPre
 			st->totalFiles++;
 		}
 	}
-	else if (st) {
-		st->skipFiles++;
-		st->totalFiles++;
+	else {
+		if (st) {
+			st->skipFiles++;
+			st->totalFiles++;
+		}
+		metrics_add(&metrics.skipped_files, 1);
 	}
 	my_dirent_destroy(ent);
 	return 0;
@@ -2216,44 +4158,188 @@ static char *get_local_path(const char *remotePath, const char *localBasePath, c
 	return rc;
 }
 
-static void mkdirs(const char *dir)
+static void mkdir_one(const char *dir)
 {
-	char *tmp;
-	char *p;
-	tmp = (char *)alloca(strlen(dir) + 1);
-	memset(tmp, '\0', sizeof(tmp));
-	strncpy(tmp, dir, strlen(dir));
-	if (tmp[0] == '/')
-		p = strchr(tmp + 1, '/');
-	else
-		p = strchr(tmp, '/');
-	if (p) {
-		*p = '\0';
 #ifdef WIN32
-		mkdir(tmp);
+	mkdir(dir);
 #else
-		mkdir(tmp, 0700);
+	mkdir(dir, 0700);
 #endif
-		chdir(tmp);
-	}
-	else {
+}
+
+/*逐级创建目录。不能使用 chdir()，其他线程中的任务可能正在使用相对路径*/
+static void mkdirs(const char *dir)
+{
+	char *tmp, *p, c;
+	tmp = (char *)alloca(strlen(dir) + 1);
+	strcpy(tmp, dir);
+	for (p = tmp + 1; *p; p++) {
 #ifdef WIN32
-		mkdir(tmp);
+		if (*p != '/' && *p != '\\') continue;
 #else
-		mkdir(tmp, 0700);
+		if (*p != '/') continue;
 #endif
-		chdir(tmp);
-		return;
+		c = *p;
+		*p = '\0';
+		mkdir_one(tmp);
+		*p = c;
+	}
+	mkdir_one(tmp);
+}
+
+/*读取文件的打包索引，不存在时 entry->path 为NULL*/
+static int db_get_pack_file(PackEntry *entry, const char *path)
+{
+	int rc;
+	sqlite3_stmt *stmt = NULL;
+	memset(entry, 0, sizeof(PackEntry));
+	rc = sqlite3_prepare_v2(db, SQL_PACK_FILE_SELECT, -1, &stmt, NULL);
+	if (rc) {
+		PRINT_FATAL("Can't build the sql %s: %s", SQL_PACK_FILE_SELECT, sqlite3_errmsg(db));
+		return -1;
+	}
+	sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
+	rc = sqlite3_step(stmt);
+	if (rc == SQLITE_ROW)
+		db_fill_pack_entry(entry, stmt);
+	sqlite3_finalize(stmt);
+	if (rc != SQLITE_ROW && rc != SQLITE_DONE) {
+		PRINT_FATAL("Can't execute the statement %s: %s", SQL_PACK_FILE_SELECT, sqlite3_errmsg(db));
+		return -1;
+	}
+	return 0;
+}
+
+/*打包的文件在网盘缓存中没有对应的项，以打包时的信息代替，用于 method_restore_file()*/
+static void pack_entry_to_cache(const PackEntry *entry, PcsFileInfo *info)
+{
+	memset(info, 0, sizeof(PcsFileInfo));
+	info->path = pcs_utils_strdup(entry->path);
+	info->size = entry->length;
+	info->server_ctime = info->server_mtime = (UInt64)entry->mtime;
+	if (entry->md5[0]) info->md5 = pcs_utils_strdup(entry->md5);
+}
+
+/*
+导入 remotePath 目录下网盘中存在，但是本地没有索引的包，例如在另一台电脑上备份的包。
+按文件名的顺序导入，同一个文件在多个包中时以最后上传的包为准，
+上传后没有记录到数据库中的旧包不会覆盖本地已经记录的更新的包。
+*/
+static int method_restore_load_packs(const char *remotePath)
+{
+	int rc, count;
+	sqlite3_stmt *stmt = NULL;
+	PcsSList *slist = NULL, *it, *last = NULL;
+	PackEntry *entries;
+	const char *text;
+	char *packDir, *indexPath;
+
+	rc = sqlite3_prepare_v2(db, SQL_PACK_SELECT_UNKNOWN, -1, &stmt, NULL);
+	if (rc) {
+		PRINT_FATAL("Can't build the sql %s: %s", SQL_PACK_SELECT_UNKNOWN, sqlite3_errmsg(db));
+		return -1;
+	}
+	packDir = pack_dir(remotePath);
+	db_bind_path_range(stmt, 1, packDir);
+	pcs_free(packDir);
+	while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+		it = pcs_slist_create_ex((const char *)sqlite3_column_text(stmt, 0), -1);
+		if (last) last->next = it;
+		else slist = it;
+		last = it;
+	}
+	sqlite3_finalize(stmt);
+	if (rc != SQLITE_DONE) {
+		PRINT_FATAL("Can't execute the statement %s: %s", SQL_PACK_SELECT_UNKNOWN, sqlite3_errmsg(db));
+		pcs_slist_destroy(slist);
+		return -1;
+	}
+	rc = 0;
+	db_begin_batch();
+	for (it = slist; it && !rc; it = it->next) {
+		indexPath = pcs_utils_sprintf("%s.idx", it->string);
+		text = pcs_cat(pcs, indexPath, NULL);
+		pcs_free(indexPath);
+		if (!text) {
+			PRINT_WARNING("Can't read the index of the pack %s: %s", it->string, pcs_strerror(pcs));
+			continue;
+		}
+		count = pack_parse_index(text, &entries);
+		if (count < 0) {
+			PRINT_WARNING("Wrong index of the pack %s", it->string);
+			continue;
+		}
+		rc = db_add_pack(it->string, count ? entries[count - 1].offset + entries[count - 1].length : 0, entries, count, 1);
+		if (!rc)
+			PRINT_NOTICE("Load %d files from the pack %s", count, it->string);
+		while (count > 0) freePackEntry(&entries[--count]);
+		pcs_free(entries);
+	}
+	db_end_batch();
+	pcs_slist_destroy(slist);
+	return rc;
+}
+
+/*
+还原 remotePath 目录下打包上传的文件，每个文件只下载包中对应的部分。
+按包和在包中的位置排序，依次读取每个包。单个文件失败时加入重试队列，继续处理其他文件。
+*/
+static int method_restore_packed(const char *localPath, const char *remotePath, DbPrepare *pre, int md5Enabled, int isForce, int isCombin, BackupState *st)
+{
+	int rc;
+	sqlite3_stmt *stmt;
+	char *dstPath;
+	PackEntry entry = {0};
+	PcsFileInfo ri = {0};
+
+	if (method_restore_load_packs(remotePath))
+		return -1;
+	rc = sqlite3_prepare_v2(db, SQL_PACK_FILE_SELECT_SUB, -1, &stmt, NULL);
+	if (rc) {
+		PRINT_FATAL("Can't build the sql %s: %s", SQL_PACK_FILE_SELECT_SUB, sqlite3_errmsg(db));
+		return -1;
 	}
-	mkdirs(p + 1);
+	db_bind_path_range(stmt, 1, remotePath);
+	while (1) {
+		rc = sqlite3_step(stmt);
+		if (rc == SQLITE_DONE) break;
+		if (rc != SQLITE_ROW) {
+			PRINT_FATAL("Can't execute the statement: %s", sqlite3_errmsg(db));
+			sqlite3_finalize(stmt);
+			return -1;
+		}
+		db_fill_pack_entry(&entry, stmt);
+		pack_entry_to_cache(&entry, &ri);
+		dstPath = get_local_path(entry.path, localPath, remotePath);
+		if (method_restore_file(dstPath, &ri, &entry, pre, md5Enabled, isForce, isCombin, st)) {
+			if (db_add_retry(METHOD_RESTORE, st, dstPath, entry.path, 0)) {
+				pcs_free(dstPath);
+				freeCacheInfo(&ri);
+				freePackEntry(&entry);
+				sqlite3_finalize(stmt);
+				return -1;
+			}
+		}
+		else {
+			st->continuousFails = 0;
+		}
+		pcs_free(dstPath);
+		freeCacheInfo(&ri);
+		freePackEntry(&entry);
+		if (st && config.printf_enabled) {
+			printf("Process: %d        \r", st->totalDir + st->totalFiles);
+			fflush(stdout);
+		}
+	}
+	sqlite3_finalize(stmt);
+	return 0;
 }
 
+/*还原目录。单个文件失败时加入重试队列，继续处理其他文件。st 不能为NULL*/
 static int method_restore_folder(const char *localPath, const char *remotePath, DbPrepare *pre, int md5Enabled, int isForce, int isCombin, BackupState *st)
 {
 	int rc;
 	sqlite3_stmt *stmt;
-	int sz;
-	char *val;
 	char *dstPath;
 	PcsFileInfo ri = {0};
 	rc = sqlite3_prepare_v2(db, SQL_CACHE_SELECT_SUB_DIR_FIRST, -1, &stmt, NULL);
@@ -2262,18 +4348,7 @@ static int method_restore_folder(const char *localPath, const char *remotePath,
 		return -1;
 	}
 	mkdirs(localPath);
-	sz = strlen(remotePath);
-	val = (char *)pcs_malloc(sz + 3);
-	memcpy(val, remotePath, sz + 1);
-	if (val[sz - 1] != '/') {
-		val[sz] = '/'; val[sz + 1] = '%'; val[sz + 2] = '\0';
-		sz += 2;
-	}
-	else {
-		val[sz] = '%'; val[sz + 1] = '\0';
-		sz++;
-	}
-	rc = sqlite3_bind_text(stmt, 1, val, sz, SQLITE_STATIC);
+	rc = db_bind_path_range(stmt, 1, remotePath);
 	if (rc) {
 		PRINT_FATAL("Can't bind the text into the statement: %s", sqlite3_errmsg(db));
 		sqlite3_finalize(stmt);
@@ -2284,12 +4359,14 @@ static int method_restore_folder(const char *localPath, const char *remotePath,
 		if (rc == SQLITE_DONE) break;
 		if (rc != SQLITE_ROW) {
 			PRINT_FATAL("Can't execute the statement: %s", sqlite3_errmsg(db));
-			pcs_free(val);
 			sqlite3_finalize(stmt);
 			return -1;
 		}
 		freeCacheInfo(&ri);
 		db_fill_cache(&ri, stmt);
+		/*包和包所在的目录不还原，其中的文件由 method_restore_packed() 还原*/
+		if (is_pack_path(ri.path))
+			continue;
 		dstPath = get_local_path(ri.path, localPath, remotePath);
 		if (ri.isdir) {
 			//if (method_restore_folder(dstPath, ri.path, pre, md5Enabled, st)) {
@@ -2308,15 +4385,18 @@ static int method_restore_folder(const char *localPath, const char *remotePath,
 			mkdir(dstPath, 0700);
 #endif
 		}
-		else {
-			if (method_restore_file(dstPath, &ri, pre, md5Enabled, isForce, isCombin, st)) {
-				pcs_free(val);
+		else if (method_restore_file(dstPath, &ri, NULL, pre, md5Enabled, isForce, isCombin, st)) {
+			/*加入重试队列，继续处理其他文件*/
+			if (db_add_retry(METHOD_RESTORE, st, dstPath, ri.path, 0)) {
 				pcs_free(dstPath);
 				freeCacheInfo(&ri);
 				sqlite3_finalize(stmt);
 				return -1;
 			}
 		}
+		else {
+			st->continuousFails = 0;
+		}
 		pcs_free(dstPath);
 		freeCacheInfo(&ri);
 		if (st && config.printf_enabled) {
@@ -2324,9 +4404,9 @@ static int method_restore_folder(const char *localPath, const char *remotePath,
 			fflush(stdout);
 		}
 	}
-	pcs_free(val);
+	freeCacheInfo(&ri);
 	sqlite3_finalize(stmt);
-	return 0;
+	return method_restore_packed(localPath, remotePath, pre, md5Enabled, isForce, isCombin, st);
 }
 
 static int method_restore_remove_untrack(my_dirent *local, const char *remotePath, DbPrepare *pre, BackupState *st)
@@ -2339,6 +4419,16 @@ static int method_restore_remove_untrack(my_dirent *local, const char *remotePat
 	if (db_get_cache(&cache, pre, remotePath)) {
 		return -1;
 	}
+	if (!cache.fs_id && !local->is_dir) {
+		/*打包上传的文件不在网盘缓存中*/
+		PackEntry packed;
+		if (db_get_pack_file(&packed, remotePath))
+			return -1;
+		if (packed.path) {
+			freePackEntry(&packed);
+			return 0;
+		}
+	}
 	if (!cache.fs_id) {
 		if (my_dirent_remove(local->path)) {
 			PRINT_FATAL("Can't remove the local dir: %s", local->path);
@@ -2383,9 +4473,14 @@ static int method_restore(const char *localPath, const char *remotePath, int md5
 	DbPrepare pre = {0};
 	char *action = NULL, *updateAction = NULL;
 	PcsFileInfo rf = {0};
+	PackEntry packed = {0};
 	BackupState st = {0};
+	time_t startTime;
 
 	PRINT_NOTICE("Restore - Start");
+	time(&startTime);
+	st.taskLocalPath = localPath;
+	st.taskRemotePath = remotePath;
 	if (pcs_islogin(pcs) != PCS_LOGIN) {
 		PRINT_FATAL("Not login or session time out");
 		return -1;
@@ -2460,7 +4555,8 @@ static int method_restore(const char *localPath, const char *remotePath, int md5
 		PRINT_NOTICE("Restore - End");
 		return -1;
 	}
-	if (db_get_cache(&rf, &pre, remotePath) || !rf.fs_id) {
+	if (db_get_cache(&rf, &pre, remotePath)
+		|| (!rf.fs_id && (db_get_pack_file(&packed, remotePath) || !packed.path))) {
 		PRINT_FATAL("The remote path not exist: %s", remotePath);
 		db_set_action(action, ACTION_STATUS_ERROR, 0);
 		pcs_free(action);
@@ -2481,15 +4577,22 @@ static int method_restore(const char *localPath, const char *remotePath, int md5
 		}
 	}
 	else { //类型为文件
-		if (method_restore_file(localPath, &rf, &pre, md5Enabled, isForce, isCombin, &st)) {
+		if (packed.path) {
+			freeCacheInfo(&rf);
+			pack_entry_to_cache(&packed, &rf);
+		}
+		if (method_restore_file(localPath, &rf, packed.path ? &packed : NULL, &pre, md5Enabled, isForce, isCombin, &st)
+			&& db_add_retry(METHOD_RESTORE, &st, localPath, remotePath, 0)) {
 			pcs_setopt(pcs, PCS_OPTION_DOWNLOAD_WRITE_FUNCTION, NULL);
 			db_set_action(action, ACTION_STATUS_ERROR, 0);
 			pcs_free(action);
 			db_prepare_destroy(&pre);
 			freeCacheInfo(&rf);
+			freePackEntry(&packed);
 			PRINT_NOTICE("Restore - End");
 			return -1;
 		}
+		freePackEntry(&packed);
 	}
 	pcs_setopt(pcs, PCS_OPTION_DOWNLOAD_WRITE_FUNCTION, NULL);
 	freeCacheInfo(&rf);
@@ -2510,10 +4613,14 @@ static int method_restore(const char *localPath, const char *remotePath, int md5
 			my_dirent_destroy(local);
 		}
 	}
+	db_clear_retry(METHOD_RESTORE, localPath, remotePath, startTime);
 	db_set_action(action, ACTION_STATUS_FINISHED, 0);
 	pcs_free(action);
 	db_prepare_destroy(&pre);
 	PRINT_NOTICE("Restore File: %d, Skip File: %d, Remove File: %d, Total File: %d", st.backupFiles, st.skipFiles, st.removeFiles, st.totalFiles);
+	if (st.failFiles) {
+		PRINT_WARNING("Failed File: %d. They will be retried later.", st.failFiles);
+	}
 	//PRINT_NOTICE("Restore Dir : %d, Skip Dirv: %d, Remove Dir : %d, Total Dir : %d", st.backupDir, st.skipDir, st.removeDir, st.totalDir);
 	PRINT_NOTICE("Restore - End");
 	return 0;
@@ -2529,6 +4636,140 @@ static int method_combin(const char *localPath, const char *remotePath, int md5E
 	return rc;
 }
 
+/*重试一项，成功后从重试队列中移除，失败时增加失败次数*/
+static int method_retry_item(int method, RetryItem *item, DbPrepare *pre, int md5Enabled, int isCombin, BackupState *st)
+{
+	int rc, type;
+	my_dirent *ent = NULL;
+	PcsFileInfo ri = {0};
+	PackEntry packed = {0};
+
+	if (method == METHOD_BACKUP) {
+		type = get_file_ent(&ent, item->localPath);
+		if (type == 0) {
+			rc = 0; /*本地已经不存在，下次完整执行任务时再处理*/
+		}
+		else if (type == 2) {
+			rc = method_backup_folder(item->localPath, item->remotePath, pre, md5Enabled, 0, isCombin, st);
+			db_clear_local();
+		}
+		else {
+			rc = method_backup_file(ent, item->remotePath, pre, md5Enabled, 0, isCombin, st);
+		}
+		my_dirent_destroy(ent);
+	}
+	else {
+		if (db_get_cache(&ri, pre, item->remotePath))
+			return -1;
+		if (!ri.fs_id) {
+			/*打包上传的文件*/
+			if (db_get_pack_file(&packed, item->remotePath))
+				return -1;
+			if (packed.path)
+				pack_entry_to_cache(&packed, &ri);
+		}
+		if ((!ri.fs_id && !packed.path) || ri.isdir)
+			rc = 0; /*网盘中已经不存在*/
+		else
+			rc = method_restore_file(item->localPath, &ri, packed.path ? &packed : NULL, pre, md5Enabled, 0, isCombin, st);
+		freeCacheInfo(&ri);
+		freePackEntry(&packed);
+	}
+	if (rc) {
+		if (item->attempts + 1 >= RETRY_MAX_ATTEMPTS) {
+			PRINT_WARNING("Give up retrying %s after %d attempts", item->localPath, item->attempts + 1);
+		}
+		return db_add_retry(method, st, item->localPath, item->remotePath, item->isdir);
+	}
+	st->continuousFails = 0;
+	return db_remove_retry(method, item->localPath, item->remotePath);
+}
+
+/*
+只处理任务重试队列中已经到期的项，不重新扫描和比较整个目录。
+method 为 METHOD_BACKUP 或 METHOD_RESTORE。
+*/
+static int method_retry(int method, const char *localPath, const char *remotePath, int md5Enabled, int isCombin)
+{
+	ActionInfo ai = {0};
+	DbPrepare pre = {0};
+	RetryItem *list = NULL, *item;
+	BackupState st = {0};
+	char *action;
+	int rc = 0;
+
+	if (db_get_retry_items(method, localPath, remotePath, &list))
+		return -1;
+	if (!list)
+		return 0;
+	PRINT_NOTICE("Retry - Start");
+	if (pcs_islogin(pcs) != PCS_LOGIN) {
+		PRINT_FATAL("Not login or session time out");
+		freeRetryItems(list);
+		return -1;
+	}
+	PRINT_NOTICE("Local Path: %s", localPath);
+	PRINT_NOTICE("Server Path: %s", remotePath);
+	st.taskLocalPath = localPath;
+	st.taskRemotePath = remotePath;
+
+	action = (char *)pcs_malloc(strlen(localPath) + strlen(remotePath) + 16);
+	if (method == METHOD_BACKUP) {
+		strcpy(action, "BACKUP: "); strcat(action, localPath);
+		strcat(action, " -> "); strcat(action, remotePath);
+	}
+	else {
+		strcpy(action, "RESTORE: "); strcat(action, localPath);
+		strcat(action, " <- "); strcat(action, remotePath);
+	}
+	if (db_get_action(&ai, action)) {
+		pcs_free(action);
+		freeRetryItems(list);
+		PRINT_NOTICE("Retry - End");
+		return -1;
+	}
+	if (ai.status == ACTION_STATUS_RUNNING) {
+		PRINT_FATAL("There have another thread running, which is start by %s at %s", ai.create_app, format_time(ai.start_time));
+		pcs_free(action);
+		freeActionInfo(&ai);
+		freeRetryItems(list);
+		PRINT_NOTICE("Retry - End");
+		return -1;
+	}
+	freeActionInfo(&ai);
+	/*重试期间标记为RUNNING，避免同一任务的备份或还原同时执行*/
+	if (db_set_action(action, ACTION_STATUS_RUNNING, 1)) {
+		pcs_free(action);
+		freeRetryItems(list);
+		PRINT_NOTICE("Retry - End");
+		return -1;
+	}
+
+	if (db_prepare(&pre, SQL_CACHE_INSERT, SQL_CACHE_SELECT, SQL_CACHE_DELETE, SQL_CACHE_UPDATE, SQL_CACHE_SET_FLAG, NULL)) {
+		db_set_action(action, ACTION_STATUS_ERROR, 0);
+		pcs_free(action);
+		freeRetryItems(list);
+		PRINT_NOTICE("Retry - End");
+		return -1;
+	}
+	if (method == METHOD_RESTORE)
+		pcs_setopt(pcs, PCS_OPTION_DOWNLOAD_WRITE_FUNCTION, &method_restore_write);
+	db_begin_batch();
+	for (item = list; item && !rc; item = item->next) {
+		rc = method_retry_item(method, item, &pre, md5Enabled, isCombin, &st);
+	}
+	db_end_batch();
+	if (method == METHOD_RESTORE)
+		pcs_setopt(pcs, PCS_OPTION_DOWNLOAD_WRITE_FUNCTION, NULL);
+	db_prepare_destroy(&pre);
+	freeRetryItems(list);
+	db_set_action(action, rc ? ACTION_STATUS_ERROR : ACTION_STATUS_FINISHED, 0);
+	pcs_free(action);
+	PRINT_NOTICE("Backup File: %d, Skip File: %d, Failed File: %d, Failed Dir: %d", st.backupFiles, st.skipFiles, st.failFiles, st.failDir);
+	PRINT_NOTICE("Retry - End");
+	return rc;
+}
+
 static void addCompareItem(CompareItem *list, char op, char type, char position, const char *path)
 {
 	CompareItem *item;
@@ -2655,70 +4896,82 @@ static void printCompareList(CompareItem *list)
 	printf(" Total: %d\n", elem_count);
 }
 
-/*根据remote信息判断本地文件是否需要更新，或者本地文件是否需要上传*/
-static int method_compare_file(const char *localPath, PcsFileInfo *remote, DbPrepare *pre, int md5Enabled, CompareItem *list, int *elem_count)
+/*
+根据remote信息判断本地文件是否需要更新，或者本地文件是否需要上传。
+localType 为本地的类型：0 - 不存在，1 - 文件，2 - 目录，与 get_file_ent() 的返回值相同
+*/
+static int method_compare_file_with(const char *localPath, int localType, time_t localMtime, PcsFileInfo *remote, int md5Enabled, CompareItem *list, int *elem_count)
 {
-	my_dirent *ent = NULL;
-	int rc;
-	rc = get_file_ent(&ent, localPath);
-	if (rc == 2) { //是目录
+	if (localType == 2) { //是目录
 		addCompareItem(list, '-', 'D', 'L', localPath); /*删除本地目录*/
-		my_dirent_destroy(ent);
-		ent = NULL;
 	}
-	if (ent == NULL) {
+	if (localType != 1) {
 		addCompareItem(list, '+', 'F', 'L', localPath); /*创建本地新文件*/
 		return 0;
 	}
 	if (md5Enabled) {
 		const char *md5;
+		char md5_buf[33];
 		if (!remote->md5 || !remote->md5[0]) {
 			PRINT_FATAL("The remote file have no md5: %s.", remote->path);
-			my_dirent_destroy(ent);
 			return -1;
 		}
-		md5 = md5_file((char *)ent->path);
+		md5 = md5_file_r((char *)localPath, md5_buf);
 		if (!md5) {
-			PRINT_FATAL("Can't calculate md5 for %s.", ent->path);
-			my_dirent_destroy(ent);
+			PRINT_FATAL("Can't calculate md5 for %s.", localPath);
 			return -1;
 		}
 		if (pcs_utils_strcmpi(md5, remote->md5)) {
-			if (ent->mtime == ((time_t)remote->server_mtime)) {
+			if (localMtime == ((time_t)remote->server_mtime)) {
 				PRINT_FATAL("Unable to determine which file is newer: "
 					"The local file %s and remote file %s have different md5 (%s : %s), "
 					"they also have same last modify time %s.",
-					ent->path, remote->path, md5, remote->md5, format_time(ent->mtime));
-				my_dirent_destroy(ent);
+					localPath, remote->path, md5, remote->md5, format_time(localMtime));
 				return -1;
 			}
-			if (ent->mtime < ((time_t)remote->server_mtime)) {
+			if (localMtime < ((time_t)remote->server_mtime)) {
 				addCompareItem(list, OP_ARROW_DOWN, 'F', 'R', remote->path); /*下载网盘文件*/
 			}
-			else if (ent->mtime >((time_t)remote->server_mtime)) {
+			else if (localMtime >((time_t)remote->server_mtime)) {
 				addCompareItem(list, OP_ARROW_UP, 'F', 'L', localPath); /*上传本地文件*/
 			}
 		}
 	}
 	else {
-		if (ent->mtime < ((time_t)remote->server_mtime)) {
+		if (localMtime < ((time_t)remote->server_mtime)) {
 			addCompareItem(list, OP_ARROW_DOWN, 'F', 'R', remote->path); /*下载网盘文件*/
 		}
-		else if (ent->mtime > ((time_t)remote->server_mtime)) {
+		else if (localMtime > ((time_t)remote->server_mtime)) {
 			addCompareItem(list, OP_ARROW_UP, 'F', 'L', localPath); /*上传本地文件*/
 		}
 	}
-	my_dirent_destroy(ent);
 	if (elem_count) (*elem_count)++;
 	return 0;
 }
 
+static int method_compare_file(const char *localPath, PcsFileInfo *remote, DbPrepare *pre, int md5Enabled, CompareItem *list, int *elem_count)
+{
+	my_dirent *ent = NULL;
+	int rc;
+	rc = get_file_ent(&ent, localPath);
+	rc = method_compare_file_with(localPath, rc, ent ? ent->mtime : 0, remote, md5Enabled, list, elem_count);
+	my_dirent_destroy(ent);
+	return rc;
+}
+
+/*从 SQL_LOCAL_SELECT_COMPARE 的结果中读取本地的类型*/
+static int db_local_type(sqlite3_stmt *stmt)
+{
+	if (sqlite3_column_type(stmt, 18) == SQLITE_NULL)
+		return 0;
+	return sqlite3_column_int(stmt, 18) ? 2 : 1;
+}
+
+/*比较目录，需先调用 db_load_local() 把本地目录树扫描到临时表中*/
 static int method_compare_folder(const char *localPath, const char *remotePath, DbPrepare *pre, int md5Enabled, CompareItem *list, int *elem_count)
 {
 	int rc;
 	sqlite3_stmt *stmt;
-	int sz;
-	char *val;
 	char *dstPath;
 	PcsFileInfo ri = { 0 };
 	rc = get_file_ent(NULL, localPath);
@@ -2735,23 +4988,12 @@ static int method_compare_folder(const char *localPath, const char *remotePath,
 		break;
 	}
 	if (elem_count) (*elem_count)++;
-	rc = sqlite3_prepare_v2(db, SQL_CACHE_SELECT_SUB, -1, &stmt, NULL);
+	rc = sqlite3_prepare_v2(db, SQL_LOCAL_SELECT_COMPARE, -1, &stmt, NULL);
 	if (rc) {
-		PRINT_FATAL("Can't build the sql %s: %s", SQL_CACHE_SELECT_SUB, sqlite3_errmsg(db));
+		PRINT_FATAL("Can't build the sql %s: %s", SQL_LOCAL_SELECT_COMPARE, sqlite3_errmsg(db));
 		return -1;
 	}
-	sz = strlen(remotePath);
-	val = (char *)pcs_malloc(sz + 3);
-	memcpy(val, remotePath, sz + 1);
-	if (val[sz - 1] != '/') {
-		val[sz] = '/'; val[sz + 1] = '%'; val[sz + 2] = '\0';
-		sz += 2;
-	}
-	else {
-		val[sz] = '%'; val[sz + 1] = '\0';
-		sz++;
-	}
-	rc = sqlite3_bind_text(stmt, 1, val, sz, SQLITE_STATIC);
+	rc = db_bind_path_range(stmt, 1, remotePath);
 	if (rc) {
 		PRINT_FATAL("Can't bind the text into the statement: %s", sqlite3_errmsg(db));
 		sqlite3_finalize(stmt);
@@ -2762,7 +5004,6 @@ static int method_compare_folder(const char *localPath, const char *remotePath,
 		if (rc == SQLITE_DONE) break;
 		if (rc != SQLITE_ROW) {
 			PRINT_FATAL("Can't execute the statement: %s", sqlite3_errmsg(db));
-			pcs_free(val);
 			sqlite3_finalize(stmt);
 			return -1;
 		}
@@ -2770,22 +5011,15 @@ static int method_compare_folder(const char *localPath, const char *remotePath,
 		db_fill_cache(&ri, stmt);
 		dstPath = get_local_path(ri.path, localPath, remotePath);
 		if (ri.isdir) {
-			//if (method_compare_folder(dstPath, ri.path, pre, md5Enabled, list, elem_count)) {
-			//	pcs_free(val);
-			//	pcs_free(dstPath);
-			//	freeCacheInfo(&ri);
-			//	sqlite3_finalize(stmt);
-			//	return -1;
-			//}
-			rc = get_file_ent(NULL, localPath);
-			switch (rc){
+			/*因为其子项已经全部查询出来了，因此无需递归处理目录*/
+			switch (db_local_type(stmt)){
 			case 1: //本地是文件
-				addCompareItem(list, '-', 'F', 'L', localPath); /*删除本地文件*/
+				addCompareItem(list, '-', 'F', 'L', dstPath); /*删除本地文件*/
 				break;
 			case 2: //本地是目录
 				break;
 			case 0: //本地不存在
-				addCompareItem(list, '+', 'D', 'L', localPath); /*创建本地新目录*/
+				addCompareItem(list, '+', 'D', 'L', dstPath); /*创建本地新目录*/
 				break;
 			default:
 				break;
@@ -2793,8 +5027,7 @@ static int method_compare_folder(const char *localPath, const char *remotePath,
 			if (elem_count) (*elem_count)++; 
 		}
 		else {
-			if (method_compare_file(dstPath, &ri, pre, md5Enabled, list, elem_count)) {
-				pcs_free(val);
+			if (method_compare_file_with(dstPath, db_local_type(stmt), (time_t)sqlite3_column_int64(stmt, 19), &ri, md5Enabled, list, elem_count)) {
 				pcs_free(dstPath);
 				freeCacheInfo(&ri);
 				sqlite3_finalize(stmt);
@@ -2808,61 +5041,40 @@ static int method_compare_folder(const char *localPath, const char *remotePath,
 			fflush(stdout);
 		}
 	}
-	pcs_free(val);
 	sqlite3_finalize(stmt);
 	return 0;
 }
 
-/*寻找到所有本地存在，但是网盘不存在的文件，即找到需要添加到网盘的本地文件*/
-static int method_compare_untrack(const char *localPath, const char *remotePath, DbPrepare *pre, CompareItem *list, int *elem_count)
+/*
+寻找到所有本地存在，但是网盘不存在的文件，即找到需要添加到网盘的本地文件。
+pre->stmts[5] 需为 SQL_LOCAL_SELECT_NEW，需先调用 db_load_local() 把本地目录树扫描到临时表中。
+*/
+static int method_compare_untrack(DbPrepare *pre, CompareItem *list, int *elem_count)
 {
 	int rc;
-	my_dirent *ents = NULL,
-		*ent = NULL;
-	PcsFileInfo rf = { 0 };
-	char *dstPath;
+	sqlite3_stmt *stmt = pre->stmts[5];
 
-	rc = get_file_ent(NULL, localPath);
-	if (rc == 2) { //目录
-		if (db_get_cache(&rf, pre, remotePath)) {
+	while (1) {
+		rc = sqlite3_step(stmt);
+		if (rc == SQLITE_DONE) break;
+		if (rc != SQLITE_ROW) {
+			PRINT_FATAL("Can't execute the statement: %s", sqlite3_errmsg(db));
+			sqlite3_reset(stmt);
 			return -1;
 		}
-		if (!rf.fs_id) {
-			addCompareItem(list, '+', 'D', 'R', remotePath); /*创建新网盘目录*/
-		}
-		freeCacheInfo(&rf);
-		ents = list_dir(localPath, 0);
-		if (ents) {
-			ent = ents;
-			while (ent) {
-				dstPath = get_remote_path(ent->path, localPath, remotePath);
-				if (method_compare_untrack(ent->path, dstPath, pre, list, elem_count)) {
-					pcs_free(dstPath);
-					my_dirent_destroy(ents);
-					return -1;
-				}
-				ent = ent->next;
-				pcs_free(dstPath);
+		if (sqlite3_column_int(stmt, 1))
+			addCompareItem(list, '+', 'D', 'R', (const char *)sqlite3_column_text(stmt, 0)); /*创建新网盘目录*/
+		else
+			addCompareItem(list, '+', 'F', 'R', (const char *)sqlite3_column_text(stmt, 0)); /*创建新网盘文件*/
+		if (elem_count) {
+			(*elem_count)++;
+			if (config.printf_enabled) {
+				printf("Process: %d        \r", *elem_count);
+				fflush(stdout);
 			}
-			my_dirent_destroy(ents);
-		}
-	}
-	else if (rc == 1) { //本地是文件
-		if (db_get_cache(&rf, pre, remotePath)) {
-			return -1;
-		}
-		if (!rf.fs_id) {
-			addCompareItem(list, '+', 'F', 'R', remotePath); /*创建新网盘文件*/
-		}
-		freeCacheInfo(&rf);
-	}
-	if (elem_count) {
-		(*elem_count)++;
-		if (config.printf_enabled) {
-			printf("Process: %d        \r", *elem_count);
-			fflush(stdout);
 		}
 	}
+	sqlite3_reset(stmt);
 	return 0;
 }
 
@@ -2946,7 +5158,7 @@ static int method_compare(const char *localPath, const char *remotePath, int md5
 	freeActionInfo(&ai);
 	//检查本地缓存是否更新 - 结束
 
-	if (db_prepare(&pre, SQL_CACHE_INSERT, SQL_CACHE_SELECT, SQL_CACHE_DELETE, SQL_CACHE_UPDATE, SQL_CACHE_SET_FLAG, SQL_CACHE_SELECT_SUB, NULL)) {
+	if (db_prepare(&pre, SQL_CACHE_INSERT, SQL_CACHE_SELECT, SQL_CACHE_DELETE, SQL_CACHE_UPDATE, SQL_CACHE_SET_FLAG, SQL_LOCAL_SELECT_NEW, NULL)) {
 		db_set_action(action, ACTION_STATUS_ERROR, 0);
 		pcs_free(action);
 		PRINT_NOTICE("Compare - End");
@@ -2960,6 +5172,20 @@ static int method_compare(const char *localPath, const char *remotePath, int md5
 		PRINT_NOTICE("Compare - End");
 		return -1;
 	}
+	//扫描本地目录树，之后的比较都与临时表做集合运算
+	if (get_file_ent(NULL, localPath) == 2) {
+		if (db_load_local(localPath, remotePath, NULL, NULL)) {
+			db_set_action(action, ACTION_STATUS_ERROR, 0);
+			pcs_free(action);
+			db_prepare_destroy(&pre);
+			freeCacheInfo(&rf);
+			PRINT_NOTICE("Compare - End");
+			return -1;
+		}
+	}
+	else {
+		db_clear_local();
+	}
 	printCompareSample();
 	if (rf.isdir) { //类型为目录
 		if (method_compare_folder(localPath, remotePath, &pre, md5Enabled, &list, &elem_count)) {
@@ -2985,7 +5211,7 @@ static int method_compare(const char *localPath, const char *remotePath, int md5
 	}
 	freeCacheInfo(&rf);
 	//寻找本地文件系统中，需要添加到服务器的文件或目录
-	if (method_compare_untrack(localPath, remotePath, &pre, &list, &elem_count)) {
+	if (method_compare_untrack(&pre, &list, &elem_count)) {
 		//PRINT_FATAL("Can't remove untrack files: %s", localPath);
 		db_set_action(action, ACTION_STATUS_ERROR, 0);
 		pcs_free(action);
@@ -2994,6 +5220,7 @@ static int method_compare(const char *localPath, const char *remotePath, int md5
 		PRINT_NOTICE("Compare - End");
 		return -1;
 	}
+	db_clear_local();
 	db_set_action(action, ACTION_STATUS_FINISHED, 0);
 	pcs_free(action);
 	db_prepare_destroy(&pre);
@@ -3007,17 +5234,17 @@ static int method_compare(const char *localPath, const char *remotePath, int md5
 static void print_datetime(const char *timeDesc, const char *dateDesc)
 {
 	time_t now, date;
-	struct tm* ptm;
+	struct tm tm;
 	time(&now);
 	if (timeDesc) {
 		printf(timeDesc, format_time(now));
 	}
 	if (dateDesc) {
-		ptm = localtime(&now);
-		ptm->tm_hour = 0;
-		ptm->tm_min = 0;
-		ptm->tm_sec = 0;
-		date = mktime(ptm);
+		D_LOCALTIME(&now, &tm);
+		tm.tm_hour = 0;
+		tm.tm_min = 0;
+		tm.tm_sec = 0;
+		date = mktime(&tm);
 		printf(dateDesc, format_time(date));
 	}
 }
@@ -3137,13 +5364,14 @@ static int method_list_op()
 static int method_md5(const char *path)
 {
 	const char *md5;
+	char md5_buf[33];
 	int rc;
 	rc = get_file_ent(NULL, path);
 	if (rc == 1) {
-		md5 = md5_file((char *)path);
+		md5 = md5_file_r((char *)path, md5_buf);
 		printf("File: %s\nMD5: %s\n", path, md5);
 	}
-	md5 = md5_string(path);
+	md5 = md5_string_r(path, md5_buf);
 	printf("String: %s\nMD5: %s\n", path, md5);
 	return 0;
 }
@@ -3311,59 +5539,726 @@ static int task(int itemIndex)
 		}
 		break;
 	case METHOD_BACKUP:
+		/*失败的文件已经加入重试队列，不再重新执行整个任务*/
 		rc = method_backup(config.items[itemIndex].localPath, config.items[itemIndex].remotePath, config.items[itemIndex].md5, 0, 0);
-		if (rc) {
-			PRINT_NOTICE("Retry");
-			rc = method_backup(config.items[itemIndex].localPath, config.items[itemIndex].remotePath, config.items[itemIndex].md5, 0, 0);
-		}
 		break;
 	case METHOD_RESTORE:
 		rc = method_restore(config.items[itemIndex].localPath, config.items[itemIndex].remotePath, config.items[itemIndex].md5, 0, 0);
-		if (rc) {
-			PRINT_NOTICE("Retry");
-			rc = method_restore(config.items[itemIndex].localPath, config.items[itemIndex].remotePath, config.items[itemIndex].md5, 0, 0);
-		}
 		break;
 	case METHOD_RESET:
 		rc = method_reset();
 		break;
 	case METHOD_COMBIN:
 		rc = method_combin(config.items[itemIndex].localPath, config.items[itemIndex].remotePath, config.items[itemIndex].md5);
-		if (rc) {
-			PRINT_NOTICE("Retry");
-			rc = method_combin(config.items[itemIndex].localPath, config.items[itemIndex].remotePath, config.items[itemIndex].md5);
-		}
 		break;
 	}
 	return rc;
 }
 
+/*只处理任务的重试队列*/
+static int task_retry(int itemIndex)
+{
+	BackupItem *item = &config.items[itemIndex];
+	int rc = 0;
+	switch (item->method)
+	{
+	case METHOD_BACKUP:
+		rc = method_retry(METHOD_BACKUP, item->localPath, item->remotePath, item->md5, 0);
+		break;
+	case METHOD_RESTORE:
+		rc = method_retry(METHOD_RESTORE, item->localPath, item->remotePath, item->md5, 0);
+		break;
+	case METHOD_COMBIN:
+		rc = method_retry(METHOD_BACKUP, item->localPath, item->remotePath, item->md5, 1);
+		if (!rc)
+			rc = method_retry(METHOD_RESTORE, item->localPath, item->remotePath, item->md5, 1);
+		break;
+	}
+	return rc;
+}
+
+/*
+调度器。
+任务按 next_run_time 组织为最小堆，主线程等待到最早的任务到期后，把任务分派给空闲的工作线程。
+最多同时执行 config.concurrency 个任务。本地路径或网盘路径有重叠的任务不会同时执行，
+到期后等待正在执行的任务完成；不同进程之间的互斥仍由 pcs_action 中的 RUNNING 状态保证。
+每个工作线程使用独立的数据库连接和由 pcs_clone() 复制的Pcs对象。
+WIN32下不创建工作线程，任务在主线程中依次执行。
+*/
+typedef struct SchedWorker {
+	Pcs		pcs;
+	int		item; /*正在执行的任务，-1表示空闲*/
+	int		alive;
+#ifndef WIN32
+	pthread_t tid;
+#endif
+} SchedWorker;
+
+static int *sched_heap = NULL; /*config.items 的下标组成的最小堆*/
+static int sched_heap_size = 0;
+static SchedWorker *sched_workers = NULL;
+static int sched_worker_count = 0;
+static int sched_running = 0;
+
+#ifdef WIN32
+#  define SCHED_LOCK()
+#  define SCHED_UNLOCK()
+#else
+static pthread_mutex_t sched_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sched_cond = PTHREAD_COND_INITIALIZER; /*有任务需要执行或者有任务完成时通知*/
+#  define SCHED_LOCK()		pthread_mutex_lock(&sched_mutex)
+#  define SCHED_UNLOCK()	pthread_mutex_unlock(&sched_mutex)
+#endif
+
+#define SCHED_DUE(i)		sched_item_due(sched_heap[i])
+
+/*任务下次需要执行的时间：下次完整执行的时间和最早的重试时间中较早的一个*/
+static time_t sched_item_due(int i)
+{
+	BackupItem *item = &config.items[i];
+	if (!item->enable)
+		return item->next_retry_time;
+	if (item->next_retry_time && item->next_retry_time < item->next_run_time)
+		return item->next_retry_time;
+	return item->next_run_time;
+}
+
+static void sched_heap_push(int item)
+{
+	int i = sched_heap_size++, parent, tmp;
+	sched_heap[i] = item;
+	while (i > 0) {
+		parent = (i - 1) / 2;
+		if (SCHED_DUE(parent) <= SCHED_DUE(i)) break;
+		tmp = sched_heap[parent]; sched_heap[parent] = sched_heap[i]; sched_heap[i] = tmp;
+		i = parent;
+	}
+}
+
+static int sched_heap_pop()
+{
+	int rc = sched_heap[0], i = 0, child, tmp;
+	sched_heap[0] = sched_heap[--sched_heap_size];
+	while ((child = i * 2 + 1) < sched_heap_size) {
+		if (child + 1 < sched_heap_size && SCHED_DUE(child + 1) < SCHED_DUE(child)) child++;
+		if (SCHED_DUE(i) <= SCHED_DUE(child)) break;
+		tmp = sched_heap[child]; sched_heap[child] = sched_heap[i]; sched_heap[i] = tmp;
+		i = child;
+	}
+	return rc;
+}
+
+/*任务 i 是否与正在执行的任务冲突。需持有锁*/
+static int sched_conflict(int i)
+{
+	int j;
+	for (j = 0; j < config.itemCount; j++) {
+		if (!config.items[j].running) continue;
+		if (config.items[i].method == METHOD_RESET || config.items[j].method == METHOD_RESET)
+			return 1;
+		if (path_overlap(config.items[i].localPath, config.items[j].localPath)
+			|| path_overlap(config.items[i].remotePath, config.items[j].remotePath))
+			return 1;
+	}
+	return 0;
+}
+
+/*
+执行任务 i，并计算下次执行时间。执行期间任务不在堆中，调度线程不会访问 config.items[i]；
+但 metrics_render() 会读取其状态，所以写入时需持有锁。
+还没有到完整执行的时间时，只处理重试队列。
+*/
+static void sched_run(int i)
+{
+	BackupItem *item = &config.items[i];
+	int rc, enable;
+	time_t now, end, retryTime, nextRunTime;
+	time(&now);
+	if (!item->enable || now < item->next_run_time) {
+		task_retry(i);
+		retryTime = db_get_retry_time(item->localPath, item->remotePath);
+		SCHED_LOCK();
+		item->next_retry_time = retryTime;
+		SCHED_UNLOCK();
+		return;
+	}
+	db_update_task_status(i + 1, 1, 0, now);
+	rc = task(i);
+	time(&end);
+	SCHED_LOCK();
+	item->last_run_time = now;
+	if (item->interval)
+		item->next_run_time += item->interval;
+	else
+		item->enable = 0;
+	item->last_end_time = end;
+	item->last_duration = (int)(end - now);
+	item->last_result = rc;
+	enable = item->enable;
+	nextRunTime = item->next_run_time;
+	SCHED_UNLOCK();
+	db_update_task_status2(i + 1, enable, now, nextRunTime, rc ? 3 : 2, rc ? 3 : 2, now, end);
+	retryTime = db_get_retry_time(item->localPath, item->remotePath);
+	SCHED_LOCK();
+	item->next_retry_time = retryTime;
+	SCHED_UNLOCK();
+}
+
+/*任务 i 执行完成。需持有锁*/
+static void sched_finish(int i)
+{
+	config.items[i].running = 0;
+	sched_running--;
+	if (config.items[i].enable || config.items[i].next_retry_time)
+		sched_heap_push(i);
+}
+
+#ifndef WIN32
+static void *sched_worker_main(void *arg)
+{
+	SchedWorker *w = (SchedWorker *)arg;
+	int i;
+	pcs = w->pcs;
+	pcs_trace_thread_name("worker");
+	if (db_open()) {
+		PRINT_FATAL("The worker can't open the cache: %s", config.cacheFilePath);
+		SCHED_LOCK();
+		w->alive = 0;
+		pthread_cond_broadcast(&sched_cond);
+		SCHED_UNLOCK();
+		return NULL;
+	}
+	SCHED_LOCK();
+	while (1) {
+		while (w->item < 0 && config.run_in_daemon)
+			pthread_cond_wait(&sched_cond, &sched_mutex);
+		if (w->item < 0) break;
+		i = w->item;
+		SCHED_UNLOCK();
+		sched_run(i);
+		SCHED_LOCK();
+		sched_finish(i);
+		w->item = -1;
+		pthread_cond_broadcast(&sched_cond);
+	}
+	w->alive = 0;
+	SCHED_UNLOCK();
+	db_close();
+	return NULL;
+}
+#endif
+
+static void sched_start_workers()
+{
+	int i;
+	sched_worker_count = 0;
+#ifndef WIN32
+	if (config.concurrency < 1) return;
+	sched_workers = (SchedWorker *)pcs_malloc(sizeof(SchedWorker) * config.concurrency);
+	memset(sched_workers, 0, sizeof(SchedWorker) * config.concurrency);
+	for (i = 0; i < config.concurrency; i++) {
+		SchedWorker *w = &sched_workers[sched_worker_count];
+		w->item = -1;
+		w->pcs = pcs_clone(pcs);
+		if (!w->pcs) {
+			PRINT_WARNING("Can't clone the pcs object: %s", pcs_strerror(pcs));
+			break;
+		}
+		w->alive = 1;
+		if (pthread_create(&w->tid, NULL, &sched_worker_main, w)) {
+			PRINT_WARNING("Can't create the worker thread");
+			pcs_destroy(w->pcs);
+			w->pcs = NULL;
+			w->alive = 0;
+			break;
+		}
+		sched_worker_count++;
+	}
+#endif
+	PRINT_NOTICE("Workers: %d", sched_worker_count);
+}
+
+static void sched_stop_workers()
+{
+#ifndef WIN32
+	int i;
+	SCHED_LOCK();
+	config.run_in_daemon = 0;
+	pthread_cond_broadcast(&sched_cond);
+	SCHED_UNLOCK();
+	for (i = 0; i < sched_worker_count; i++) {
+		pthread_join(sched_workers[i].tid, NULL);
+		pcs_destroy(sched_workers[i].pcs);
+	}
+#endif
+	if (sched_workers) pcs_free(sched_workers);
+	sched_workers = NULL;
+	sched_worker_count = 0;
+}
+
+/*返回空闲的工作线程，没有时返回NULL。需持有锁*/
+static SchedWorker *sched_idle_worker()
+{
+	int i;
+	for (i = 0; i < sched_worker_count; i++) {
+		if (sched_workers[i].alive && sched_workers[i].item < 0)
+			return &sched_workers[i];
+	}
+	return NULL;
+}
+
+/*等待到 deadline，有任务完成时提前返回。需持有锁*/
+static void sched_wait(time_t deadline)
+{
+#ifdef WIN32
+	D_SLEEP(1);
+#else
+	struct timespec ts;
+	time_t now;
+	time(&now);
+	if (deadline > now + 60) deadline = now + 60;
+	if (deadline <= now) deadline = now + 1;
+	ts.tv_sec = deadline;
+	ts.tv_nsec = 0;
+	pthread_cond_timedwait(&sched_cond, &sched_mutex, &ts);
+#endif
+}
+
 static void svc_loop()
 {
-	int rc, i;
-	time_t now, end;
-	while(config.run_in_daemon) {
+	int i, n, alive, *deferred;
+	time_t now, bandwidthTime;
+	SchedWorker *w;
+
+	sched_heap = (int *)pcs_malloc(sizeof(int) * (config.itemCount + 1));
+	deferred = (int *)pcs_malloc(sizeof(int) * (config.itemCount + 1));
+	sched_heap_size = 0;
+	sched_running = 0;
+	for (i = 0; i < config.itemCount; i++) {
+		/*上次运行时留下的重试项*/
+		config.items[i].next_retry_time = db_get_retry_time(config.items[i].localPath, config.items[i].remotePath);
+		if (config.items[i].enable || config.items[i].next_retry_time)
+			sched_heap_push(i);
+	}
+	sched_start_workers();
+	SCHED_LOCK();
+	while (config.run_in_daemon) {
 		time(&now);
-		for (i = 0; i < config.itemCount; i++) {
-			if (!config.items[i].enable) continue;
-			if (now >= config.items[i].next_run_time) {
-				db_update_task_status(i + 1, 1, 0, now);
-				rc = task(i);
-				config.items[i].last_run_time = now;
-				if (config.items[i].interval) {
-					config.items[i].next_run_time += config.items[i].interval;
-				}
-				else
-					config.items[i].enable = 0;
-				time(&end);
-				db_update_task_status2(i + 1, config.items[i].enable, config.items[i].last_run_time, config.items[i].next_run_time,
-					rc ? 3 : 2, rc ? 3 : 2, now, end);
+		bandwidthTime = bandwidth_apply(now);
+		n = 0;
+		alive = 0;
+		for (i = 0; i < sched_worker_count; i++) alive += sched_workers[i].alive;
+		while (sched_heap_size > 0 && SCHED_DUE(0) <= now) {
+			i = sched_heap_pop();
+			if (sched_conflict(i)) {
+				deferred[n++] = i;
+				continue;
+			}
+			w = sched_idle_worker();
+			if (!w && alive > 0) {
+				deferred[n++] = i;
+				continue;
+			}
+			config.items[i].running = 1;
+			sched_running++;
+			if (w) {
+				w->item = i;
+#ifndef WIN32
+				pthread_cond_broadcast(&sched_cond);
+#endif
+			}
+			else {
+				/*没有工作线程，在当前线程中执行*/
+				SCHED_UNLOCK();
+				sched_run(i);
+				SCHED_LOCK();
+				sched_finish(i);
+				time(&now);
 			}
 		}
-		D_SLEEP(1);
+		while (n > 0) sched_heap_push(deferred[--n]);
+		if (sched_heap_size > 0 && SCHED_DUE(0) > now)
+			sched_wait(bandwidthTime && bandwidthTime < SCHED_DUE(0) ? bandwidthTime : SCHED_DUE(0));
+		else
+			sched_wait(now + 1); /*有任务在等待，任务完成时会被唤醒*/
+	}
+	SCHED_UNLOCK();
+	sched_stop_workers();
+	pcs_free(deferred);
+	pcs_free(sched_heap);
+	sched_heap = NULL;
+}
+
+/*
+以 Prometheus 文本格式（version 0.0.4）输出监控指标。
+配置 metricsListen 后，启动一个线程监听该地址，对 GET /metrics 返回所有指标，其它请求返回404。
+每个连接只处理一个请求，响应后关闭连接。WIN32下不支持。
+*/
+#ifndef WIN32
+
+typedef struct MetricsBuffer {
+	char	*data;
+	size_t	size;
+	size_t	capacity;
+} MetricsBuffer;
+
+static int metrics_fd = -1;
+static pthread_t metrics_tid;
+static Pcs metrics_pcs = NULL; /*主线程的Pcs对象，工作线程复制的对象与其共享HTTP统计*/
+static time_t metrics_start_time = 0;
+
+static void metrics_printf(MetricsBuffer *buf, const char *fmt, ...)
+{
+	va_list args;
+	char *data;
+	int n;
+	while (1) {
+		va_start(args, fmt);
+		n = vsnprintf(buf->data + buf->size, buf->capacity - buf->size, fmt, args);
+		va_end(args);
+		if (n < 0) return;
+		if (buf->size + n < buf->capacity) {
+			buf->size += n;
+			return;
+		}
+		buf->capacity = (buf->size + n + 1) * 2;
+		data = (char *)pcs_malloc(buf->capacity);
+		if (!data) return;
+		memcpy(data, buf->data, buf->size);
+		pcs_free(buf->data);
+		buf->data = data;
+	}
+}
+
+/*输出标签的值，转义反斜杠、双引号和换行*/
+static void metrics_label(MetricsBuffer *buf, const char *name, const char *value, int last)
+{
+	const char *p;
+	metrics_printf(buf, "%s=\"", name);
+	for (p = value ? value : ""; *p; p++) {
+		if (*p == '\\') metrics_printf(buf, "\\\\");
+		else if (*p == '"') metrics_printf(buf, "\\\"");
+		else if (*p == '\n') metrics_printf(buf, "\\n");
+		else metrics_printf(buf, "%c", *p);
+	}
+	metrics_printf(buf, last ? "\"" : "\",");
+}
+
+static void metrics_header(MetricsBuffer *buf, const char *name, const char *type, const char *help)
+{
+	metrics_printf(buf, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+/*输出直方图，第i个桶的上限为2^i毫秒，最后一个桶为+Inf。labels 为空串时不带其它标签*/
+static void metrics_histogram(MetricsBuffer *buf, const char *name, const char *labels,
+	const unsigned long long *buckets, unsigned long long count, double sum)
+{
+	unsigned long long cumulative = 0;
+	int i;
+	for (i = 0; i < PCS_HTTP_STATS_BUCKETS; i++) {
+		cumulative += buckets[i];
+		if (i < PCS_HTTP_STATS_BUCKETS - 1)
+			metrics_printf(buf, "%s_bucket{%s%sle=\"%g\"} %llu\n", name, labels, labels[0] ? "," : "", (double)(1UL << i) / 1000.0, cumulative);
+		else
+			metrics_printf(buf, "%s_bucket{%s%sle=\"+Inf\"} %llu\n", name, labels, labels[0] ? "," : "", count);
+	}
+	if (labels[0]) {
+		metrics_printf(buf, "%s_sum{%s} %.6f\n", name, labels, sum);
+		metrics_printf(buf, "%s_count{%s} %llu\n", name, labels, count);
+	}
+	else {
+		metrics_printf(buf, "%s_sum %.6f\n", name, sum);
+		metrics_printf(buf, "%s_count %llu\n", name, count);
+	}
+}
+
+static void metrics_item_labels(MetricsBuffer *buf, int i)
+{
+	char method[16], *p;
+	strncpy(method, get_method_name(config.items[i].method), sizeof(method) - 1);
+	method[sizeof(method) - 1] = '\0';
+	for (p = method; *p && *p != ' '; p++);
+	*p = '\0';
+	metrics_printf(buf, "{item=\"%d\",", i + 1);
+	metrics_label(buf, "method", method, 0);
+	metrics_label(buf, "local", config.items[i].localPath, 0);
+	metrics_label(buf, "remote", config.items[i].remotePath, 1);
+	metrics_printf(buf, "}");
+}
+
+static void metrics_render(MetricsBuffer *buf)
+{
+	Metrics m;
+	PcsHttpStats *hs;
+	PcsHttpEndpointStats *es;
+	unsigned long long buckets[PCS_HTTP_STATS_BUCKETS];
+	char labels[64];
+	int i, j, due = 0, running;
+	time_t now;
+
+	METRICS_LOCK();
+	m = metrics;
+	METRICS_UNLOCK();
+
+	metrics_header(buf, "pcs_uploaded_bytes_total", "counter", "Bytes of files uploaded successfully.");
+	metrics_printf(buf, "pcs_uploaded_bytes_total %llu\n", (unsigned long long)m.uploaded_bytes);
+	metrics_header(buf, "pcs_downloaded_bytes_total", "counter", "Bytes of files downloaded successfully.");
+	metrics_printf(buf, "pcs_downloaded_bytes_total %llu\n", (unsigned long long)m.downloaded_bytes);
+	metrics_header(buf, "pcs_uploaded_files_total", "counter", "Files uploaded successfully.");
+	metrics_printf(buf, "pcs_uploaded_files_total %llu\n", (unsigned long long)m.uploaded_files);
+	metrics_header(buf, "pcs_downloaded_files_total", "counter", "Files downloaded successfully.");
+	metrics_printf(buf, "pcs_downloaded_files_total %llu\n", (unsigned long long)m.downloaded_files);
+	metrics_header(buf, "pcs_skipped_files_total", "counter", "Files skipped because they were unchanged.");
+	metrics_printf(buf, "pcs_skipped_files_total %llu\n", (unsigned long long)m.skipped_files);
+	metrics_header(buf, "pcs_failed_files_total", "counter", "Files added to the retry queue.");
+	metrics_printf(buf, "pcs_failed_files_total %llu\n", (unsigned long long)m.failed_files);
+	metrics_header(buf, "pcs_active_transfers", "gauge", "Files being uploaded or downloaded.");
+	metrics_printf(buf, "pcs_active_transfers %d\n", m.active_transfers);
+
+	time(&now);
+	SCHED_LOCK();
+	for (i = 0; i < sched_heap_size; i++) {
+		if (SCHED_DUE(i) <= now) due++;
+	}
+	running = sched_running;
+	metrics_header(buf, "pcs_queue_depth", "gauge", "Tasks that are due but not yet running.");
+	metrics_printf(buf, "pcs_queue_depth %d\n", due);
+	metrics_header(buf, "pcs_running_tasks", "gauge", "Tasks being executed.");
+	metrics_printf(buf, "pcs_running_tasks %d\n", running);
+
+	metrics_header(buf, "pcs_task_running", "gauge", "Whether the task is being executed.");
+	for (i = 0; i < config.itemCount; i++) {
+		metrics_printf(buf, "pcs_task_running");
+		metrics_item_labels(buf, i);
+		metrics_printf(buf, " %d\n", config.items[i].running ? 1 : 0);
+	}
+	metrics_header(buf, "pcs_task_last_duration_seconds", "gauge", "Duration of the last full run of the task.");
+	for (i = 0; i < config.itemCount; i++) {
+		if (!config.items[i].last_end_time) continue;
+		metrics_printf(buf, "pcs_task_last_duration_seconds");
+		metrics_item_labels(buf, i);
+		metrics_printf(buf, " %d\n", config.items[i].last_duration);
+	}
+	metrics_header(buf, "pcs_task_last_success", "gauge", "Whether the last full run of the task succeeded.");
+	for (i = 0; i < config.itemCount; i++) {
+		if (!config.items[i].last_end_time) continue;
+		metrics_printf(buf, "pcs_task_last_success");
+		metrics_item_labels(buf, i);
+		metrics_printf(buf, " %d\n", config.items[i].last_result ? 0 : 1);
+	}
+	metrics_header(buf, "pcs_task_last_run_timestamp_seconds", "gauge", "Unix time the last full run of the task finished.");
+	for (i = 0; i < config.itemCount; i++) {
+		if (!config.items[i].last_end_time) continue;
+		metrics_printf(buf, "pcs_task_last_run_timestamp_seconds");
+		metrics_item_labels(buf, i);
+		metrics_printf(buf, " %ld\n", (long)config.items[i].last_end_time);
+	}
+	metrics_header(buf, "pcs_task_next_run_timestamp_seconds", "gauge", "Unix time of the next full run of the task.");
+	for (i = 0; i < config.itemCount; i++) {
+		if (!config.items[i].enable) continue;
+		metrics_printf(buf, "pcs_task_next_run_timestamp_seconds");
+		metrics_item_labels(buf, i);
+		metrics_printf(buf, " %ld\n", (long)config.items[i].next_run_time);
+	}
+	SCHED_UNLOCK();
+
+	hs = (PcsHttpStats *)pcs_malloc(sizeof(PcsHttpStats));
+	if (hs && pcs_getstats(metrics_pcs, hs) == PCS_OK) {
+		metrics_header(buf, "pcs_http_requests_total", "counter", "HTTP requests sent to the server.");
+		for (i = 0; i < PCS_HTTP_ENDPOINT_COUNT; i++) {
+			metrics_printf(buf, "pcs_http_requests_total{endpoint=\"%s\"} %lu\n", pcs_http_endpoint_name(i), hs->endpoints[i].count);
+		}
+		metrics_header(buf, "pcs_http_errors_total", "counter", "HTTP requests that failed or returned a status other than 200.");
+		for (i = 0; i < PCS_HTTP_ENDPOINT_COUNT; i++) {
+			metrics_printf(buf, "pcs_http_errors_total{endpoint=\"%s\"} %lu\n", pcs_http_endpoint_name(i), hs->endpoints[i].errors);
+		}
+		metrics_header(buf, "pcs_http_received_bytes_total", "counter", "Bytes received from the server.");
+		for (i = 0; i < PCS_HTTP_ENDPOINT_COUNT; i++) {
+			metrics_printf(buf, "pcs_http_received_bytes_total{endpoint=\"%s\"} %.0f\n", pcs_http_endpoint_name(i), hs->endpoints[i].bytes_in);
+		}
+		metrics_header(buf, "pcs_http_sent_bytes_total", "counter", "Bytes sent to the server.");
+		for (i = 0; i < PCS_HTTP_ENDPOINT_COUNT; i++) {
+			metrics_printf(buf, "pcs_http_sent_bytes_total{endpoint=\"%s\"} %.0f\n", pcs_http_endpoint_name(i), hs->endpoints[i].bytes_out);
+		}
+		metrics_header(buf, "pcs_http_request_duration_seconds", "histogram", "Total time of HTTP requests.");
+		for (i = 0; i < PCS_HTTP_ENDPOINT_COUNT; i++) {
+			es = &hs->endpoints[i];
+			for (j = 0; j < PCS_HTTP_STATS_BUCKETS; j++) buckets[j] = es->buckets[j];
+			snprintf(labels, sizeof(labels), "endpoint=\"%s\"", pcs_http_endpoint_name(i));
+			metrics_histogram(buf, "pcs_http_request_duration_seconds", labels, buckets, es->count, es->total);
+		}
+	}
+	if (hs) pcs_free(hs);
+
+	for (j = 0; j < PCS_HTTP_STATS_BUCKETS; j++) buckets[j] = m.db_commit.buckets[j];
+	metrics_header(buf, "pcs_sqlite_commit_duration_seconds", "histogram", "Time to commit a SQLite write transaction.");
+	metrics_histogram(buf, "pcs_sqlite_commit_duration_seconds", "", buckets, m.db_commit.count, m.db_commit.sum);
+
+	metrics_header(buf, "pcs_start_time_seconds", "gauge", "Unix time the daemon started.");
+	metrics_printf(buf, "pcs_start_time_seconds %ld\n", (long)metrics_start_time);
+}
+
+static void metrics_send(int fd, const char *data, size_t size)
+{
+	ssize_t n;
+	while (size > 0) {
+		n = send(fd, data, size, MSG_NOSIGNAL);
+		if (n <= 0) return;
+		data += n;
+		size -= n;
+	}
+}
+
+static void metrics_serve(int fd)
+{
+	char req[2048], header[256];
+	size_t len = 0;
+	ssize_t n;
+	MetricsBuffer buf = { 0 };
+	struct timeval tv = { 5, 0 };
+
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	while (len < sizeof(req) - 1) {
+		n = recv(fd, req + len, sizeof(req) - 1 - len, 0);
+		if (n <= 0) break;
+		len += n;
+		req[len] = '\0';
+		if (strstr(req, "\r\n\r\n") || strstr(req, "\n\n")) break;
+	}
+	req[len] = '\0';
+	if (strncmp(req, "GET /metrics ", 13) && strncmp(req, "GET /metrics?", 13)) {
+		const char *body = "Not Found\n";
+		n = snprintf(header, sizeof(header), "HTTP/1.0 404 Not Found\r\nContent-Type: text/plain\r\nContent-Length: %d\r\nConnection: close\r\n\r\n", (int)strlen(body));
+		metrics_send(fd, header, n);
+		metrics_send(fd, body, strlen(body));
+		return;
+	}
+	buf.capacity = 8192;
+	buf.data = (char *)pcs_malloc(buf.capacity);
+	if (!buf.data) return;
+	metrics_render(&buf);
+	n = snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %lu\r\nConnection: close\r\n\r\n", (unsigned long)buf.size);
+	metrics_send(fd, header, n);
+	metrics_send(fd, buf.data, buf.size);
+	pcs_free(buf.data);
+}
+
+static void *metrics_main(void *arg)
+{
+	int fd;
+	pcs_trace_thread_name("metrics");
+	while (1) {
+		fd = accept(metrics_fd, NULL, NULL);
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED) continue;
+			break; /*metrics_stop() 关闭了监听*/
+		}
+		metrics_serve(fd);
+		close(fd);
+	}
+	return NULL;
+}
+
+/*
+监听 config.metrics_listen。以"/"开头时为 Unix socket 的路径，
+否则为"host:port"、":port" 或 "port"，省略 host 时只监听 127.0.0.1。
+*/
+static int metrics_listen()
+{
+	const char *addr = config.metrics_listen, *colon;
+	char host[64];
+	int fd, on = 1;
+
+	if (addr[0] == '/') {
+		struct sockaddr_un sun;
+		if (strlen(addr) >= sizeof(sun.sun_path)) {
+			PRINT_WARNING("The metrics socket path is too long: %s", addr);
+			return -1;
+		}
+		memset(&sun, 0, sizeof(sun));
+		sun.sun_family = AF_UNIX;
+		strcpy(sun.sun_path, addr);
+		unlink(addr);
+		fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (fd < 0) return -1;
+		if (bind(fd, (struct sockaddr *)&sun, sizeof(sun)) || listen(fd, 8)) {
+			close(fd);
+			return -1;
+		}
+	}
+	else {
+		struct sockaddr_in sin;
+		memset(&sin, 0, sizeof(sin));
+		sin.sin_family = AF_INET;
+		colon = strrchr(addr, ':');
+		strcpy(host, "127.0.0.1");
+		if (colon && colon > addr) {
+			if ((size_t)(colon - addr) >= sizeof(host)) return -1;
+			memcpy(host, addr, colon - addr);
+			host[colon - addr] = '\0';
+		}
+		sin.sin_port = htons((unsigned short)atoi(colon ? colon + 1 : addr));
+		if (!sin.sin_port || inet_pton(AF_INET, host, &sin.sin_addr) != 1) {
+			PRINT_WARNING("Wrong metrics listen address: %s", addr);
+			return -1;
+		}
+		fd = socket(AF_INET, SOCK_STREAM, 0);
+		if (fd < 0) return -1;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+		if (bind(fd, (struct sockaddr *)&sin, sizeof(sin)) || listen(fd, 8)) {
+			close(fd);
+			return -1;
+		}
+	}
+	return fd;
+}
+
+static void metrics_start()
+{
+	time(&metrics_start_time);
+	if (!config.metrics_listen) return;
+	metrics_pcs = pcs;
+	metrics_fd = metrics_listen();
+	if (metrics_fd < 0) {
+		PRINT_WARNING("Can't listen on %s for metrics: %s", config.metrics_listen, strerror(errno));
+		metrics_fd = -1;
+		return;
+	}
+	if (pthread_create(&metrics_tid, NULL, &metrics_main, NULL)) {
+		PRINT_WARNING("Can't create the metrics thread");
+		close(metrics_fd);
+		metrics_fd = -1;
+		return;
 	}
+	PRINT_NOTICE("Metrics: %s", config.metrics_listen);
 }
 
+static void metrics_stop()
+{
+	if (metrics_fd < 0) return;
+	shutdown(metrics_fd, SHUT_RDWR);
+	pthread_join(metrics_tid, NULL);
+	close(metrics_fd);
+	metrics_fd = -1;
+	metrics_pcs = NULL;
+	if (config.metrics_listen[0] == '/')
+		unlink(config.metrics_listen);
+}
+
+#else
+
+static void metrics_start()
+{
+	if (config.metrics_listen)
+		PRINT_WARNING("The metrics endpoint is not supported on Windows");
+}
+
+static void metrics_stop()
+{
+}
+
+#endif
+
 static int run_svc(struct params *params)
 {
 	config.run_in_daemon = 1;
@@ -3386,6 +6281,7 @@ static int run_svc(struct params *params)
 			log_open(config.logFilePath);
 			PRINT_NOTICE("Log file continue from %s", log_file_path());
 		}
+		log_set_rotate((long)config.logMaxSize * 1024 * 1024, LOG_BACKUPS);
 	}
 	printf("Run in Daemon: %s\n", config.run_in_daemon ? "yes" : "no");
 	printf("Log Enabled: %s\n", config.log_enabled ? "yes" : "no");
@@ -3396,6 +6292,7 @@ static int run_svc(struct params *params)
 	PRINT_NOTICE("Run in Daemon: %s", config.run_in_daemon ? "yes" : "no");
 	PRINT_NOTICE("Log Enabled: %s", config.log_enabled ? "yes" : "no");
 	PRINT_NOTICE("Printf Enabled: %s", config.printf_enabled ? "yes" : "no");
+	PRINT_NOTICE("Concurrency: %d", config.concurrency);
 	if (db_open()) {
 		freeConfig(FALSE);
 		PRINT_NOTICE("Application end up");
@@ -3433,7 +6330,9 @@ static int run_svc(struct params *params)
 	printf("\nTask:\n");
 	print_taks();
 	printf("\n");
+	metrics_start();
 	svc_loop();
+	metrics_stop();
 	pcs_destroy(pcs);
 	pcs = NULL;
 	freeConfig(FALSE);
@@ -3529,6 +6428,7 @@ static int run_shell(struct params *params)
 			PCS_OPTION_SECURE_ENABLE, (void *)((long)PcsTrue),
 			PCS_OPTION_END);
 	}
+	bandwidth_apply(time(NULL));
 	switch (params->action){
 	case ACTION_UPDATE:
 		rc = method_update(params->args[0]);
@@ -3608,6 +6508,13 @@ int start_daemon(struct params *params)
 {
 	int rc = 0;
 	_pcs_mem_printf = &d_mem_printf;
+	if (params->trace) {
+		if (pcs_trace_open(params->trace)) {
+			printf("Can't create the trace file: %s\n", params->trace);
+			return -1;
+		}
+		pcs_trace_thread_name("main");
+	}
 	if (params->action == ACTION_TIME)
 		rc = method_time();
 	else {
@@ -3623,5 +6530,6 @@ int start_daemon(struct params *params)
 		else
 			rc = run_shell(params);
 	}
+	pcs_trace_close();
 	return rc;
 }
@@ -247,7 +247,8 @@ my_dirent *create_dirent(const char *basepath, const char *filename, int is_dir,
 int get_file_ent(my_dirent **pEnt, const char *path)
 {
 	struct stat st;
-	stat(path, &st);
+	if (stat(path, &st))
+		return 0;
 	if (S_ISDIR(st.st_mode)) {
 		//ΪĿ¼
 		if (pEnt) *pEnt = create_dirent(path, NULL, 1, st.st_mtime, 0);
@@ -264,7 +265,8 @@ int get_file_ent(my_dirent **pEnt, const char *path)
 int is_dir_or_file(const char *path)
 {
 	struct stat st;
-	stat(path, &st);
+	if (stat(path, &st))
+		return 0;
 	if (S_ISDIR(st.st_mode))
 		return 2;
 	else if (S_ISREG(st.st_mode))
@@ -336,10 +338,11 @@ int filesearch(const char *path, my_dirent *root, int recursion)
         if (ent->d_type == 4) {
 			if(!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, ".."))
 				continue;
-			stat(path, &st);
-			p = create_dirent(path, ent->d_name, 1, st.st_mtime, 0);
-            if (!ent)
+			p = create_dirent(path, ent->d_name, 1, 0, 0);
+            if (!p)
 				return -1;
+			if (stat(p->path, &st) == 0)
+				p->mtime = st.st_mtime;
 			cusor->next = p;
 			cusor = p;
 			if (recursion) {
@@ -348,10 +351,14 @@ int filesearch(const char *path, my_dirent *root, int recursion)
 			}
         }
         else if (ent->d_type == 8){
-			stat(path, &st);
-			p = create_dirent(path, ent->d_name, 0, st.st_mtime, st.st_size);
+			p = create_dirent(path, ent->d_name, 0, 0, 0);
             if (!p)
 				return -1;
+			//ȡϢĿ¼
+			if (stat(p->path, &st) == 0) {
+				p->mtime = st.st_mtime;
+				p->size = st.st_size;
+			}
 			cusor->next = p;
 			cusor = p;
         }
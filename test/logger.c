@@ -4,6 +4,7 @@
 #include <time.h>
 #include <string.h>
 #include <stdarg.h>
+#include <stddef.h>
 //#include <unistd.h>
 //#include <error.h>
 //#include <sys/file.h>
@@ -16,8 +17,25 @@
 #ifdef WIN32
 //#  include <stdint.h>
 #  define snprintf _snprintf
+#  define LOG_LOCK()
+#  define LOG_UNLOCK()
 #else
 #  include <alloca.h>
+#  include <pthread.h>
+#  include <errno.h>
+#  include <sys/time.h>
+/*
+ * The daemon logs from several task threads. Each thread formats its
+ * records into its own ring buffer without taking any lock; a background
+ * flusher thread drains all rings, writes them to the file in batches and
+ * rotates the file when it grows too large. When a ring is full, NOTICE
+ * and lower records are dropped (and counted), FATAL and WARNING records
+ * wait a bounded time for the flusher.
+ */
+#  define LOG_ASYNC
+static pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;
+#  define LOG_LOCK()   pthread_mutex_lock(&log_mutex)
+#  define LOG_UNLOCK() pthread_mutex_unlock(&log_mutex)
 #endif
 
 static char LOG_LEVEL_NOTE[][10] = 
@@ -26,11 +44,228 @@ static char LOG_LEVEL_NOTE[][10] =
 static FILE *log_fp                 = NULL;
 static char *log_filename           = NULL;
 static int  log_opened              = 0;
+static long log_max_size            = 0; /* rotate when the file is larger, 0 disables */
+static int  log_backups             = 1;
 
 #define log_buffer_size 8192
-static char log_buffer[log_buffer_size];
 static char log_extra_info[log_buffer_size];
 
+#ifdef LOG_ASYNC
+#define LOG_RING_SIZE     (64 * 1024) /* per thread, must be a power of two */
+#define LOG_FLUSH_MS      200
+#define LOG_WAIT_MS       100 /* longest time a FATAL/WARNING record waits for space */
+
+struct log_ring {
+    unsigned long    head;         /* next write offset, owned by the producer */
+    unsigned long    tail;         /* next read offset, owned by the flusher */
+    unsigned long    dropped;      /* records dropped, owned by the producer */
+    unsigned long    dropped_seen; /* dropped count already reported */
+    int              orphan;       /* the owner thread has exited */
+    struct log_ring *next;
+    char             data[LOG_RING_SIZE];
+};
+
+static struct log_ring *log_rings = NULL; /* guarded by log_mutex */
+static pthread_key_t    log_key;
+static pthread_once_t   log_key_once = PTHREAD_ONCE_INIT;
+static pthread_cond_t   log_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t        log_thread;
+static int              log_running = 0;
+static int              log_stopping = 0;
+static __thread struct log_ring *log_my_ring = NULL;
+
+static void log_ring_release(void *arg)
+{
+    __atomic_store_n(&((struct log_ring *)arg)->orphan, 1, __ATOMIC_RELEASE);
+}
+
+static void log_key_create(void)
+{
+    pthread_key_create(&log_key, log_ring_release);
+}
+
+static struct log_ring *log_get_ring(void)
+{
+    struct log_ring *r = log_my_ring;
+    if (r) return r;
+    r = (struct log_ring *)malloc(sizeof(struct log_ring));
+    if (!r) return NULL;
+    memset(r, 0, offsetof(struct log_ring, data));
+    pthread_once(&log_key_once, log_key_create);
+    pthread_setspecific(log_key, r);
+    LOG_LOCK();
+    r->next = log_rings;
+    log_rings = r;
+    LOG_UNLOCK();
+    log_my_ring = r;
+    return r;
+}
+
+static void log_ring_copy_in(struct log_ring *r, unsigned long pos, const void *src, size_t len)
+{
+    size_t off = pos & (LOG_RING_SIZE - 1), first = LOG_RING_SIZE - off;
+    if (first >= len) {
+        memcpy(r->data + off, src, len);
+    }
+    else {
+        memcpy(r->data + off, src, first);
+        memcpy(r->data, (const char *)src + first, len - first);
+    }
+}
+
+static void log_ring_copy_out(struct log_ring *r, unsigned long pos, void *dst, size_t len)
+{
+    size_t off = pos & (LOG_RING_SIZE - 1), first = LOG_RING_SIZE - off;
+    if (first >= len) {
+        memcpy(dst, r->data + off, len);
+    }
+    else {
+        memcpy(dst, r->data + off, first);
+        memcpy((char *)dst + first, r->data, len - first);
+    }
+}
+
+/* Stage one record in the calling thread's ring. Returns 0 if it was dropped. */
+static int log_ring_push(int level, const char *buf, unsigned int count)
+{
+    struct log_ring *r = log_get_ring();
+    unsigned long head, tail;
+    unsigned int need = count + sizeof(count);
+    int waited = 0;
+    struct timespec ts = { 0, 1000000 };
+
+    if (!r) return 0;
+    head = r->head;
+    while (1) {
+        tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+        if (LOG_RING_SIZE - (head - tail) >= need) break;
+        if (level > LOG_WARNING || waited++ >= LOG_WAIT_MS) {
+            __atomic_store_n(&r->dropped, r->dropped + 1, __ATOMIC_RELEASE);
+            pthread_cond_signal(&log_cond);
+            return 0;
+        }
+        pthread_cond_signal(&log_cond);
+        nanosleep(&ts, NULL);
+    }
+    log_ring_copy_in(r, head, &count, sizeof(count));
+    log_ring_copy_in(r, head + sizeof(count), buf, count);
+    __atomic_store_n(&r->head, head + need, __ATOMIC_RELEASE);
+    if (level <= LOG_WARNING || (head + need - tail) > LOG_RING_SIZE / 2)
+        pthread_cond_signal(&log_cond);
+    return 1;
+}
+#endif
+
+/* Rename FILE -> FILE.1 -> FILE.2 ... and reopen FILE. Needs the lock. */
+static void log_rotate(void)
+{
+    char *src, *dst;
+    size_t len = strlen(log_filename) + 16;
+    int i;
+
+    src = (char *)alloca(len);
+    dst = (char *)alloca(len);
+    fclose(log_fp);
+    for (i = log_backups - 1; i > 0; i--) {
+        snprintf(src, len, "%s.%d", log_filename, i);
+        snprintf(dst, len, "%s.%d", log_filename, i + 1);
+        rename(src, dst);
+    }
+    snprintf(dst, len, "%s.1", log_filename);
+    rename(log_filename, dst);
+    log_fp = fopen(log_filename, "a");
+    if (log_fp == NULL) {
+        perror("can't not open log file");
+        exit(1);
+    }
+}
+
+/* Write formatted records to the file. Needs the lock. */
+static void log_emit(const char *buf, size_t count)
+{
+    if (count == 0) return;
+    if (fwrite(buf, 1, count, log_fp) < count) {
+        perror("write error");
+        exit(1);
+    }
+}
+
+static void log_emit_done(void)
+{
+    fflush(log_fp);
+    if (log_max_size > 0 && ftell(log_fp) >= log_max_size)
+        log_rotate();
+}
+
+#ifdef LOG_ASYNC
+/* Move everything staged in the rings into the file. Needs the lock. */
+static void log_drain(void)
+{
+    static char batch[LOG_RING_SIZE];
+    size_t used = 0;
+    struct log_ring *r, **pr;
+    unsigned long head, tail, dropped;
+    unsigned int count;
+    char datetime[100];
+    time_t now;
+    struct tm tm;
+
+    pr = &log_rings;
+    while ((r = *pr) != NULL) {
+        int orphan = __atomic_load_n(&r->orphan, __ATOMIC_ACQUIRE);
+        head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        tail = r->tail;
+        while (tail != head) {
+            log_ring_copy_out(r, tail, &count, sizeof(count));
+            if (used + count > sizeof(batch)) {
+                log_emit(batch, used);
+                used = 0;
+            }
+            log_ring_copy_out(r, tail + sizeof(count), batch + used, count);
+            used += count;
+            tail += sizeof(count) + count;
+        }
+        __atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+        dropped = __atomic_load_n(&r->dropped, __ATOMIC_ACQUIRE);
+        if (dropped != r->dropped_seen) {
+            now = time(NULL);
+            localtime_r(&now, &tm);
+            strftime(datetime, sizeof(datetime), "%Y-%m-%d %H:%M:%S", &tm);
+            log_emit(batch, used);
+            used = 0;
+            fprintf(log_fp, "--%s-- [%s] [logger] %lu log records dropped\n",
+                LOG_LEVEL_NOTE[LOG_WARNING], datetime, dropped - r->dropped_seen);
+            r->dropped_seen = dropped;
+        }
+        if (orphan && __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == tail) {
+            *pr = r->next;
+            free(r);
+            continue;
+        }
+        pr = &r->next;
+    }
+    log_emit(batch, used);
+    log_emit_done();
+}
+
+static void *log_flush_main(void *arg)
+{
+    struct timeval tv;
+    struct timespec ts;
+    LOG_LOCK();
+    while (!log_stopping) {
+        gettimeofday(&tv, NULL);
+        ts.tv_sec = tv.tv_sec + (tv.tv_usec / 1000 + LOG_FLUSH_MS) / 1000;
+        ts.tv_nsec = ((tv.tv_usec / 1000 + LOG_FLUSH_MS) % 1000) * 1000000;
+        pthread_cond_timedwait(&log_cond, &log_mutex, &ts);
+        log_drain();
+    }
+    log_drain();
+    LOG_UNLOCK();
+    return NULL;
+}
+#endif
+
 int log_open(const char* filename)
 {
 	int len;
@@ -48,6 +283,11 @@ int log_open(const char* filename)
     }
 
     atexit(log_close);
+#ifdef LOG_ASYNC
+    log_stopping = 0;
+    /* fall back to writing on the caller's thread if the flusher can't start */
+    log_running = pthread_create(&log_thread, NULL, log_flush_main, NULL) == 0;
+#endif
     log_opened = 1;
     log_extra_info[0] = 0;
     FM_LOG_NOTICE("log_open");
@@ -58,6 +298,16 @@ void log_close(void)
 {
     if (log_opened) {
         FM_LOG_NOTICE("log_close\n");
+#ifdef LOG_ASYNC
+        if (log_running) {
+            LOG_LOCK();
+            log_stopping = 1;
+            pthread_cond_signal(&log_cond);
+            LOG_UNLOCK();
+            pthread_join(log_thread, NULL);
+            log_running = 0;
+        }
+#endif
         fclose(log_fp);
         free(log_filename);
         log_fp       = NULL;
@@ -66,6 +316,14 @@ void log_close(void)
     }
 }
 
+void log_set_rotate(long max_size, int backups)
+{
+    LOG_LOCK();
+    log_max_size = max_size;
+    log_backups = backups < 1 ? 1 : backups;
+    LOG_UNLOCK();
+}
+
 void log_write(int level, const char *file,
         const int line, const char *fmt, ...)
 {
@@ -78,34 +336,52 @@ void log_write(int level, const char *file,
 void log_writev(int level, const char *file,
         const int line, const char *fmt, va_list ap)
 {
-    static char buffer[log_buffer_size];
-    static char datetime[100];
-    static char line_str[20];
-    static time_t now;
-	size_t count;
+    char buffer[log_buffer_size];
+    char message[log_buffer_size];
+    char datetime[100];
+    time_t now;
+    struct tm tm;
+	int count;
 
     if (log_opened == 0) {
         fprintf(stderr, "log_open not called yet\n");
         exit(1);
     }
     now = time(NULL);
+#ifdef WIN32
+    tm = *localtime(&now);
+#else
+    localtime_r(&now, &tm);
+#endif
 
-    strftime(datetime, 99, "%Y-%m-%d %H:%M:%S", localtime(&now));
-    snprintf(line_str, 19, "%d", line);
-    vsnprintf(log_buffer, log_buffer_size, fmt, ap);   
+    strftime(datetime, 99, "%Y-%m-%d %H:%M:%S", &tm);
+    vsnprintf(message, log_buffer_size, fmt, ap);   
 
     count = snprintf(buffer, log_buffer_size,
             "--%s-- [%s] [%s:%d]%s %s\n", 
-            LOG_LEVEL_NOTE[level], datetime, file, line, log_extra_info, log_buffer);
-    if (fwrite(buffer, 1, count, log_fp) < 0) {
-        perror("write error");
-        exit(1);
+            LOG_LEVEL_NOTE[level], datetime, file, line, log_extra_info, message);
+    if (count < 0 || count >= log_buffer_size) {
+        count = log_buffer_size - 1;
+        buffer[count - 1] = '\n';
     }
-	fflush(log_fp);
+#ifdef LOG_ASYNC
+    if (log_running) {
+        log_ring_push(level, buffer, (unsigned int)count);
+        return;
+    }
+#endif
+    LOG_LOCK();
+    log_emit(buffer, count);
+    log_emit_done();
+    LOG_UNLOCK();
 }
 
+/* Not synchronized with writers: call it before starting other threads. */
 void log_add_info(const char *info)
 {
-    int len = strlen(log_extra_info);
+    int len;
+    LOG_LOCK();
+    len = strlen(log_extra_info);
     snprintf(log_extra_info + len, log_buffer_size - len, " [%s]", info);
+    LOG_UNLOCK();
 }
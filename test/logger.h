@@ -2,6 +2,8 @@
  *
  * LOGGER v0.0.3
  * A simple logger for c/c++ under linux, multiprocess-safe
+ * Thread-safe: under linux each thread stages records in its own ring
+ * buffer and a background thread writes them to the file in batches.
  *
  * ---- CopyLeft by Felix021 @ http://www.felix021.com ----
  *
@@ -22,6 +24,9 @@
  *   
  *   //Need EXTRA_INFO to be logged automatically?
  *   log_add_info("pid:123");
+ *
+ *   //Rotate the file when it exceeds 10MB, keep log.txt.1 ... log.txt.3
+ *   log_set_rotate(10 * 1024 * 1024, 3);
  *   
  *   //You don't need to call log_close manually, it'll be called at exit
  *   log_close();
@@ -38,6 +43,7 @@ void log_write(int, const char *, const int, const char *, ...);
 void log_writev(int level, const char *file,
         const int line, const char *fmt, va_list ap);
 void log_add_info(const char *info);
+void log_set_rotate(long max_size, int backups);
 
 #define LOG_FATAL         0
 #define LOG_WARNING       1
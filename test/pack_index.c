@@ -0,0 +1,78 @@
+﻿#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pack_index.h"
+
+void freePackEntry(PackEntry *entry)
+{
+	if (entry->path) pcs_free(entry->path);
+	if (entry->localPath) pcs_free(entry->localPath);
+	if (entry->packPath) pcs_free(entry->packPath);
+	memset(entry, 0, sizeof(PackEntry));
+}
+
+/*
+生成包的索引文件。第一行为 PACK_INDEX_MAGIC，
+之后每行一个文件，依次为 offset、length、mtime、md5 和网盘路径，以 Tab 分隔。
+使用完后需调用 pcs_free() 释放
+*/
+char *pack_build_index(const PackEntry *entries, int count, size_t *pSize)
+{
+	char *buf;
+	size_t sz, pos;
+	int i;
+	sz = strlen(PACK_INDEX_MAGIC) + 2;
+	for (i = 0; i < count; i++)
+		sz += strlen(entries[i].path) + 100;
+	buf = (char *)pcs_malloc(sz);
+	pos = sprintf(buf, "%s\n", PACK_INDEX_MAGIC);
+	for (i = 0; i < count; i++) {
+		pos += sprintf(buf + pos, "%lld\t%lld\t%lld\t%s\t%s\n",
+			(long long)entries[i].offset, (long long)entries[i].length,
+			(long long)entries[i].mtime, entries[i].md5, entries[i].path);
+	}
+	*pSize = pos;
+	return buf;
+}
+
+/*解析 pack_build_index() 生成的索引文件，返回文件数，格式错误返回-1。使用完后需释放 *pEntries 及其中的每一项*/
+int pack_parse_index(const char *text, PackEntry **pEntries)
+{
+	PackEntry *entries;
+	const char *p, *end;
+	long long offset, length, mtime;
+	char md5[33];
+	int count = 0, n;
+
+	if (strncmp(text, PACK_INDEX_MAGIC "\n", strlen(PACK_INDEX_MAGIC) + 1))
+		return -1;
+	p = text + strlen(PACK_INDEX_MAGIC) + 1;
+	for (end = p; *end; end++) {
+		if (*end == '\n') count++;
+	}
+	entries = (PackEntry *)pcs_malloc(sizeof(PackEntry) * (count + 1));
+	memset(entries, 0, sizeof(PackEntry) * (count + 1));
+	count = 0;
+	while (*p) {
+		end = strchr(p, '\n');
+		if (!end) end = p + strlen(p);
+		n = 0;
+		if (sscanf(p, "%lld\t%lld\t%lld\t%32s\t%n", &offset, &length, &mtime, md5, &n) != 4 || n == 0 || p + n >= end) {
+			while (count > 0) freePackEntry(&entries[--count]);
+			pcs_free(entries);
+			return -1;
+		}
+		entries[count].path = (char *)pcs_malloc(end - p - n + 1);
+		memcpy(entries[count].path, p + n, end - p - n);
+		entries[count].path[end - p - n] = '\0';
+		entries[count].offset = offset;
+		entries[count].length = length;
+		entries[count].mtime = (time_t)mtime;
+		strcpy(entries[count].md5, md5);
+		count++;
+		p = *end ? end + 1 : end;
+	}
+	*pEntries = entries;
+	return count;
+}
@@ -0,0 +1,41 @@
+﻿#ifndef _PACK_INDEX_H_
+#define _PACK_INDEX_H_
+
+#include <time.h>
+#include "../pcs/pcs.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define PACK_INDEX_MAGIC		"PCSPACK 1" /*包的索引文件的第一行*/
+
+/*打包上传的一个文件，即 pcs_pack_file 中的一行*/
+typedef struct PackEntry {
+	char	*path; /*文件的网盘路径*/
+	char	*localPath; /*只在打包时使用*/
+	char	*packPath; /*包的网盘路径，只在还原时使用*/
+	Int64	offset; /*在包中的位置*/
+	Int64	length;
+	time_t	mtime;
+	char	md5[33];
+} PackEntry;
+
+/*释放 entry 中的字符串，并清零*/
+void freePackEntry(PackEntry *entry);
+
+/*
+生成包的索引文件。第一行为 PACK_INDEX_MAGIC，
+之后每行一个文件，依次为 offset、length、mtime、md5 和网盘路径，以 Tab 分隔。
+使用完后需调用 pcs_free() 释放
+*/
+char *pack_build_index(const PackEntry *entries, int count, size_t *pSize);
+
+/*解析 pack_build_index() 生成的索引文件，返回文件数，格式错误返回-1。使用完后需释放 *pEntries 及其中的每一项*/
+int pack_parse_index(const char *text, PackEntry **pEntries);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
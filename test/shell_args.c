@@ -32,6 +32,7 @@ const char *argp_program_version = program_full_name;
 #define OPT_MD5				6
 #define OPT_SECURE_METHOD	7
 #define OPT_SECURE_KEY		8
+#define OPT_TRACE			9
 
 struct argp_option options[] = {
 	{ 0,			0,	 0,						0,							"Options:", 0},
@@ -57,6 +58,7 @@ struct argp_option options[] = {
 	{ "config",     OPT_CONFIG, "<config>",		OPTION_ARG_OPTIONAL,		"Specify the config file.", 0 },
 	{ "cache",      OPT_CACHE, "<cache>",		OPTION_ARG_OPTIONAL,		"Specify the cache file.", 0 },
 	{ "md5",		OPT_MD5, 0,					OPTION_ARG_OPTIONAL,		"Specify that whether use md5 when execute backup, restore, combin, compare.", 0 },
+	{ "trace",		OPT_TRACE, "<trace file>",	OPTION_ARG_OPTIONAL,		"Write the timeline in Chrome trace format, which can be opened by chrome://tracing or ui.perfetto.dev.", 0 },
 
 	{0, 0, 0, 0, 0, 0}
 };
@@ -463,6 +465,7 @@ static error_t parse_opt (int key, char *arg, struct argp_state *state)
 		}
 		if (params->config) pcs_free(params->config);
 		if (params->cache) pcs_free(params->cache);
+		if (params->trace) pcs_free(params->trace);
 		params->is_fail = PcsFalse;
 		params->username = NULL;
 		params->password = NULL;
@@ -482,6 +485,7 @@ static error_t parse_opt (int key, char *arg, struct argp_state *state)
 		params->args_count = 0;
 		params->config = NULL;
 		params->cache = NULL;
+		params->trace = NULL;
 		params->md5 = PcsFalse;
 		break;
 
@@ -641,6 +645,12 @@ static error_t parse_opt (int key, char *arg, struct argp_state *state)
 		params->md5 = PcsTrue;
 		break;
 
+	case OPT_TRACE:
+		if (arg && arg[0]) {
+			params->trace = pcs_utils_strdup(arg);
+		}
+		break;
+
 	case ARGP_KEY_END:
 	case ARGP_KEY_ARGS:
 	case ARGP_KEY_SUCCESS:
@@ -692,6 +702,7 @@ void shell_args_destroy_params(struct params *params)
 	}
 	if (params->config) pcs_free(params->config);
 	if (params->cache) pcs_free(params->cache);
+	if (params->trace) pcs_free(params->trace);
 	pcs_free(params);
 }
 
@@ -47,6 +47,7 @@ struct params {
 	char		*secure_key;
 	char		*config;
 	char		*cache;
+	char		*trace;
 	PcsBool		is_recursion;
 	PcsBool		is_force;
 	PcsBool		is_desc;
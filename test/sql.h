@@ -1,7 +1,7 @@
 #ifndef _SQL_H
 #define _SQL_H
 
-#define DB_VERSION				3
+#define DB_VERSION				4
 #define DB_VERSION_KEY			"DB_VERSION"
 
 #define TABLE_NAME_CACHE		"pcs_cache"
@@ -24,9 +24,42 @@
 								"  [mtime]					INTEGER," \
 								"  [capp]					NVARCHAR," \
 								"  [mapp]					NVARCHAR,"\
-								"  [flag]					INTEGER)"
+								"  [flag]					INTEGER," \
+								"  [parent_id]				INTEGER)"
 #define TABLE_CACHE_INDEX_CREATOR "CREATE INDEX [ix_pcs_cache_path] ON [pcs_cache] ([server_path])"
 
+/*
+ * pcs_cache 的层级结构：每行的 parent_id 为其父目录所在行的 ROWID。
+ * 父目录为 "/" 但 "/" 本身没有缓存时，parent_id 为0；父目录没有缓存时，parent_id 为NULL，
+ * 父目录之后被缓存时，再由触发器补上。
+ * 新行的 parent_id 由 SQL_CACHE_INSERT 直接算出（?17 为父目录路径，由调用者截取），不再由触发器回写，
+ * 否则每次插入都要多执行一次 UPDATE；在SQL中用字符串函数截取父目录路径同样比插入本身还慢。
+ * 列出直接子项（SQL_CACHE_SELECT_CHILDREN）按 parent_id 等值查找，索引覆盖了查询的所有列，不需要回表；
+ * 整棵子树的操作仍使用 server_path 的范围条件，一次索引范围扫描比按 parent_id 逐层递归快得多。
+*/
+/*路径 p 的父目录路径，p 为SQL表达式*/
+#define SQL_PARENT_PATH(p)		"(CASE WHEN rtrim(" p ", replace(" p ", '/', '')) = '/' THEN '/' " \
+								"ELSE substr(rtrim(" p ", replace(" p ", '/', '')), 1, length(rtrim(" p ", replace(" p ", '/', ''))) - 1) END)"
+/*路径 p 对应的节点ID，p 为SQL表达式*/
+#define SQL_PATH_ID(p)			"COALESCE((SELECT [pp].[rowid] FROM [pcs_cache] [pp] WHERE [pp].[server_path] = " p "), CASE WHEN " p " = '/' THEN 0 END)"
+#define SQL_CACHE_HIERARCHY_CREATOR \
+								"CREATE INDEX IF NOT EXISTS [ix_pcs_cache_parent] ON [pcs_cache] ([parent_id], [server_path], [server_mtime], [server_isdir]);" \
+								"CREATE TRIGGER IF NOT EXISTS [tr_pcs_cache_insert_root] AFTER INSERT ON [pcs_cache] " \
+								"WHEN NEW.[server_path] = '/' BEGIN " \
+								"  UPDATE [pcs_cache] SET [parent_id] = NEW.[rowid] WHERE [parent_id] = 0;" \
+								"END;" \
+								/*新缓存的目录收养已缓存的子项，用 +[parent_id] 让查询走 server_path 索引*/ \
+								"CREATE TRIGGER IF NOT EXISTS [tr_pcs_cache_insert_dir] AFTER INSERT ON [pcs_cache] " \
+								"WHEN NEW.[server_isdir] <> 0 AND NEW.[server_path] <> '/' BEGIN " \
+								"  UPDATE [pcs_cache] SET [parent_id] = NEW.[rowid] " \
+								"    WHERE [server_path] >= NEW.[server_path] || '/' AND [server_path] < NEW.[server_path] || '0' " \
+								"    AND instr(substr([server_path], length(NEW.[server_path]) + 2), '/') = 0 " \
+								"    AND (+[parent_id] IS NULL OR +[parent_id] = 0);" \
+								"END;" \
+								"CREATE TRIGGER IF NOT EXISTS [tr_pcs_cache_delete] AFTER DELETE ON [pcs_cache] BEGIN " \
+								"  UPDATE [pcs_cache] SET [parent_id] = NULL WHERE [parent_id] = OLD.[rowid];" \
+								"END"
+
 #define TABLE_NAME_OP			"pcs_op"
 #define TABLE_ACTION_CREATOR	"CREATE TABLE [pcs_action] (" \
 								"  [action]					NVARCHAR, " \
@@ -56,10 +89,69 @@
 	"  [elapsed]				INTEGER, " \
 	"  [md5]					INTEGER) "
 
+/*
+ * 失败的单个文件操作。method 为 METHOD_BACKUP 或 METHOD_RESTORE，task_local 和 task_remote 为所属任务的路径。
+ * 失败后按指数退避安排下次重试，重试时只处理该表中的项，不再重新执行整个任务。
+*/
+#define TABLE_NAME_RETRY		"pcs_retry"
+#define TABLE_RETRY_CREATOR		"CREATE TABLE [pcs_retry] (" \
+	"  [method]					INTEGER, " \
+	"  [task_local]				NVARCHAR, " \
+	"  [task_remote]			NVARCHAR, " \
+	"  [local_path]				NVARCHAR, " \
+	"  [remote_path]			NVARCHAR, " \
+	"  [isdir]					INTEGER, " \
+	"  [attempts]				INTEGER, " \
+	"  [next_time]				INTEGER, " \
+	"  [last_time]				INTEGER, " \
+	"  PRIMARY KEY ([method], [local_path], [remote_path]))"
+#define TABLE_RETRY_INDEX_CREATOR "CREATE INDEX [ix_pcs_retry_task] ON [pcs_retry] ([task_local], [task_remote], [next_time])"
+
+/*
+ * 打包备份的小文件。小文件按顺序写入较大的包文件中，再整个上传到任务网盘目录下的 .pcspack 目录，
+ * pcs_pack 记录每个包在网盘中的路径，pcs_pack_file 记录每个文件所在的包及其在包中的位置，
+ * 还原时按位置只下载包中的对应部分。每个包旁边还上传一个同名加 .idx 的索引文件，换一台电脑还原时从中导入。
+ * 打包的文件不在 pcs_cache 中，pcs_pack_file.path 为该文件对应的网盘路径。
+*/
+#define TABLE_NAME_PACK			"pcs_pack"
+#define TABLE_PACK_CREATOR		"CREATE TABLE [pcs_pack] (" \
+	"  [id]						INTEGER PRIMARY KEY, " \
+	"  [server_path]			NVARCHAR, " \
+	"  [size]					INTEGER, " \
+	"  [ctime]					INTEGER, " \
+	"  [dirty]					INTEGER DEFAULT 0)"
+#define TABLE_NAME_PACK_FILE	"pcs_pack_file"
+#define TABLE_PACK_FILE_CREATOR	"CREATE TABLE [pcs_pack_file] (" \
+	"  [path]					NVARCHAR PRIMARY KEY, " \
+	"  [pack_id]				INTEGER, " \
+	"  [offset]					INTEGER, " \
+	"  [length]					INTEGER, " \
+	"  [mtime]					INTEGER, " \
+	"  [md5]					NVARCHAR)"
+#define TABLE_PACK_FILE_INDEX_CREATOR "CREATE INDEX [ix_pcs_pack_file_pack] ON [pcs_pack_file] ([pack_id])"
+/*包中的文件被删除或者改为在其他包中时，标记该包的索引文件需要重新上传*/
+#define TABLE_PACK_FILE_TRIGGER_CREATOR "CREATE TRIGGER [tr_pcs_pack_file_delete] AFTER DELETE ON [pcs_pack_file] " \
+	"BEGIN UPDATE pcs_pack SET dirty = 1 WHERE id = OLD.pack_id; END; " \
+	"CREATE TRIGGER [tr_pcs_pack_file_move] BEFORE INSERT ON [pcs_pack_file] " \
+	"BEGIN UPDATE pcs_pack SET dirty = 1 WHERE id = (SELECT pack_id FROM pcs_pack_file WHERE path = NEW.path) AND id <> NEW.pack_id; END"
+
 #define SQL_UPDATE_DB_FROM_VER0	"alter table pcs_task add md5 INTEGER"
+#define SQL_UPDATE_DB_FROM_VER3	"alter table pcs_cache add parent_id INTEGER"
+#define SQL_UPDATE_DB_FILL_PARENT "UPDATE [pcs_cache] SET [parent_id] = " SQL_PATH_ID(SQL_PARENT_PATH("[pcs_cache].[server_path]")) " " \
+								"WHERE [server_path] <> '/'"
 
 #define SQL_TABLE_EXISTS		"SELECT name FROM sqlite_master WHERE type = 'table' AND name=?"
 
+/*WAL 模式下 synchronous=NORMAL 只在检查点时同步磁盘，断电最多丢失最近提交的事务，不会损坏数据库*/
+#define SQL_PRAGMA_TUNE			"PRAGMA journal_mode=WAL;" \
+								"PRAGMA synchronous=NORMAL;" \
+								"PRAGMA temp_store=MEMORY;" \
+								"PRAGMA cache_size=-16384;" \
+								"PRAGMA mmap_size=268435456"
+#define SQL_BEGIN				"BEGIN"
+#define SQL_BEGIN_IMMEDIATE		"BEGIN IMMEDIATE"
+#define SQL_COMMIT				"COMMIT"
+
 #define SQL_TASK_SELECT_ALL		"SELECT id,method,enabled,last_run_time,next_run_time,schedule,interval,local_path,remote_path,status,result,start_time,end_time,elapsed,md5 FROM pcs_task"
 #define SQL_TASK_SELECT_ONE		"SELECT id,method,enabled,last_run_time,next_run_time,schedule,interval,local_path,remote_path,status,result,start_time,end_time,elapsed,md5 FROM pcs_task WHERE method=?1 AND local_path=?2 AND remote_path=?3"
 #define SQL_TASK_DELETE_ALL		"DELETE FROM pcs_task"
@@ -71,6 +163,22 @@
 								"result=?6, start_time=?7, end_time=?8, elapsed=?9 " \
 								"WHERE id=?1"
 
+/*
+ * 记录一次失败：attempts 加1，下次重试时间为 ?7 + min(?8 * 2^(attempts-1), ?9)。
+ * ?1 method, ?2 task_local, ?3 task_remote, ?4 local_path, ?5 remote_path, ?6 isdir, ?7 当前时间
+*/
+#define SQL_RETRY_ADD			"INSERT OR REPLACE INTO pcs_retry (method,task_local,task_remote,local_path,remote_path,isdir,attempts,next_time,last_time) " \
+								"SELECT ?1, ?2, ?3, ?4, ?5, ?6, n, ?7 + min(?8 << min(n - 1, 20), ?9), ?7 " \
+								"FROM (SELECT COALESCE((SELECT attempts FROM pcs_retry WHERE method=?1 AND local_path=?4 AND remote_path=?5), 0) + 1 AS n)"
+#define SQL_RETRY_DELETE		"DELETE FROM pcs_retry WHERE method=?1 AND local_path=?2 AND remote_path=?3"
+/*已经到期、并且未超过最大重试次数（?5）的项*/
+#define SQL_RETRY_SELECT_DUE	"SELECT local_path, remote_path, isdir, attempts FROM pcs_retry " \
+								"WHERE task_local=?2 AND task_remote=?3 AND method=?1 AND next_time <= ?4 AND attempts < ?5 " \
+								"ORDER BY remote_path"
+/*任务完整执行一次后，删除本次执行中没有再失败的项*/
+#define SQL_RETRY_CLEAR_STALE	"DELETE FROM pcs_retry WHERE task_local=?2 AND task_remote=?3 AND method=?1 AND last_time < ?4"
+#define SQL_RETRY_NEXT_TIME		"SELECT min(next_time) FROM pcs_retry WHERE task_local=?1 AND task_remote=?2 AND attempts < ?3"
+
 #define SQL_ACTION_EXISTS		"SELECT status FROM pcs_action WHERE action=?1"
 #define SQL_ACTION_SELECT		"SELECT ROWID, action,status,start_time,end_time,capp,mapp FROM pcs_action WHERE action=?1"
 #define SQL_ACTION_INSERT		"INSERT INTO pcs_action (action,status,start_time,end_time,capp,mapp) VALUES (?1,?2,?3,?4,?5,?5)"
@@ -84,30 +192,116 @@
 								"server_md5, server_dlink, server_if_has_sub_dir, ctime, mtime, capp, mapp, flag "\
 								"FROM pcs_cache "\
 								"WHERE server_path=?1"
-#define SQL_CACHE_SELECT_UNTRACK "SELECT server_fs_id, server_path, server_filename, server_ctime, server_mtime, "\
-								"server_size, server_category, server_isdir, server_dir_empty, server_empty, "\
-								"server_md5, server_dlink, server_if_has_sub_dir, ctime, mtime, capp, mapp, flag "\
-								"FROM pcs_cache "\
-								"WHERE server_path LIKE ?1 AND flag = 0"
 #define SQL_CACHE_SELECT_SUB	"SELECT server_fs_id, server_path, server_filename, server_ctime, server_mtime, "\
 								"server_size, server_category, server_isdir, server_dir_empty, server_empty, "\
 								"server_md5, server_dlink, server_if_has_sub_dir, ctime, mtime, capp, mapp, flag "\
 								"FROM pcs_cache "\
-								"WHERE server_path LIKE ?1"
+								"WHERE server_path >= ?1 AND server_path < ?2"
 #define SQL_CACHE_SELECT_SUB_DIR_FIRST SQL_CACHE_SELECT_SUB " ORDER BY server_isdir DESC"
+#define SQL_CACHE_SELECT_CHILDREN "SELECT server_path, server_mtime, server_isdir "\
+								"FROM pcs_cache "\
+								"WHERE parent_id = " SQL_PATH_ID("?1")
 #define SQL_CACHE_INSERT		"INSERT INTO pcs_cache (server_fs_id, server_path, server_filename, server_ctime, server_mtime, " \
 								"server_size, server_category, server_isdir, server_dir_empty, server_empty, "\
-								"server_md5, server_dlink, server_if_has_sub_dir, ctime, mtime, capp, mapp, flag) " \
-								"VALUES (?1, ?2, ?3, ?4, ?5, ?6, ?7, ?8, ?9, ?10, ?11, ?12, ?13, ?14, ?14, ?15, ?15, ?16)"
+								"server_md5, server_dlink, server_if_has_sub_dir, ctime, mtime, capp, mapp, flag, parent_id) " \
+								"VALUES (?1, ?2, ?3, ?4, ?5, ?6, ?7, ?8, ?9, ?10, ?11, ?12, ?13, ?14, ?14, ?15, ?15, ?16, " \
+								"CASE WHEN ?2 <> '/' THEN " SQL_PATH_ID("?17") " END)"
 #define SQL_CACHE_UPDATE		"UPDATE pcs_cache SET server_fs_id=?1, server_path=?2, server_filename=?3, server_ctime=?4, server_mtime=?5, " \
 								"server_size=?6, server_category=?7, server_isdir=?8, server_dir_empty=?9, server_empty=?10, "\
 								"server_md5=?11, server_dlink=?12, server_if_has_sub_dir=?13, mtime=?14, mapp=?15, flag=?16 " \
 								"WHERE server_path=?2"
 #define SQL_CACHE_DELETE		"DELETE FROM pcs_cache WHERE server_path=?1"
-#define SQL_CACHE_CLEAR			"DELETE FROM pcs_cache WHERE server_path LIKE ?1"
-#define SQL_CACHE_SET_FLAG_SUB	"UPDATE pcs_cache SET flag = ?2, mtime=?3, mapp=?4 WHERE server_path LIKE ?1"
+#define SQL_CACHE_CLEAR			"DELETE FROM pcs_cache WHERE server_path >= ?1 AND server_path < ?2"
+#define SQL_CACHE_SET_FLAG_SUB	"UPDATE pcs_cache SET flag = ?3, mtime=?4, mapp=?5 WHERE server_path >= ?1 AND server_path < ?2"
 #define SQL_CACHE_SET_FLAG		"UPDATE pcs_cache SET flag = ?2, mtime=?3, mapp=?4 WHERE server_path = ?1"
 //#define SQL_CACHE_CLEAR_ALL		"DELETE FROM pcs_cache"
 
+/*
+ * 本地文件扫描结果。备份和比较时先把整个本地目录树写入该临时表，
+ * 再与 pcs_cache 做集合运算得出新增、变化和多余的项，避免逐个文件查询缓存。
+ * path 为本地文件对应的网盘路径。
+*/
+#define TABLE_LOCAL_CREATOR		"CREATE TEMP TABLE IF NOT EXISTS [pcs_local] (" \
+								"  [path]					NVARCHAR PRIMARY KEY, " \
+								"  [local_path]				NVARCHAR, " \
+								"  [isdir]					INTEGER, " \
+								"  [mtime]					INTEGER, " \
+								"  [size]					INTEGER)"
+#define SQL_LOCAL_CLEAR			"DELETE FROM temp.pcs_local"
+#define SQL_LOCAL_INSERT		"INSERT OR REPLACE INTO temp.pcs_local (path, local_path, isdir, mtime, size) VALUES (?1, ?2, ?3, ?4, ?5)"
+/*
+ * 备份的工作列表：网盘缓存和打包的文件中都不存在、类型不同，或者需要进一步比较的本地项（?1 为是否启用md5）。
+ * 按 path 排序，保证目录在其子项之前；?2 为上一页最后一项的 path，每页最多 ?3 项。
+*/
+#define SQL_LOCAL_SELECT_BACKUP	"SELECT l.path, l.local_path, l.isdir, l.mtime, l.size, " \
+								"c.server_fs_id, c.server_isdir, c.server_mtime, c.server_md5, p.pack_id, p.md5 " \
+								"FROM temp.pcs_local l LEFT JOIN pcs_cache c ON c.server_path = l.path " \
+								"LEFT JOIN pcs_pack_file p ON p.path = l.path " \
+								"WHERE l.path > ?2 AND (CASE " \
+								"WHEN c.rowid IS NOT NULL THEN c.server_isdir <> l.isdir OR (l.isdir = 0 AND (?1 <> 0 OR l.mtime > c.server_mtime)) " \
+								"WHEN p.rowid IS NOT NULL THEN l.isdir <> 0 OR ?1 <> 0 OR l.mtime > p.mtime " \
+								"ELSE 1 END) " \
+								"ORDER BY l.path LIMIT ?3"
+/*标记本地存在的所有项*/
+#define SQL_LOCAL_SET_FLAG		"UPDATE pcs_cache SET flag = ?1, mtime=?2, mapp=?3 " \
+								"WHERE server_path IN (SELECT path FROM temp.pcs_local)"
+/*
+ * ?1 目录下网盘缓存中存在、但本地不存在的项。
+ * 只返回最上层的项：其父目录本地存在，或者父目录即为 ?3 本身。
+*/
+#define SQL_LOCAL_SELECT_UNTRACK "SELECT c.server_path, c.server_isdir FROM pcs_cache c " \
+								"WHERE c.server_path >= ?1 AND c.server_path < ?2 " \
+								"AND NOT EXISTS (SELECT 1 FROM temp.pcs_local l WHERE l.path = c.server_path) " \
+								"AND (c.parent_id IS NULL OR c.parent_id = " SQL_PATH_ID("?3") " " \
+								"OR EXISTS (SELECT 1 FROM pcs_cache p JOIN temp.pcs_local l ON l.path = p.server_path WHERE p.rowid = c.parent_id)) " \
+								"ORDER BY c.server_path"
+/*?1 目录下网盘缓存中的所有项，以及对应的本地项（本地不存在时 isdir 和 mtime 为 NULL）*/
+#define SQL_LOCAL_SELECT_COMPARE "SELECT c.server_fs_id, c.server_path, c.server_filename, c.server_ctime, c.server_mtime, "\
+								"c.server_size, c.server_category, c.server_isdir, c.server_dir_empty, c.server_empty, "\
+								"c.server_md5, c.server_dlink, c.server_if_has_sub_dir, c.ctime, c.mtime, c.capp, c.mapp, c.flag, "\
+								"l.isdir, l.mtime "\
+								"FROM pcs_cache c LEFT JOIN temp.pcs_local l ON l.path = c.server_path "\
+								"WHERE c.server_path >= ?1 AND c.server_path < ?2"
+/*本地存在，但网盘缓存中不存在的项*/
+#define SQL_LOCAL_SELECT_NEW	"SELECT l.path, l.isdir FROM temp.pcs_local l "\
+								"WHERE NOT EXISTS (SELECT 1 FROM pcs_cache c WHERE c.server_path = l.path) "\
+								"ORDER BY l.path"
+
+#define SQL_PACK_INSERT			"INSERT INTO pcs_pack (server_path, size, ctime) VALUES (?1, ?2, ?3)"
+#define SQL_PACK_FILE_INSERT	"INSERT OR REPLACE INTO pcs_pack_file (path, pack_id, offset, length, mtime, md5) VALUES (?1, ?2, ?3, ?4, ?5, ?6)"
+/*导入的包中的文件，已经记录在文件名更大（更晚上传）的包中时不导入，?7 为导入的包的网盘路径*/
+#define SQL_PACK_FILE_IMPORT	"INSERT OR REPLACE INTO pcs_pack_file (path, pack_id, offset, length, mtime, md5) " \
+								"SELECT ?1, ?2, ?3, ?4, ?5, ?6 WHERE NOT EXISTS (SELECT 1 FROM pcs_pack_file f " \
+								"JOIN pcs_pack p ON p.id = f.pack_id WHERE f.path = ?1 AND p.server_path > ?7)"
+#define SQL_PACK_FILE_DELETE	"DELETE FROM pcs_pack_file WHERE path=?1"
+#define SQL_PACK_FILE_SELECT	"SELECT f.path, f.offset, f.length, f.mtime, f.md5, p.server_path, p.id " \
+								"FROM pcs_pack_file f JOIN pcs_pack p ON p.id = f.pack_id WHERE f.path = ?1"
+/*?1 目录下打包的文件，按包中的位置排序。已经单独上传到网盘中的文件以网盘中的为准*/
+#define SQL_PACK_FILE_SELECT_SUB "SELECT f.path, f.offset, f.length, f.mtime, f.md5, p.server_path, p.id " \
+								"FROM pcs_pack_file f JOIN pcs_pack p ON p.id = f.pack_id WHERE f.path >= ?1 AND f.path < ?2 " \
+								"AND NOT EXISTS (SELECT 1 FROM pcs_cache c WHERE c.server_path = f.path) " \
+								"ORDER BY p.id, f.offset"
+#define SQL_PACK_FILE_SELECT_PACK "SELECT f.path, f.offset, f.length, f.mtime, f.md5, p.server_path, p.id " \
+								"FROM pcs_pack_file f JOIN pcs_pack p ON p.id = f.pack_id WHERE p.server_path = ?1 ORDER BY f.offset"
+/*?1 目录下网盘中存在，但是本地没有索引的包*/
+#define SQL_PACK_SELECT_UNKNOWN	"SELECT c.server_path, c.server_size FROM pcs_cache c WHERE c.server_path >= ?1 AND c.server_path < ?2 " \
+								"AND c.server_isdir = 0 AND c.server_path LIKE '%.pack' " \
+								"AND NOT EXISTS (SELECT 1 FROM pcs_pack p WHERE p.server_path = c.server_path) " \
+								"ORDER BY c.server_path"
+/*?1 目录下本地已经不存在的打包文件*/
+#define SQL_PACK_FILE_DELETE_UNTRACK "DELETE FROM pcs_pack_file WHERE path >= ?1 AND path < ?2 " \
+								"AND NOT EXISTS (SELECT 1 FROM temp.pcs_local l WHERE l.path = pcs_pack_file.path AND l.isdir = 0)"
+/*?1 目录下已经单独上传到网盘中的打包文件，例如打包上传失败后重试时单独上传的文件*/
+#define SQL_PACK_FILE_DELETE_UPLOADED "DELETE FROM pcs_pack_file WHERE path >= ?1 AND path < ?2 " \
+								"AND EXISTS (SELECT 1 FROM pcs_cache c WHERE c.server_path = pcs_pack_file.path)"
+/*?1 目录下已经没有任何文件的包*/
+#define SQL_PACK_SELECT_EMPTY	"SELECT server_path FROM pcs_pack p WHERE server_path >= ?1 AND server_path < ?2 " \
+								"AND NOT EXISTS (SELECT 1 FROM pcs_pack_file f WHERE f.pack_id = p.id)"
+#define SQL_PACK_DELETE			"DELETE FROM pcs_pack WHERE server_path=?1"
+#define SQL_PACK_EXISTS			"SELECT 1 FROM pcs_pack WHERE server_path=?1"
+/*?1 目录下索引文件需要重新上传的包*/
+#define SQL_PACK_SELECT_DIRTY	"SELECT server_path FROM pcs_pack WHERE server_path >= ?1 AND server_path < ?2 AND dirty <> 0"
+#define SQL_PACK_SET_CLEAN		"UPDATE pcs_pack SET dirty = 0 WHERE server_path = ?1"
+
 
 #endif